@@ -0,0 +1,201 @@
+/**
+ * @file coldstart.c
+ * @brief First-launch latency with and without page-cache prewarming
+ *
+ * Usage: coldstart [-n rounds] [-s script] [shell]
+ *
+ * Each round evicts the programs named in the script (default
+ * bench/coldstart.tsh) and all of their shared libraries from the page
+ * cache with POSIX_FADV_DONTNEED, then runs the script through the shell
+ * (default ./tsh) once with TSH_PREWARM=0 and once with TSH_PREWARM=1, in
+ * alternating order.  Every command in the script is therefore a first
+ * launch on a cold cache.
+ *
+ * Eviction only drops clean pages that no process has mapped, so files
+ * such as libc stay resident; the report shows how much of the script's
+ * files were actually cold after eviction.
+ */
+
+#define _GNU_SOURCE // setenv with the test macros of a strict build
+
+#include "../tsh_prewarm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/* Page residency of the evicted files, summed over one walk */
+struct residency {
+    size_t pages;
+    size_t resident;
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void evict(const char *file, int fd, void *arg) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void count_resident(const char *file, int fd, void *arg) {
+    struct residency *r = arg;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        return;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    size_t npages = ((size_t)st.st_size + (size_t)page - 1) / (size_t)page;
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char *vec = malloc(npages);
+    if (map != MAP_FAILED && vec != NULL &&
+        mincore(map, (size_t)st.st_size, vec) == 0) {
+        for (size_t i = 0; i < npages; i++) {
+            r->resident += vec[i] & 1;
+        }
+        r->pages += npages;
+    }
+    free(vec);
+    if (map != MAP_FAILED) {
+        munmap(map, (size_t)st.st_size);
+    }
+}
+
+/* Applies fn to every program named in the script */
+static void walk_script(const char *script, void (*fn)(const char *, int,
+                                                       void *),
+                        void *arg) {
+    const char *line = script;
+    while (*line != '\0') {
+        size_t len = strcspn(line, "\n");
+        char word[4096];
+        size_t wlen = strcspn(line, " \t\n");
+        if (wlen > 0 && wlen < sizeof(word) && memchr(line, '/', wlen)) {
+            memcpy(word, line, wlen);
+            word[wlen] = '\0';
+            prewarm_walk(word, fn, arg);
+        }
+        line += len + (line[len] == '\n');
+    }
+}
+
+static double run_script(const char *shell, const char *script, bool prewarm) {
+    int in[2];
+    if (pipe(in) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    setenv("TSH_PREWARM", prewarm ? "1" : "0", 1);
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&fa, in[1]);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    char *argv[] = {(char *)shell, "-p", NULL};
+
+    double start = now_ms();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(in[0]);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", shell, strerror(err));
+        exit(1);
+    }
+    size_t len = strlen(script);
+    if (write(in[1], script, len) != (ssize_t)len) {
+        perror("write");
+    }
+    close(in[1]);
+    int status;
+    waitpid(pid, &status, 0);
+    return now_ms() - start;
+}
+
+static char *read_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    static char buf[1 << 16];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    int rounds = 5;
+    const char *script_path = "bench/coldstart.tsh";
+    int c;
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 's':
+            script_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n rounds] [-s script] [shell]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    const char *shell = optind < argc ? argv[optind] : "./tsh";
+    if (rounds < 1) {
+        rounds = 1;
+    }
+    char *script = read_file(script_path);
+
+    double *cold = calloc(rounds, sizeof(double));
+    double *warm = calloc(rounds, sizeof(double));
+    struct residency before = {0, 0}, after = {0, 0};
+    walk_script(script, count_resident, &before);
+
+    for (int r = 0; r < rounds; r++) {
+        for (int k = 0; k < 2; k++) {
+            bool prewarm = (k + r) % 2 == 1;
+            walk_script(script, evict, NULL);
+            if (r == 0 && k == 0) {
+                walk_script(script, count_resident, &after);
+            }
+            double ms = run_script(shell, script, prewarm);
+            (prewarm ? warm : cold)[r] = ms;
+        }
+    }
+
+    qsort(cold, rounds, sizeof(double), cmp_double);
+    qsort(warm, rounds, sizeof(double), cmp_double);
+    printf("files: %zu pages, %zu resident before eviction, %zu after\n",
+           before.pages, before.resident, after.resident);
+    printf("%-14s %9s %9s %9s\n", "script (ms)", "min", "p50", "max");
+    printf("%-14s %9.1f %9.1f %9.1f\n", "no prewarm", cold[0],
+           cold[rounds / 2], cold[rounds - 1]);
+    printf("%-14s %9.1f %9.1f %9.1f\n", "TSH_PREWARM=1", warm[0],
+           warm[rounds / 2], warm[rounds - 1]);
+    printf("p50 improvement: %.1f%%\n",
+           100.0 * (cold[rounds / 2] - warm[rounds / 2]) / cold[rounds / 2]);
+    return 0;
+}
@@ -0,0 +1,227 @@
+/**
+ * @file pattern.c
+ * @brief Matching cost of compiled patterns against backtracking matchers
+ *
+ * Usage: pattern [-t ms]
+ *
+ * Each case matches one text against one glob pattern with
+ *   backtrack  a straightforward recursive matcher, as shells often use
+ *   fnmatch    the C library's fnmatch(3) (flags 0)
+ *   compile    pattern_matches(), compiling through the cache every call
+ *   compiled   pattern_match() on a pattern compiled once
+ * for about -t milliseconds each (default 200) and reports nanoseconds per
+ * match.  The cases include typical job selectors and case arms as well
+ * as patterns like a*a*a*a*b, on which backtracking takes time
+ * polynomial in the text with the number of stars as the exponent.  All
+ * matchers must agree on every case, or the benchmark fails.
+ */
+
+#include "../tsh_pattern.h"
+
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench_case {
+    const char *name;
+    char *pattern;
+    char *text;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Matches one class at the [ at p; returns past its ], or NULL if none */
+static const char *class_match(const char *p, char c, bool *hit) {
+    const char *q = p + 1;
+    bool negate = *q == '!' || *q == '^';
+    q += negate;
+    bool first = true;
+    *hit = false;
+    while (*q != '\0' && (*q != ']' || first)) {
+        first = false;
+        char lo = *q++;
+        if (lo == '\\' && *q != '\0') {
+            lo = *q++;
+        }
+        char hi = lo;
+        if (q[0] == '-' && q[1] != ']' && q[1] != '\0') {
+            hi = q[1];
+            q += 2;
+            if (hi == '\\' && *q != '\0') {
+                hi = *q++;
+            }
+        }
+        if ((unsigned char)c >= (unsigned char)lo &&
+            (unsigned char)c <= (unsigned char)hi) {
+            *hit = true;
+        }
+    }
+    if (*q != ']') {
+        return NULL;
+    }
+    *hit ^= negate;
+    return q + 1;
+}
+
+/* The textbook recursive glob matcher: on *, try every split */
+static bool backtrack(const char *p, const char *s) {
+    for (; *p != '\0'; p++, s++) {
+        if (*p == '*') {
+            while (p[1] == '*') {
+                p++;
+            }
+            for (const char *t = s;; t++) {
+                if (backtrack(p + 1, t)) {
+                    return true;
+                }
+                if (*t == '\0') {
+                    return false;
+                }
+            }
+        }
+        if (*s == '\0') {
+            return false;
+        }
+        if (*p == '?') {
+            continue;
+        }
+        if (*p == '[') {
+            bool hit;
+            const char *next = class_match(p, *s, &hit);
+            if (next != NULL) {
+                if (!hit) {
+                    return false;
+                }
+                p = next - 1;
+                continue;
+            }
+        }
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+        if (*p != *s) {
+            return false;
+        }
+    }
+    return *s == '\0';
+}
+
+static char *repeat(const char *unit, int n, const char *tail) {
+    size_t len = strlen(unit) * n + strlen(tail) + 1;
+    char *s = malloc(len);
+    if (s == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    s[0] = '\0';
+    for (int i = 0; i < n; i++) {
+        strcat(s, unit);
+    }
+    strcat(s, tail);
+    return s;
+}
+
+enum matcher { BACKTRACK, FNMATCH, COMPILE, COMPILED, NMATCHERS };
+
+static const char *matcher_names[NMATCHERS] = {"backtrack", "fnmatch",
+                                               "compile", "compiled"};
+
+static bool run_one(enum matcher m, struct pattern *p,
+                    const struct bench_case *c) {
+    switch (m) {
+    case BACKTRACK:
+        return backtrack(c->pattern, c->text);
+    case FNMATCH:
+        return fnmatch(c->pattern, c->text, 0) == 0;
+    case COMPILE:
+        return pattern_matches(c->pattern, c->text);
+    default:
+        return pattern_match(p, c->text);
+    }
+}
+
+/* Nanoseconds per match, running for about budget_ns */
+static double time_matcher(enum matcher m, struct pattern *p,
+                           const struct bench_case *c, double budget_ns) {
+    long iters = 0;
+    long batch = 1;
+    double start = now_ns();
+    double elapsed;
+    volatile bool sink = false;
+    do {
+        for (long i = 0; i < batch; i++) {
+            sink ^= run_one(m, p, c);
+        }
+        iters += batch;
+        elapsed = now_ns() - start;
+        if (batch < (1L << 20)) {
+            batch *= 2;
+        }
+    } while (elapsed < budget_ns);
+    (void)sink;
+    return elapsed / iters;
+}
+
+int main(int argc, char **argv) {
+    double budget_ms = 200;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't') {
+            budget_ms = atof(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-t ms]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    struct bench_case cases[] = {
+        {"literal", "sleep", "sleep"},
+        {"job selector", "*sleep 3*", "@build make -j8 && sleep 30 &"},
+        {"suffix", "*.c", "src/shell/tsh_pattern.c"},
+        {"classes", "[a-z]*[0-9][0-9]?.log", "worker-node17a.log"},
+        {"stars 3", repeat("a*", 3, "b"), repeat("a", 24, "")},
+        {"stars 5", repeat("a*", 5, "b"), repeat("a", 24, "")},
+        {"stars 7", repeat("a*", 7, "b"), repeat("a", 24, "")},
+        {"wide", repeat("?*", 80, "b"), repeat("ab", 100, "")},
+    };
+    size_t ncases = sizeof(cases) / sizeof(cases[0]);
+
+    printf("%-13s", "ns/match");
+    for (int m = 0; m < NMATCHERS; m++) {
+        printf(" %11s", matcher_names[m]);
+    }
+    printf("\n");
+    for (size_t i = 0; i < ncases; i++) {
+        const struct bench_case *c = &cases[i];
+        struct pattern *p = pattern_compile(c->pattern);
+        if (p == NULL) {
+            fprintf(stderr, "%s: out of memory\n", c->name);
+            return 1;
+        }
+        bool expect = pattern_match(p, c->text);
+        printf("%-13s", c->name);
+        for (int m = 0; m < NMATCHERS; m++) {
+            if (run_one(m, p, c) != expect) {
+                fprintf(stderr, "\n%s: %s disagrees on %s\n", c->name,
+                        matcher_names[m], c->pattern);
+                return 1;
+            }
+            printf(" %11.1f", time_matcher(m, p, c, budget_ms * 1e6));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    size_t compiled, hits;
+    pattern_stats(&compiled, &hits);
+    printf("patterns compiled: %zu, cache hits: %zu\n", compiled, hits);
+    return 0;
+}
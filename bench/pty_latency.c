@@ -0,0 +1,380 @@
+/**
+ * @file pty_latency.c
+ * @brief Interactive latency of the shell, driven through a pseudo-terminal
+ *
+ * Usage: pty_latency [-n rounds] [-j N[,N...]] [-B] [shell]
+ *
+ * The shell (default ./tsh) runs on the slave side of a pty as an
+ * interactive session with its prompt enabled.  For each background load
+ * level N (default 0,16,128) a fresh shell first starts N background jobs
+ * (sleeping, or busy loops with -B), then the harness acts as a user:
+ *
+ *  exec    types "/bin/true", time until the next prompt
+ *  builtin types "bg" (a builtin that only prints), time until the prompt
+ *  ^C      starts a foreground job, presses Ctrl-C and measures both the
+ *          time until the job receives SIGINT (signal forwarding) and the
+ *          time until the next prompt
+ *  ^Z      the same with Ctrl-Z and SIGTSTP
+ *
+ * The foreground job is this program re-executed as a "sleeper": it
+ * reports its pid and then, on SIGINT or SIGTSTP, the CLOCK_MONOTONIC time
+ * at which the signal arrived, which the harness compares with the time it
+ * wrote the control character.
+ */
+
+#define _GNU_SOURCE // posix_openpt, ptsname
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROMPT "tsh> "
+#define TIMEOUT_MS 10000
+#define MAX_BG 4096
+
+enum metric { M_EXEC, M_BUILTIN, M_INT_SIG, M_INT_PROMPT, M_TSTP_SIG,
+              M_TSTP_PROMPT, NMETRICS };
+static const char *metric_names[NMETRICS] = {
+    "exec->prompt", "builtin->prompt", "^C->SIGINT", "^C->prompt",
+    "^Z->SIGTSTP", "^Z->prompt",
+};
+
+/* Output read from the pty master that has not been matched yet */
+static struct {
+    char buf[1 << 16];
+    size_t len;
+} out;
+
+static int master = -1;
+static pid_t shell_pid;
+static pid_t bg_pids[MAX_BG];
+static int nbg;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void die(const char *what) {
+    fprintf(stderr, "pty_latency: %s\n", what);
+    if (shell_pid > 0) {
+        kill(shell_pid, SIGKILL);
+    }
+    for (int i = 0; i < nbg; i++) {
+        kill(bg_pids[i], SIGKILL);
+    }
+    exit(1);
+}
+
+/*****************
+ * Child programs
+ *****************/
+
+static void sleeper_handler(int sig) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    char line[64];
+    int n = snprintf(line, sizeof(line), "sig %d %lld\n", sig,
+                     (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+    if (write(STDOUT_FILENO, line, (size_t)n) < 0) {
+        _exit(1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Foreground job: reports its pid, then waits for SIGINT or SIGTSTP */
+static int run_sleeper(void) {
+    signal(SIGINT, sleeper_handler);
+    signal(SIGTSTP, sleeper_handler);
+    printf("ready %d\n", (int)getpid());
+    fflush(stdout);
+    while (true) {
+        pause();
+    }
+    return 0;
+}
+
+/* Busy background job for -B */
+static int run_spinner(void) {
+    volatile unsigned long x = 0;
+    while (true) {
+        x++;
+    }
+    return 0;
+}
+
+/*****************
+ * Talking to the shell
+ *****************/
+
+static void type(const char *text) {
+    size_t len = strlen(text);
+    if (write(master, text, len) != (ssize_t)len) {
+        die("write to pty failed");
+    }
+}
+
+/*
+ * Reads until needle appears in the output.  The output up to and
+ * including the needle is consumed; *before (if not NULL) receives a copy
+ * of what preceded the needle, NUL-terminated and truncated to size.
+ */
+static void expect(const char *needle, char *before, size_t size) {
+    size_t nlen = strlen(needle);
+    double deadline = now_us() + TIMEOUT_MS * 1000.0;
+
+    while (true) {
+        char *hit = memmem(out.buf, out.len, needle, nlen);
+        if (hit != NULL) {
+            size_t pre = (size_t)(hit - out.buf);
+            if (before != NULL) {
+                size_t n = pre < size - 1 ? pre : size - 1;
+                memcpy(before, out.buf, n);
+                before[n] = '\0';
+            }
+            size_t used = pre + nlen;
+            memmove(out.buf, out.buf + used, out.len - used);
+            out.len -= used;
+            return;
+        }
+        if (out.len == sizeof(out.buf)) {
+            // Keep only a tail long enough to hold a split needle
+            memmove(out.buf, out.buf + out.len - nlen, nlen);
+            out.len = nlen;
+        }
+
+        int left = (int)((deadline - now_us()) / 1000);
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (left <= 0 || poll(&pfd, 1, left) == 0) {
+            fprintf(stderr, "timed out waiting for \"%s\"\n", needle);
+            die("no response from shell");
+        }
+        ssize_t n = read(master, out.buf + out.len, sizeof(out.buf) - out.len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            die("shell exited");
+        }
+        out.len += (size_t)n;
+    }
+}
+
+static void start_shell(const char *shell) {
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        die("cannot allocate a pty");
+    }
+    const char *slave_name = ptsname(master);
+
+    shell_pid = fork();
+    if (shell_pid < 0) {
+        die("fork failed");
+    }
+    if (shell_pid == 0) {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave < 0) {
+            _exit(127);
+        }
+        ioctl(slave, TIOCSCTTY, 0);
+
+        // No echo, so the output holds only what the shell and jobs print
+        struct termios tio;
+        tcgetattr(slave, &tio);
+        tio.c_lflag &= ~(tcflag_t)(ECHO | ECHONL);
+        tcsetattr(slave, TCSANOW, &tio);
+
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO) {
+            close(slave);
+        }
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    expect(PROMPT, NULL, 0);
+}
+
+static void stop_shell(void) {
+    for (int i = 0; i < nbg; i++) {
+        kill(bg_pids[i], SIGKILL);
+    }
+    nbg = 0;
+    type("quit\n");
+    int status;
+    struct pollfd pfd = {master, POLLIN, 0};
+    while (poll(&pfd, 1, 200) > 0) {
+        if (read(master, out.buf, sizeof(out.buf)) <= 0) {
+            break;
+        }
+    }
+    kill(shell_pid, SIGKILL);
+    waitpid(shell_pid, &status, 0);
+    close(master);
+    out.len = 0;
+}
+
+/* Starts n background jobs and records their pids for clean-up */
+static void start_background(int n, const char *self, bool busy) {
+    char cmd[4200];
+    char before[256];
+    snprintf(cmd, sizeof(cmd), busy ? "%s --spin &\n" : "/bin/sleep 100000 &\n",
+             self);
+    for (int i = 0; i < n && nbg < MAX_BG; i++) {
+        type(cmd);
+        expect(PROMPT, before, sizeof(before));
+        int jid, pid;
+        char *line = strchr(before, '[');
+        if (line == NULL || sscanf(line, "[%d] (%d)", &jid, &pid) != 2) {
+            die("could not start a background job");
+        }
+        bg_pids[nbg++] = pid;
+    }
+}
+
+/*
+ * Runs a sleeper in the foreground, sends it ctrl, and records the time
+ * until the job receives the signal and until the shell prompts again.
+ */
+static void signal_round(const char *self, char ctrl, double *to_sig,
+                         double *to_prompt) {
+    char cmd[4200];
+    char before[512];
+    snprintf(cmd, sizeof(cmd), "%s --sleeper\n", self);
+    type(cmd);
+    expect("ready ", NULL, 0);
+    expect("\n", before, sizeof(before));
+    pid_t pid = atoi(before);
+
+    char key[2] = {ctrl, '\0'};
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long sent_ns = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    double sent = now_us();
+    type(key);
+
+    expect("sig ", NULL, 0);
+    expect("\n", before, sizeof(before));
+    int sig;
+    long long got_ns;
+    if (sscanf(before, "%d %lld", &sig, &got_ns) != 2) {
+        die("malformed sleeper report");
+    }
+    *to_sig = (double)(got_ns - sent_ns) / 1e3;
+
+    expect(PROMPT, NULL, 0);
+    *to_prompt = now_us() - sent;
+
+    if (ctrl == '\x1a') {
+        // Leave no stopped job behind
+        kill(pid, SIGKILL);
+        kill(pid, SIGCONT);
+        expect("terminated by signal", NULL, 0);
+    }
+}
+
+static void timed_command(const char *cmd, double *elapsed) {
+    double start = now_us();
+    type(cmd);
+    expect(PROMPT, NULL, 0);
+    *elapsed = now_us() - start;
+}
+
+static void report(int load, double *samples[NMETRICS], int rounds) {
+    for (int m = 0; m < NMETRICS; m++) {
+        double *s = samples[m];
+        qsort(s, rounds, sizeof(*s), cmp_double);
+        printf("%6d  %-16s %9.1f %9.1f %9.1f %9.1f\n", load, metric_names[m],
+               s[0], s[rounds / 2], s[(rounds * 9) / 10], s[rounds - 1]);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "--sleeper") == 0) {
+        return run_sleeper();
+    }
+    if (argc == 2 && strcmp(argv[1], "--spin") == 0) {
+        return run_spinner();
+    }
+
+    int rounds = 50;
+    const char *loads = "0,16,128";
+    bool busy = false;
+    int c;
+    while ((c = getopt(argc, argv, "n:j:B")) != -1) {
+        switch (c) {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'j':
+            loads = optarg;
+            break;
+        case 'B':
+            busy = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n rounds] [-j N[,N...]] [-B] [shell]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    const char *shell = optind < argc ? argv[optind] : "./tsh";
+    if (rounds < 1) {
+        rounds = 1;
+    }
+
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len < 0) {
+        die("cannot find own executable");
+    }
+    self[len] = '\0';
+
+    signal(SIGPIPE, SIG_IGN);
+
+    double *samples[NMETRICS];
+    for (int m = 0; m < NMETRICS; m++) {
+        samples[m] = calloc(rounds, sizeof(double));
+    }
+
+    printf("%6s  %-16s %9s %9s %9s %9s\n", "bgjobs", "latency (us)", "min",
+           "p50", "p90", "max");
+    for (const char *p = loads; *p != '\0';) {
+        int load = atoi(p);
+        start_shell(shell);
+        start_background(load, self, busy);
+        for (int r = 0; r < rounds; r++) {
+            timed_command("/bin/true\n", &samples[M_EXEC][r]);
+            timed_command("bg\n", &samples[M_BUILTIN][r]);
+            signal_round(self, '\x03', &samples[M_INT_SIG][r],
+                         &samples[M_INT_PROMPT][r]);
+            signal_round(self, '\x1a', &samples[M_TSTP_SIG][r],
+                         &samples[M_TSTP_PROMPT][r]);
+        }
+        stop_shell();
+        report(load, samples, rounds);
+
+        p += strcspn(p, ",");
+        p += (*p == ',');
+    }
+    return 0;
+}
@@ -0,0 +1,218 @@
+/**
+ * @file startup.c
+ * @brief Measures shell start-up: exec-to-first-output latency and peak RSS
+ *
+ * Usage: startup [-n runs] [-s script | -c command] shell...
+ *
+ * Each shell binary is started runs times as "shell -p" with the script
+ * (default: a single "bg" line, a builtin that prints without forking) on
+ * its standard input.  The latency of a run is the time from spawning the
+ * shell to the first byte of output, i.e. process creation, dynamic
+ * loading, relocation and shell initialization plus one command.  Peak RSS
+ * comes from wait4's rusage.  The script is fed once per run, so the same
+ * program doubles as the PGO training driver.
+ *
+ * With -c, each run is "shell -c command" with an empty standard input
+ * instead, which measures the shell as a system() replacement; /bin/sh
+ * can be listed alongside for comparison.
+ */
+
+#define _GNU_SOURCE // pipe2
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+struct run {
+    double first_us; // spawn to first output byte
+    double total_us; // spawn to exit
+    long maxrss_kb;
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char *buf = NULL;
+    size_t cap = 0;
+    *len = 0;
+    size_t n;
+    do {
+        if (cap - *len < 4096) {
+            cap = cap ? 2 * cap : 8192;
+            buf = realloc(buf, cap);
+        }
+        n = fread(buf + *len, 1, cap - *len, f);
+        *len += n;
+    } while (n > 0);
+    fclose(f);
+    return buf;
+}
+
+static int run_once(const char *shell, const char *command,
+                    const char *script, size_t len, struct run *out) {
+    int in[2], outp[2];
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(outp, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, outp[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, outp[1], STDERR_FILENO);
+    char *argv[] = {(char *)shell, "-p", NULL, NULL};
+    if (command != NULL) {
+        argv[1] = "-c";
+        argv[2] = (char *)command;
+    }
+
+    double start = now_us();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(in[0]);
+    close(outp[1]);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", shell, strerror(err));
+        close(in[1]);
+        close(outp[0]);
+        return -1;
+    }
+
+    // Scripts are small enough to fit in the pipe without blocking
+    if (command == NULL && write(in[1], script, len) != (ssize_t)len) {
+        perror("write");
+    }
+    close(in[1]);
+
+    char buf[4096];
+    ssize_t n;
+    out->first_us = -1;
+    while ((n = read(outp[0], buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        if (out->first_us < 0) {
+            out->first_us = now_us() - start;
+        }
+    }
+    close(outp[0]);
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        return -1;
+    }
+    out->total_us = now_us() - start;
+    out->maxrss_kb = ru.ru_maxrss;
+    if (out->first_us < 0) {
+        out->first_us = out->total_us;
+    }
+    return 0;
+}
+
+static void report(const char *shell, struct run *runs, int n) {
+    double *first = malloc(n * sizeof(*first));
+    double *total = malloc(n * sizeof(*total));
+    long rss = 0;
+    for (int i = 0; i < n; i++) {
+        first[i] = runs[i].first_us;
+        total[i] = runs[i].total_us;
+        if (runs[i].maxrss_kb > rss) {
+            rss = runs[i].maxrss_kb;
+        }
+    }
+    qsort(first, n, sizeof(*first), cmp_double);
+    qsort(total, n, sizeof(*total), cmp_double);
+    printf("%-28s %9.1f %9.1f %9.1f %9.1f %9ld\n", shell, first[0],
+           first[n / 2], first[(n * 9) / 10], total[n / 2], rss);
+    free(first);
+    free(total);
+}
+
+static int usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n runs] [-s script | -c command] shell...\n",
+            prog);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    int runs = 500;
+    const char *script_path = NULL;
+    const char *command = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:c:")) != -1) {
+        switch (c) {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 's':
+            script_path = optarg;
+            break;
+        case 'c':
+            command = optarg;
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (optind >= argc || runs < 1) {
+        return usage(argv[0]);
+    }
+
+    size_t len;
+    char *script;
+    if (script_path != NULL) {
+        script = read_file(script_path, &len);
+    } else {
+        script = strdup("bg\n");
+        len = strlen(script);
+    }
+
+    struct run *results = calloc(runs, sizeof(*results));
+    printf("%-28s %9s %9s %9s %9s %9s\n", "shell (us, KB)", "first-min",
+           "first-p50", "first-p90", "exit-p50", "maxrss");
+    for (int s = optind; s < argc; s++) {
+        int ok = 0;
+        for (int i = 0; i < runs; i++) {
+            if (run_once(argv[s], command, script, len, &results[ok]) == 0) {
+                ok++;
+            }
+        }
+        if (ok > 0) {
+            report(argv[s], results, ok);
+        }
+    }
+    free(results);
+    free(script);
+    return 0;
+}
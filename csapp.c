@@ -0,0 +1,445 @@
+/**
+ * @file csapp.c
+ * @brief Signal and async-signal-safe I/O wrappers used by the shell
+ *
+ * The formatter in this file is a small printf replacement that is safe to
+ * call from signal handlers: it only touches its arguments, the stack and
+ * write(2).  Output is accumulated in a fixed buffer and flushed when the
+ * buffer fills or the call completes.
+ */
+
+#include "csapp.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Size of the on-stack buffer used by the fd-backed sio_* functions */
+#define SIO_BUFSIZE 512
+
+/*
+ * Output sink for the formatter.  With fd < 0 the sink is a string buffer
+ * and excess output is counted but dropped; with fd >= 0 the buffer is
+ * flushed to the descriptor whenever it fills.
+ */
+struct sio_sink {
+    char *buf;
+    size_t size;   // capacity of buf
+    size_t len;    // bytes currently held in buf
+    size_t total;  // bytes produced so far
+    int fd;        // flush target, or -1
+    bool failed;   // a write error occurred
+};
+
+/**
+ * @brief Installs a signal handler with restartable system calls
+ *
+ * @param[in] signum The signal to install the handler for
+ * @param[in] handler The new handler (or SIG_IGN / SIG_DFL)
+ * @return The previous handler
+ */
+handler_t *Signal(int signum, handler_t *handler) {
+    struct sigaction action, old_action;
+
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask); // Block sigs of type being handled
+    action.sa_flags = SA_RESTART; // Restart syscalls if possible
+
+    if (sigaction(signum, &action, &old_action) < 0) {
+        perror("Signal error");
+        exit(1);
+    }
+
+    return old_action.sa_handler;
+}
+
+/**
+ * @brief Writes n bytes, retrying after short writes and interruptions
+ */
+ssize_t sio_writen(int fileno, const void *buf, size_t n) {
+    const char *p = buf;
+    size_t left = n;
+
+    while (left > 0) {
+        ssize_t nw = write(fileno, p, left);
+        if (nw < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        left -= (size_t)nw;
+        p += nw;
+    }
+    return (ssize_t)n;
+}
+
+static void sink_flush(struct sio_sink *sink) {
+    if (sink->fd >= 0 && sink->len > 0) {
+        if (sio_writen(sink->fd, sink->buf, sink->len) < 0) {
+            sink->failed = true;
+        }
+        sink->len = 0;
+    }
+}
+
+static void sink_putc(struct sio_sink *sink, char c) {
+    sink->total++;
+    if (sink->fd < 0) {
+        // Leave room for the terminating NUL
+        if (sink->len + 1 < sink->size) {
+            sink->buf[sink->len++] = c;
+        }
+        return;
+    }
+    if (sink->len == sink->size) {
+        sink_flush(sink);
+    }
+    sink->buf[sink->len++] = c;
+}
+
+static void sink_write(struct sio_sink *sink, const char *s, size_t n) {
+    while (n > 0) {
+        size_t room;
+        if (sink->fd < 0) {
+            room = sink->size > sink->len + 1 ? sink->size - sink->len - 1 : 0;
+            size_t take = n < room ? n : room;
+            memcpy(sink->buf + sink->len, s, take);
+            sink->len += take;
+            sink->total += n;
+            return;
+        }
+        if (sink->len == sink->size) {
+            sink_flush(sink);
+        }
+        room = sink->size - sink->len;
+        size_t take = n < room ? n : room;
+        memcpy(sink->buf + sink->len, s, take);
+        sink->len += take;
+        sink->total += take;
+        s += take;
+        n -= take;
+    }
+}
+
+static void sink_pad(struct sio_sink *sink, char c, int count) {
+    while (count-- > 0) {
+        sink_putc(sink, c);
+    }
+}
+
+/*
+ * Renders an unsigned value in the given base into the end of tmp and
+ * returns a pointer to the first digit.
+ */
+static char *format_unsigned(char *end, uintmax_t val, unsigned base,
+                             bool upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char *p = end;
+    do {
+        *--p = digits[val % base];
+        val /= base;
+    } while (val != 0);
+    return p;
+}
+
+/*
+ * The formatter proper.  Supports the flags "-0 +", field width and
+ * precision (including '*'), the length modifiers hh h l ll z j t, and the
+ * conversions d i u o x X c s p %.
+ */
+static void sio_format(struct sio_sink *sink, const char *fmt, va_list argp) {
+    char numbuf[3 * sizeof(uintmax_t) + 2];
+    char *numend = numbuf + sizeof(numbuf);
+
+    while (*fmt != '\0') {
+        const char *lit = fmt;
+        while (*fmt != '\0' && *fmt != '%') {
+            fmt++;
+        }
+        if (fmt > lit) {
+            sink_write(sink, lit, (size_t)(fmt - lit));
+        }
+        if (*fmt == '\0') {
+            break;
+        }
+        fmt++; // skip '%'
+
+        bool left = false, zero = false, plus = false, space = false;
+        for (;; fmt++) {
+            if (*fmt == '-') {
+                left = true;
+            } else if (*fmt == '0') {
+                zero = true;
+            } else if (*fmt == '+') {
+                plus = true;
+            } else if (*fmt == ' ') {
+                space = true;
+            } else {
+                break;
+            }
+        }
+
+        int width = 0;
+        if (*fmt == '*') {
+            width = va_arg(argp, int);
+            if (width < 0) {
+                left = true;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (*fmt++ - '0');
+            }
+        }
+
+        int prec = -1;
+        if (*fmt == '.') {
+            fmt++;
+            prec = 0;
+            if (*fmt == '*') {
+                prec = va_arg(argp, int);
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') {
+                    prec = prec * 10 + (*fmt++ - '0');
+                }
+            }
+        }
+
+        enum { LEN_INT, LEN_CHAR, LEN_SHORT, LEN_LONG, LEN_LLONG, LEN_SIZE,
+               LEN_MAX, LEN_PTRDIFF } len = LEN_INT;
+        if (*fmt == 'h') {
+            fmt++;
+            len = LEN_SHORT;
+            if (*fmt == 'h') {
+                fmt++;
+                len = LEN_CHAR;
+            }
+        } else if (*fmt == 'l') {
+            fmt++;
+            len = LEN_LONG;
+            if (*fmt == 'l') {
+                fmt++;
+                len = LEN_LLONG;
+            }
+        } else if (*fmt == 'z') {
+            fmt++;
+            len = LEN_SIZE;
+        } else if (*fmt == 'j') {
+            fmt++;
+            len = LEN_MAX;
+        } else if (*fmt == 't') {
+            fmt++;
+            len = LEN_PTRDIFF;
+        }
+
+        char conv = *fmt;
+        if (conv == '\0') {
+            break;
+        }
+        fmt++;
+
+        const char *body = NULL;
+        size_t body_len = 0;
+        char sign = '\0';
+        char ch;
+        const char *prefix = "";
+
+        switch (conv) {
+        case 'd':
+        case 'i': {
+            intmax_t val;
+            switch (len) {
+            case LEN_LONG:
+                val = va_arg(argp, long);
+                break;
+            case LEN_LLONG:
+                val = va_arg(argp, long long);
+                break;
+            case LEN_SIZE:
+                val = va_arg(argp, ssize_t);
+                break;
+            case LEN_MAX:
+                val = va_arg(argp, intmax_t);
+                break;
+            case LEN_PTRDIFF:
+                val = va_arg(argp, ptrdiff_t);
+                break;
+            case LEN_CHAR:
+                val = (signed char)va_arg(argp, int);
+                break;
+            case LEN_SHORT:
+                val = (short)va_arg(argp, int);
+                break;
+            default:
+                val = va_arg(argp, int);
+                break;
+            }
+            uintmax_t mag = val < 0 ? -(uintmax_t)val : (uintmax_t)val;
+            if (val < 0) {
+                sign = '-';
+            } else if (plus) {
+                sign = '+';
+            } else if (space) {
+                sign = ' ';
+            }
+            body = format_unsigned(numend, mag, 10, false);
+            body_len = (size_t)(numend - body);
+            if (prec == 0 && mag == 0) {
+                body_len = 0; // zero with zero precision prints no digits
+            }
+            break;
+        }
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+        case 'p': {
+            uintmax_t val;
+            if (conv == 'p') {
+                val = (uintptr_t)va_arg(argp, void *);
+                prefix = "0x";
+            } else {
+                switch (len) {
+                case LEN_LONG:
+                    val = va_arg(argp, unsigned long);
+                    break;
+                case LEN_LLONG:
+                    val = va_arg(argp, unsigned long long);
+                    break;
+                case LEN_SIZE:
+                    val = va_arg(argp, size_t);
+                    break;
+                case LEN_MAX:
+                    val = va_arg(argp, uintmax_t);
+                    break;
+                case LEN_PTRDIFF:
+                    val = (uintmax_t)va_arg(argp, ptrdiff_t);
+                    break;
+                case LEN_CHAR:
+                    val = (unsigned char)va_arg(argp, unsigned);
+                    break;
+                case LEN_SHORT:
+                    val = (unsigned short)va_arg(argp, unsigned);
+                    break;
+                default:
+                    val = va_arg(argp, unsigned);
+                    break;
+                }
+            }
+            unsigned base = (conv == 'u') ? 10 : (conv == 'o') ? 8 : 16;
+            body = format_unsigned(numend, val, base, conv == 'X');
+            body_len = (size_t)(numend - body);
+            if (prec == 0 && val == 0 && conv != 'p') {
+                body_len = 0;
+            }
+            break;
+        }
+        case 'c':
+            ch = (char)va_arg(argp, int);
+            body = &ch;
+            body_len = 1;
+            prec = -1;
+            break;
+        case 's':
+            body = va_arg(argp, const char *);
+            if (body == NULL) {
+                body = "(null)";
+            }
+            body_len = strlen(body);
+            if (prec >= 0 && (size_t)prec < body_len) {
+                body_len = (size_t)prec;
+            }
+            prec = -1;
+            break;
+        case '%':
+            sink_putc(sink, '%');
+            continue;
+        default:
+            // Unknown conversion: emit it verbatim
+            sink_putc(sink, '%');
+            sink_putc(sink, conv);
+            continue;
+        }
+
+        // Integer precision is a minimum digit count
+        int zeros = 0;
+        if (prec >= 0 && conv != 's' && (size_t)prec > body_len) {
+            zeros = prec - (int)body_len;
+        }
+        int used = (int)body_len + zeros + (sign != '\0') + (int)strlen(prefix);
+        int pad = width > used ? width - used : 0;
+
+        if (!left && !(zero && prec < 0)) {
+            sink_pad(sink, ' ', pad);
+        }
+        if (sign != '\0') {
+            sink_putc(sink, sign);
+        }
+        sink_write(sink, prefix, strlen(prefix));
+        if (!left && zero && prec < 0) {
+            sink_pad(sink, conv == 's' || conv == 'c' ? ' ' : '0', pad);
+        }
+        sink_pad(sink, '0', zeros);
+        sink_write(sink, body, body_len);
+        if (left) {
+            sink_pad(sink, ' ', pad);
+        }
+    }
+}
+
+size_t sio_vsnprintf(char *buf, size_t size, const char *fmt, va_list argp) {
+    struct sio_sink sink = {buf, size, 0, 0, -1, false};
+    sio_format(&sink, fmt, argp);
+    if (size > 0) {
+        buf[sink.len] = '\0';
+    }
+    return sink.total;
+}
+
+size_t sio_snprintf(char *buf, size_t size, const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    size_t n = sio_vsnprintf(buf, size, fmt, argp);
+    va_end(argp);
+    return n;
+}
+
+ssize_t sio_vdprintf(int fileno, const char *fmt, va_list argp) {
+    char buf[SIO_BUFSIZE];
+    struct sio_sink sink = {buf, sizeof(buf), 0, 0, fileno, false};
+    sio_format(&sink, fmt, argp);
+    sink_flush(&sink);
+    return sink.failed ? -1 : (ssize_t)sink.total;
+}
+
+ssize_t sio_dprintf(int fileno, const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t n = sio_vdprintf(fileno, fmt, argp);
+    va_end(argp);
+    return n;
+}
+
+ssize_t sio_printf(const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t n = sio_vdprintf(STDOUT_FILENO, fmt, argp);
+    va_end(argp);
+    return n;
+}
+
+ssize_t sio_eprintf(const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t n = sio_vdprintf(STDERR_FILENO, fmt, argp);
+    va_end(argp);
+    return n;
+}
@@ -0,0 +1,44 @@
+/**
+ * @file csapp.h
+ * @brief Signal and async-signal-safe I/O wrappers used by the shell
+ *
+ * This is the subset of the CS:APP support package that tsh relies on:
+ * the Signal() wrapper around sigaction, and the sio_* family of
+ * async-signal-safe formatted output routines.
+ *
+ * The sio formatter never calls malloc or stdio.  Output is rendered into
+ * a caller-provided (or on-stack) buffer and written with write(2), so a
+ * typical message costs exactly one system call.
+ */
+
+#ifndef __CSAPP_H__
+#define __CSAPP_H__
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Signal handler type */
+typedef void handler_t(int);
+
+/* Installs a restartable handler for signum and returns the old one */
+handler_t *Signal(int signum, handler_t *handler);
+
+/* Async-signal-safe formatted output (subset of printf) */
+ssize_t sio_printf(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+ssize_t sio_eprintf(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+ssize_t sio_dprintf(int fileno, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+ssize_t sio_vdprintf(int fileno, const char *fmt, va_list argp);
+
+/* Formats into buf (always NUL-terminated), returns the untruncated length */
+size_t sio_snprintf(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+size_t sio_vsnprintf(char *buf, size_t size, const char *fmt, va_list argp);
+
+/* Writes the whole buffer, retrying on short writes and EINTR */
+ssize_t sio_writen(int fileno, const void *buf, size_t n);
+
+#endif /* __CSAPP_H__ */
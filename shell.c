@@ -2,9 +2,50 @@
  * @file tsh.c
  * @brief A tiny shell program with job control
  *  Builtin Command:
- *  fg job, bg job, quit, jobs
+ *  fg job..., bg job..., quit [wait[=T] | terminate[=T] | detach],
+ *  jobs [-l] (with -l, also the resource use of recently finished jobs)
+ *  cache cmd (memoizes the output of deterministic commands)
+ *  needs in... -> out... : cmd (skips cmd when its outputs are fresh)
+ *  retry [-n N] [--backoff MIN..MAX] [--on CODES] cmd (reruns failures)
+ *  pin [-u|-r|-a N] [path...] (launches programs through held descriptors)
+ *  kill [-s SIG | -SIG] [--all] [--state=S] [spec...] (signals jobs)
+ *  wait [--state=S] [spec...] (waits for jobs to finish)
+ *  @tag... cmd (tags the job; @tag selects the tagged jobs in jobs, bg,
+ *        fg, kill, wait and jtop)
+ *  jtop [-b] [-n N] [-d T] [-s KEY] (live CPU, memory and I/O of the jobs)
+ *  time cmd (reports the time and delays of the jobs cmd ran)
+ *  sched [-j N|auto|off] [-p POLICY] [-b BUDGET] [-f PRIO|all|off]
+ *        [-t file|off] (queues, packs and preempts background jobs)
+ *  cmd &[prio=N,deadline=T,group=G,weight=W,cpu=N,mem=SIZE]
+ *        (a background job for sched)
+ *  parallel [-j N|auto] cmd [args...] ::: arg... (runs cmd for each arg)
+ *  array FIRST-LAST[%LIMIT] cmd ... $IDX (runs cmd for each index as one
+ *        job; %jid.idx names a single task)
+ *  spawn-script file [&] (runs a script as a coroutine of the shell)
+ *  trap [cmd SIG...] (runs cmd on INT, TERM, HUP, USR1 or EXIT)
+ *  on-done [%jid|@tag cmd] (runs cmd once the job or the tagged jobs are
+ *        done)
+ *  match [-p] word pattern... (tests word against glob patterns; %?pattern
+ *        selects the jobs whose command line contains pattern)
+ *  read [-r] [-d delim] [-n N] [-u fd] [name] [: cmd...] (reads a record
+ *        into $name, or runs cmd for each record)
  *  Builtin command is evaluated by builtincmd() function
  *
+ *  With -c string the shell runs one command string (commands joined by
+ *  ;, && and ||, each possibly a pipeline) and exits with the status of the
+ *  last command, initializing job control only if a command needs it.
+ *
+ *  On quit or end of input, jobs that are still around are waited for,
+ *  terminated (the default) or detached according to the quit argument or
+ *  TSH_SHUTDOWN, within a bounded time.
+ *
+ *  With -D path the shell becomes a daemon serving sessions on a Unix
+ *  socket, and with -A path it attaches to one (see tsh_daemon.h).
+ *
+ *  The scheduler, array jobs and script coroutines live in tsh_sched.c,
+ *  tsh_array.c and tsh_script.c; tsh_shell.h lists what they use of this
+ *  file.
+ *
  *  This file implements a tiny shell that can respond to builtin job
  *  commands, process foreground job and background jobs by managing
  *  such jobs through job lists.
@@ -19,22 +60,51 @@
  *  sigtstp_handler to respond to the three signals so it prints the
  *  corresponding message and also reaps children correctly.
  *
+ *  Work that cannot be done inside a signal handler (e.g. relaunching a
+ *  failed job after a delay) runs in a small event loop: the SIGCHLD
+ *  handler queues each reaped child in a ring, and the shell drains the
+ *  ring and fires due timers whenever it waits for input or for the
+ *  foreground job.
+ *
  * @author Jiayi Wang
  */
 
+#define _GNU_SOURCE // statx
+
 #include "csapp.h"
+#include "tsh_acct.h"
+#include "tsh_array.h"
+#include "tsh_cache.h"
+#include "tsh_cgroup.h"
+#include "tsh_daemon.h"
 #include "tsh_helper.h"
+#include "tsh_jtop.h"
+#include "tsh_mtime.h"
+#include "tsh_pattern.h"
+#include "tsh_pin.h"
+#include "tsh_prewarm.h"
+#include "tsh_read.h"
+#include "tsh_sched.h"
+#include "tsh_script.h"
+#include "tsh_shell.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 /*
@@ -55,8 +125,42 @@
 #endif
 
 /* Function prototypes */
-void eval(const char *cmdline);
-void builtincmd(parseline_return parse_result, struct cmdline_tokens token);
+bool builtincmd(const char *cmdline, parseline_return parse_result,
+                struct cmdline_tokens token);
+jid_t launch_job(const char *cmdline, parseline_return parse_result,
+                 struct cmdline_tokens *token);
+int wait_fg(jid_t jid);
+int run_job(const char *cmdline, parseline_return parse_result,
+            struct cmdline_tokens *token);
+
+void builtin_cache(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token);
+void builtin_needs(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token);
+void builtin_retry(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token);
+void builtin_pin(const char *cmdline, parseline_return parse_result,
+                 struct cmdline_tokens *token);
+void builtin_kill(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token);
+void builtin_wait(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token);
+void builtin_jtop(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token);
+void builtin_time(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token);
+void builtin_match(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token);
+void builtin_read(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token);
+
+void shell_init(void);
+bool shell_shutdown(const char *policy);
+int run_string(const char *str);
+
+int read_cmdline(char *cmdline, size_t size);
+int read_input(int fd, bool owned, const struct read_opts *opts, char *buf,
+               size_t size);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
@@ -64,6 +168,71 @@ void sigint_handler(int sig);
 void sigquit_handler(int sig);
 void cleanup(void);
 
+/* Builtin commands recognized by name rather than by parseline() */
+typedef void named_builtin_fn(const char *cmdline,
+                              parseline_return parse_result,
+                              struct cmdline_tokens *token);
+static const struct named_builtin {
+    const char *name;
+    named_builtin_fn *fn;
+} named_builtins[] = {
+    {"cache", builtin_cache},
+    {"needs", builtin_needs},
+    {"retry", builtin_retry},
+    {"pin", builtin_pin},
+    {"kill", builtin_kill},
+    {"wait", builtin_wait},
+    {"jtop", builtin_jtop},
+    {"time", builtin_time},
+    {"sched", builtin_sched},
+    {"parallel", builtin_parallel},
+    {"array", builtin_array},
+    {"spawn-script", builtin_spawn_script},
+    {"trap", builtin_trap},
+    {"on-done", builtin_on_done},
+    {"match", builtin_match},
+    {"read", builtin_read},
+};
+
+/* Set once shell_init() has set up job control */
+static bool shell_initialized = false;
+
+/* Descriptor limit the shell started with, restored in its children */
+static struct rlimit nofile_limit;
+
+/* Wait status of the most recently reaped foreground job */
+static volatile sig_atomic_t fg_status = 0;
+
+/* Exit status of the last builtin, for -c's && and || (0 unless it fails) */
+static int builtin_status = 0;
+
+/* Set when Ctrl-C arrives while no job is in the foreground */
+volatile sig_atomic_t sigint_pending = 0;
+
+/* Set while shutting down, when shell_shutdown() reports on each job */
+volatile sig_atomic_t shutting_down = 0;
+
+/*
+ * Children reaped by sigchld_handler, waiting to be seen by the event loop.
+ * The handler is the only producer and runs with the consumer's signals
+ * blocked, so the indices need no further synchronization.  When the ring
+ * is full the handler stops reaping and sets reap_deferred; the children
+ * stay zombies until the event loop has made room and reaps them itself,
+ * so no exit is ever lost.  With delay accounting on, the handler always
+ * defers, so that the delays are read from the event loop.
+ */
+#define REAP_RING_SIZE 4096
+static struct reap_event {
+    pid_t pid;
+    jid_t jid;
+    int status;
+} reap_ring[REAP_RING_SIZE];
+static volatile sig_atomic_t reap_head = 0; // next slot to fill
+static volatile sig_atomic_t reap_tail = 0; // next slot to drain
+static volatile sig_atomic_t reap_deferred = 0;
+
+static void reap_children(void);
+
 /**
  * @brief Runs the shell and accepts command line arguments for shell to eval
  *
@@ -78,8 +247,11 @@ void cleanup(void);
  */
 int main(int argc, char **argv) {
     char c;
-    char cmdline[MAXLINE_TSH]; // Cmdline for fgets
+    char cmdline[MAXLINE_TSH]; // Cmdline read from stdin
     bool emit_prompt = true;   // Emit prompt (default)
+    const char *daemon_path = NULL; // -D: serve sessions on this socket
+    const char *attach_path = NULL; // -A: attach to a daemon
+    const char *command = NULL;     // -c: run this string and exit
 
     // Redirect stderr to stdout (so that driver will get all output
     // on the pipe connected to stdout)
@@ -89,7 +261,7 @@ int main(int argc, char **argv) {
     }
 
     // Parse the command line
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpc:D:A:")) != EOF) {
         switch (c) {
         case 'h': // Prints help message
             usage();
@@ -100,17 +272,88 @@ int main(int argc, char **argv) {
         case 'p': // Disables prompt printing
             emit_prompt = false;
             break;
+        case 'c': // Runs one command string
+            command = optarg;
+            break;
+        case 'D': // Runs as a daemon serving sessions
+            daemon_path = optarg;
+            break;
+        case 'A': // Attaches to a daemon
+            attach_path = optarg;
+            break;
         default:
             usage();
         }
     }
 
+    // A client only relays; the shell itself runs in the daemon's session
+    if (attach_path != NULL) {
+        return daemon_attach(attach_path, emit_prompt);
+    }
+
+    // Returns in a forked session with the client's stdio, cwd and env
+    if (daemon_path != NULL) {
+        daemon_serve(daemon_path, &emit_prompt);
+    }
+
     // Create environment variable
     if (putenv("MY_ENV=42") < 0) {
         perror("putenv error");
         exit(1);
     }
 
+    // One-shot mode sets up job control only if a command needs it, and
+    // then leaves through the same shutdown as quit (EXIT trap, policy)
+    if (command != NULL) {
+        int status = run_string(command);
+        shell_shutdown(NULL);
+        return status;
+    }
+
+    shell_init();
+
+    // Execute the shell's read/eval loop
+    while (true) {
+        if (emit_prompt) {
+            printf("%s", prompt);
+
+            // We must flush stdout since we are not printing a full line.
+            fflush(stdout);
+        }
+
+        // Wait for a line, running background events in the meantime
+        int nread = read_cmdline(cmdline, MAXLINE_TSH);
+        if (nread < 0) {
+            perror("read error");
+            exit(1);
+        }
+
+        if (nread == 0) {
+            // End of file (Ctrl-D)
+            printf("\n");
+            shell_shutdown(NULL);
+            return 0;
+        }
+
+        // Evaluate the command line
+        eval(cmdline);
+    }
+
+    return -1; // control never reaches here
+}
+
+/**
+ * @brief Sets up stdout, the job list and the signal handlers
+ *
+ * Interactive shells call this at start-up; in -c mode it runs on the
+ * first command that needs job control.  Calls after the first do nothing.
+ */
+void shell_init(void) {
+    if (shell_initialized) {
+        return;
+    }
+    shell_initialized = true;
+
     // Set buffering mode of stdout to line buffering.
     // This prevents lines from being printed in the wrong order.
     if (setvbuf(stdout, NULL, _IOLBF, 0) < 0) {
@@ -120,6 +363,14 @@ int main(int argc, char **argv) {
 
     // Initialize the job list
     init_job_list();
+    acct_init();
+
+    // Every job holds a pidfd, so allow as many descriptors as the hard
+    // limit does; children get the original limit back before exec
+    if (getrlimit(RLIMIT_NOFILE, &nofile_limit) == 0) {
+        struct rlimit raised = {nofile_limit.rlim_max, nofile_limit.rlim_max};
+        setrlimit(RLIMIT_NOFILE, &raised);
+    }
 
     // Register a function to clean up the job list on program termination.
     // The function may not run in the case of abnormal termination (e.g. when
@@ -139,38 +390,6 @@ int main(int argc, char **argv) {
     Signal(SIGTTOU, SIG_IGN);
 
     Signal(SIGQUIT, sigquit_handler);
-
-    // Execute the shell's read/eval loop
-    while (true) {
-        if (emit_prompt) {
-            printf("%s", prompt);
-
-            // We must flush stdout since we are not printing a full line.
-            fflush(stdout);
-        }
-
-        if ((fgets(cmdline, MAXLINE_TSH, stdin) == NULL) && ferror(stdin)) {
-            perror("fgets error");
-            exit(1);
-        }
-
-        if (feof(stdin)) {
-            // End of file (Ctrl-D)
-            printf("\n");
-            return 0;
-        }
-
-        // Remove any trailing newline
-        char *newline = strchr(cmdline, '\n');
-        if (newline != NULL) {
-            *newline = '\0';
-        }
-
-        // Evaluate the command line
-        eval(cmdline);
-    }
-
-    return -1; // control never reaches here
 }
 
 /**
@@ -187,21 +406,6 @@ int main(int argc, char **argv) {
 void eval(const char *cmdline) {
     parseline_return parse_result;
     struct cmdline_tokens token;
-    pid_t pid;
-    sigset_t mask_all, prev_all, sigchld, prev, mask_one;
-    sigfillset(&mask_all);
-    sigemptyset(&sigchld);
-    sigaddset(&sigchld, SIGCHLD);
-    sigaddset(&sigchld, SIGINT);
-    sigaddset(&sigchld, SIGTSTP);
-    sigemptyset(&prev);
-    sigemptyset(&mask_one);
-    sigaddset(&mask_one, SIGCHLD);
-    sigaddset(&mask_one, SIGINT);
-    sigaddset(&mask_one, SIGTSTP);
-    jid_t jid;
-    int fdin = 0;
-    int fdout = 0;
 
     // Parse command line
     parse_result = parseline(cmdline, &token); // parse whether bg or fg
@@ -211,270 +415,3262 @@ void eval(const char *cmdline) {
     }
 
     // call helper function builtin
-    builtincmd(parse_result, token);
-
-    if (token.builtin != BUILTIN_NONE) {
+    if (builtincmd(cmdline, parse_result, token)) {
         return;
     }
 
+    run_job(cmdline, parse_result, &token);
+}
+
+/**
+ * @brief Launches a command as a new job without waiting for it
+ *
+ * @param[in] cmdline The command line, recorded in the job list
+ * @param[in] parse_result PARSELINE_FG or PARSELINE_BG
+ * @param[in] token The parsed command; argv[0] is the program to run
+ * @return The job ID of the new job, or 0 if the job was not started
+ *
+ * Background jobs are announced as they start.  Foreground jobs are left
+ * for the caller to wait on with wait_fg().
+ */
+jid_t launch_job(const char *cmdline, parseline_return parse_result,
+                 struct cmdline_tokens *token) {
+    pid_t pid;
+    sigset_t mask_all, prev_all, mask_one;
+    sigfillset(&mask_all);
+    sigemptyset(&mask_one);
+    sigaddset(&mask_one, SIGCHLD);
+    sigaddset(&mask_one, SIGINT);
+    sigaddset(&mask_one, SIGTSTP);
+    jid_t jid;
+
+    if (parse_result != PARSELINE_BG && parse_result != PARSELINE_FG) {
+        sio_printf("not bg or fg\n");
+        exit(0);
+    }
+
+    // background jobs wait their turn if the scheduler limits them
+    struct job_opts opts;
+    if (!parse_job_opts(token->bg_opts, &opts)) {
+        return 0;
+    }
+    if (parse_result == PARSELINE_BG &&
+        (bg_sched.limit > 0 || opts.cpu > 0 || opts.mem > 0)) {
+        return sched_submit(&bg_sched, cmdline, token, &opts);
+    }
+
     // the call should not be builtin function if reach this stage
     sigprocmask(SIG_BLOCK, &mask_one, &prev_all);
-    if (token.infile != NULL) {
+    pid = spawn_job(token, &prev_all, -1);
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        return 0;
+    }
+
+    // add to joblist; a script coroutine does not own the terminal, so
+    // its foreground jobs run as background jobs it waits for
+    sigprocmask(SIG_BLOCK, &mask_all, NULL);
+    jid = add_job(pid,
+                  parse_result == PARSELINE_BG || script_current != NULL
+                      ? BG
+                      : FG,
+                  cmdline);
+    job_set_prio(jid, opts.prio);
+    tag_job(jid, token);
+    if (parse_result == PARSELINE_BG) {
+        // print out background job and return
+        sio_printf("[%d] (%d) %s\n", (int)jid, (int)pid, cmdline);
+    }
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    return jid;
+}
+
+/* Files a new job under the @tags of its command line */
+void tag_job(jid_t jid, const struct cmdline_tokens *token) {
+    for (int i = 0; i < token->ntags; i++) {
+        if (!job_add_tag(jid, token->tags[i])) {
+            sio_printf("@%s: cannot tag job %%%d\n", token->tags[i],
+                       (int)jid);
+        }
+    }
+}
+
+/**
+ * @brief Opens the redirections and forks the process of a job
+ *
+ * @param[in] token The parsed command; argv[0] is the program to run
+ * @param[in] prev_mask The signal mask the child runs the program with
+ * @param[in] cgroup_fd The cgroup.procs of the cgroup the child joins, or
+ *            -1 to stay in the shell's
+ * @return The child's pid, or 0 (after printing an error) if a
+ *         redirection could not be opened
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked; the caller
+ * adds the job to the job list before unblocking them.
+ */
+pid_t spawn_job(const struct cmdline_tokens *token, const sigset_t *prev_mask,
+                int cgroup_fd) {
+    pid_t pid;
+    int fdin = 0;
+    int fdout = 0;
+
+    if (token->infile != NULL) {
         // file input
-        fdin = open(token.infile, O_RDONLY);
+        fdin = open(token->infile, O_RDONLY);
         if (fdin < 0) {
             if (errno == ENOENT) {
-                sio_printf("%s: No such file or directory\n", token.infile);
+                sio_printf("%s: No such file or directory\n", token->infile);
             } else {
-                sio_printf("%s: Permission denied\n", token.infile);
+                sio_printf("%s: Permission denied\n", token->infile);
             }
-            sigprocmask(SIG_SETMASK, &prev_all, NULL);
-            return;
+            return 0;
         }
     }
-    if (token.outfile != NULL) {
+    if (token->outfile != NULL) {
         // file output
-        fdout = open(token.outfile, O_WRONLY | O_CREAT | O_TRUNC,
+        fdout = open(token->outfile, O_WRONLY | O_CREAT | O_TRUNC,
                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fdout < 0) {
             if (errno == ENOENT) {
-                sio_printf("%s: No such file or directory\n", token.outfile);
+                sio_printf("%s: No such file or directory\n", token->outfile);
             } else {
-                sio_printf("%s: Permission denied\n", token.outfile);
+                sio_printf("%s: Permission denied\n", token->outfile);
             }
-            sigprocmask(SIG_SETMASK, &prev_all, NULL);
-            return;
+            if (token->infile != NULL) {
+                close(fdin);
+            }
+            return 0;
         }
     }
 
+    prewarm_command(token->argv[0]);
+    read_sync();
+
     // fork child to run the program
     if ((pid = fork()) == 0) {
         setpgid(pid, pid);
-        if (token.infile != NULL) {
+        if (token->infile != NULL) {
             dup2(fdin, 0);
         }
-        if (token.outfile != NULL) {
+        if (token->outfile != NULL) {
             dup2(fdout, 1);
         }
-        sigprocmask(SIG_SETMASK, &prev_all, NULL);
-        if (execve(token.argv[0], token.argv, environ) < 0) {
-            fdin = open(token.argv[0], O_RDONLY);
+        setrlimit(RLIMIT_NOFILE, &nofile_limit);
+        if (cgroup_fd >= 0 && write(cgroup_fd, "0", 1) < 0) {
+            sio_printf("%s: running without its cgroup limits\n",
+                       token->argv[0]);
+        }
+        sigprocmask(SIG_SETMASK, prev_mask, NULL);
+        if (pin_execve(token->argv, environ) < 0) {
+            fdin = open(token->argv[0], O_RDONLY);
             if (fdin < 0) {
                 if (errno == ENOENT) {
                     sio_printf("%s: No such file or directory\n",
-                               token.argv[0]);
+                               token->argv[0]);
                 } else {
-                    sio_printf("%s: Permission denied\n", token.argv[0]);
+                    sio_printf("%s: Permission denied\n", token->argv[0]);
                 }
             }
             exit(0);
         }
-        return;
     }
 
-    // add to joblist
-    sigprocmask(SIG_BLOCK, &mask_all, NULL);
-    if (parse_result == PARSELINE_BG) {
-        jid = add_job(pid, BG, cmdline);
-    } else if (parse_result == PARSELINE_FG) {
-        jid = add_job(pid, FG, cmdline);
-    } else {
-        sio_printf("not bg or fg\n");
-        exit(0);
+    if (pid > 0) {
+        // Also set the group here, so that the job can be signalled as a
+        // group before the child gets to run
+        setpgid(pid, pid);
+        pin_note_launch(token->argv[0]);
     }
-    sigprocmask(SIG_SETMASK, &prev_all, NULL);
-
-    // decide whether to wait for child process to terminate / stop
-    if (parse_result == PARSELINE_FG) {
-
-        // wait for child process to end
-        sigprocmask(SIG_BLOCK, &sigchld, NULL);
-        int fjid;
-        while ((fjid = fg_job()) > 0) {
-            job_state state = job_get_state(fjid);
-            if (state == ST) {
-                sio_printf("job is stopped");
-                break;
-            }
-            sigsuspend(&prev);
-        }
-        if (token.infile != NULL) {
-            close(fdin);
-        }
-        if (token.outfile != NULL) {
-            close(fdout);
-        }
-        sigprocmask(SIG_SETMASK, &prev, NULL);
-    } else if (parse_result == PARSELINE_BG) {
 
-        // print out background job and return
-        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-        sio_printf("[%d] (%d) %s\n", (int)jid, (int)pid, cmdline);
-        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    // the child holds its own copies of the redirected files
+    if (token->infile != NULL) {
+        close(fdin);
     }
-    return;
+    if (token->outfile != NULL) {
+        close(fdout);
+    }
+    return pid > 0 ? pid : 0;
 }
 
 /**
- * @brief Runs the builtin function to respond to any builtin command call
- *  If the token indicates the command is not a builtin command, the function
- *  does not enter any of the conditionals and will run normally in eval()
+ * @brief Waits for the foreground job to terminate or stop
  *
- * @param[in] parse_result The parse result from eval() function
- * @param[in] token The token from eval() function
+ * @param[in] jid The foreground job
+ * @return The job's exit code (128 plus the signal number if it was killed
+ *         by a signal), or -1 if the job stopped instead
  *
- * This function cases on four builtin command.
- * The builtin commands are:
- *  bg job, fg job, jobs, quit
+ * In a script coroutine the script yields instead (see script_wait_job()).
  */
-void builtincmd(parseline_return parse_result, struct cmdline_tokens token) {
-
-    sigset_t mask_all, prev_all, sigchld, prev, mask_one;
-    sigfillset(&mask_all);
+int wait_fg(jid_t jid) {
+    if (script_current != NULL) {
+        return script_wait_job(jid);
+    }
+    sigset_t sigchld, prev;
     sigemptyset(&sigchld);
     sigaddset(&sigchld, SIGCHLD);
     sigaddset(&sigchld, SIGINT);
     sigaddset(&sigchld, SIGTSTP);
     sigemptyset(&prev);
-    sigemptyset(&mask_one);
-    sigaddset(&mask_one, SIGCHLD);
-    sigaddset(&mask_one, SIGINT);
-    sigaddset(&mask_one, SIGTSTP);
-    int fdout = 0;
 
-    if (token.builtin == BUILTIN_QUIT) {
-        exit(0);
+    // wait for child process to end, serving background events meanwhile
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+    preempt_begin(jid);
+    int fjid;
+    while ((fjid = fg_job()) > 0) {
+        job_state state = job_get_state(fjid);
+        if (state == ST) {
+            sio_printf("job is stopped");
+            break;
+        }
+        event_poll(-1, -1);
     }
+    preempt_end();
 
-    if (token.builtin == BUILTIN_JOBS) {
-        // list all background jobs
-        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-        if (token.outfile != NULL) {
-            fdout = open(token.outfile, O_WRONLY | O_CREAT | O_TRUNC,
-                         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-            if (fdout < 0) {
-                if (errno == ENOENT) {
-                    sio_printf("%s: No such file or directory\n",
-                               token.outfile);
-                } else {
-                    sio_printf("%s: Permission denied\n", token.outfile);
-                }
-                sigprocmask(SIG_SETMASK, &prev_all, NULL);
-                return;
-            }
-            list_jobs(fdout);
-            close(fdout);
-        } else {
-            list_jobs(STDOUT_FILENO);
+    int status = -1;
+    if (!job_exists(jid)) {
+        if (WIFEXITED(fg_status)) {
+            status = WEXITSTATUS(fg_status);
+        } else if (WIFSIGNALED(fg_status)) {
+            status = 128 + WTERMSIG(fg_status);
         }
-        sigprocmask(SIG_SETMASK, &prev_all, NULL);
     }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return status;
+}
 
-    if (token.builtin == BUILTIN_BG) {
-        if (token.argc == 1) {
-            sio_printf("bg command requires PID or %%jobid argument\n");
-            return;
-        }
+/**
+ * @brief Launches a command and waits for it if it runs in the foreground
+ *
+ * @return The exit code of a foreground job as returned by wait_fg(), 0
+ *         for a background job, or -1 if the job could not be started
+ */
+int run_job(const char *cmdline, parseline_return parse_result,
+            struct cmdline_tokens *token) {
+    jid_t jid = launch_job(cmdline, parse_result, token);
+    if (jid == 0) {
+        return -1;
+    }
+    if (parse_result == PARSELINE_BG) {
+        return 0;
+    }
+    return wait_fg(jid);
+}
 
-        char *start = token.argv[1];
-        char *num;
-        if ((*start) != '%') {
-            num = token.argv[1];
-        } else {
-            num = token.argv[1] + 1;
-        }
-        pid_t jid = atoi(num);
-        if (jid == 0) {
-            sio_printf("bg: argument must be a PID or %%jobid\n");
-            return;
-        }
-        const char *cmd;
-        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-        if (job_exists(jid)) {
-            // jid is jid
-            pid_t pid = job_get_pid(jid);
-            cmd = job_get_cmdline(jid);
-            sio_printf("[%d] (%d) %s\n", (int)jid, (int)pid, cmd);
-            job_set_state(jid, BG);
-            killpg(pid, SIGCONT);
-        } else {
-            // jid is pid
-            pid_t pid = jid;
-            jid = job_from_pid(pid);
-            if (jid == 0) {
-                printf("%s: No such job\n", token.argv[1]);
-                sigprocmask(SIG_SETMASK, &prev_all, NULL);
-                return;
-            }
-            cmd = job_get_cmdline(jid);
-            sio_printf("[%d] (%d) %s\n", (int)jid, (int)pid, cmd);
-            job_set_state(jid, BG);
-            killpg(pid, SIGCONT);
+/*****************
+ * Job specifications
+ *****************/
+
+/* A job (or, for kill, a process) named on a builtin's command line */
+struct job_ref {
+    jid_t jid; // 0 for a process that is not one of the shell's jobs
+    pid_t pid;
+    long idx; // the task of an array job (%jid.idx), or -1 for the job
+};
+
+/**
+ * @brief Parses %jid, %first-%last (or %first-last), %jid.idx or a pid
+ *
+ * @param[out] first, last The job ID range, or 0 for a pid
+ * @param[out] pid The pid, or 0 for a job ID range
+ * @param[out] idx The task index of %jid.idx, or -1
+ * @return false if spec is malformed
+ */
+bool parse_job_spec(const char *spec, jid_t *first, jid_t *last, pid_t *pid,
+                    long *idx) {
+    char *end;
+    *idx = -1;
+    if (spec[0] != '%') {
+        long n = strtol(spec, &end, 10);
+        if (end == spec || *end != '\0' || n < 1 || n > INT32_MAX) {
+            return false;
         }
-        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        *first = *last = 0;
+        *pid = (pid_t)n;
+        return true;
+    }
+
+    const char *p = spec + 1;
+    long a = strtol(p, &end, 10);
+    if (end == p || a < 1 || a > INT32_MAX) {
+        return false;
+    }
+    long b = a;
+    if (*end == '.') {
+        p = end + 1;
+        *idx = isdigit((unsigned char)*p) ? strtol(p, &end, 10) : -1;
+        if (*idx < 0) {
+            return false;
+        }
+    } else if (*end == '-') {
+        p = end + 1 + (end[1] == '%');
+        b = strtol(p, &end, 10);
+        if (end == p || b < a || b > INT32_MAX) {
+            return false;
+        }
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    *first = (jid_t)a;
+    *last = (jid_t)b;
+    *pid = 0;
+    return true;
+}
+
+/**
+ * @brief Adds a job (or process) to a growing array of job_refs
+ */
+static bool push_ref(struct job_ref **refs, size_t *count, size_t *cap,
+                     jid_t jid, pid_t pid, long idx) {
+    if (*count == *cap) {
+        size_t new_cap = *cap ? 2 * *cap : 16;
+        struct job_ref *grown = realloc(*refs, new_cap * sizeof(*grown));
+        if (grown == NULL) {
+            return false;
+        }
+        *refs = grown;
+        *cap = new_cap;
+    }
+    (*refs)[(*count)++] = (struct job_ref){jid, pid, idx};
+    return true;
+}
+
+/**
+ * @brief Resolves the job arguments of kill, bg, fg, jobs and wait
+ *
+ * @param[in] who The builtin's name, for error messages
+ * @param[in] argc, argv The arguments: job specs (see parse_job_spec()),
+ *            @tag for the jobs launched with that tag, %?pattern for the
+ *            jobs whose command line contains pattern (see tsh_pattern.h),
+ *            %jid.idx for a task of an array job (not filtered by
+ *            --state), and the selectors
+ *            --all and --state=running|stopped|pending|preempted.  Without
+ *            specs, the selectors pick from every job; with specs, --state
+ *            filters the jobs they name.
+ * @param[in] allow_pids Whether a pid that is not a job is let through
+ *            (with jid 0) rather than reported as no such job
+ * @param[out] count The number of entries in the returned array
+ * @return A malloc'd array of the jobs, in argument order
+ *
+ * Every argument is resolved in one pass over the job list, so that e.g.
+ * kill %1-%10000 costs no more than walking the jobs once, and a @tag
+ * visits only its own jobs, through the job list's tag index.  Errors are
+ * reported per argument; a malformed argument selects nothing.  Must be
+ * called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+static struct job_ref *select_jobs(const char *who, int argc, char **argv,
+                                   bool allow_pids, size_t *count) {
+    unsigned states = 0; // mask of 1 << state, 0 for any
+    bool all = false;
+    int nspecs = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--all") == 0) {
+            all = true;
+        } else if (strcmp(argv[i], "--state=running") == 0) {
+            states |= (1u << FG) | (1u << BG);
+        } else if (strcmp(argv[i], "--state=stopped") == 0) {
+            states |= 1u << ST;
+        } else if (strcmp(argv[i], "--state=pending") == 0) {
+            states |= 1u << PD;
+        } else if (strcmp(argv[i], "--state=preempted") == 0) {
+            states |= 1u << PR;
+        } else if (strncmp(argv[i], "--state=", 8) == 0) {
+            sio_printf("%s: %s: state must be running, stopped, pending "
+                       "or preempted\n",
+                       who, argv[i] + 8);
+        } else {
+            nspecs++;
+        }
+    }
+
+    struct job_ref *refs = NULL;
+    size_t cap = 0;
+    *count = 0;
+    if (all || nspecs == 0) {
+        for (jid_t jid = job_next(0); jid != 0; jid = job_next(jid)) {
+            if ((states == 0 || (states & (1u << job_get_state(jid)))) &&
+                !push_ref(&refs, count, &cap, jid, job_get_pid(jid), -1)) {
+                sio_printf("%s: out of memory\n", who);
+                return refs;
+            }
+        }
+    }
+
+    for (int i = 0; i < argc; i++) {
+        jid_t first, last;
+        pid_t pid;
+        if (strncmp(argv[i], "--", 2) == 0) {
+            continue;
+        }
+        if (argv[i][0] == '@') {
+            // only the tagged jobs, through the tag's index
+            size_t ntagged;
+            const jid_t *tagged = job_tagged(argv[i] + 1, &ntagged);
+            if (ntagged == 0) {
+                sio_printf("%s: No such job\n", argv[i]);
+            }
+            for (size_t t = 0; t < ntagged; t++) {
+                jid_t jid = tagged[t];
+                if ((states == 0 || (states & (1u << job_get_state(jid)))) &&
+                    !push_ref(&refs, count, &cap, jid, job_get_pid(jid),
+                              -1)) {
+                    sio_printf("%s: out of memory\n", who);
+                    return refs;
+                }
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "%?", 2) == 0) {
+            // the jobs whose command line contains the pattern, which is
+            // compiled once for all of them
+            char glob[MAXLINE_TSH + 2];
+            snprintf(glob, sizeof(glob), "*%s*", argv[i] + 2);
+            struct pattern *p = pattern_compile(glob);
+            bool found = false;
+            for (jid_t jid = job_next(0); p != NULL && jid != 0;
+                 jid = job_next(jid)) {
+                if (!pattern_match(p, job_get_cmdline(jid))) {
+                    continue;
+                }
+                found = true;
+                if ((states == 0 || (states & (1u << job_get_state(jid)))) &&
+                    !push_ref(&refs, count, &cap, jid, job_get_pid(jid),
+                              -1)) {
+                    sio_printf("%s: out of memory\n", who);
+                    return refs;
+                }
+            }
+            if (!found) {
+                sio_printf("%s: No such job\n", argv[i]);
+            }
+            continue;
+        }
+        long idx;
+        if (!parse_job_spec(argv[i], &first, &last, &pid, &idx)) {
+            sio_printf("%s: argument must be a PID, %%jobid or @tag\n", who);
+            continue;
+        }
+        if (idx >= 0) {
+            // a single task of an array job
+            if (!array_has_task(array_find(first), idx)) {
+                sio_printf("%s: No such task\n", argv[i]);
+            } else if (!push_ref(&refs, count, &cap, first, 0, idx)) {
+                sio_printf("%s: out of memory\n", who);
+                return refs;
+            }
+            continue;
+        }
+        if (pid != 0) {
+            first = last = job_from_pid(pid);
+            if (first == 0) {
+                if (allow_pids) {
+                    push_ref(&refs, count, &cap, 0, pid, -1);
+                } else {
+                    sio_printf("%s: No such job\n", argv[i]);
+                }
+                continue;
+            }
+        }
+
+        bool found = false;
+        for (jid_t jid = job_next(first - 1); jid != 0 && jid <= last;
+             jid = job_next(jid)) {
+            found = true;
+            if ((states == 0 || (states & (1u << job_get_state(jid)))) &&
+                !push_ref(&refs, count, &cap, jid, job_get_pid(jid), -1)) {
+                sio_printf("%s: out of memory\n", who);
+                return refs;
+            }
+        }
+        if (!found) {
+            sio_printf("%s: No such job\n", argv[i]);
+        }
+    }
+    return refs;
+}
+
+/**
+ * @brief Continues a job in the foreground and waits for it
+ *
+ * @return false if the job stopped again
+ */
+static bool continue_fg(jid_t jid) {
+    sigset_t mask_all, prev_all;
+    sigfillset(&mask_all);
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    if (!job_exists(jid)) {
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        return true;
+    }
+    if (array_find(jid) != NULL || script_find(jid) != NULL) {
+        sio_printf("fg: %%%d: array and script jobs run in the background\n",
+                   (int)jid);
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        return true;
+    }
+    // a script coroutine waits for the job without taking the terminal
+    job_state state = script_current != NULL ? BG : FG;
+    if (job_get_state(jid) == PD) {
+        if (!sched_start_now(jid, state, &prev_all)) {
+            sigprocmask(SIG_SETMASK, &prev_all, NULL);
+            return true;
+        }
+    } else {
+        if (job_get_state(jid) == PR) {
+            preempt_resume(jid);
+        }
+        job_set_state(jid, state);
+        job_kill(jid, SIGCONT);
+    }
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    return wait_fg(jid) >= 0;
+}
+
+/**
+ * @brief Runs the builtin function to respond to any builtin command call
+ *  If the token indicates the command is not a builtin command, the function
+ *  does not enter any of the conditionals and will run normally in eval()
+ *
+ * @param[in] parse_result The parse result from eval() function
+ * @param[in] token The token from eval() function
+ *
+ * @param[in] cmdline The command line being evaluated
+ * @return true if the command was a builtin and has been handled
+ *
+ * This function cases on four builtin command.
+ * The builtin commands are:
+ *  bg job, fg job, jobs, quit
+ * Other builtins are looked up by name in named_builtins.
+ */
+bool builtincmd(const char *cmdline, parseline_return parse_result,
+                struct cmdline_tokens token) {
+
+    sigset_t mask_all, prev_all, sigchld, prev, mask_one;
+    sigfillset(&mask_all);
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigaddset(&sigchld, SIGINT);
+    sigaddset(&sigchld, SIGTSTP);
+    sigemptyset(&prev);
+    sigemptyset(&mask_one);
+    sigaddset(&mask_one, SIGCHLD);
+    sigaddset(&mask_one, SIGINT);
+    sigaddset(&mask_one, SIGTSTP);
+    int fdout = 0;
+
+    builtin_status = 0;
+    if (token.builtin == BUILTIN_NONE) {
+        for (size_t i = 0;
+             i < sizeof(named_builtins) / sizeof(named_builtins[0]); i++) {
+            if (strcmp(token.argv[0], named_builtins[i].name) == 0) {
+                named_builtins[i].fn(cmdline, parse_result, &token);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (token.builtin == BUILTIN_QUIT) {
+        if (shell_shutdown(token.argc > 1 ? token.argv[1] : NULL)) {
+            exit(0);
+        }
+        return true;
+    }
+
+    if (token.builtin == BUILTIN_JOBS) {
+        // list the jobs (or those selected), and with -l the finished ones
+        bool long_list = token.argc > 1 && strcmp(token.argv[1], "-l") == 0;
+        int nargs = token.argc - (long_list ? 2 : 1);
+        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+        sched_annotate(&bg_sched);
+        sched_annotate(&par_sched);
+        array_annotate();
+        script_annotate();
+        int fd = STDOUT_FILENO;
+        if (token.outfile != NULL) {
+            fdout = open(token.outfile, O_WRONLY | O_CREAT | O_TRUNC,
+                         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if (fdout < 0) {
+                if (errno == ENOENT) {
+                    sio_printf("%s: No such file or directory\n",
+                               token.outfile);
+                } else {
+                    sio_printf("%s: Permission denied\n", token.outfile);
+                }
+                sigprocmask(SIG_SETMASK, &prev_all, NULL);
+                return true;
+            }
+            fd = fdout;
+        }
+        if (nargs == 0) {
+            list_jobs(fd);
+        } else {
+            size_t count;
+            struct job_ref *refs =
+                select_jobs("jobs", nargs, token.argv + token.argc - nargs,
+                            false, &count);
+            jid_t *jids = count > 0 ? malloc(count * sizeof(*jids)) : NULL;
+            size_t njids = 0;
+            for (size_t i = 0; jids != NULL && i < count; i++) {
+                if (refs[i].idx < 0) {
+                    jids[njids++] = refs[i].jid;
+                }
+            }
+            if (njids > 0) {
+                list_jobs_of(fd, jids, njids);
+            }
+            free(jids);
+            // then the single tasks of array jobs
+            for (size_t i = 0; i < count; i++) {
+                if (refs[i].idx >= 0) {
+                    array_list_task(fd, array_find(refs[i].jid), refs[i].idx);
+                }
+            }
+            free(refs);
+        }
+        if (long_list) {
+            list_job_exits(fd);
+        }
+        if (fd != STDOUT_FILENO) {
+            close(fd);
+        }
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    }
+
+    if (token.builtin == BUILTIN_BG) {
+        if (token.argc == 1) {
+            sio_printf("bg command requires PID or %%jobid argument\n");
+            return true;
+        }
+
+        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+        size_t count;
+        struct job_ref *refs = select_jobs("bg", token.argc - 1,
+                                           token.argv + 1, false, &count);
+        for (size_t i = 0; i < count; i++) {
+            jid_t jid = refs[i].jid;
+            struct job_array *a = array_find(jid);
+            if (a != NULL) {
+                // the tasks go on together, and only if the array stopped
+                if (refs[i].idx >= 0) {
+                    sio_printf("bg: %%%d.%ld: a task continues with its "
+                               "array\n",
+                               (int)jid, refs[i].idx);
+                    continue;
+                }
+                sio_printf("[%d] (array) %s\n", (int)jid,
+                           job_get_cmdline(jid));
+                array_signal(a, -1, SIGCONT);
+                continue;
+            }
+            struct script *sc = script_find(jid);
+            if (sc != NULL) {
+                sio_printf("[%d] (script) %s\n", (int)jid,
+                           job_get_cmdline(jid));
+                script_signal(sc, SIGCONT);
+                continue;
+            }
+            if (job_get_state(jid) == PD) {
+                // start it now, regardless of the scheduler's limit
+                if (!sched_start_now(jid, BG, &prev_all)) {
+                    continue;
+                }
+            } else if (job_get_state(jid) == PR) {
+                preempt_resume(jid);
+            } else {
+                job_set_state(jid, BG);
+                job_kill(jid, SIGCONT);
+            }
+            sio_printf("[%d] (%d) %s\n", (int)jid, (int)job_get_pid(jid),
+                       job_get_cmdline(jid));
+        }
+        free(refs);
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
     }
 
     if (token.builtin == BUILTIN_FG) {
+        if (token.argc == 1) {
+            sio_printf("fg command requires PID or %%jobid argument\n");
+            return true;
+        }
+
+        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+        size_t count;
+        struct job_ref *refs = select_jobs("fg", token.argc - 1,
+                                           token.argv + 1, false, &count);
+        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+
+        // Each job in turn, until one of them stops
+        for (size_t i = 0; i < count && continue_fg(refs[i].jid); i++) {
+        }
+        free(refs);
+    }
+    return true;
+}
+
+/*****************
+ * Named builtins
+ *****************/
+
+/**
+ * @brief Finds the raw text of a command line after its @tags and first
+ * n words, for builtins that keep a command given as arguments as text
+ *
+ * The words are assumed to need no quotes, as a builtin's name and
+ * options do; the rest of the line is returned as typed.
+ */
+const char *command_text(const char *cmdline, int n) {
+    const char *p = cmdline;
+    for (int words = 0;;) {
+        p += strspn(p, " \t");
+        if ((*p != '@' || words > 0) && words++ == n) {
+            return p;
+        }
+        p += strcspn(p, " \t");
+    }
+}
+
+/**
+ * @brief Replaces $NAME and ${NAME} in text with the value of NAME, for
+ * each of the nvars names
+ *
+ * @return false if the result would not fit in size bytes
+ */
+bool expand_vars(const char *text, const char *const *names,
+                 const char *const *values, size_t nvars, char *buf,
+                 size_t size) {
+    size_t n = 0;
+    for (const char *p = text; *p != '\0';) {
+        size_t skip = 0, v;
+        for (v = 0; p[0] == '$' && v < nvars && skip == 0; v++) {
+            size_t len = strlen(names[v]);
+            if (p[1] == '{' && strncmp(p + 2, names[v], len) == 0 &&
+                p[2 + len] == '}') {
+                skip = len + 3;
+            } else if (strncmp(p + 1, names[v], len) == 0 &&
+                       !isalnum((unsigned char)p[1 + len]) &&
+                       p[1 + len] != '_') {
+                skip = len + 1;
+            }
+        }
+        if (skip > 0) {
+            size_t len = strlen(values[v - 1]);
+            if (n + len >= size) {
+                return false;
+            }
+            memcpy(buf + n, values[v - 1], len);
+            n += len;
+            p += skip;
+        } else {
+            if (n + 1 >= size) {
+                return false;
+            }
+            buf[n++] = *p++;
+        }
+    }
+    buf[n] = '\0';
+    return true;
+}
+
+/**
+ * @brief Drops the first n arguments, e.g. a prefix builtin's own name
+ */
+static void shift_tokens(struct cmdline_tokens *token, int n) {
+    memmove(token->argv, token->argv + n,
+            (size_t)(token->argc - n + 1) * sizeof(token->argv[0]));
+    token->argc -= n;
+    token->builtin = BUILTIN_NONE;
+}
+
+/**
+ * @brief Runs the command left in token after a prefix builtin removed its
+ * own arguments, so that prefixes can be combined (e.g. needs ... : cache)
+ */
+static void run_prefixed(const char *cmdline, parseline_return parse_result,
+                         struct cmdline_tokens *token) {
+    for (size_t i = 0; i < sizeof(named_builtins) / sizeof(named_builtins[0]);
+         i++) {
+        if (strcmp(token->argv[0], named_builtins[i].name) == 0) {
+            named_builtins[i].fn(cmdline, parse_result, token);
+            return;
+        }
+    }
+    run_job(cmdline, parse_result, token);
+}
+
+/**
+ * @brief Opens an output redirection, printing an error on failure
+ *
+ * @return The file descriptor, or -1
+ */
+static int open_outfile(const char *outfile) {
+    int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            sio_printf("%s: No such file or directory\n", outfile);
+        } else {
+            sio_printf("%s: Permission denied\n", outfile);
+        }
+    }
+    return fd;
+}
+
+/*
+ * Captures of cached commands that were stopped before they finished.  The
+ * job still has its scratch file open, so the output is copied to stdout
+ * and stored only once the job has exited (see cache_job_done()).
+ */
+#define CACHE_PENDING_MAX 16
+static struct cache_pending {
+    jid_t jid;
+    struct cache_key key;
+    char *path;
+} cache_pending[CACHE_PENDING_MAX];
+static size_t ncache_pending = 0;
+
+/**
+ * @brief Finishes the capture of a stopped cached command once its job
+ * has exited (from event_dispatch())
+ *
+ * @param[in] jid The job that exited
+ * @param[in] status Its wait status
+ */
+static void cache_job_done(jid_t jid, int status) {
+    for (size_t i = 0; i < ncache_pending; i++) {
+        struct cache_pending *p = &cache_pending[i];
+        if (p->jid != jid) {
+            continue;
+        }
+        int fd = open(p->path, O_RDONLY);
+        if (fd >= 0) {
+            cache_copy_fd(STDOUT_FILENO, fd);
+            close(fd);
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            cache_store(&p->key, p->path, true);
+        } else {
+            unlink(p->path);
+        }
+        free(p->path);
+        *p = cache_pending[--ncache_pending];
+        return;
+    }
+}
+
+/**
+ * @brief Returns true if stdin is a terminal or /dev/null, i.e. cannot
+ * feed a command input that the cache key does not cover
+ */
+static bool cache_stdin_inert(void) {
+    if (isatty(STDIN_FILENO)) {
+        return true;
+    }
+    struct stat in, null;
+    return fstat(STDIN_FILENO, &in) == 0 && S_ISCHR(in.st_mode) &&
+           stat("/dev/null", &null) == 0 && in.st_rdev == null.st_rdev;
+}
+
+/**
+ * @brief Runs a command through the output cache
+ *
+ * Usage: cache command [args...] [< infile] [> outfile]
+ *        cache stats
+ *        cache clear
+ *
+ * On a hit the stored output is copied to outfile (or stdout) and nothing
+ * is launched.  On a miss the command runs in the foreground and its output
+ * is stored if it exits with status 0.  Without an output redirection, the
+ * output is captured in the cache directory and copied to stdout once the
+ * command finishes; if it is stopped first, that happens when its job
+ * exits.  Background commands, and commands without an input redirection
+ * whose stdin is neither a terminal nor /dev/null, are run uncached, since
+ * the key does not cover what they read.
+ */
+void builtin_cache(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token) {
+    if (token->argc == 2 && strcmp(token->argv[1], "stats") == 0) {
+        cache_print_stats(STDOUT_FILENO);
+        return;
+    }
+    if (token->argc == 2 && strcmp(token->argv[1], "clear") == 0) {
+        cache_clear();
+        return;
+    }
+    if (token->argc < 2) {
+        sio_printf("cache: usage: cache command [args...] | cache stats | "
+                   "cache clear\n");
+        return;
+    }
+    shift_tokens(token, 1);
+
+    struct cache_key key;
+    if (parse_result == PARSELINE_BG) {
+        sio_printf("cache: background jobs are not cached\n");
+        run_job(cmdline, parse_result, token);
+        return;
+    }
+    if (token->infile == NULL && !cache_stdin_inert()) {
+        sio_printf("cache: stdin is not a terminal or /dev/null; "
+                   "running uncached\n");
+        run_job(cmdline, parse_result, token);
+        return;
+    }
+    if (!cache_make_key(token->argv, token->infile, &key)) {
+        run_job(cmdline, parse_result, token);
+        return;
+    }
+
+    if (cache_lookup(&key)) {
+        int fd = STDOUT_FILENO;
+        if (token->outfile != NULL && (fd = open_outfile(token->outfile)) < 0) {
+            return;
+        }
+        bool restored = cache_restore(&key, fd);
+        if (fd != STDOUT_FILENO) {
+            close(fd);
+        }
+        if (restored) {
+            return;
+        }
+    }
+
+    // Miss: capture the output in a scratch file if it goes to stdout
+    char *outfile = token->outfile;
+    if (outfile == NULL) {
+        token->outfile = (char *)cache_scratch_path();
+    }
+    jid_t jid = launch_job(cmdline, parse_result, token);
+    if (jid == 0) {
+        if (outfile == NULL && token->outfile != NULL) {
+            unlink(token->outfile);
+        }
+        return;
+    }
+    int status = wait_fg(jid);
+
+    if (outfile != NULL) {
+        if (status == 0) {
+            cache_store(&key, outfile, false);
+        }
+    } else if (token->outfile != NULL) {
+        if (status == -1 && job_exists(jid)) {
+            // stopped: the job may still write to the file
+            if (ncache_pending < CACHE_PENDING_MAX) {
+                cache_pending[ncache_pending++] = (struct cache_pending){
+                    jid, key, strdup(token->outfile)};
+            } else {
+                sio_printf("cache: output of job [%d] is left in %s\n",
+                           (int)jid, token->outfile);
+            }
+            return;
+        }
+        int fd = open(token->outfile, O_RDONLY);
+        if (fd >= 0) {
+            cache_copy_fd(STDOUT_FILENO, fd);
+            close(fd);
+        }
+        if (status == 0) {
+            cache_store(&key, token->outfile, true);
+        } else {
+            unlink(token->outfile);
+        }
+    }
+}
+
+/* A file named by needs, and whether it was listed as an input or output */
+struct needs_file {
+    char *path;
+    bool input;
+    bool output;
+};
+
+static int needs_file_cmp(const void *a, const void *b) {
+    return strcmp(((const struct needs_file *)a)->path,
+                  ((const struct needs_file *)b)->path);
+}
+
+/**
+ * @brief Decides whether any output is missing or older than an input
+ *
+ * The files are sorted and listed once each, however often they were
+ * named, and their mtimes are then looked up in a single batch (see
+ * tsh_mtime.h) rather than one statx() after another.  A missing input
+ * also counts as stale, so that the command runs and reports the problem
+ * itself.  If memory runs out the outputs are taken to be stale.
+ */
+static bool outputs_stale(char **inputs, int ninputs, char **outputs,
+                          int noutputs) {
+    size_t total = (size_t)ninputs + (size_t)noutputs;
+    struct needs_file *files = malloc(total * sizeof(*files));
+    char **paths = calloc(total, sizeof(*paths));
+    int64_t *mtimes = malloc(total * sizeof(*mtimes));
+    if (files == NULL || paths == NULL || mtimes == NULL) {
+        free(files);
+        free(paths);
+        free(mtimes);
+        return true;
+    }
+
+    for (int i = 0; i < ninputs; i++) {
+        files[i] = (struct needs_file){inputs[i], true, false};
+    }
+    for (int i = 0; i < noutputs; i++) {
+        files[ninputs + i] = (struct needs_file){outputs[i], false, true};
+    }
+    qsort(files, total, sizeof(*files), needs_file_cmp);
+    size_t n = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (n > 0 && strcmp(files[n - 1].path, files[i].path) == 0) {
+            files[n - 1].input |= files[i].input;
+            files[n - 1].output |= files[i].output;
+        } else {
+            paths[n] = files[i].path;
+            files[n++] = files[i];
+        }
+    }
+    mtime_batch(paths, n, mtimes);
+
+    bool stale = false;
+    int64_t oldest = INT64_MAX;
+    int64_t newest = INT64_MIN;
+    for (size_t i = 0; i < n && !stale; i++) {
+        stale = mtimes[i] < 0;
+        if (files[i].output && mtimes[i] < oldest) {
+            oldest = mtimes[i];
+        }
+        if (files[i].input && mtimes[i] > newest) {
+            newest = mtimes[i];
+        }
+    }
+    free(files);
+    free(paths);
+    free(mtimes);
+    return stale || newest > oldest;
+}
+
+/**
+ * @brief Runs a command only if its outputs are out of date
+ *
+ * Usage: needs [input...] -> output... : command [args...] [&]
+ *
+ * The command is skipped when every output exists and is at least as new
+ * as every input, as in make.  Otherwise it is run like any other command,
+ * in the background if the line ends with '&'.
+ */
+void builtin_needs(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token) {
+    int arrow = -1;
+    int colon = -1;
+    for (int i = 1; i < token->argc; i++) {
+        if (arrow < 0 && strcmp(token->argv[i], "->") == 0) {
+            arrow = i;
+        } else if (arrow >= 0 && strcmp(token->argv[i], ":") == 0) {
+            colon = i;
+            break;
+        }
+    }
+    if (arrow < 0 || colon < 0 || colon == arrow + 1 ||
+        colon == token->argc - 1) {
+        sio_printf("needs: usage: needs [input...] -> output... : command\n");
+        return;
+    }
+
+    if (!outputs_stale(token->argv + 1, arrow - 1, token->argv + arrow + 1,
+                       colon - arrow - 1)) {
+        if (verbose) {
+            sio_printf("needs: %s is up to date\n", token->argv[arrow + 1]);
+        }
+        return;
+    }
+
+    shift_tokens(token, colon + 1);
+    run_prefixed(cmdline, parse_result, token);
+}
+
+/**
+ * @brief Copies parsed tokens so that they outlive the original
+ *
+ * Token strings live in the _buf of whichever structure parseline() filled
+ * in, so a plain structure copy would still refer to it.  This packs the
+ * strings into the copy's own buffer.
+ */
+void copy_tokens(struct cmdline_tokens *dst, const struct cmdline_tokens *src) {
+    size_t used = 0;
+    char *strs[MAXARGS + 3 + MAXTAGS];
+
+    dst->argc = src->argc;
+    dst->builtin = src->builtin;
+    for (int i = 0; i < src->argc; i++) {
+        strs[i] = src->argv[i];
+    }
+    strs[src->argc] = src->infile;
+    strs[src->argc + 1] = src->outfile;
+    strs[src->argc + 2] = src->bg_opts;
+    for (int i = 0; i < src->ntags; i++) {
+        strs[src->argc + 3 + i] = src->tags[i];
+    }
+
+    for (int i = 0; i < src->argc + 3 + src->ntags; i++) {
+        if (strs[i] == NULL) {
+            continue;
+        }
+        size_t len = strlen(strs[i]) + 1;
+        if (used + len > sizeof(dst->_buf)) {
+            len = 0; // cannot happen for tokens parsed from one line
+        }
+        memcpy(dst->_buf + used, strs[i], len);
+        strs[i] = dst->_buf + used;
+        used += len;
+    }
+
+    for (int i = 0; i < src->argc; i++) {
+        dst->argv[i] = strs[i];
+    }
+    dst->argv[src->argc] = NULL;
+    dst->infile = strs[src->argc];
+    dst->outfile = strs[src->argc + 1];
+    dst->bg_opts = strs[src->argc + 2];
+    dst->ntags = src->ntags;
+    for (int i = 0; i < src->ntags; i++) {
+        dst->tags[i] = strs[src->argc + 3 + i];
+    }
+}
+
+/* Lifecycle of a retried command */
+typedef enum retry_state {
+    RETRY_RUNNING,     // an attempt is running
+    RETRY_WAITING,     // backing off before the next attempt
+    RETRY_SUCCEEDED,   // an attempt exited with status 0
+    RETRY_FAILED,      // attempts exhausted or a non-retryable status
+    RETRY_INTERRUPTED, // cancelled with Ctrl-C
+} retry_state;
+
+/* A command run under retry, with the exit status of every attempt */
+struct retry {
+    int id;
+    retry_state state;
+    char cmdline[MAXLINE_TSH];
+    struct cmdline_tokens token;
+    int max_attempts;
+    int nattempts;
+    int *statuses;          // exit status of each attempt
+    int64_t min_delay;      // first backoff, in ns
+    int64_t max_delay;      // backoff cap, in ns
+    bool on_any;            // retry on any non-zero status
+    uint64_t on_codes[4];   // otherwise, bitmap of retryable statuses
+    pid_t pid;              // running attempt (asynchronous retries only)
+    jid_t jid;              // its job, while the scheduler holds it back
+    int64_t next_attempt;   // when the next attempt starts, if waiting
+    bool async;             // driven by the event loop
+};
+
+#define RETRY_HISTORY 64
+static struct retry **retries; // oldest first
+static size_t nretries;
+static int next_retry_id = 1;
+static uint64_t rng_state;
+
+/* xorshift64* generator for backoff jitter */
+static uint64_t next_random(void) {
+    if (rng_state == 0) {
+        rng_state = (uint64_t)monotonic_ns() ^ ((uint64_t)getpid() << 32) ^
+                    0x9E3779B97F4A7C15ULL;
+    }
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Parses a duration such as "250ms", "1.5s" or "2m" into nanoseconds.
+ * A bare number is in seconds.  Returns -1 if the text is not a duration.
+ */
+int64_t parse_duration(const char *text, const char **end) {
+    char *rest;
+    double val = strtod(text, &rest);
+    if (rest == text || val < 0) {
+        return -1;
+    }
+    double scale = 1e9;
+    if (strncmp(rest, "ms", 2) == 0) {
+        scale = 1e6;
+        rest += 2;
+    } else if (strncmp(rest, "us", 2) == 0) {
+        scale = 1e3;
+        rest += 2;
+    } else if (*rest == 's') {
+        rest++;
+    } else if (*rest == 'm') {
+        scale = 60e9;
+        rest++;
+    }
+    *end = rest;
+    return (int64_t)(val * scale);
+}
+
+/* Exit status as printed in retry messages */
+static void format_status(char *buf, size_t size, int status) {
+    if (status > 128 && status < 128 + NSIG) {
+        sio_snprintf(buf, size, "signal %d", status - 128);
+    } else if (status < 0) {
+        sio_snprintf(buf, size, "launch failure");
+    } else {
+        sio_snprintf(buf, size, "status %d", status);
+    }
+}
+
+static bool retry_wants(const struct retry *r, int status) {
+    if (status == 0 || r->nattempts >= r->max_attempts) {
+        return false;
+    }
+    if (status < 0 || status > 255) {
+        return false;
+    }
+    if (r->on_any) {
+        // Ctrl-C on an attempt means the user wants to stop
+        return status != 128 + SIGINT;
+    }
+    return (r->on_codes[status / 64] >> (status % 64)) & 1;
+}
+
+/*
+ * Exponential backoff with equal jitter: half the step, plus a random part
+ * of the other half
+ */
+static int64_t retry_delay(const struct retry *r) {
+    int64_t delay = r->min_delay;
+    for (int i = 1; i < r->nattempts && delay < r->max_delay; i++) {
+        delay *= 2;
+    }
+    if (delay > r->max_delay) {
+        delay = r->max_delay;
+    }
+    int64_t half = delay / 2;
+    return half + (int64_t)(next_random() % (uint64_t)(half + 1));
+}
+
+static void retry_record(struct retry *r, int status) {
+    r->statuses[r->nattempts++] = status;
+}
+
+static void retry_finish(struct retry *r, int status) {
+    char what[32];
+    format_status(what, sizeof(what), status);
+    r->state = (status == 0) ? RETRY_SUCCEEDED : RETRY_FAILED;
+    r->pid = 0;
+    if (status == 0 && r->nattempts > 1) {
+        sio_printf("retry: succeeded after %d attempts: %s\n", r->nattempts,
+                   r->cmdline);
+    } else if (status != 0) {
+        sio_printf("retry: gave up after %d attempt%s (%s): %s\n",
+                   r->nattempts, r->nattempts == 1 ? "" : "s", what,
+                   r->cmdline);
+    }
+}
+
+/*
+ * Launches the next attempt as a job named after it, so that the history
+ * in 'jobs -l' tells the attempts apart; called with signals blocked
+ */
+static jid_t retry_launch_job(struct retry *r, parseline_return parse_result) {
+    char name[MAXLINE_TSH + 32];
+    sio_snprintf(name, sizeof(name), "attempt %d/%d: %s", r->nattempts + 1,
+                 r->max_attempts, r->cmdline);
+    return launch_job(name, parse_result, &r->token);
+}
+
+/* Launches the next background attempt; called with signals blocked */
+static void retry_launch(struct retry *r) {
+    jid_t jid = retry_launch_job(r, PARSELINE_BG);
+    if (jid == 0) {
+        retry_record(r, -1);
+        retry_finish(r, -1);
+        return;
+    }
+    r->pid = job_get_pid(jid); // 0 until the scheduler starts it
+    r->jid = jid;
+    r->state = RETRY_RUNNING;
+}
+
+/* Timer callback: the backoff of an asynchronous retry has elapsed */
+static void retry_timer(void *arg) {
+    struct retry *r = arg;
+    if (r->state == RETRY_WAITING) {
+        retry_launch(r);
+    }
+}
+
+/* Decides what follows an attempt that exited with the given status */
+static void retry_attempt_done(struct retry *r, int status) {
+    retry_record(r, status);
+    if (!retry_wants(r, status)) {
+        retry_finish(r, status);
+        return;
+    }
+    char what[32];
+    format_status(what, sizeof(what), status);
+    int64_t delay = retry_delay(r);
+    sio_printf("retry: attempt %d/%d exited with %s, retrying in %ldms: %s\n",
+               r->nattempts, r->max_attempts, what, (long)(delay / 1000000),
+               r->cmdline);
+    r->state = RETRY_WAITING;
+    r->pid = 0;
+    r->next_attempt = monotonic_ns() + delay;
+    if (r->async) {
+        timer_add(r->next_attempt, retry_timer, r);
+    }
+}
+
+/**
+ * @brief Event loop hook: a child process has been reaped
+ *
+ * Called from event_dispatch() with signals blocked.
+ */
+static void retry_child_exited(pid_t pid, int status) {
+    for (size_t i = 0; i < nretries; i++) {
+        struct retry *r = retries[i];
+        if (r->async && r->state == RETRY_RUNNING && r->pid == pid) {
+            int code = WIFEXITED(status)     ? WEXITSTATUS(status)
+                       : WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                             : -1;
+            retry_attempt_done(r, code);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Scheduler hook: a pending job has been started as pid, or
+ * cancelled if pid is 0
+ */
+void retry_job_started(jid_t jid, pid_t pid) {
+    for (size_t i = 0; i < nretries; i++) {
+        struct retry *r = retries[i];
+        if (r->async && r->state == RETRY_RUNNING && r->pid == 0 &&
+            r->jid == jid) {
+            r->pid = pid;
+            if (pid == 0) {
+                r->state = RETRY_INTERRUPTED;
+                sio_printf("retry: cancelled before attempt %d: %s\n",
+                           r->nattempts + 1, r->cmdline);
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Registers a new retry record with room for max_attempts statuses,
+ * dropping the oldest finished ones; NULL (and nothing registered) if out
+ * of memory
+ */
+static struct retry *retry_new(int max_attempts) {
+    struct retry *r = calloc(1, sizeof(*r));
+    int *statuses = calloc((size_t)max_attempts, sizeof(int));
+    if (r == NULL || statuses == NULL) {
+        free(r);
+        free(statuses);
+        return NULL;
+    }
+    r->max_attempts = max_attempts;
+    r->statuses = statuses;
+    if (nretries >= RETRY_HISTORY) {
+        for (size_t i = 0; i < nretries; i++) {
+            if (retries[i]->state != RETRY_RUNNING &&
+                retries[i]->state != RETRY_WAITING) {
+                free(retries[i]->statuses);
+                free(retries[i]);
+                memmove(&retries[i], &retries[i + 1],
+                        (nretries - i - 1) * sizeof(retries[0]));
+                nretries--;
+                break;
+            }
+        }
+    }
+    struct retry **grown = realloc(retries, (nretries + 1) * sizeof(*grown));
+    if (grown == NULL) {
+        free(r->statuses);
+        free(r);
+        return NULL;
+    }
+    retries = grown;
+    retries[nretries++] = r;
+    r->id = next_retry_id++;
+    return r;
+}
+
+/* Prints every retry record with the statuses of its attempts */
+static void retry_list(int output_fd) {
+    static const char *const names[] = {"Running", "Waiting", "Succeeded",
+                                        "Failed", "Interrupted"};
+    for (size_t i = 0; i < nretries; i++) {
+        struct retry *r = retries[i];
+        char buf[MAXLINE_TSH + 512];
+        size_t n = sio_snprintf(buf, sizeof(buf), "retry[%d] %s %d/%d %s\n"
+                                "    statuses:", r->id, names[r->state],
+                                r->nattempts, r->max_attempts, r->cmdline);
+        for (int k = 0; k < r->nattempts && n < sizeof(buf); k++) {
+            n += sio_snprintf(buf + n, sizeof(buf) - n, " %d", r->statuses[k]);
+        }
+        if (n < sizeof(buf)) {
+            n += sio_snprintf(buf + n, sizeof(buf) - n, "\n");
+        }
+        sio_writen(output_fd, buf, n < sizeof(buf) ? n : sizeof(buf) - 1);
+    }
+}
+
+/**
+ * @brief Runs a command again after it fails
+ *
+ * Usage: retry [-n attempts] [--backoff MIN..MAX] [--on CODE,...]
+ *              command [args...] [&]
+ *        retry -l
+ *
+ * Attempts are launched through the normal job path.  Between attempts the
+ * shell waits an exponentially growing, jittered delay (default 100ms..10s)
+ * in its event loop; no process sleeps on its behalf.  By default any
+ * non-zero status is retried, up to 3 attempts in total; --on restricts
+ * retries to the listed statuses (128+N for death by signal N).  In the
+ * foreground, Ctrl-C stops the retries.  A background retry continues
+ * while the shell accepts other commands.  'retry -l' lists the statuses
+ * of each attempt of recent retries; each attempt is also a job of its
+ * own, named "attempt K/N: ...", in the history shown by 'jobs -l'.
+ */
+void builtin_retry(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token) {
+    int max_attempts = 3;
+    int64_t min_delay = 100 * 1000000LL;
+    int64_t max_delay = 10 * 1000000000LL;
+    bool on_any = true;
+    uint64_t on_codes[4] = {0, 0, 0, 0};
+    int i;
+
+    if (token->argc == 2 && strcmp(token->argv[1], "-l") == 0) {
+        retry_list(STDOUT_FILENO);
+        return;
+    }
+
+    for (i = 1; i < token->argc && token->argv[i][0] == '-'; i++) {
+        const char *opt = token->argv[i];
+        const char *val = (i + 1 < token->argc) ? token->argv[i + 1] : NULL;
+        const char *end;
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (val == NULL) {
+            sio_printf("retry: %s requires an argument\n", opt);
+            return;
+        }
+        i++;
+        if (strcmp(opt, "-n") == 0) {
+            char *rest;
+            long n = strtol(val, &rest, 10);
+            max_attempts = (rest != val && *rest == '\0' && n <= INT_MAX)
+                               ? (int)n
+                               : 0;
+            if (max_attempts < 1) {
+                sio_printf("retry: -n must be a positive count\n");
+                return;
+            }
+        } else if (strcmp(opt, "--backoff") == 0) {
+            min_delay = parse_duration(val, &end);
+            max_delay = min_delay;
+            if (min_delay >= 0 && strncmp(end, "..", 2) == 0) {
+                max_delay = parse_duration(end + 2, &end);
+            }
+            if (min_delay < 0 || max_delay < min_delay || *end != '\0') {
+                sio_printf("retry: bad backoff '%s' (want MIN..MAX)\n", val);
+                return;
+            }
+        } else if (strcmp(opt, "--on") == 0) {
+            on_any = false;
+            for (const char *p = val; *p != '\0';) {
+                char *next;
+                long code = strtol(p, &next, 10);
+                if (next == p || code < 0 || code > 255 ||
+                    (*next != ',' && *next != '\0')) {
+                    sio_printf("retry: bad status list '%s'\n", val);
+                    return;
+                }
+                on_codes[code / 64] |= 1ULL << (code % 64);
+                p = (*next == ',') ? next + 1 : next;
+            }
+        } else {
+            sio_printf("retry: unknown option %s\n", opt);
+            return;
+        }
+    }
+    if (i >= token->argc) {
+        sio_printf("retry: usage: retry [-n N] [--backoff MIN..MAX] "
+                   "[--on CODE,...] command [args...]\n");
+        return;
+    }
+
+    struct retry *r = retry_new(max_attempts);
+    if (r == NULL) {
+        sio_printf("retry: out of memory\n");
+        return;
+    }
+    shift_tokens(token, i);
+    sio_snprintf(r->cmdline, sizeof(r->cmdline), "%s", cmdline);
+    copy_tokens(&r->token, token);
+    r->min_delay = min_delay > 0 ? min_delay : 1;
+    r->max_delay = max_delay > 0 ? max_delay : 1;
+    r->on_any = on_any;
+    memcpy(r->on_codes, on_codes, sizeof(on_codes));
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    if (parse_result == PARSELINE_BG) {
+        r->async = true;
+        retry_launch(r);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
+
+    // Foreground: run attempts one after another in this call
+    while (true) {
+        r->state = RETRY_RUNNING;
+        jid_t jid = retry_launch_job(r, PARSELINE_FG);
+        if (jid == 0) {
+            retry_record(r, -1);
+            retry_finish(r, -1);
+            break;
+        }
+        pid_t pid = job_get_pid(jid);
+        int status = wait_fg(jid);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        if (status < 0) {
+            // Stopped: the event loop takes over once it is resumed
+            r->async = true;
+            r->pid = pid;
+            break;
+        }
+        retry_attempt_done(r, status);
+        if (r->state != RETRY_WAITING) {
+            break;
+        }
+
+        // Back off in the event loop; Ctrl-C abandons the retries
+        int64_t deadline = r->next_attempt;
+        sigint_pending = 0;
+        while (!sigint_pending && monotonic_ns() < deadline) {
+            event_poll(-1, deadline);
+        }
+        if (sigint_pending) {
+            sigint_pending = 0;
+            r->state = RETRY_INTERRUPTED;
+            sio_printf("\nretry: interrupted after %d attempt%s\n",
+                       r->nattempts, r->nattempts == 1 ? "" : "s");
+            break;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/**
+ * @brief Pins executables so they launch without a path lookup
+ *
+ * Usage: pin [path...]
+ *        pin -u [path...]
+ *        pin -r
+ *        pin -a N
+ *
+ * With no arguments, lists the pinned programs and their launch counts.
+ * Pinned programs keep running the file that was pinned even if it is
+ * replaced on disk; 'pin -r' re-pins every program to its current file.
+ * 'pin -u' unpins the given programs, or all of them.  'pin -a N' keeps
+ * the N most launched programs pinned automatically (0 turns it off).
+ */
+void builtin_pin(const char *cmdline, parseline_return parse_result,
+                 struct cmdline_tokens *token) {
+    if (token->argc == 1) {
+        pin_print(STDOUT_FILENO);
+        return;
+    }
+
+    const char *opt = token->argv[1];
+    if (strcmp(opt, "-u") == 0) {
+        if (token->argc == 2) {
+            pin_clear();
+        }
+        for (int i = 2; i < token->argc; i++) {
+            if (!pin_remove(token->argv[i])) {
+                sio_printf("pin: %s is not pinned\n", token->argv[i]);
+            }
+        }
+    } else if (strcmp(opt, "-r") == 0 && token->argc == 2) {
+        pin_refresh(STDOUT_FILENO);
+    } else if (strcmp(opt, "-a") == 0 && token->argc == 3) {
+        char *end;
+        long n = strtol(token->argv[2], &end, 10);
+        if (*end != '\0' || n < 0 || n > 4096) {
+            sio_printf("pin: -a needs a count between 0 and 4096\n");
+            return;
+        }
+        pin_set_auto((int)n);
+    } else if (opt[0] == '-') {
+        sio_printf("pin: usage: pin [path...] | pin -u [path...] | pin -r | "
+                   "pin -a N\n");
+    } else {
+        for (int i = 1; i < token->argc; i++) {
+            pin_add(token->argv[i]);
+        }
+    }
+}
+
+/* Signal names accepted by kill, without the SIG prefix */
+static const struct signal_name {
+    const char *name;
+    int sig;
+} signal_names[] = {
+    {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+    {"ABRT", SIGABRT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+    {"SEGV", SIGSEGV}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE},
+    {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD},
+    {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+    {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH},
+};
+
+/**
+ * @brief Parses a signal name (with or without SIG) or number
+ *
+ * @return The signal number, or -1 if name is not a signal
+ */
+int parse_signal(const char *name) {
+    if (isdigit((unsigned char)name[0])) {
+        char *end;
+        long sig = strtol(name, &end, 10);
+        return (*end == '\0' && sig >= 0 && sig < NSIG) ? (int)sig : -1;
+    }
+    if (strncasecmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]);
+         i++) {
+        if (strcasecmp(name, signal_names[i].name) == 0) {
+            return signal_names[i].sig;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Signals a job as kill does, continuing it if it is stopped and
+ * sig would otherwise have no effect until it is continued, and
+ * cancelling it if it is still pending
+ *
+ * @return 0, or -1 with errno set
+ */
+int signal_job(jid_t jid, int sig) {
+    struct job_array *a = array_find(jid);
+    if (a != NULL) {
+        return array_signal(a, -1, sig);
+    }
+    struct script *sc = script_find(jid);
+    if (sc != NULL) {
+        return script_signal(sc, sig);
+    }
+    if (job_get_state(jid) == PD) {
+        // A pending job has no process: any real signal but CONT cancels it
+        if (sig != 0 && sig != SIGCONT) {
+            sched_cancel(jid);
+        }
+        return 0;
+    }
+    if (job_kill(jid, sig) < 0) {
+        return -1;
+    }
+    if (job_get_state(jid) == PR &&
+        (sig == SIGTERM || sig == SIGHUP || sig == SIGCONT)) {
+        preempt_resume(jid);
+    }
+    if (job_get_state(jid) == ST &&
+        (sig == SIGTERM || sig == SIGHUP || sig == SIGCONT)) {
+        if (sig != SIGCONT) {
+            job_kill(jid, SIGCONT);
+        }
+        job_set_state(jid, BG);
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a signal to jobs and processes
+ *
+ * kill [-s SIG | -SIG] [--all] [--state=running|stopped] [spec...]
+ * kill -l
+ *
+ * Specs are %jid, ranges %first-%last, %jid.idx and pids (see
+ * select_jobs()); the default signal is TERM.  Jobs are signalled as
+ * process groups through job_kill(), which checks the job's pidfd first,
+ * so a job that exits in the meantime is never confused with a process
+ * that reuses its pid.  As in other shells, a stopped job sent TERM or HUP
+ * is also continued so that it can act on the signal.  Array jobs and
+ * their tasks are signalled through array_signal().
+ */
+void builtin_kill(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token) {
+    // Options may come anywhere before --; everything else is left in
+    // argv for select_jobs()
+    int sig = SIGTERM;
+    int nargs = 0;
+    bool options = true;
+    for (int i = 1; i < token->argc; i++) {
+        const char *arg = token->argv[i];
+        if (!options || arg[0] != '-' || strncmp(arg, "--", 2) == 0) {
+            if (strcmp(arg, "--") == 0 && options) {
+                options = false;
+            } else {
+                token->argv[1 + nargs++] = token->argv[i];
+            }
+            continue;
+        }
+        if (strcmp(arg, "-l") == 0) {
+            for (size_t n = 0;
+                 n < sizeof(signal_names) / sizeof(signal_names[0]); n++) {
+                sio_printf("%2d) SIG%s\n", signal_names[n].sig,
+                           signal_names[n].name);
+            }
+            return;
+        } else if (strcmp(arg, "-s") == 0 && i + 1 < token->argc) {
+            arg = token->argv[++i];
+        } else {
+            arg++;
+        }
+        if ((sig = parse_signal(arg)) < 0) {
+            sio_printf("kill: %s: invalid signal\n", arg);
+            return;
+        }
+    }
+    if (nargs == 0) {
+        sio_printf("kill: usage: kill [-s SIG | -SIG] [--all] "
+                   "[--state=running|stopped] [%%jid | %%first-%%last | "
+                   "%%jid.idx | pid]...\n");
+        return;
+    }
+
+    sigset_t mask_all, prev_all;
+    sigfillset(&mask_all);
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    size_t count;
+    struct job_ref *refs =
+        select_jobs("kill", nargs, token->argv + 1, true, &count);
+    for (size_t n = 0; n < count; n++) {
+        jid_t jid = refs[n].jid;
+        if (jid == 0) {
+            if (kill(refs[n].pid, sig) < 0) {
+                sio_printf("kill: (%d) - %s\n", (int)refs[n].pid,
+                           strerror(errno));
+            }
+            continue;
+        }
+        if (refs[n].idx >= 0) {
+            struct job_array *a = array_find(jid);
+            if (a != NULL && array_signal(a, refs[n].idx, sig) < 0) {
+                sio_printf("kill: %%%d.%ld: %s\n", (int)jid, refs[n].idx,
+                           strerror(errno));
+            }
+            continue;
+        }
+        if (signal_job(jid, sig) < 0) {
+            sio_printf("kill: %%%d: %s\n", (int)jid, strerror(errno));
+        }
+    }
+    free(refs);
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
+}
+
+/**
+ * @brief Waits for jobs to finish
+ *
+ * wait [--state=S] [spec...]
+ *
+ * Waits for the jobs named as for kill (%jid, ranges, pids, @tag and
+ * %jid.idx for one task of an array job), or for every job without
+ * arguments, serving the event loop meanwhile.  A
+ * job that stops is not waited for, as it would never finish, and Ctrl-C
+ * gives up.  The jobs are checked in order and only up to the first one
+ * still running, so each wakeup costs O(1) however many jobs are waited
+ * for.  In a script coroutine, the script yields to the shell meanwhile,
+ * and gives up if it is killed.
+ */
+void builtin_wait(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token) {
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    size_t count;
+    struct job_ref *refs =
+        select_jobs("wait", token->argc - 1, token->argv + 1, false, &count);
+
+    sigint_pending = 0;
+    size_t i = 0;
+    while (!sigint_pending && !script_cancelled()) {
+        // a pending job gets its pid when it starts; a script does not
+        // wait for itself
+        while (i < count &&
+               (!job_exists(refs[i].jid) || refs[i].jid == script_self() ||
+                (refs[i].pid != 0 && job_get_pid(refs[i].jid) != refs[i].pid) ||
+                (refs[i].idx >= 0 &&
+                 !array_task_live(refs[i].jid, refs[i].idx)) ||
+                job_get_state(refs[i].jid) == ST)) {
+            i++;
+        }
+        if (i == count) {
+            break;
+        }
+        event_poll(-1, -1);
+    }
+    sigint_pending = 0;
+    free(refs);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/**
+ * @brief Shows the jobs' resource use, refreshed from the event loop
+ *
+ * jtop [-b] [-n frames] [-d delay] [-s cpu|rss|io|age|jid] [@tag]
+ *
+ * On a terminal jtop redraws every delay (1s by default) until q or
+ * Ctrl-C, and acts on the selected job: f continues it in the foreground
+ * (leaving jtop), b in the background, z stops it, x sends TERM and X
+ * KILL; s cycles the sort order.  With -b, or when not on a terminal, it
+ * prints frames (one unless -n says otherwise) as plain text.  With @tag
+ * only the jobs with that tag are shown.
+ *
+ * Sampling happens with the job list locked, and the waits between frames
+ * run the event loop, so background events are handled while jtop is up.
+ */
+void builtin_jtop(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token) {
+    int frames = 0;
+    int64_t delay = 1000000000;
+    const char *sort = NULL;
+    const char *tag = NULL;
+    bool batch = false;
+    for (int i = 1; i < token->argc; i++) {
+        const char *opt = token->argv[i];
+        const char *val = (i + 1 < token->argc) ? token->argv[i + 1] : NULL;
+        const char *end;
+        if (strcmp(opt, "-b") == 0) {
+            batch = true;
+            continue;
+        }
+        if (opt[0] == '@' && opt[1] != '\0' && tag == NULL) {
+            tag = opt + 1;
+            continue;
+        }
+        if (val == NULL || opt[0] != '-') {
+            sio_printf("jtop: usage: jtop [-b] [-n frames] [-d delay] "
+                       "[-s cpu|rss|io|age|jid] [@tag]\n");
+            return;
+        }
+        i++;
+        if (strcmp(opt, "-n") == 0) {
+            if ((frames = atoi(val)) < 1) {
+                sio_printf("jtop: -n must be a positive count\n");
+                return;
+            }
+        } else if (strcmp(opt, "-d") == 0) {
+            delay = parse_duration(val, &end);
+            if (delay <= 0 || *end != '\0') {
+                sio_printf("jtop: bad delay '%s'\n", val);
+                return;
+            }
+        } else if (strcmp(opt, "-s") == 0) {
+            sort = val;
+        } else {
+            sio_printf("jtop: unknown option %s\n", opt);
+            return;
+        }
+    }
+
+    struct jtop *view = jtop_new();
+    if (view == NULL) {
+        sio_printf("jtop: out of memory\n");
+        return;
+    }
+    if (sort != NULL && !jtop_sort_by_name(view, sort)) {
+        sio_printf("jtop: unknown sort key '%s'\n", sort);
+        jtop_free(view);
+        return;
+    }
+    jtop_set_tag(view, tag);
+
+    struct termios saved;
+    bool interactive = !batch && isatty(STDOUT_FILENO) &&
+                       tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (!interactive && frames == 0) {
+        frames = 1;
+    }
+    int rows = 0;
+    if (interactive) {
+        struct termios raw = saved;
+        raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        sio_printf("\033[?25l");
+        struct winsize ws;
+        rows = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0
+                   ? ws.ws_row
+                   : 24;
+    }
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    sigint_pending = 0;
+
+    bool done = false;
+    jid_t to_fg = 0;
+    for (int frame = 0; !done && (frames == 0 || frame < frames); frame++) {
+        jtop_sample(view);
+        jtop_render(view, STDOUT_FILENO, rows, interactive);
+        if (frame + 1 == frames) {
+            break;
+        }
+
+        int64_t deadline = monotonic_ns() + delay;
+        while (!done && !sigint_pending && monotonic_ns() < deadline) {
+            if (!event_poll(interactive ? STDIN_FILENO : -1, deadline)) {
+                continue;
+            }
+            char keys[32];
+            ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+            if (n <= 0) {
+                done = true;
+            }
+            for (ssize_t k = 0; k < n && !done; k++) {
+                jid_t jid = jtop_selected(view);
+                if (keys[k] == '\033' && k + 2 < n && keys[k + 1] == '[') {
+                    // Arrow keys
+                    jtop_move(view, keys[k + 2] == 'A'   ? -1
+                                    : keys[k + 2] == 'B' ? 1
+                                                         : 0);
+                    k += 2;
+                } else if (keys[k] == 'q') {
+                    done = true;
+                } else if (keys[k] == 's') {
+                    jtop_next_sort(view);
+                } else if (keys[k] == 'f' && jid != 0) {
+                    to_fg = jid;
+                    done = true;
+                } else if (keys[k] == 'b' && jid != 0) {
+                    signal_job(jid, SIGCONT);
+                } else if (keys[k] == 'z' && jid != 0) {
+                    signal_job(jid, SIGSTOP);
+                } else if ((keys[k] == 'x' || keys[k] == 'X') && jid != 0) {
+                    signal_job(jid, keys[k] == 'x' ? SIGTERM : SIGKILL);
+                }
+            }
+            if (!done) {
+                jtop_render(view, STDOUT_FILENO, rows, interactive);
+            }
+        }
+        done = done || sigint_pending;
+    }
+    sigint_pending = 0;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    if (interactive) {
+        sio_printf("\033[?25h\n");
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+    jtop_free(view);
+    if (to_fg != 0) {
+        continue_fg(to_fg);
+    }
+}
+
+/**
+ * @brief Runs a command and reports the resources of the jobs it ran
+ *
+ * time command [args...]
+ *
+ * Reports the wall-clock time, and the user and system time of the jobs
+ * that the command started and that finished before it returned, so it
+ * also covers prefixes such as retry.  With delay accounting on (see
+ * tsh_acct.h), it adds how long those jobs waited for a CPU, for block
+ * I/O and for swap-in, which tells contention apart from the work itself.
+ */
+void builtin_time(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token) {
+    if (token->argc < 2) {
+        sio_printf("time: usage: time command [args...]\n");
+        return;
+    }
+    if (parse_result == PARSELINE_BG) {
+        sio_printf("time: cannot time a background job\n");
+        return;
+    }
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    int64_t start = monotonic_ns();
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    size_t first = job_exit_count();
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    shift_tokens(token, 1);
+    run_prefixed(cmdline, parse_result, token);
+    int64_t real = monotonic_ns() - start;
+
+    int64_t user = 0, sys = 0;
+    struct job_delays total = {true, true, 0, 0, 0};
+    bool any = false;
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (size_t n = first; n < job_exit_count(); n++) {
+        const struct job_exit *e = job_exit_get(n);
+        if (e == NULL || e->start_ns < start) {
+            continue; // overwritten, or a job started before time
+        }
+        user += e->user_ns;
+        sys += e->sys_ns;
+        total.valid = total.valid && e->delays.valid;
+        total.has_swapin = total.has_swapin && e->delays.has_swapin;
+        total.cpu_ns += e->delays.cpu_ns;
+        total.blkio_ns += e->delays.blkio_ns;
+        total.swapin_ns += e->delays.swapin_ns;
+        any = true;
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    char buf[3][32];
+    format_ns(buf[0], sizeof(buf[0]), real);
+    format_ns(buf[1], sizeof(buf[1]), user);
+    format_ns(buf[2], sizeof(buf[2]), sys);
+    sio_printf("real %s  user %s  sys %s\n", buf[0], buf[1], buf[2]);
+    if (any && total.valid) {
+        format_ns(buf[0], sizeof(buf[0]), (int64_t)total.cpu_ns);
+        format_ns(buf[1], sizeof(buf[1]), (int64_t)total.blkio_ns);
+        if (total.has_swapin) {
+            format_ns(buf[2], sizeof(buf[2]), (int64_t)total.swapin_ns);
+        } else {
+            sio_snprintf(buf[2], sizeof(buf[2]), "-");
+        }
+        sio_printf("wait cpu %s  blkio %s  swapin %s\n", buf[0], buf[1],
+                   buf[2]);
+    }
+}
+
+
+/*****************
+ * Pattern matching
+ *****************/
+
+/**
+ * @brief Tests a word against glob patterns, like the arms of a case
+ *
+ * match [-p] word pattern...
+ *
+ * The status is 0 if word matches any of the patterns (see tsh_pattern.h
+ * for their syntax) and 1 otherwise, so that -c strings can branch with
+ * && and ||; -p also prints the first pattern that matched.  Patterns are
+ * compiled once and cached, so a match repeated in a loop or a script
+ * only pays for the matching.
+ */
+void builtin_match(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token) {
+    int arg = 1;
+    bool print = token->argc > 1 && strcmp(token->argv[1], "-p") == 0;
+    if (print) {
+        arg++;
+    }
+    if (token->argc - arg < 2) {
+        sio_printf("match: usage: match [-p] word pattern...\n");
+        builtin_status = 2;
+        return;
+    }
+    const char *word = token->argv[arg];
+    for (int i = arg + 1; i < token->argc; i++) {
+        struct pattern *p = pattern_compile(token->argv[i]);
+        if (p == NULL) {
+            sio_printf("match: out of memory\n");
+            builtin_status = 2;
+            return;
+        }
+        if (pattern_match(p, word)) {
+            if (print) {
+                sio_printf("%s\n", token->argv[i]);
+            }
+            return;
+        }
+    }
+    builtin_status = 1;
+}
+
+/*****************
+ * Reading input
+ *****************/
+
+/* Environment entries ("NAME=value") that read rewrites in place */
+#define READ_MAX_VARS 16
+static struct read_var {
+    char *entry;
+    size_t cap;
+} read_vars[READ_MAX_VARS];
+static size_t nread_vars;
+
+/**
+ * @brief Sets the environment variable name to value, for read
+ *
+ * setenv() allocates a new entry on every call and never frees the old
+ * one, which a loop over millions of records cannot afford, so read keeps
+ * entries of its own and overwrites them in place while the value fits.
+ * An entry is only reused while it is still the one in the environment;
+ * once something else has set or unset the name, it is forgotten (not
+ * freed, since the environment may still point to it) and replaced.
+ */
+static bool read_setvar(const char *name, const char *value) {
+    size_t nlen = strlen(name);
+    size_t vlen = strlen(value);
+    struct read_var *v = NULL;
+    for (size_t i = 0; i < nread_vars && v == NULL; i++) {
+        if (strncmp(read_vars[i].entry, name, nlen) == 0 &&
+            read_vars[i].entry[nlen] == '=') {
+            v = &read_vars[i];
+        }
+    }
+    bool current = v != NULL && getenv(name) == v->entry + nlen + 1;
+    if (current && nlen + vlen + 2 <= v->cap) {
+        memcpy(v->entry + nlen + 1, value, vlen + 1);
+        return true;
+    }
+    if (v == NULL && nread_vars == READ_MAX_VARS) {
+        return setenv(name, value, 1) == 0;
+    }
+
+    size_t cap = 2 * (nlen + vlen + 2);
+    char *entry = malloc(cap < 64 ? 64 : cap);
+    if (entry == NULL) {
+        return false;
+    }
+    memcpy(entry, name, nlen);
+    entry[nlen] = '=';
+    memcpy(entry + nlen + 1, value, vlen + 1);
+    if (putenv(entry) != 0) {
+        free(entry);
+        return false;
+    }
+    if (v == NULL) {
+        v = &read_vars[nread_vars++];
+    } else if (current) {
+        free(v->entry); // putenv() replaced it in the environment
+    }
+    v->entry = entry;
+    v->cap = cap < 64 ? 64 : cap;
+    return true;
+}
+
+/* True if name can be a variable: a letter or _, then alphanumerics */
+static bool valid_var_name(const char *name) {
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_') {
+        return false;
+    }
+    for (const char *p = name + 1; *p != '\0'; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Finds the command of a read loop: the raw text after its ':'
+ *
+ * @param[out] prefix_len The length of the text before the ':'
+ * @return The command, or NULL if there is no ':'
+ *
+ * Option values are skipped, so that read -d : reads up to colons.
+ */
+static const char *read_loop_body(const char *cmdline, size_t *prefix_len) {
+    bool value = false;
+    for (int w = 1;; w++) {
+        const char *p = command_text(cmdline, w);
+        size_t len = strcspn(p, " \t");
+        if (len == 0) {
+            return NULL;
+        }
+        if (!value && len == 1 && p[0] == ':') {
+            *prefix_len = (size_t)(p - cmdline);
+            return command_text(cmdline, w + 1);
+        }
+        value = !value && len == 2 && p[0] == '-' && strchr("dnu", p[1]);
+    }
+}
+
+/**
+ * @brief Reads records from stdin or a file into a variable
+ *
+ * read [-r] [-d delim] [-n N] [-u fd] [name] [< file]
+ * read [-r] [-d delim] [-n N] [-u fd] [name] [< file] : cmd [args...]
+ *
+ * Reads one record, a line by default, into the environment variable name
+ * (REPLY if none), where the commands the shell runs find it.  -d ends
+ * records at delim instead (-d '' at NUL bytes), -n N after at most N
+ * bytes, and -u reads descriptor fd rather than stdin.  Without -r, \c
+ * stands for c and a backslash at the end of a line continues the record.
+ * The status is 1 at end of input.  If the shell reads its commands from
+ * stdin, read takes the lines that follow it there.
+ *
+ * With : cmd, read is a while read loop: cmd (the rest of the line, as
+ * typed) runs for each record with $name replaced by the record, until
+ * the input ends or Ctrl-C.  A < file before the : is opened by read
+ * alone, so even a pipe or FIFO is read a block at a time; shared regular
+ * files are read in blocks too and the rest is handed back before each
+ * fork (see tsh_read.h).  A loop whose commands are builtins runs without
+ * a system call per record.
+ */
+void builtin_read(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token) {
+    struct read_opts opts = {.delim = '\n', .max = 0, .raw = false};
+    int fd = STDIN_FILENO;
+    int i;
+    builtin_status = 2;
+    for (i = 1; i < token->argc && token->argv[i][0] == '-'; i++) {
+        const char *opt = token->argv[i];
+        const char *val = (i + 1 < token->argc) ? token->argv[i + 1] : NULL;
+        char *end;
+        if (strcmp(opt, "-r") == 0) {
+            opts.raw = true;
+            continue;
+        }
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (val == NULL) {
+            sio_printf("read: %s requires an argument\n", opt);
+            return;
+        }
+        i++;
+        if (strcmp(opt, "-d") == 0) {
+            opts.delim = (unsigned char)val[0];
+        } else if (strcmp(opt, "-n") == 0) {
+            long n = strtol(val, &end, 10);
+            if (end == val || *end != '\0' || n < 1) {
+                sio_printf("read: -n must be a positive count\n");
+                return;
+            }
+            opts.max = (size_t)n;
+        } else if (strcmp(opt, "-u") == 0) {
+            long n = strtol(val, &end, 10);
+            if (end == val || *end != '\0' || n < 0 || n > INT_MAX ||
+                fcntl((int)n, F_GETFD) < 0) {
+                sio_printf("read: %s: bad file descriptor\n", val);
+                return;
+            }
+            fd = (int)n;
+        } else {
+            sio_printf("read: unknown option %s\n", opt);
+            return;
+        }
+    }
+    const char *name = "REPLY";
+    if (i < token->argc && strcmp(token->argv[i], ":") != 0) {
+        name = token->argv[i++];
+    }
+    size_t prefix_len = strlen(cmdline);
+    const char *body = read_loop_body(cmdline, &prefix_len);
+    bool loop = i < token->argc;
+    if (!valid_var_name(name) || loop != (body != NULL) ||
+        (loop && (strcmp(token->argv[i], ":") != 0 || *body == '\0'))) {
+        sio_printf("read: usage: read [-r] [-d delim] [-n N] [-u fd] "
+                   "[name] [: command [args...]]\n");
+        return;
+    }
+
+    // A < after the : is the loop command's own
+    bool owned = false;
+    if (token->infile != NULL && memchr(cmdline, '<', prefix_len) != NULL) {
+        fd = open(token->infile, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            sio_printf("%s: %s\n", token->infile,
+                       errno == ENOENT ? "No such file or directory"
+                                       : "Permission denied");
+            return;
+        }
+        owned = true;
+    }
+
+    char record[MAXLINE_TSH];
+    char line[MAXLINE_TSH];
+    int status = 0;
+    int r;
+    sigint_pending = 0;
+    while ((r = read_input(fd, owned, &opts, record, sizeof(record))) > 0) {
+        if (!read_setvar(name, record)) {
+            sio_printf("read: out of memory\n");
+            status = 2;
+            break;
+        }
+        if (body == NULL) {
+            break;
+        }
+        const char *value = record;
+        if (!expand_vars(body, &name, &value, 1, line, sizeof(line))) {
+            sio_printf("read: %s: command too long\n", record);
+            status = 2;
+            break;
+        }
+        eval(line);
+        if (sigint_pending || script_cancelled()) {
+            break;
+        }
+    }
+    if (r < 0 && errno != EINTR) {
+        sio_printf("read: %s\n", strerror(errno));
+        status = 2;
+    } else if (r == 0 && body == NULL) {
+        status = 1;
+    }
+    if (owned) {
+        read_forget(fd);
+        close(fd);
+    }
+    read_sync();
+    builtin_status = status;
+}
+
+/*****************
+ * Shutdown
+ *****************/
+
+/* What quit and end of input do with the jobs that are left */
+enum shutdown_policy {
+    SHUTDOWN_WAIT,      // wait for running jobs, then terminate the rest
+    SHUTDOWN_TERMINATE, // HUP and TERM, then KILL after a grace period
+    SHUTDOWN_DETACH,    // leave the jobs running
+};
+
+#define SHUTDOWN_WAIT_NS 30000000000LL // default wait for running jobs
+#define SHUTDOWN_GRACE_NS 2000000000LL // default time from TERM to KILL
+#define SHUTDOWN_KILL_NS 1000000000LL  // longest wait after KILL
+
+/* A job being shut down, and what became of it */
+struct shutdown_job {
+    jid_t jid;
+    pid_t pid;
+    const char *cmdline; // the job's own copy, kept by delete_job()
+    int status;          // wait status, if reaped is set
+    bool reaped;
+    bool killed;  // sent SIGKILL
+    bool pending; // never started, dropped from its scheduler's queue
+};
+
+/* The jobs being shut down, in job ID order */
+static struct shutdown_job *shutdown_list;
+static size_t shutdown_count;
+
+/**
+ * @brief Records the exit of a job being shut down (from event_dispatch())
+ */
+void shutdown_child_exited(jid_t jid, int status) {
+    size_t lo = 0, hi = shutdown_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (shutdown_list[mid].jid < jid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < shutdown_count && shutdown_list[lo].jid == jid) {
+        shutdown_list[lo].status = status;
+        shutdown_list[lo].reaped = true;
+    }
+}
+
+/**
+ * @brief Parses wait[=TIME], terminate[=TIME] or detach
+ *
+ * @param[out] limit How long to wait (wait) or the grace period (terminate)
+ */
+static bool parse_shutdown_policy(const char *text,
+                                  enum shutdown_policy *policy,
+                                  int64_t *limit) {
+    const char *arg = NULL;
+    if (strncmp(text, "wait", 4) == 0) {
+        *policy = SHUTDOWN_WAIT;
+        *limit = SHUTDOWN_WAIT_NS;
+        arg = text + 4;
+    } else if (strncmp(text, "terminate", 9) == 0) {
+        *policy = SHUTDOWN_TERMINATE;
+        *limit = SHUTDOWN_GRACE_NS;
+        arg = text + 9;
+    } else if (strcmp(text, "detach") == 0) {
+        *policy = SHUTDOWN_DETACH;
+        *limit = 0;
+        return true;
+    } else {
+        return false;
+    }
+    if (*arg == '\0') {
+        return true;
+    }
+    const char *end;
+    if (*arg != '=' || (*limit = parse_duration(arg + 1, &end)) < 0 ||
+        *end != '\0') {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Waits until deadline or Ctrl-C for the jobs to exit
+ *
+ * @param[in] running_only Stop waiting once only stopped jobs are left
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+static void shutdown_drain(int64_t deadline, bool running_only) {
+    while (!sigint_pending && monotonic_ns() < deadline) {
+        jid_t jid = job_next(0);
+        if (running_only) {
+            while (jid != 0 && job_get_state(jid) == ST) {
+                jid = job_next(jid);
+            }
+        }
+        if (jid == 0) {
+            return;
+        }
+        event_poll(-1, deadline);
+    }
+}
+
+/**
+ * @brief Sends sig to each job still alive, continuing stopped ones
+ */
+static void shutdown_signal(int sig) {
+    for (size_t i = 0; i < shutdown_count; i++) {
+        jid_t jid = shutdown_list[i].jid;
+        if (!job_exists(jid)) {
+            continue;
+        }
+        if (job_get_pid(jid) == 0) {
+            // an array or script job, continued if it is paused
+            signal_job(jid, sig);
+            continue;
+        }
+        job_kill(jid, sig);
+        if (sig == SIGKILL) {
+            shutdown_list[i].killed = true;
+        } else if (job_get_state(jid) == ST) {
+            job_kill(jid, SIGCONT);
+            job_set_state(jid, BG);
+        }
+    }
+}
+
+/**
+ * @brief Reports what became of each job
+ */
+static void shutdown_report(enum shutdown_policy policy) {
+    for (size_t i = 0; i < shutdown_count; i++) {
+        const struct shutdown_job *job = &shutdown_list[i];
+        char what[64];
+        if (job->pending) {
+            snprintf(what, sizeof(what), "not started");
+        } else if (job_exists(job->jid)) {
+            snprintf(what, sizeof(what), "%s",
+                     policy == SHUTDOWN_DETACH ? "detached"
+                                               : "did not exit, abandoned");
+        } else if (!job->reaped) {
+            snprintf(what, sizeof(what), "exited");
+        } else if (WIFSIGNALED(job->status)) {
+            int sig = WTERMSIG(job->status);
+            snprintf(what, sizeof(what), "%s by signal %d",
+                     job->killed && sig == SIGKILL ? "killed" : "terminated",
+                     sig);
+        } else {
+            snprintf(what, sizeof(what), "exited with status %d",
+                     WEXITSTATUS(job->status));
+        }
+        sio_printf("[%d] (%d) %s: %s\n", (int)job->jid, (int)job->pid,
+                   job->cmdline, what);
+    }
+}
+
+/**
+ * @brief Deals with the remaining jobs before the shell exits
+ *
+ * @param[in] policy The quit argument, or NULL for TSH_SHUTDOWN or else
+ *            terminate
+ * @return false (after printing an error) if policy is not valid
+ *
+ * wait waits for the running jobs up to its time limit (30s by default),
+ * then terminates whatever is left.  terminate sends HUP and TERM, and
+ * CONT to stopped jobs so that they can act on them, then KILL to the
+ * jobs still alive after the grace period (2s by default).  detach leaves
+ * the jobs running, continuing stopped ones rather than leaving them
+ * stopped for good.  Ctrl-C cuts the current wait short.
+ *
+ * The EXIT trap runs first, for at most the wait limit (wait) or the
+ * grace period; a trap still running then is shut down with the jobs, or
+ * cut short with HUP under detach, since it cannot outlive the shell.
+ *
+ * Every phase signals each job once and then waits on the event loop with
+ * a deadline, so however many jobs there are, the shell exits within the
+ * wait limit (or one grace period for the trap), the grace period and
+ * SHUTDOWN_KILL_NS, plus the time to make a few system calls per job.
+ */
+bool shell_shutdown(const char *policy) {
+    enum shutdown_policy how = SHUTDOWN_TERMINATE;
+    int64_t limit = SHUTDOWN_GRACE_NS;
+    if (policy != NULL) {
+        if (!parse_shutdown_policy(policy, &how, &limit)) {
+            sio_printf("quit: %s: policy must be wait[=TIME], "
+                       "terminate[=TIME] or detach\n",
+                       policy);
+            return false;
+        }
+    } else if ((policy = getenv("TSH_SHUTDOWN")) != NULL &&
+               !parse_shutdown_policy(policy, &how, &limit)) {
+        sio_printf("TSH_SHUTDOWN: %s: ignored\n", policy);
+        how = SHUTDOWN_TERMINATE;
+        limit = SHUTDOWN_GRACE_NS;
+    }
+    if (!shell_initialized) {
+        return true;
+    }
+    int64_t first_deadline =
+        monotonic_ns() + (how == SHUTDOWN_DETACH ? SHUTDOWN_GRACE_NS : limit);
+    jid_t trap_jid = trap_exit(first_deadline);
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (trap_jid != 0 && how == SHUTDOWN_DETACH) {
+        signal_job(trap_jid, SIGHUP);
+        while (script_find(trap_jid) != NULL &&
+               monotonic_ns() < first_deadline + SHUTDOWN_KILL_NS) {
+            event_poll(-1, first_deadline + SHUTDOWN_KILL_NS);
+        }
+    }
+
+    size_t cap = 0;
+    for (jid_t jid = job_next(0); jid != 0; jid = job_next(jid)) {
+        if (shutdown_count == cap) {
+            cap = cap ? 2 * cap : 64;
+            struct shutdown_job *grown =
+                realloc(shutdown_list, cap * sizeof(*grown));
+            if (grown == NULL) {
+                break;
+            }
+            shutdown_list = grown;
+        }
+        shutdown_list[shutdown_count++] = (struct shutdown_job){
+            jid, job_get_pid(jid), job_get_cmdline(jid), 0, false, false,
+            job_get_state(jid) == PD};
+    }
+    if (shutdown_count == 0) {
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return true;
+    }
+    shutting_down = 1;
+    sigint_pending = 0;
 
-        if (token.argc == 1) {
-            sio_printf("fg command requires PID or %%jobid argument\n");
-            return;
+    // Jobs still waiting for a scheduler are not started at all, nor are
+    // the pending tasks of array jobs
+    for (size_t i = 0; i < shutdown_count; i++) {
+        if (shutdown_list[i].pending) {
+            sched_cancel(shutdown_list[i].jid);
         }
+    }
+    array_cancel_all();
 
-        char *start = token.argv[1];
-        char *num;
-        if ((*start) != '%') {
-            num = token.argv[1];
+    if (how == SHUTDOWN_DETACH) {
+        for (size_t i = 0; i < shutdown_count; i++) {
+            if (job_get_state(shutdown_list[i].jid) == ST) {
+                job_kill(shutdown_list[i].jid, SIGCONT);
+            }
+        }
+    } else {
+        int64_t grace = SHUTDOWN_GRACE_NS;
+        if (how == SHUTDOWN_WAIT) {
+            shutdown_drain(first_deadline, true);
+            sigint_pending = 0;
         } else {
-            num = token.argv[1] + 1;
+            grace = limit;
         }
-        pid_t jid = atoi(num);
-        if (jid == 0) {
-            sio_printf("fg: argument must be a PID or %%jobid\n");
-            return;
+        shutdown_signal(SIGHUP);
+        shutdown_signal(SIGTERM);
+        shutdown_drain(monotonic_ns() + grace, false);
+        sigint_pending = 0;
+        shutdown_signal(SIGKILL);
+        shutdown_drain(monotonic_ns() + SHUTDOWN_KILL_NS, false);
+    }
+
+    shutdown_report(how);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return true;
+}
+
+/*****************
+ * One-shot mode (-c)
+ *****************/
+
+/* How a command in a -c string is joined to the one before it */
+typedef enum list_op { LIST_SEQ, LIST_AND, LIST_OR } list_op;
+
+#define MAX_PIPELINE 16
+
+/**
+ * @brief Returns true if the command needs the job list or a builtin
+ */
+static bool needs_job_control(parseline_return parse_result,
+                              const struct cmdline_tokens *token) {
+    if (parse_result == PARSELINE_BG || token->builtin != BUILTIN_NONE) {
+        return true;
+    }
+    for (size_t i = 0; i < sizeof(named_builtins) / sizeof(named_builtins[0]);
+         i++) {
+        if (strcmp(token->argv[0], named_builtins[i].name) == 0) {
+            return true;
         }
+    }
+    return false;
+}
 
-        sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-        if (job_exists(jid)) {
-            // jid is jid
-            job_set_state(jid, FG);
-            pid_t pid = job_get_pid(jid);
-            killpg(pid, SIGCONT);
-            int fjid;
-            sigprocmask(SIG_SETMASK, &prev_all, NULL);
-            sigprocmask(SIG_BLOCK, &sigchld, NULL);
-            while ((fjid = fg_job()) > 0) {
-                job_state state = job_get_state(fjid);
-                if (state == ST) {
-                    break;
-                    sigprocmask(SIG_SETMASK, &prev_all, NULL);
-                }
-                sigsuspend(&prev_all);
+/**
+ * @brief Applies a command's redirections to the current process
+ *
+ * @return false (after printing an error) if a file could not be opened
+ */
+static bool redirect_stdio(const struct cmdline_tokens *token) {
+    if (token->infile != NULL) {
+        int fd = open(token->infile, O_RDONLY);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                sio_printf("%s: No such file or directory\n", token->infile);
+            } else {
+                sio_printf("%s: Permission denied\n", token->infile);
             }
-        } else {
-            // jid is pid
-            pid_t pid = jid;
-            jid = job_from_pid(pid);
-            if (jid == 0) {
-                printf("%s: No such job\n", token.argv[1]);
-                sigprocmask(SIG_SETMASK, &prev_all, NULL);
-                return;
+            return false;
+        }
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    if (token->outfile != NULL) {
+        int fd = open_outfile(token->outfile);
+        if (fd < 0) {
+            return false;
+        }
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+    return true;
+}
+
+/**
+ * @brief Replaces the current process with the command (in a child, or
+ * in the shell itself for the last command of a -c string)
+ */
+static void exec_command(const struct cmdline_tokens *token) {
+    if (!redirect_stdio(token)) {
+        _exit(1);
+    }
+    if (shell_initialized) {
+        setrlimit(RLIMIT_NOFILE, &nofile_limit);
+    }
+    pin_execve(token->argv, environ);
+    if (errno == ENOENT) {
+        sio_printf("%s: No such file or directory\n", token->argv[0]);
+    } else {
+        sio_printf("%s: Permission denied\n", token->argv[0]);
+    }
+    _exit(127);
+}
+
+/**
+ * @brief Converts a wait status to a shell exit code
+ */
+static int exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/**
+ * @brief Runs a foreground pipeline of external commands and waits for it
+ *
+ * @return The exit code of the last stage
+ *
+ * The stages stay in the shell's process group, as with sh -c, so the
+ * terminal delivers Ctrl-C to them directly.  SIGCHLD is blocked and the
+ * stages are reaped by pid, which keeps them away from sigchld_handler if
+ * an earlier command installed it.
+ */
+static int run_pipeline(struct cmdline_tokens *stages, int nstages) {
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    pid_t pids[MAX_PIPELINE];
+    int nstarted = 0;
+    int in_fd = -1;
+    for (int i = 0; i < nstages; i++) {
+        int pipe_fds[2] = {-1, -1};
+        if (i < nstages - 1 && pipe(pipe_fds) < 0) {
+            perror("pipe");
+            break;
+        }
+        prewarm_command(stages[i].argv[0]);
+        read_sync();
+        pid_t pid = fork();
+        if (pid == 0) {
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            if (in_fd >= 0) {
+                dup2(in_fd, STDIN_FILENO);
+                close(in_fd);
             }
-            job_set_state(jid, FG);
-            killpg(pid, SIGCONT);
-            sigprocmask(SIG_SETMASK, &prev_all, NULL);
-            int fjid;
-            sigprocmask(SIG_BLOCK, &sigchld, NULL);
-            while ((fjid = fg_job()) > 0) {
-                job_state state = job_get_state(fjid);
-                if (state == ST) {
+            if (pipe_fds[1] >= 0) {
+                dup2(pipe_fds[1], STDOUT_FILENO);
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+            }
+            exec_command(&stages[i]);
+        }
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (pipe_fds[1] >= 0) {
+            close(pipe_fds[1]);
+        }
+        in_fd = pipe_fds[0];
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        pids[nstarted++] = pid;
+        pin_note_launch(stages[i].argv[0]);
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+
+    int status = 0;
+    int code = 1;
+    for (int i = 0; i < nstarted; i++) {
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) {
+        }
+        if (i == nstages - 1) {
+            code = exit_code(status);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return code;
+}
+
+/**
+ * @brief Runs one element of a -c string: a command or a pipeline
+ *
+ * @param[in] text The element, NUL-terminated
+ * @param[in] last true if nothing follows it, so it may replace the shell
+ * @return Its exit code
+ */
+static int run_element(char *text, bool last) {
+    static struct cmdline_tokens stages[MAX_PIPELINE];
+    char *starts[MAX_PIPELINE];
+    int nstages = 0;
+    char quote = '\0';
+
+    starts[nstages++] = text;
+    for (char *p = text; *p != '\0'; p++) {
+        if (quote != '\0') {
+            quote = (*p == quote) ? '\0' : quote;
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if (*p == '|') {
+            if (nstages == MAX_PIPELINE) {
+                sio_printf("Error: pipeline too long\n");
+                return 2;
+            }
+            *p = '\0';
+            starts[nstages++] = p + 1;
+        }
+    }
+
+    parseline_return parse_result = PARSELINE_EMPTY;
+    for (int i = 0; i < nstages; i++) {
+        parse_result = parseline(starts[i], &stages[i]);
+        if (parse_result == PARSELINE_ERROR) {
+            return 2;
+        }
+        if (parse_result == PARSELINE_EMPTY) {
+            if (nstages == 1) {
+                return 0;
+            }
+            sio_printf("Error: empty command in pipeline\n");
+            return 2;
+        }
+        if (nstages > 1 && needs_job_control(parse_result, &stages[i])) {
+            sio_printf("Error: builtins and & are not supported in "
+                       "pipelines\n");
+            return 2;
+        }
+    }
+    if (nstages > 1) {
+        return run_pipeline(stages, nstages);
+    }
+
+    struct cmdline_tokens *token = &stages[0];
+    if (needs_job_control(parse_result, token)) {
+        shell_init();
+        if (builtincmd(text, parse_result, *token)) {
+            return builtin_status;
+        }
+        int status = run_job(text, parse_result, token);
+        return status < 0 ? 1 : status;
+    }
+
+    // The last simple command needs no shell around it, unless the shell
+    // has background jobs the command would inherit as children
+    if (last && !shell_initialized) {
+        fflush(stdout);
+        read_sync();
+        exec_command(token);
+    }
+    return run_pipeline(token, 1);
+}
+
+/**
+ * @brief Runs a command string for -c and returns the last exit code
+ *
+ * Commands are separated by ';', '&', '&&' and '||' (outside quotes) and
+ * are run left to right; '&' (or '&[opts]', see parse_job_opts()) runs the
+ * command before it in the background, and '&&' and '||' skip the next
+ * command unless the previous one succeeded or failed respectively.
+ */
+int run_string(const char *str) {
+    char elem[MAXLINE_TSH];
+    list_op op = LIST_SEQ;
+    int status = 0;
+    const char *p = str;
+
+    while (*p != '\0') {
+        size_t len = 0;
+        char quote = '\0';
+        list_op next_op = LIST_SEQ;
+        for (p += strspn(p, " \t"); *p != '\0'; p++) {
+            if (quote == '\0') {
+                if (*p == ';') {
+                    p++;
                     break;
                 }
-                sigsuspend(&prev_all);
+                if (p[0] == '&' && p[1] != '&') {
+                    // "cmd & next" or "cmd &[opts] next": keep the '&',
+                    // with its launch options, as cmd's own last word
+                    size_t amp = 1;
+                    if (p[1] == '[') {
+                        const char *close = strchr(p, ']');
+                        amp = close != NULL ? (size_t)(close - p) + 1
+                                            : strlen(p);
+                    }
+                    while (len > 0 && isspace((unsigned char)elem[len - 1])) {
+                        len--;
+                    }
+                    if (len + 1 + amp >= sizeof(elem)) {
+                        sio_printf("Error: command too long\n");
+                        return 2;
+                    }
+                    elem[len++] = ' ';
+                    memcpy(elem + len, p, amp);
+                    len += amp;
+                    p += amp;
+                    break;
+                }
+                if ((p[0] == '&' && p[1] == '&') ||
+                    (p[0] == '|' && p[1] == '|')) {
+                    next_op = (*p == '&') ? LIST_AND : LIST_OR;
+                    p += 2;
+                    break;
+                }
+                if (*p == '\'' || *p == '"') {
+                    quote = *p;
+                }
+            } else if (*p == quote) {
+                quote = '\0';
+            }
+            if (len == sizeof(elem) - 1) {
+                sio_printf("Error: command too long\n");
+                return 2;
             }
+            elem[len++] = *p;
         }
-        sigprocmask(SIG_SETMASK, &prev_all, NULL);
+        elem[len] = '\0';
+
+        bool last = p[strspn(p, " \t\r\n")] == '\0';
+        bool skip = (op == LIST_AND && status != 0) ||
+                    (op == LIST_OR && status == 0);
+        if (!skip) {
+            status = run_element(elem, last);
+        }
+        op = next_op;
+    }
+    return status;
+}
+
+/*****************
+ * Event loop
+ *****************/
+
+/* Buffered command input, so the event loop can tell if a line is ready */
+static struct {
+    char buf[65536];
+    size_t start;   // first unread byte
+    size_t end;     // one past the last buffered byte
+    size_t scanned; // lines before this were seen by prewarm_scan()
+    bool eof;
+    bool active; // the shell reads its commands from here
+} input;
+
+/* Pending timers, kept as a binary min-heap ordered by deadline */
+static struct timer {
+    int64_t deadline; // CLOCK_MONOTONIC, ns
+    void (*fn)(void *);
+    void *arg;
+} *timers;
+static size_t ntimers;
+static size_t timers_cap;
+
+/**
+ * @brief Returns the monotonic clock in nanoseconds
+ */
+int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Arranges for fn(arg) to run from the event loop at deadline
+ */
+void timer_add(int64_t deadline, void (*fn)(void *), void *arg) {
+    if (ntimers == timers_cap) {
+        size_t cap = (timers_cap == 0) ? 16 : 2 * timers_cap;
+        struct timer *grown = realloc(timers, cap * sizeof(*grown));
+        if (grown == NULL) {
+            sio_printf("timer: out of memory\n");
+            return;
+        }
+        timers = grown;
+        timers_cap = cap;
+    }
+    size_t i = ntimers++;
+    while (i > 0 && timers[(i - 1) / 2].deadline > deadline) {
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    timers[i].deadline = deadline;
+    timers[i].fn = fn;
+    timers[i].arg = arg;
+}
+
+/* Removes the earliest timer from the heap */
+static struct timer timer_pop(void) {
+    struct timer top = timers[0];
+    struct timer last = timers[--ntimers];
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= ntimers) {
+            break;
+        }
+        if (child + 1 < ntimers &&
+            timers[child + 1].deadline < timers[child].deadline) {
+            child++;
+        }
+        if (timers[child].deadline >= last.deadline) {
+            break;
+        }
+        timers[i] = timers[child];
+        i = child;
+    }
+    if (ntimers > 0) {
+        timers[i] = last;
+    }
+    return top;
+}
+
+/**
+ * @brief Looks for pid among the children reaped but not yet dispatched
+ *
+ * A job may be deleted, and its pid reused, before event_dispatch() has
+ * seen its exit.  Must be called with SIGCHLD blocked.
+ */
+bool reap_pending(pid_t pid, int *status) {
+    for (sig_atomic_t i = reap_tail; i != reap_head; i++) {
+        if (reap_ring[i % REAP_RING_SIZE].pid == pid) {
+            if (status != NULL) {
+                *status = reap_ring[i % REAP_RING_SIZE].status;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Handles reaped children, trapped signals and due timers, then
+ * lets the script coroutines run
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+void event_dispatch(void) {
+    while (reap_tail != reap_head || reap_deferred) {
+        if (reap_tail == reap_head) {
+            // the ring filled up, or the handler left the children to
+            // be reaped here: reap them
+            reap_deferred = 0;
+            reap_children();
+            continue;
+        }
+        struct reap_event ev = reap_ring[reap_tail % REAP_RING_SIZE];
+        reap_tail++;
+        retry_child_exited(ev.pid, ev.status);
+        shutdown_child_exited(ev.jid, ev.status);
+        sched_child_exited(ev.jid, ev.pid, ev.status);
+        if (ev.jid == 0) {
+            array_child_exited(ev.pid, ev.status);
+        }
+        script_child_exited(ev.pid, ev.status);
+        if (ev.jid != 0) {
+            cache_job_done(ev.jid, ev.status);
+            hooks_job_done(ev.jid, ev.status);
+        }
+    }
+    hooks_dispatch();
+
+    int64_t now = monotonic_ns();
+    while (ntimers > 0 && timers[0].deadline <= now) {
+        struct timer t = timer_pop();
+        t.fn(t.arg);
+    }
+    script_resume_all();
+}
+
+/**
+ * @brief Runs one round of the event loop
+ *
+ * @param[in] fd A descriptor to wait for input on, or -1
+ * @param[in] deadline Monotonic time to return by, or -1 for none
+ * @return true if fd is ready for reading
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.  Dispatches
+ * pending events, then sleeps until fd becomes readable, a signal arrives,
+ * the next timer or the deadline is due, and dispatches again.  Signals are
+ * unblocked only inside ppoll(), so none can slip in between the check for
+ * work and the sleep.  Called from a script coroutine, it yields to the
+ * shell instead and returns false once the script is resumed, so that the
+ * caller checks again for what it waits on.
+ */
+bool event_poll(int fd, int64_t deadline) {
+    if (script_current != NULL) {
+        script_yield(deadline);
+        return false;
+    }
+    sigset_t unblocked;
+    sigemptyset(&unblocked);
+
+    // A script job that finished, or a child reaped now rather than by
+    // the handler, may be what the caller waits for
+    unsigned retired = scripts_retired;
+    sig_atomic_t dispatched = reap_tail;
+    event_dispatch();
+    if (scripts_retired != retired || reap_tail != dispatched) {
+        return false;
+    }
+
+    int64_t wake = deadline;
+    if (ntimers > 0 && (wake < 0 || timers[0].deadline < wake)) {
+        wake = timers[0].deadline;
+    }
+    if (traps_pending) {
+        wake = 0; // a trapped signal came after event_dispatch() looked
+    }
+    struct timespec ts;
+    struct timespec *timeout = NULL;
+    if (wake >= 0) {
+        int64_t delta = wake - monotonic_ns();
+        if (delta < 0) {
+            delta = 0;
+        }
+        ts.tv_sec = delta / 1000000000;
+        ts.tv_nsec = delta % 1000000000;
+        timeout = &ts;
+    }
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int n = ppoll(&pfd, fd >= 0 ? 1 : 0, timeout, &unblocked);
+    event_dispatch();
+    return n > 0;
+}
+
+/**
+ * @brief Waits in the event loop for more input on stdin and appends it
+ *
+ * The unread input is first moved to the front of the buffer.  Returns -1
+ * on a read error, otherwise 0 (whether or not anything came).
+ */
+static int input_fill(void) {
+    size_t avail = input.end - input.start;
+    memmove(input.buf, input.buf + input.start, avail);
+    input.scanned -= (input.scanned > input.start) ? input.start
+                                                    : input.scanned;
+    input.start = 0;
+    input.end = avail;
+    if (!event_poll(STDIN_FILENO, -1)) {
+        return 0;
+    }
+    ssize_t n = read(STDIN_FILENO, input.buf + input.end,
+                     sizeof(input.buf) - input.end);
+    if (n < 0) {
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+    }
+    if (n == 0) {
+        input.eof = true;
+    } else {
+        input.end += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the next command line from stdin, without its newline
+ *
+ * @param[out] cmdline Receives the line
+ * @param[in] size Size of cmdline; longer lines are split, as with fgets
+ * @return 1 if a line was read, 0 at end of file, -1 on a read error
+ *
+ * Until a complete line is buffered the shell sits in the event loop, so
+ * timers and reaped jobs are handled while it waits at the prompt.  A final
+ * line without a newline is discarded at end of file.
+ */
+int read_cmdline(char *cmdline, size_t size) {
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    int result;
+    input.active = true;
+    while (true) {
+        char *start = input.buf + input.start;
+        size_t avail = input.end - input.start;
+        char *newline = memchr(start, '\n', avail);
+        if (newline != NULL || avail >= size - 1) {
+            size_t len = (newline != NULL) ? (size_t)(newline - start) : avail;
+            size_t take = len < size - 1 ? len : size - 1;
+            memcpy(cmdline, start, take);
+            cmdline[take] = '\0';
+            input.start += take + (take == len && newline != NULL ? 1 : 0);
+            result = 1;
+
+            // Let upcoming commands start loading while this one runs
+            if (input.scanned < input.start) {
+                input.scanned = input.start;
+            }
+            char *last = memrchr(input.buf + input.scanned, '\n',
+                                 input.end - input.scanned);
+            if (last != NULL) {
+                size_t upto = (size_t)(last - input.buf) + 1;
+                prewarm_scan(input.buf + input.scanned, upto - input.scanned);
+                input.scanned = upto;
+            }
+            break;
+        }
+        if (input.eof) {
+            result = 0;
+            break;
+        }
+        if (input_fill() < 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return result;
+}
+
+/**
+ * @brief Reads a record for the read builtin
+ *
+ * When the shell takes its commands from stdin, a read of stdin takes the
+ * lines that follow the read command, as in other shells, straight from
+ * the command input buffer; like read_cmdline(), it waits in the event
+ * loop.  Other descriptors are left to read_record().  Either way, Ctrl-C
+ * gives up on the record.
+ *
+ * @return As read_record()
+ */
+int read_input(int fd, bool owned, const struct read_opts *opts, char *buf,
+               size_t size) {
+    if (fd != STDIN_FILENO || owned || !input.active) {
+        return read_record(fd, owned, opts, buf, size, &sigint_pending);
+    }
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    struct read_state state = {0};
+    int result = 0;
+    buf[0] = '\0';
+    while (!state.done) {
+        if (input.start < input.end) {
+            input.start += read_decode(&state, opts, input.buf + input.start,
+                                       input.end - input.start, buf, size);
+            continue;
+        }
+        if (input.eof) {
+            break;
+        }
+        if (sigint_pending || input_fill() < 0) {
+            errno = sigint_pending ? EINTR : errno;
+            result = -1;
+            break;
+        }
+    }
+    if (input.scanned < input.start) {
+        input.scanned = input.start;
     }
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return result < 0 ? result : state.any;
 }
 
 /*****************
@@ -482,51 +3678,114 @@ void builtincmd(parseline_return parse_result, struct cmdline_tokens token) {
  *****************/
 
 /**
- * @brief SIGCHLD signal handler
+ * @brief Reaps the next child that has exited or stopped, without blocking
  *
- * @param[in] sig The singal number
+ * @return The child's pid, or 0 (or -1) if there is none
  *
- * This function responds to SIGCHlD signal and reaps all terminated child
- * process and update the job list correspondingly
+ * With delay accounting on, the child is first looked at with WNOWAIT, so
+ * that its delays can be read while it is still a zombie.
  */
-void sigchld_handler(int sig) {
+static pid_t reap_next(int *status, struct rusage *ru,
+                       struct job_delays *delays) {
+    delays->valid = false;
+    if (!acct_enabled()) {
+        return wait4(-1, status, WNOHANG | WUNTRACED, ru);
+    }
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WNOHANG | WNOWAIT) < 0 ||
+        info.si_pid == 0) {
+        return 0;
+    }
+    if (info.si_code != CLD_STOPPED && info.si_code != CLD_TRAPPED) {
+        acct_collect(info.si_pid, delays);
+    }
+    return wait4(info.si_pid, status, WNOHANG | WUNTRACED, ru);
+}
+
+/**
+ * @brief Reaps the children that have exited or stopped, updating the job
+ * list and queueing each exit for the event loop
+ *
+ * Stops, leaving the rest for event_dispatch(), once the reap ring is
+ * full.  Async-signal-safe.
+ */
+static void reap_children(void) {
     sigset_t mask_all, prev_all;
     pid_t pid;
-    int olderrno = errno;
     jid_t jid;
     sigemptyset(&mask_all);
     sigaddset(&mask_all, SIGCHLD);
     sigaddset(&mask_all, SIGINT);
     sigaddset(&mask_all, SIGTSTP);
     int status;
+    struct rusage ru;
+    struct job_delays delays;
 
     sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-    while ((pid = waitpid(-1, &status, (WNOHANG | WUNTRACED))) > 0) {
+    while (true) {
+        if (reap_head - reap_tail >= REAP_RING_SIZE) {
+            reap_deferred = 1;
+            break;
+        }
+        if ((pid = reap_next(&status, &ru, &delays)) <= 0) {
+            break;
+        }
 
         jid = job_from_pid(pid);
 
         // if terminated abnormally, print out message
-        if (WIFSIGNALED(status) && jid != 0) {
+        if (WIFSIGNALED(status) && jid != 0 && !shutting_down) {
             int sig = WTERMSIG(status);
             sio_printf("Job [%d] (%d) terminated by signal %d\n", (int)jid,
                        (int)pid, sig);
         }
 
-        // if stopped, print out message and stop the process
-        if (WIFSTOPPED(status)) {
+        // if stopped, print out message and stop the process; a job
+        // stopped for preemption stays quietly Preempted, and the tasks
+        // of an array job are not jobs of their own
+        if (WIFSTOPPED(status) && jid != 0 && job_get_state(jid) != PR) {
             int sig = WSTOPSIG(status);
             sio_printf("Job [%d] (%d) stopped by signal %d\n", (int)jid,
                        (int)pid, sig);
             job_set_state(jid, ST);
         }
         if (!WIFSTOPPED(status)) {
+            if (job_get_state(jid) == FG) {
+                fg_status = status;
+            }
+            job_record_exit(jid, status, &ru, &delays);
             delete_job(jid);
+
+            // hand the exit over to the event loop
+            struct reap_event *ev = &reap_ring[reap_head % REAP_RING_SIZE];
+            ev->pid = pid;
+            ev->jid = jid;
+            ev->status = status;
+            reap_head++;
         }
     }
     sigprocmask(SIG_SETMASK, &prev_all, NULL);
+}
 
+/**
+ * @brief SIGCHLD signal handler
+ *
+ * @param[in] sig The singal number
+ *
+ * This function responds to SIGCHlD signal and reaps all terminated child
+ * process and update the job list correspondingly.  With delay accounting
+ * on, reading the delays may take a netlink round trip, which is left to
+ * event_dispatch() instead.
+ */
+void sigchld_handler(int sig) {
+    int olderrno = errno;
+    if (acct_enabled()) {
+        reap_deferred = 1;
+    } else {
+        reap_children();
+    }
     errno = olderrno;
-    return;
 }
 
 /**
@@ -535,7 +3794,9 @@ void sigchld_handler(int sig) {
  * @param[in] sig The singal number
  *
  * This function responds to SIGINT signal and send SIGINT to all foreground
- * porcesses in the foreground group
+ * porcesses in the foreground group.  With no foreground job, it records the
+ * interrupt so that a builtin waiting in the event loop can give up, unless
+ * trap ignores INT.  A trap on INT runs from the event loop either way.
  */
 void sigint_handler(int sig) {
 
@@ -551,8 +3812,13 @@ void sigint_handler(int sig) {
     jid = fg_job();
 
     if (jid) {
-        pid_t pid = job_get_pid(jid);
-        killpg(pid, SIGINT);
+        job_kill(jid, SIGINT);
+    } else if (trap_cmds[SIGINT] == NULL || trap_cmds[SIGINT][0] != '\0') {
+        sigint_pending = 1;
+    }
+    if (trap_cmds[SIGINT] != NULL && trap_cmds[SIGINT][0] != '\0') {
+        trap_pending[SIGINT] = 1;
+        traps_pending = 1;
     }
     sigprocmask(SIG_SETMASK, &prev_all, NULL);
 
@@ -581,8 +3847,7 @@ void sigtstp_handler(int sig) {
     jid = fg_job();
 
     if (jid) {
-        pid_t pid = job_get_pid(jid);
-        killpg(pid, SIGTSTP);
+        job_kill(jid, SIGTSTP);
     }
     sigprocmask(SIG_SETMASK, &prev_all, NULL);
 
@@ -603,4 +3868,5 @@ void cleanup(void) {
     Signal(SIGCHLD, SIG_DFL); // Handles terminated or stopped child
 
     destroy_job_list();
+    cgroup_cleanup();
 }
@@ -0,0 +1,48 @@
+/**
+ * @file check.h
+ * @brief Minimal assertions shared by the unit test drivers
+ *
+ * A failed check reports its file, line and expression and the driver
+ * carries on, so one run lists every failure.  main() ends with
+ * check_report(), whose value it returns.
+ */
+
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+#include <string.h>
+
+static int check_failures;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                    #cond);                                                  \
+            check_failures++;                                                \
+        }                                                                    \
+    } while (0)
+
+#define CHECK_STR(got, want)                                                 \
+    do {                                                                     \
+        const char *got_ = (got);                                            \
+        const char *want_ = (want);                                          \
+        if (got_ == NULL || strcmp(got_, want_) != 0) {                      \
+            fprintf(stderr, "%s:%d: %s is \"%s\", want \"%s\"\n", __FILE__, \
+                    __LINE__, #got, got_ != NULL ? got_ : "(null)", want_);  \
+            check_failures++;                                                \
+        }                                                                    \
+    } while (0)
+
+/* Prints the outcome of the driver; returns main()'s exit status */
+static int check_report(const char *name) {
+    if (check_failures > 0) {
+        printf("%s: %d check(s) FAILED\n", name, check_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif /* __CHECK_H__ */
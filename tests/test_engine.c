@@ -0,0 +1,149 @@
+/**
+ * @file test_engine.c
+ * @brief Tests of the libtsh job engine through its C API
+ *
+ * Runs real programs from /bin: foreground commands and their exit codes,
+ * redirections, background jobs reported through the engine's descriptor
+ * and callback, signals, stop and continue, and two engines side by side.
+ */
+
+#include "../tsh_engine.h"
+#include "check.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* What the completion callback saw */
+struct seen {
+    int calls;
+    tsh_jid jid;
+    int exit_code;
+};
+
+static void on_complete(tsh_engine *engine, const struct tsh_job_info *job,
+                        void *arg) {
+    struct seen *seen = arg;
+    seen->calls++;
+    seen->jid = job->jid;
+    seen->exit_code = job->exit_code;
+    CHECK(job->state == TSH_JOB_DONE);
+}
+
+static tsh_engine *new_engine(struct seen *seen) {
+    struct tsh_engine_options opts = {
+        .on_complete = on_complete,
+        .arg = seen,
+        .output_fd = open("/dev/null", O_WRONLY | O_CLOEXEC),
+        .forward_signals = false,
+    };
+    tsh_engine *engine = tsh_engine_create(&opts);
+    CHECK(engine != NULL);
+    return engine;
+}
+
+static void test_foreground(void) {
+    struct seen seen = {0};
+    tsh_engine *engine = new_engine(&seen);
+    int code = -2;
+
+    CHECK(tsh_engine_eval(engine, "/bin/true", NULL, &code) == 0);
+    CHECK(code == 0);
+    CHECK(tsh_engine_eval(engine, "/bin/sh -c 'exit 3'", NULL, &code) == 0);
+    CHECK(code == 3);
+    CHECK(seen.calls == 2 && seen.exit_code == 3);
+    CHECK(tsh_engine_eval(engine, "", NULL, &code) == 0);
+    CHECK(tsh_engine_eval(engine, "/no/such/program", NULL, &code) == -1);
+    // parseline() reports syntax errors on stderr
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    CHECK(tsh_engine_eval(engine, "/bin/echo 'open", NULL, &code) == -1);
+    dup2(saved, STDERR_FILENO);
+    close(null);
+    close(saved);
+    CHECK(tsh_engine_eval(engine, "quit", NULL, &code) == -1);
+    CHECK(tsh_engine_job_count(engine) == 0);
+
+    // Redirections
+    char path[] = "/tmp/tsh-test-engine.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    char line[64];
+    snprintf(line, sizeof(line), "/bin/echo hello > %s", path);
+    CHECK(tsh_engine_eval(engine, line, NULL, &code) == 0 && code == 0);
+    snprintf(line, sizeof(line), "/bin/grep -q hello < %s", path);
+    CHECK(tsh_engine_eval(engine, line, NULL, &code) == 0 && code == 0);
+    char buf[16] = {0};
+    CHECK(read(fd, buf, sizeof(buf)) == 6);
+    CHECK_STR(buf, "hello\n");
+    close(fd);
+    unlink(path);
+    CHECK(tsh_engine_eval(engine, "/bin/cat < /no/such/file", NULL, &code) ==
+          -1);
+
+    tsh_engine_destroy(engine);
+}
+
+static void test_background(void) {
+    struct seen seen = {0};
+    tsh_engine *engine = new_engine(&seen);
+
+    tsh_jid jid = 0;
+    CHECK(tsh_engine_eval(engine, "/bin/sh -c 'exit 7' &", &jid, NULL) == 0);
+    CHECK(jid > 0);
+    CHECK(tsh_engine_job_count(engine) == 1);
+    struct tsh_job_info info;
+    CHECK(tsh_engine_job(engine, jid, &info) && info.pid > 0);
+
+    // The engine's descriptor becomes readable once the job is done
+    struct pollfd pfd = {tsh_engine_fd(engine), POLLIN, 0};
+    CHECK(poll(&pfd, 1, 5000) == 1);
+    CHECK(tsh_engine_poll(engine, 0) == 1);
+    CHECK(seen.calls == 1 && seen.jid == jid && seen.exit_code == 7);
+    CHECK(tsh_engine_job_count(engine) == 0);
+    CHECK(!tsh_engine_job(engine, jid, &info));
+    CHECK(tsh_engine_wait(engine, jid) == -1);
+
+    // Signals, and stop and continue through bg
+    jid = tsh_engine_spawn(engine, "/bin/sleep 30");
+    CHECK(jid > 0);
+    CHECK(tsh_engine_spawn(engine, "jobs") == 0);
+    CHECK(tsh_engine_signal(engine, jid, SIGSTOP) == 0);
+    CHECK(tsh_engine_signal(engine, jid, SIGCONT) == 0);
+    CHECK(tsh_engine_eval(engine, "bg %1", NULL, NULL) == 0);
+    CHECK(tsh_engine_eval(engine, "bg %9", NULL, NULL) == -1);
+    CHECK(tsh_engine_signal(engine, jid, SIGTERM) == 0);
+    CHECK(tsh_engine_wait(engine, jid) == 128 + SIGTERM);
+    CHECK(tsh_engine_signal(engine, jid, SIGTERM) == -1);
+
+    // Jobs left running are killed and reaped with the engine
+    jid = tsh_engine_spawn(engine, "/bin/sleep 30");
+    CHECK(tsh_engine_job(engine, jid, &info));
+    tsh_engine_destroy(engine);
+    CHECK(kill(info.pid, 0) == -1);
+}
+
+static void test_two_engines(void) {
+    struct seen a_seen = {0}, b_seen = {0};
+    tsh_engine *a = new_engine(&a_seen);
+    tsh_engine *b = new_engine(&b_seen);
+    tsh_jid ja = tsh_engine_spawn(a, "/bin/sh -c 'exit 1'");
+    tsh_jid jb = tsh_engine_spawn(b, "/bin/sh -c 'exit 2'");
+    CHECK(ja == 1 && jb == 1);
+    CHECK(tsh_engine_wait(b, jb) == 2);
+    CHECK(tsh_engine_wait(a, ja) == 1);
+    CHECK(a_seen.calls == 1 && a_seen.exit_code == 1);
+    CHECK(b_seen.calls == 1 && b_seen.exit_code == 2);
+    tsh_engine_destroy(a);
+    tsh_engine_destroy(b);
+}
+
+int main(void) {
+    test_foreground();
+    test_background();
+    test_two_engines();
+    return check_report("test_engine");
+}
@@ -0,0 +1,52 @@
+/**
+ * @file test_engine_cpp.cpp
+ * @brief Tests of the C++ wrapper in tsh_engine.hpp
+ *
+ * Builds against libtsh.a as a C++ host would, and checks that callbacks
+ * of any callable type run, that the engine survives being moved, and that
+ * jobs still running are cleaned up when it goes out of scope.
+ */
+
+#include "../tsh_engine.hpp"
+#include "check.h"
+
+#include <csignal>
+#include <fcntl.h>
+#include <vector>
+
+int main() {
+    std::vector<int> codes;
+    pid_t leftover = 0;
+    {
+        int quiet = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        tsh::Engine engine(
+            [&codes](const tsh_job_info &job) {
+                codes.push_back(job.exit_code);
+            },
+            quiet);
+        CHECK(engine.run("/bin/true") == 0);
+        CHECK(engine.run("/bin/sh -c 'exit 4'") == 4);
+        CHECK(engine.run("/no/such/program") == -1);
+
+        tsh_jid jid = engine.spawn("/bin/sh -c 'exit 5'");
+        CHECK(jid > 0);
+        while (engine.job_count() > 0) {
+            engine.poll(-1);
+        }
+
+        tsh::Engine moved(std::move(engine));
+        CHECK(moved.get() != nullptr && engine.get() == nullptr);
+        jid = moved.spawn("/bin/sleep 30");
+        CHECK(moved.signal(jid, SIGTERM));
+        CHECK(moved.wait(jid) == 128 + SIGTERM);
+
+        jid = moved.spawn("/bin/sleep 30");
+        tsh_job_info info;
+        CHECK(tsh_engine_job(moved.get(), jid, &info));
+        leftover = info.pid;
+    }
+    CHECK(kill(leftover, 0) == -1);
+    CHECK((codes == std::vector<int>{0, 4, 5, 128 + SIGTERM}));
+
+    return check_report("test_engine_cpp");
+}
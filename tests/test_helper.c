@@ -0,0 +1,269 @@
+/**
+ * @file test_helper.c
+ * @brief Unit tests for the command line parser, the job list's pid hash
+ *        table and sio_snprintf()
+ *
+ * The pid table tests pick process IDs whose home slots collide at the end
+ * of the table, so that probe runs wrap around to slot 0, and check that
+ * backward-shift deletion leaves every remaining pid findable.  The pids
+ * are above any real pid_max, so no pidfd is ever opened for them.
+ */
+
+#include "../csapp.h"
+#include "../tsh_helper.h"
+#include "check.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*****************
+ * parseline
+ *****************/
+
+/* Parses cmdline with the parser's error messages sent to /dev/null */
+static parseline_return parse_quiet(const char *cmdline,
+                                    struct cmdline_tokens *token) {
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    parseline_return result = parseline(cmdline, token);
+    dup2(saved, STDERR_FILENO);
+    close(null);
+    close(saved);
+    return result;
+}
+
+static void test_parseline(void) {
+    struct cmdline_tokens t;
+
+    CHECK(parseline("", &t) == PARSELINE_EMPTY);
+    CHECK(parseline(" \t\n", &t) == PARSELINE_EMPTY);
+    CHECK(parseline("&", &t) == PARSELINE_EMPTY);
+
+    CHECK(parseline("/bin/echo a  b\n", &t) == PARSELINE_FG);
+    CHECK(t.argc == 3);
+    CHECK_STR(t.argv[0], "/bin/echo");
+    CHECK_STR(t.argv[2], "b");
+    CHECK(t.argv[3] == NULL);
+    CHECK(t.infile == NULL && t.outfile == NULL && t.bg_opts == NULL);
+    CHECK(t.builtin == BUILTIN_NONE);
+
+    CHECK(parseline("/bin/sleep 1 &", &t) == PARSELINE_BG);
+    CHECK(t.argc == 2 && t.argv[2] == NULL);
+
+    CHECK(parseline("cmd 'a b' \"c 'd'\" e", &t) == PARSELINE_FG);
+    CHECK(t.argc == 4);
+    CHECK_STR(t.argv[1], "a b");
+    CHECK_STR(t.argv[2], "c 'd'");
+
+    CHECK(parseline("cmd < in > out", &t) == PARSELINE_FG);
+    CHECK_STR(t.infile, "in");
+    CHECK_STR(t.outfile, "out");
+    CHECK(t.argc == 1);
+    CHECK(parseline("cmd <in >out arg", &t) == PARSELINE_FG);
+    CHECK_STR(t.infile, "in");
+    CHECK_STR(t.outfile, "out");
+    CHECK_STR(t.argv[1], "arg");
+
+    CHECK(parseline("@etl @nightly load.sh @notatag &", &t) == PARSELINE_BG);
+    CHECK(t.ntags == 2);
+    CHECK_STR(t.tags[0], "etl");
+    CHECK_STR(t.tags[1], "nightly");
+    CHECK(t.argc == 2);
+    CHECK_STR(t.argv[0], "load.sh");
+    CHECK_STR(t.argv[1], "@notatag");
+
+    CHECK(parseline("job &[prio=3,cpus=0-1]", &t) == PARSELINE_BG);
+    CHECK_STR(t.bg_opts, "prio=3,cpus=0-1");
+    CHECK(t.argc == 1 && t.argv[1] == NULL);
+
+    CHECK(parseline("jobs", &t) == PARSELINE_FG && t.builtin == BUILTIN_JOBS);
+    CHECK(parseline("fg %1", &t) == PARSELINE_FG && t.builtin == BUILTIN_FG);
+    CHECK(parseline("bg %1", &t) == PARSELINE_FG && t.builtin == BUILTIN_BG);
+    CHECK(parseline("quit", &t) == PARSELINE_FG &&
+          t.builtin == BUILTIN_QUIT);
+
+    CHECK(parse_quiet("cmd < a < b", &t) == PARSELINE_ERROR);
+    CHECK(parse_quiet("cmd > a > b", &t) == PARSELINE_ERROR);
+    CHECK(parse_quiet("cmd < > b", &t) == PARSELINE_ERROR);
+    CHECK(parse_quiet("cmd >", &t) == PARSELINE_ERROR);
+    CHECK(parse_quiet("cmd 'open", &t) == PARSELINE_ERROR);
+    CHECK(parse_quiet("@a @b @c @d @e cmd", &t) == PARSELINE_ERROR);
+
+    // MAXARGS - 1 arguments fit, with room for the NULL
+    char line[MAXLINE_TSH];
+    size_t len = 0;
+    for (int i = 0; i < MAXARGS - 1; i++) {
+        len += sio_snprintf(line + len, sizeof(line) - len, "a ");
+    }
+    CHECK(parseline(line, &t) == PARSELINE_FG);
+    CHECK(t.argc == MAXARGS - 1 && t.argv[MAXARGS - 1] == NULL);
+    sio_snprintf(line + len, sizeof(line) - len, "a");
+    CHECK(parse_quiet(line, &t) == PARSELINE_ERROR);
+
+    // Lines are cut at MAXLINE_TSH - 1 bytes
+    char *longer = malloc(2 * MAXLINE_TSH);
+    memset(longer, 'x', 2 * MAXLINE_TSH - 1);
+    longer[2 * MAXLINE_TSH - 1] = '\0';
+    CHECK(parseline(longer, &t) == PARSELINE_FG);
+    CHECK(t.argc == 1 && strlen(t.argv[0]) == MAXLINE_TSH - 1);
+    free(longer);
+}
+
+/*****************
+ * Pid hash table
+ *****************/
+
+/* Mirrors pid_hash() in tsh_helper.c */
+static size_t home_slot(pid_t pid) {
+    return (size_t)(((uint64_t)(uint32_t)pid * 0x9E3779B97F4A7C15ULL) >>
+                    32) &
+           63;
+}
+
+/* Fills pids[0..n) with fake pids whose home slot is slot */
+static void pids_at(size_t slot, pid_t *pids, int n, pid_t *next) {
+    for (int found = 0; found < n; (*next)++) {
+        if (home_slot(*next) == slot) {
+            pids[found++] = *next;
+        }
+    }
+}
+
+#define NPROBE 7
+
+static void test_pid_table(void) {
+    init_job_list();
+    pid_t next = 5000000;
+
+    // Three pids homed at 63 and two each at 62 and 0 fill slots 62 to 4:
+    // the probe run wraps past the end, with the homes interleaved
+    pid_t at63[3], at62[2], at0[2];
+    pids_at(63, at63, 3, &next);
+    pids_at(62, at62, 2, &next);
+    pids_at(0, at0, 2, &next);
+    pid_t pids[NPROBE] = {at63[0], at62[0], at0[0], at63[1],
+                          at62[1], at0[1],  at63[2]};
+    jid_t jids[NPROBE];
+    for (int i = 0; i < NPROBE; i++) {
+        jids[i] = add_job(pids[i], BG, "sleep");
+        CHECK(jids[i] == i + 1);
+    }
+    for (int i = 0; i < NPROBE; i++) {
+        CHECK(job_from_pid(pids[i]) == jids[i]);
+    }
+
+    // Delete from the front of the run, where every later entry is a
+    // candidate for shifting back across the wraparound
+    int order[NPROBE] = {1, 0, 3, 5, 2, 6, 4};
+    bool gone[NPROBE] = {false};
+    for (int k = 0; k < NPROBE; k++) {
+        int d = order[k];
+        CHECK(delete_job(jids[d]));
+        gone[d] = true;
+        for (int i = 0; i < NPROBE; i++) {
+            CHECK(job_from_pid(pids[i]) == (gone[i] ? 0 : jids[i]));
+        }
+    }
+    CHECK(!delete_job(jids[0]));
+    CHECK(job_count_state(BG) == 0);
+
+    // Reinsert after the deletions, then churn against a model
+    srand(1);
+    pid_t live[32] = {0};
+    jid_t live_jid[32] = {0};
+    for (int step = 0; step < 5000; step++) {
+        int i = rand() % 32;
+        if (live[i] == 0) {
+            pid_t pid = 5000000 + (pid_t)(rand() % 4096);
+            if (job_from_pid(pid) != 0) {
+                continue;
+            }
+            live_jid[i] = add_job(pid, BG, "churn");
+            CHECK(live_jid[i] != 0);
+            live[i] = pid;
+        } else {
+            CHECK(delete_job(live_jid[i]));
+            CHECK(job_from_pid(live[i]) == 0);
+            live[i] = 0;
+        }
+        for (int j = 0; j < 32; j++) {
+            if (live[j] != 0) {
+                CHECK(job_from_pid(live[j]) == live_jid[j]);
+            }
+        }
+    }
+    destroy_job_list();
+}
+
+/*****************
+ * sio_snprintf
+ *****************/
+
+/* Formats with sio_snprintf() and snprintf() and compares the results */
+__attribute__((format(printf, 2, 3))) static void
+check_format(int line, const char *fmt, ...) {
+    char got[256];
+    char want[256];
+    va_list args, copy;
+    va_start(args, fmt);
+    va_copy(copy, args);
+    size_t got_len = sio_vsnprintf(got, sizeof(got), fmt, args);
+    int want_len = vsnprintf(want, sizeof(want), fmt, copy);
+    va_end(copy);
+    va_end(args);
+    if (strcmp(got, want) != 0 || got_len != (size_t)want_len) {
+        fprintf(stderr, "%s:%d: \"%s\" gives \"%s\" (%zu), want \"%s\" (%d)\n",
+                __FILE__, line, fmt, got, got_len, want, want_len);
+        check_failures++;
+    }
+}
+
+#define CHECK_FORMAT(...) check_format(__LINE__, __VA_ARGS__)
+
+static void test_snprintf(void) {
+    CHECK_FORMAT("plain");
+    CHECK_FORMAT("%d %i %d", 0, -5, INT_MIN);
+    CHECK_FORMAT("[%5d|%-5d|%05d|%05d]", 42, 42, -42, 42);
+    CHECK_FORMAT("[%+d|% d|%+d|% 5d]", 7, 7, -7, 7);
+    CHECK_FORMAT("[%.3d|%8.3d|%-8.3d|%.3u]", 7, -7, 7, 7u);
+    CHECK_FORMAT("[%.0d|%5.0d|%.0x|%.0d]", 0, 0, 0u, 1);
+    CHECK_FORMAT("[%x|%X|%o|%o]", 255, 255, 8, 0);
+    CHECK_FORMAT("[%u|%u]", 0u, UINT_MAX);
+    CHECK_FORMAT("[%hhd|%hhu|%hd|%hu]", 300, 300, 70000, 70000);
+    CHECK_FORMAT("[%ld|%lu|%lx]", LONG_MIN, ULONG_MAX, ULONG_MAX);
+    CHECK_FORMAT("[%lld|%llu]", LLONG_MIN, ULLONG_MAX);
+    CHECK_FORMAT("[%zu|%zd|%zx]", SIZE_MAX, (ssize_t)-1, (size_t)4096);
+    CHECK_FORMAT("[%jd|%ju]", INTMAX_MIN, UINTMAX_MAX);
+    CHECK_FORMAT("[%td]", (ptrdiff_t)-12345);
+    CHECK_FORMAT("[%s|%.2s|%-6s|%6.2s|%.0s]", "abc", "abc", "ab", "abc",
+                 "abc");
+    CHECK_FORMAT("[%c|%3c|%-3c]", 'x', 'y', 'z');
+    CHECK_FORMAT("[%*d|%-*d|%*d]", 6, 1, 6, 2, -6, 3);
+    CHECK_FORMAT("[%.*s|%.*d]", 3, "abcdef", 4, 5);
+    CHECK_FORMAT("100%%");
+    CHECK_FORMAT("%p", (void *)0x1234);
+
+    // Truncation keeps the buffer terminated and reports the full length
+    char buf[8];
+    CHECK(sio_snprintf(buf, 5, "hello %s", "world") == 11);
+    CHECK_STR(buf, "hell");
+    memset(buf, 'z', sizeof(buf));
+    CHECK(sio_snprintf(buf, 0, "%d", 12345) == 5);
+    CHECK(buf[0] == 'z');
+    CHECK(sio_snprintf(buf, 1, "%d", 12345) == 5);
+    CHECK_STR(buf, "");
+    CHECK(sio_snprintf(buf, sizeof(buf), "%7d", -1) == 7);
+    CHECK_STR(buf, "     -1");
+}
+
+int main(void) {
+    test_parseline();
+    test_pid_table();
+    test_snprintf();
+    return check_report("test_helper");
+}
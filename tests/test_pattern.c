@@ -0,0 +1,144 @@
+/**
+ * @file test_pattern.c
+ * @brief Unit tests for the compiled glob matcher
+ *
+ * Fixed cases cover the syntax in tsh_pattern.h, including patterns with
+ * more states than fit in one machine word.  Random patterns over a small
+ * alphabet are then checked against fnmatch(3), which agrees with
+ * tsh_pattern on everything but classes.
+ */
+
+#include "../tsh_pattern.h"
+#include "check.h"
+
+#include <fnmatch.h>
+#include <stdlib.h>
+
+struct match_case {
+    const char *pattern;
+    const char *text;
+    bool match;
+};
+
+static const struct match_case cases[] = {
+    {"", "", true},
+    {"", "a", false},
+    {"sleep", "sleep", true},
+    {"sleep", "sleeps", false},
+    {"sleep", "slee", false},
+    {"*", "", true},
+    {"*", "anything at all", true},
+    {"**", "x", true},
+    {"?", "", false},
+    {"?", "x", true},
+    {"??", "x", false},
+    {"*.c", "src/tsh_pattern.c", true},
+    {"*.c", "tsh_pattern.h", false},
+    {"*sleep 3*", "@build make && sleep 30 &", true},
+    {"a*b*c", "abc", true},
+    {"a*b*c", "aXbYc", true},
+    {"a*b*c", "acb", false},
+    {"a*a*a*a*b", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", false},
+    {"a*a*a*a*b", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaab", true},
+    {"[abc]", "b", true},
+    {"[abc]", "d", false},
+    {"[a-z]*[0-9]", "worker7", true},
+    {"[a-z]*[0-9]", "Worker7", false},
+    {"[!a-z]", "A", true},
+    {"[!a-z]", "q", false},
+    {"[^0-9]x", "ax", true},
+    {"[^0-9]x", "5x", false},
+    {"[]]", "]", true},
+    {"[!]]", "]", false},
+    {"[a-]", "-", true},
+    {"[", "[", true},
+    {"a[b", "a[b", true},
+    {"\\*", "*", true},
+    {"\\*", "x", false},
+    {"\\?x", "?x", true},
+    {"a\\", "a\\", true},
+    {"*/", "dir/", true},
+    {".*", ".hidden", true},
+};
+
+/* A pattern and text longer than one word of automaton state */
+static void test_long(void) {
+    char pattern[201];
+    char text[201];
+    for (int i = 0; i < 200; i++) {
+        pattern[i] = (i % 3 == 0) ? '?' : 'x';
+        text[i] = 'x';
+    }
+    pattern[200] = text[200] = '\0';
+    CHECK(pattern_matches(pattern, text));
+    text[199] = 'y';
+    CHECK(!pattern_matches(pattern, text));
+    text[199] = '\0';
+    CHECK(!pattern_matches(pattern, text));
+
+    pattern[0] = '*';
+    pattern[199] = 'y';
+    text[199] = 'y';
+    text[150] = '\0';
+    CHECK(!pattern_matches(pattern, text));
+}
+
+static void random_string(char *buf, int maxlen, const char *alphabet) {
+    int len = rand() % (maxlen + 1);
+    size_t n = strlen(alphabet);
+    for (int i = 0; i < len; i++) {
+        buf[i] = alphabet[rand() % n];
+    }
+    buf[len] = '\0';
+}
+
+static void test_random(void) {
+    srand(1);
+    char pattern[16];
+    char text[16];
+    for (int i = 0; i < 20000; i++) {
+        random_string(pattern, 10, "ab*?");
+        random_string(text, 12, "ab");
+        bool want = fnmatch(pattern, text, 0) == 0;
+        if (pattern_matches(pattern, text) != want) {
+            fprintf(stderr, "%s: \"%s\" against \"%s\" should be %s\n",
+                    __FILE__, pattern, text, want ? "true" : "false");
+            check_failures++;
+        }
+    }
+}
+
+static void test_cache(void) {
+    size_t compiled, hits, compiled2, hits2;
+    struct pattern *p = pattern_compile("cache-*-test");
+    CHECK(p != NULL);
+    pattern_stats(&compiled, &hits);
+    CHECK(pattern_compile("cache-*-test") == p);
+    pattern_stats(&compiled2, &hits2);
+    CHECK(compiled2 == compiled && hits2 == hits + 1);
+    CHECK(pattern_match(p, "cache-1-test"));
+
+    // A full cache evicts, but a pattern still compiles and matches
+    char name[32];
+    for (int i = 0; i < 2 * PATTERN_CACHE_SIZE; i++) {
+        snprintf(name, sizeof(name), "filler%d*", i);
+        CHECK(pattern_matches(name, name));
+    }
+    CHECK(pattern_matches("cache-*-test", "cache--test"));
+}
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const struct match_case *c = &cases[i];
+        struct pattern *p = pattern_compile(c->pattern);
+        if (p == NULL || pattern_match(p, c->text) != c->match) {
+            fprintf(stderr, "%s: \"%s\" against \"%s\" should be %s\n",
+                    __FILE__, c->pattern, c->text, c->match ? "true" : "false");
+            check_failures++;
+        }
+    }
+    test_long();
+    test_random();
+    test_cache();
+    return check_report("test_pattern");
+}
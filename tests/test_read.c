@@ -0,0 +1,218 @@
+/**
+ * @file test_read.c
+ * @brief Unit tests for record decoding and buffered record input
+ *
+ * read_decode() is fed records split across chunks at every position,
+ * with and without escapes.  read_record() is run on pipes and regular
+ * files, owned and shared, checking that a shared descriptor is never
+ * left past the records the caller consumed once read_sync() has run.
+ */
+
+#include "../tsh_read.h"
+#include "check.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const struct read_opts lines = {.delim = '\n', .max = 0, .raw = false};
+static const struct read_opts raw_lines = {.delim = '\n', .max = 0,
+                                           .raw = true};
+
+/*
+ * Decodes the first record of data, fed in two chunks split at split.
+ * Returns the bytes consumed.
+ */
+static size_t decode_split(const struct read_opts *opts, const char *data,
+                           size_t split, char *buf, size_t size) {
+    struct read_state state = {0};
+    size_t len = strlen(data);
+    size_t used = read_decode(&state, opts, data, split, buf, size);
+    if (!state.done) {
+        used += read_decode(&state, opts, data + split, len - split, buf,
+                            size);
+    }
+    return used;
+}
+
+static void test_decode(void) {
+    char buf[64];
+    struct read_state state = {0};
+
+    CHECK(read_decode(&state, &raw_lines, "one\ntwo\n", 8, buf, 64) == 4);
+    CHECK_STR(buf, "one");
+    CHECK(state.done && state.any && state.len == 3);
+
+    // Every split of the input gives the same record
+    const char *escaped = "a\\tb\\\\c\\\nd\ne";
+    for (size_t split = 0; split <= strlen(escaped); split++) {
+        CHECK(decode_split(&lines, escaped, split, buf, 64) == 11);
+        CHECK_STR(buf, "atb\\cd");
+        CHECK(decode_split(&raw_lines, escaped, split, buf, 64) == 9);
+        CHECK_STR(buf, "a\\tb\\\\c\\");
+    }
+
+    // No delimiter: the record takes everything and is not done
+    memset(&state, 0, sizeof(state));
+    CHECK(read_decode(&state, &lines, "partial", 7, buf, 64) == 7);
+    CHECK(!state.done && state.any);
+    CHECK_STR(buf, "partial");
+
+    // An empty record still counts, and empty input does not
+    memset(&state, 0, sizeof(state));
+    CHECK(read_decode(&state, &lines, "\n", 1, buf, 64) == 1);
+    CHECK(state.done && state.any && buf[0] == '\0');
+    memset(&state, 0, sizeof(state));
+    CHECK(read_decode(&state, &lines, "", 0, buf, 64) == 0);
+    CHECK(!state.any);
+
+    // -n and the buffer size both end the record early
+    struct read_opts max3 = {.delim = '\n', .max = 3, .raw = true};
+    memset(&state, 0, sizeof(state));
+    CHECK(read_decode(&state, &max3, "abcdef\n", 7, buf, 64) == 3);
+    CHECK(state.done);
+    CHECK_STR(buf, "abc");
+    memset(&state, 0, sizeof(state));
+    CHECK(read_decode(&state, &lines, "abcdef\n", 7, buf, 4) == 3);
+    CHECK(state.done);
+    CHECK_STR(buf, "abc");
+
+    // Other delimiters, including NUL
+    struct read_opts colon = {.delim = ':', .max = 0, .raw = false};
+    memset(&state, 0, sizeof(state));
+    CHECK(read_decode(&state, &colon, "a\nb:c", 5, buf, 64) == 4);
+    CHECK_STR(buf, "a\nb");
+    struct read_opts nul = {.delim = '\0', .max = 0, .raw = true};
+    memset(&state, 0, sizeof(state));
+    CHECK(read_decode(&state, &nul, "x y\0z", 5, buf, 64) == 4);
+    CHECK_STR(buf, "x y");
+}
+
+/* Writes data to a new temporary file and returns it open for reading */
+static int temp_file(const char *data, size_t len) {
+    char path[] = "/tmp/tsh-test-read.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(path);
+    if (write(fd, data, len) != (ssize_t)len) {
+        perror("write");
+        exit(1);
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+static void test_shared_pipe(void) {
+    int p[2];
+    CHECK(pipe(p) == 0);
+    CHECK(write(p[1], "one\ntwo\n", 8) == 8);
+    close(p[1]);
+
+    // A shared pipe is read a byte at a time: the rest stays in the pipe
+    char buf[64];
+    CHECK(read_record(p[0], false, &lines, buf, sizeof(buf), NULL) == 1);
+    CHECK_STR(buf, "one");
+    read_sync();
+    char rest[16] = {0};
+    CHECK(read(p[0], rest, sizeof(rest)) == 4);
+    CHECK_STR(rest, "two\n");
+    CHECK(read_record(p[0], false, &lines, buf, sizeof(buf), NULL) == 0);
+    read_sync();
+    close(p[0]);
+}
+
+static void test_shared_file(void) {
+    int fd = temp_file("one\ntwo\nthree", 13);
+    char buf[64];
+    CHECK(read_record(fd, false, &lines, buf, sizeof(buf), NULL) == 1);
+    CHECK_STR(buf, "one");
+    CHECK(read_record(fd, false, &lines, buf, sizeof(buf), NULL) == 1);
+    CHECK_STR(buf, "two");
+
+    // read_sync() hands back the read-ahead
+    read_sync();
+    CHECK(lseek(fd, 0, SEEK_CUR) == 8);
+    char rest[16] = {0};
+    CHECK(read(fd, rest, sizeof(rest)) == 5);
+    CHECK_STR(rest, "three");
+
+    // After something else moved the offset, reading starts there
+    lseek(fd, 4, SEEK_SET);
+    CHECK(read_record(fd, false, &lines, buf, sizeof(buf), NULL) == 1);
+    CHECK_STR(buf, "two");
+    CHECK(read_record(fd, false, &lines, buf, sizeof(buf), NULL) == 1);
+    CHECK_STR(buf, "three");
+    CHECK(read_record(fd, false, &lines, buf, sizeof(buf), NULL) == 0);
+    read_sync();
+    CHECK(lseek(fd, 0, SEEK_CUR) == 13);
+    close(fd);
+}
+
+static void test_owned(void) {
+    // Records longer than the buffer are split; a record may span blocks
+    size_t len = READ_BLOCK_SIZE + 100;
+    char *data = malloc(len);
+    memset(data, 'x', len);
+    data[10] = '\n';
+    data[READ_BLOCK_SIZE + 5] = '\n';
+    data[len - 1] = 'y';
+    int fd = temp_file(data, len);
+    free(data);
+
+    char *buf = malloc(READ_BLOCK_SIZE);
+    CHECK(read_record(fd, true, &raw_lines, buf, 64, NULL) == 1);
+    CHECK(strlen(buf) == 10);
+    size_t total = 0;
+    int records = 0;
+    char last = '\0';
+    while (read_record(fd, true, &raw_lines, buf, 1000, NULL) == 1) {
+        total += strlen(buf);
+        records++;
+        last = buf[0] != '\0' ? buf[strlen(buf) - 1] : last;
+    }
+    CHECK(total == len - 12);
+    CHECK(records > 2);
+    CHECK(last == 'y');
+
+    // Owned descriptors keep their buffer across read_sync()
+    lseek(fd, 0, SEEK_SET);
+    read_forget(fd);
+    CHECK(read_record(fd, true, &raw_lines, buf, 64, NULL) == 1);
+    read_sync();
+    CHECK(read_record(fd, true, &raw_lines, buf, READ_BLOCK_SIZE, NULL) ==
+          1);
+    CHECK(strlen(buf) == READ_BLOCK_SIZE + 5 - 11);
+    read_forget(fd);
+    close(fd);
+    free(buf);
+}
+
+static void test_stop(void) {
+    int p[2];
+    CHECK(pipe(p) == 0);
+    CHECK(write(p[1], "x\n", 2) == 2);
+    volatile sig_atomic_t stop = 1;
+    char buf[8];
+    errno = 0;
+    CHECK(read_record(p[0], false, &lines, buf, sizeof(buf), &stop) == -1);
+    CHECK(errno == EINTR);
+    stop = 0;
+    CHECK(read_record(p[0], false, &lines, buf, sizeof(buf), &stop) == 1);
+    CHECK_STR(buf, "x");
+    read_sync();
+    close(p[0]);
+    close(p[1]);
+}
+
+int main(void) {
+    test_decode();
+    test_shared_pipe();
+    test_shared_file();
+    test_owned();
+    test_stop();
+    return check_report("test_read");
+}
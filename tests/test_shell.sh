@@ -0,0 +1,364 @@
+#!/bin/sh
+# End-to-end tests of the builtins in a running shell
+#
+# Usage: tests/test_shell.sh [path/to/tsh]
+#
+# The read cases feed the shell its commands on stdin, so read takes its
+# records from the shell's own command input (read_input()) and the next
+# command must start exactly where the record ended.  Most other cases
+# feed it a session the same way and compare what it printed, with pids
+# replaced by PID; lines whose order depends on when jobs are reaped are
+# counted rather than compared.
+
+tsh=${1:-./tsh}
+failures=0
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# check NAME WANT GOT
+check() {
+    if [ "$3" != "$2" ]; then
+        printf '%s: got "%s", want "%s"\n' "$1" "$3" "$2" >&2
+        failures=$((failures + 1))
+    fi
+}
+
+got=$(printf 'read X\nhello world\n/usr/bin/printenv X\n' | "$tsh" -p)
+check "read from command input" "hello world" "$got"
+
+got=$(printf 'read -r Y\na\\b\nread Z\nc\\d\\\ne\n/usr/bin/printenv Y Z\n' |
+      "$tsh" -p)
+check "read -r and escapes" "a\\b
+cde" "$got"
+
+got=$(printf 'read -d : A\nx:/usr/bin/printenv A\n' | "$tsh" -p)
+check "read -d leaves the rest of the line" "x" "$got"
+
+got=$(printf 'read -n 3 B\nabc/usr/bin/printenv B\n' | "$tsh" -p)
+check "read -n leaves the rest of the line" "abc" "$got"
+
+got=$("$tsh" -c 'read Z || /bin/echo eof' < /dev/null)
+check "read status at end of input" "eof" "$got"
+
+printf 'one\ntwo\nthree' > "$tmp/records"
+got=$("$tsh" -c "read R < $tmp/records : /bin/echo got \$R")
+check "read loop over a file" "got one
+got two
+got three" "$got"
+
+got=$("$tsh" -c 'read -u 3 V : /bin/echo fd $V' 3< "$tmp/records")
+check "read loop over -u fd" "fd one
+fd two
+fd three" "$got"
+
+got=$(cat "$tmp/records" | "$tsh" -c 'read -d o W : /bin/echo [$W]')
+check "read loop over a pipe with -d" "[]
+[ne tw]
+[ three]" "$got"
+
+got=$("$tsh" -c 'match -p sleep30 "*.c" "sleep*" && /bin/echo yes')
+check "match -p" "sleep*
+yes" "$got"
+
+got=$("$tsh" -c 'match foo "b*" "?" || /bin/echo no')
+check "match failure" "no" "$got"
+
+# cache: hits, piped stdin, and a capture stopped before it finished
+export TSH_CACHE_DIR="$tmp/cache"
+got=$("$tsh" -c 'cache /bin/echo hi ; cache /bin/echo hi ; cache stats' \
+      < /dev/null | grep -e '^hi$' -e hits)
+check "cache hit" "hi
+hi
+  hits         1 (50%)" "$got"
+
+got=$(echo piped | "$tsh" -c 'cache /bin/cat')
+check "cache runs piped stdin uncached" \
+      "cache: stdin is not a terminal or /dev/null; running uncached
+piped" "$got"
+
+stop="/bin/sh -c 'kill -STOP \$\$; /bin/echo late'"
+got=$("$tsh" -c "cache $stop ; /bin/echo between ; fg %1 ; cache $stop" \
+      < /dev/null)
+check "cache keeps a stopped capture" "Job [1] stopped by signal 19
+between
+late
+late" "$(echo "$got" | sed 's/([0-9]*) //')"
+check "cache scratch files" "0" "$(ls "$tmp/cache" | grep -c '^tmp\.')"
+unset TSH_CACHE_DIR
+
+# needs: enough files to go through the ring, and too few to
+for f in a b c d e; do
+    touch -d '2020-01-01' "$tmp/in.$f"
+done
+touch -d '2021-01-01' "$tmp/out"
+ins="$tmp/in.a $tmp/in.b $tmp/in.c $tmp/in.d $tmp/in.e"
+got=$("$tsh" -c "needs $ins -> $tmp/out : /bin/echo ran ; \
+                 needs $tmp/in.a -> $tmp/out : /bin/echo ran" < /dev/null)
+check "needs with outputs up to date" "" "$got"
+touch "$tmp/in.e"
+got=$("$tsh" -c "needs $ins -> $tmp/out : /bin/echo ran ; \
+                 needs $tmp/in.e -> $tmp/out : /bin/echo ran" < /dev/null)
+check "needs with a newer input" "ran
+ran" "$got"
+got=$("$tsh" -c "needs $ins -> $tmp/out $tmp/none : /bin/echo ran" \
+      < /dev/null)
+check "needs with a missing output" "ran" "$got"
+
+# retry: attempts, their statuses, and option parsing
+got=$("$tsh" -c "retry -n 2 --backoff 1ms /bin/sh -c 'exit 3' ; retry -l ; \
+                 jobs -l" < /dev/null | grep -e gave -e statuses -e Exit |
+      sed 's/(.*) Exit 3 .* attempt/attempt/; s/: retry.*//')
+check "retry attempts in the history" \
+      "retry: gave up after 2 attempts (status 3)
+    statuses: 3 3
+[1] attempt 1/2
+[1] attempt 2/2" "$got"
+
+got=$("$tsh" -c 'retry -n 3x /bin/true ; retry -n 0 /bin/true' < /dev/null)
+check "retry -n parsing" "retry: -n must be a positive count
+retry: -n must be a positive count" "$got"
+
+got=$("$tsh" -c "retry --on 4 --backoff 1ms /bin/sh -c 'exit 3'" < /dev/null)
+check "retry --on skips other statuses" \
+      "retry: gave up after 1 attempt (status 3): retry --on 4 --backoff 1ms \
+/bin/sh -c 'exit 3'" "$got"
+
+# pin: a pinned program keeps running the file that was pinned
+cp /bin/echo "$tmp/prog"
+cp /bin/false "$tmp/false"
+got=$(printf '%s\n' "pin $tmp/prog" "$tmp/prog one" "pin" \
+             "/bin/mv $tmp/false $tmp/prog" "$tmp/prog two" "pin -r" \
+             "$tmp/prog three" "pin -u $tmp/prog" "pin -u $tmp/prog" "pin" |
+      "$tsh" -p)
+check "pin" "one
+       1 $tmp/prog
+two
+pin: $tmp/prog changed
+pin: $tmp/prog is not pinned" "$got"
+
+# kill: selectors by state, ranges, and bad signals
+got=$(printf '%s\n' "/bin/sleep 30 &" "/bin/sleep 30 &" "/bin/sleep 30 &" \
+             "kill -STOP %2" "/bin/sleep 0.2" "kill --state=stopped --all" \
+             "/bin/sleep 0.2" "jobs" "kill %1-%3" "wait" "jobs" \
+             "kill -FOO %1" | "$tsh" -p | sed 's/([0-9]*)/(PID)/')
+check "kill selectors" "[1] (PID) /bin/sleep 30 &
+[2] (PID) /bin/sleep 30 &
+[3] (PID) /bin/sleep 30 &
+Job [2] (PID) stopped by signal 19
+Job [2] (PID) terminated by signal 15
+[1] (PID) Running /bin/sleep 30 &
+[3] (PID) Running /bin/sleep 30 &
+Job [1] (PID) terminated by signal 15
+Job [3] (PID) terminated by signal 15
+kill: FOO: invalid signal" "$got"
+
+# Shutdown: wait, terminate with a grace period, and detach
+got=$(printf '%s\n' "/bin/sleep 0.1 &" "quit bogus" "quit wait" |
+      "$tsh" -p | sed 's/([0-9]*)/(PID)/')
+check "quit wait" "[1] (PID) /bin/sleep 0.1 &
+quit: bogus: policy must be wait[=TIME], terminate[=TIME] or detach
+[1] (PID) /bin/sleep 0.1 &: exited with status 0" "$got"
+
+stubborn="/bin/sh -c 'trap \"\" TERM HUP; /bin/sleep 30' &"
+start=$(date +%s)
+got=$(printf '%s\n' "$stubborn" "/bin/sleep 0.2" "quit terminate=0.3s" |
+      "$tsh" -p | sed -n '2s/.*: //p')
+check "quit terminate kills after the grace period" "killed by signal 9" \
+      "$got"
+check "quit terminate is bounded" "yes" \
+      "$([ $(($(date +%s) - start)) -lt 5 ] && echo yes)"
+
+# (into a file: the detached job keeps the shell's stdout open)
+printf '/bin/sleep 30 &\n' | TSH_SHUTDOWN=detach "$tsh" -p > "$tmp/detach"
+got=$(cat "$tmp/detach")
+pid=$(echo "$got" | sed -n '1s/.*(\([0-9]*\)).*/\1/p')
+check "EOF with TSH_SHUTDOWN=detach" "detached alive" \
+      "$(echo "$got" | sed -n '$s/.*: //p') $(kill "$pid" && echo alive)"
+
+# Scheduler: a fixed limit, parallel, and the adaptive controller
+got=$(printf '%s\n' "sched -j 1" "/bin/sleep 0.3 &" "/bin/true &" \
+             "/bin/true &" "jobs" "wait" "sched -j 0" |
+      "$tsh" -p | sed 's/([0-9]*)/(PID)/')
+check "sched -j queues background jobs" "[1] (PID) /bin/sleep 0.3 &
+[2] (pending) /bin/true &
+[3] (pending) /bin/true &
+[1] (PID) Running /bin/sleep 0.3 &
+[2] (PID) Pending #1 /bin/true &
+[3] (PID) Pending #2 /bin/true &
+[2] (PID) /bin/true &
+[3] (PID) /bin/true &
+sched: 0: limit must be 1..1024, auto or off" "$got"
+
+got=$("$tsh" -c 'parallel -j 2 /usr/bin/test {} = 1 ::: 1 2 3' < /dev/null)
+check "parallel counts failures" "parallel: 2 of 3 jobs failed" "$got"
+
+got=$(printf '%s\n' "sched -j auto" "sched -t $tmp/trace" "/bin/sleep 0.7 &" \
+             "wait" "sched -t off" "sched" | "$tsh" -p |
+      grep -c '^bg: limit [0-9]* (auto, ')
+check "sched -j auto" "1" "$got"
+check "sched -t traces the controller" "yes" \
+      "$(grep -q '^[0-9]* bg limit=[0-9]* running=1 ' "$tmp/trace" &&
+         echo yes)"
+
+# Scheduling policies: the order in which pending jobs start
+started() {
+    "$tsh" -p | sed -n 's/^\[\([0-9]*\)\] ([0-9]*) \/bin\/true .*/\1/p' |
+        tr '\n' ' '
+}
+got=$(printf '%s\n' "sched -j 1 -p prio" "/bin/sleep 0.3 &" \
+             "/bin/true &[prio=1]" "/bin/true &[prio=5]" \
+             "/bin/true &[prio=3]" "wait" | started)
+check "sched -p prio" "3 4 2 " "$got"
+got=$(printf '%s\n' "sched -j 1 -p edf" "/bin/sleep 0.3 &" \
+             "/bin/true &[deadline=10s]" "/bin/true &" \
+             "/bin/true &[deadline=1s]" "wait" | started)
+check "sched -p edf" "4 2 3 " "$got"
+got=$(printf '%s\n' "sched -j 1 -p fair" "/bin/sleep 0.3 &" \
+             "/bin/true &[group=a]" "/bin/true &[group=a]" \
+             "/bin/true &[group=b,weight=2]" "wait" | started)
+check "sched -p fair" "4 2 3 " "$got"
+got=$(printf '%s\n' "sched -j 1 -p prio" "/bin/sleep 0.3 &" \
+             "/bin/true &[prio=2]" "jobs" "sched -p lifo" "kill %2" |
+      "$tsh" -p | sed -n '/Pending/s/.*) //p; /lifo/p')
+check "pending jobs show their place" "Pending #1 prio=2 /bin/true &[prio=2]
+sched: lifo: policy must be fifo, prio, fair or edf" "$got"
+
+# Declared resources: packing into the budget, and jobs that never fit
+got=$(printf '%s\n' "sched -b cpu=2,mem=1G" "sched" "/bin/sleep 0.3 &[cpu=2]" \
+             "/bin/true &[cpu=1]" "/bin/true &[mem=512M]" "/bin/true &[cpu=4]" \
+             "jobs" "wait" "sched -b cpu=x" | "$tsh" -p |
+      sed 's/([0-9]*)/(PID)/; s/; limits .*//' |
+      grep -v -e '^bg: no limit' -e '^parallel:' -e '^\[3\] (PID) Running')
+check "sched -b packs declared jobs" "  declared: cpu 0 of 2, mem 0B of 1G
+[1] (PID) /bin/sleep 0.3 &[cpu=2]
+[2] (pending) /bin/true &[cpu=1]
+[3] (PID) /bin/true &[mem=512M]
+bg: job needs 4 CPUs, more than the budget of 2
+[1] (PID) Running /bin/sleep 0.3 &[cpu=2]
+[2] (PID) Pending #1 cpu=1 mem=- /bin/true &[cpu=1]
+[2] (PID) /bin/true &[cpu=1]
+sched: cpu=x: budget must be cpu=N,mem=SIZE or host" "$got"
+
+# Preemption: a foreground job stops the background jobs below its prio;
+# the foreground command lists the states of the shell's children
+states='/usr/bin/ps -o stat= --ppid $PPID | /usr/bin/sort | /usr/bin/tr -d "\n"'
+states="/bin/sh -c '/bin/sleep 0.2; $states'"
+got=$(printf '%s\n' "sched -f 5" "/bin/sleep 2 &[prio=1]" \
+             "/bin/sleep 2 &[prio=9]" "$states" "/bin/echo" "sched -f all" \
+             "$states" "/bin/echo" "jobs" "kill %1 %2" | "$tsh" -p |
+      sed 's/([0-9]*)/(PID)/' | grep -v -e '^\[.\] (PID) /' -e '^Job')
+check "sched -f preempts background jobs" "SST
+STT
+[1] (PID) Running /bin/sleep 2 &[prio=1]
+[2] (PID) Running /bin/sleep 2 &[prio=9]" "$got"
+
+# Tags: selecting, signalling and waiting for the jobs under a tag (the
+# order in which the jobs are reaped varies, so their exits are counted)
+got=$(printf '%s\n' "@web /bin/sleep 30 &" "@web @db /bin/sleep 30 &" \
+             "@db /bin/sleep 30 &" "jobs @db" "kill @web" "wait @web" "jobs" \
+             "jobs @web" "kill @db" "wait" | "$tsh" -p |
+      sed 's/([0-9]*)/(PID)/')
+check "tags" "[1] (PID) @web /bin/sleep 30 &
+[2] (PID) @web @db /bin/sleep 30 &
+[3] (PID) @db /bin/sleep 30 &
+[2] (PID) Running @web @db /bin/sleep 30 &
+[3] (PID) Running @db /bin/sleep 30 &
+[3] (PID) Running @db /bin/sleep 30 &
+@web: No such job" "$(echo "$got" | grep -v '^Job')"
+check "tagged jobs terminated" "3" "$(echo "$got" | grep -c '^Job .* 15$')"
+
+# Arrays: $IDX, failures, and single tasks named by %jid.idx
+task="/bin/sh -c 'echo \$IDX >> $tmp/idx; exit \$((\$IDX % 2))'"
+got=$(printf '%s\n' "array 1-4%2 $task" "wait" "array 1-3%1 /bin/sleep 30" \
+             "/bin/sleep 0.1" "jobs %1.2" "kill %1.1" "wait %1.1" "jobs %1" \
+             "kill %1" "wait" "array 5-2 /bin/true" | "$tsh" -p |
+      sed 's/([0-9]*)/(PID)/; s/^\(\[1\] (array) .* cancelled\):.*/\1/')
+check "array" "[1] (array) array 1-4%2 $task
+[1] (array) 4 done, 2 failed, 0 cancelled
+[1] (array) array 1-3%1 /bin/sleep 30
+[1.2] (PID) Pending /bin/sleep 30
+[1] (PID) Running 1/3 done, 1 running, 1 failed array 1-3%1 /bin/sleep 30
+[1] (array) 2 done, 2 failed, 1 cancelled
+array: usage: array FIRST-LAST[%LIMIT] cmd [args...]" "$got"
+check "array runs every index" "1 2 3 4 " "$(sort "$tmp/idx" | tr '\n' ' ')"
+
+# Scripts: two run side by side in the shell, then one in the foreground
+printf '/bin/sleep 0.3\n/bin/echo a done\n' > "$tmp/a.tsh"
+printf '/bin/echo b start\n/bin/sleep 0.1\n/bin/echo b done\n' > "$tmp/b.tsh"
+got=$(printf '%s\n' "spawn-script $tmp/a.tsh &" "spawn-script $tmp/b.tsh &" \
+             "wait" "spawn-script $tmp/b.tsh" "spawn-script $tmp/none" |
+      "$tsh" -p)
+check "spawn-script" "[1] (script) spawn-script $tmp/a.tsh &
+[2] (script) spawn-script $tmp/b.tsh &
+b start
+b done
+a done
+b start
+b done
+spawn-script: $tmp/none: No such file or directory" "$got"
+
+# trap and on-done: hooks run from the event loop
+got=$(printf '%s\n' "trap '/bin/echo got usr1' USR1" \
+             "trap '/bin/echo bye' EXIT" "trap" \
+             "/bin/sh -c 'kill -USR1 \$PPID'" "/bin/sleep 0.1" \
+             "/bin/sh -c '/bin/sleep 0.4; exit 3' &" \
+             "on-done %1 /bin/echo job \$JID status \$STATUS" \
+             "@t /bin/sleep 0.1 &" "@t /bin/sleep 0.2 &" \
+             "on-done @t /bin/echo tag \$TAG done" "on-done" "wait" \
+             "/bin/sleep 0.1" "trap - USR1" "trap" | "$tsh" -p |
+      sed 's/([0-9]*)/(PID)/')
+check "trap and on-done" "trap -- '/bin/echo bye' EXIT
+trap -- '/bin/echo got usr1' USR1
+got usr1
+[1] (PID) /bin/sh -c '/bin/sleep 0.4; exit 3' &
+[2] (PID) @t /bin/sleep 0.1 &
+[3] (PID) @t /bin/sleep 0.2 &
+on-done %1 /bin/echo job \$JID status \$STATUS
+on-done @t /bin/echo tag \$TAG done
+tag t done
+job 1 status 3
+trap -- '/bin/echo bye' EXIT
+
+bye" "$got"
+
+# jtop in batch mode
+got=$(printf '%s\n' "/bin/sleep 1 &" "jtop -b" "jtop -b -s bogus" "kill %1" |
+      "$tsh" -p | sed -n '2,3p; 4s/^ *1  *[0-9]* .*  \/bin/1 \/bin/p; 5p')
+check "jtop -b" "jtop: 1 jobs, sorted by cpu
+  JID     PID S   CPU%      RSS   READ/s  WRITE/s       AGE  COMMAND
+1 /bin/sleep 1 &
+jtop: unknown sort key 'bogus'" "$got"
+
+# Delay accounting: delays are read before the event loop reaps a job
+got=$(printf '/bin/true\n/bin/sleep 0.1 &\n/bin/sleep 0.2\njobs -l\n' |
+      TSH_DELAYACCT=1 "$tsh" -p | grep -c ' wait cpu ')
+check "delays of every job" "3" "$got"
+
+# Daemon mode: sessions, exit status, and the socket path
+echo notes > "$tmp/notes"
+"$tsh" -D "$tmp/notes" >/dev/null 2>&1
+check "daemon leaves a regular file alone" "1 notes" "$? $(cat "$tmp/notes")"
+
+"$tsh" -D "$tmp/sock" >/dev/null 2>&1 &
+daemon=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$tmp/sock" ] && break
+    sleep 0.1
+done
+got=$(printf '/usr/bin/printenv MARK\n' |
+      MARK=attached "$tsh" -p -A "$tmp/sock")
+check "daemon session" "attached" "$got"
+printf 'quit\n' | "$tsh" -p -A "$tmp/sock"
+check "daemon session status" "0" "$?"
+"$tsh" -D "$tmp/sock" >/dev/null 2>&1
+check "second daemon on a live socket" "1" "$?"
+kill "$daemon"
+wait "$daemon" 2>/dev/null
+printf '/bin/echo hi\n' | "$tsh" -p -A "$tmp/sock" >/dev/null 2>&1
+check "attach without a daemon" "1" "$?"
+
+if [ "$failures" -ne 0 ]; then
+    echo "test_shell: $failures check(s) FAILED"
+    exit 1
+fi
+echo "test_shell: ok"
@@ -0,0 +1,268 @@
+/**
+ * @file tsh_acct.c
+ * @brief Per-job delay accounting
+ *
+ * acct_collect() runs from the event loop, on a child that is still a
+ * zombie; the SIGCHLD handler leaves such children to event_dispatch()
+ * rather than wait on the kernel itself.  It sticks to system calls and
+ * static buffers all the same.  A taskstats query is one sendto() and one
+ * recv() on a netlink socket opened at start-up, with a receive timeout
+ * so that the shell cannot hang on it.  Replies are matched to requests
+ * by sequence number, in case an earlier reply arrived after its timeout.
+ */
+
+#include "tsh_acct.h"
+
+#include <fcntl.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Where the delays come from */
+static enum { ACCT_OFF, ACCT_TASKSTATS, ACCT_PROC } source = ACCT_OFF;
+
+static int nl_fd = -1;
+static uint16_t family_id;
+static uint32_t nl_seq;
+static long ticks_per_sec;
+
+/* A generic-netlink request with a single attribute */
+struct nl_request {
+    struct nlmsghdr n;
+    struct genlmsghdr g;
+    char attrs[64];
+};
+
+/* Reply buffer; a taskstats reply is well under a page */
+static union {
+    struct nlmsghdr n;
+    char buf[4096];
+} reply;
+
+static void *attr_data(struct nlattr *na) {
+    return (char *)na + NLA_HDRLEN;
+}
+
+static struct nlattr *attr_next(struct nlattr *na) {
+    return (struct nlattr *)((char *)na + NLA_ALIGN(na->nla_len));
+}
+
+/**
+ * @brief Sends a request and receives its reply into reply
+ *
+ * @return The length of the reply, or -1 on error (including a netlink
+ *         error reply such as EPERM)
+ */
+static ssize_t nl_query(uint16_t type, uint8_t cmd, uint16_t attr,
+                        const void *data, size_t len) {
+    struct nl_request req;
+    memset(&req, 0, sizeof(req));
+    struct nlattr *na = (struct nlattr *)req.attrs;
+    na->nla_type = attr;
+    na->nla_len = (uint16_t)(NLA_HDRLEN + len);
+    memcpy(attr_data(na), data, len);
+    req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN) + NLA_ALIGN(na->nla_len);
+    req.n.nlmsg_type = type;
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_seq = ++nl_seq;
+    req.g.cmd = cmd;
+    req.g.version = 1;
+
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if (sendto(nl_fd, &req, req.n.nlmsg_len, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel)) < 0) {
+        return -1;
+    }
+    for (;;) {
+        ssize_t n = recv(nl_fd, &reply, sizeof(reply), 0);
+        if (n < (ssize_t)NLMSG_LENGTH(GENL_HDRLEN) ||
+            !NLMSG_OK(&reply.n, (size_t)n)) {
+            return -1;
+        }
+        if (reply.n.nlmsg_seq != nl_seq) {
+            continue; // a late reply to an earlier query
+        }
+        if (reply.n.nlmsg_type == NLMSG_ERROR) {
+            return -1;
+        }
+        return n;
+    }
+}
+
+/* Looks up the TASKSTATS family; false if the kernel has none */
+static bool resolve_family(void) {
+    if (nl_query(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME,
+                 TASKSTATS_GENL_NAME, sizeof(TASKSTATS_GENL_NAME)) < 0) {
+        return false;
+    }
+    char *end = (char *)&reply + reply.n.nlmsg_len;
+    for (struct nlattr *na =
+             (struct nlattr *)((char *)&reply + NLMSG_LENGTH(GENL_HDRLEN));
+         (char *)na + NLA_HDRLEN <= end; na = attr_next(na)) {
+        if (na->nla_len < NLA_HDRLEN) {
+            break;
+        }
+        if (na->nla_type == CTRL_ATTR_FAMILY_ID) {
+            memcpy(&family_id, attr_data(na), sizeof(family_id));
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool collect_taskstats(pid_t pid, struct job_delays *delays) {
+    uint32_t id = (uint32_t)pid;
+    if (nl_query(family_id, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_PID, &id,
+                 sizeof(id)) < 0) {
+        return false;
+    }
+    // TASKSTATS_TYPE_AGGR_PID nests TASKSTATS_TYPE_PID and the stats
+    char *end = (char *)&reply + reply.n.nlmsg_len;
+    struct nlattr *outer =
+        (struct nlattr *)((char *)&reply + NLMSG_LENGTH(GENL_HDRLEN));
+    if ((char *)outer + NLA_HDRLEN > end ||
+        outer->nla_type != TASKSTATS_TYPE_AGGR_PID) {
+        return false;
+    }
+    char *outer_end = (char *)outer + outer->nla_len;
+    for (struct nlattr *na = attr_data(outer);
+         (char *)na + NLA_HDRLEN <= outer_end; na = attr_next(na)) {
+        if (na->nla_len < NLA_HDRLEN) {
+            break;
+        }
+        if (na->nla_type == TASKSTATS_TYPE_STATS &&
+            na->nla_len >= NLA_HDRLEN + offsetof(struct taskstats,
+                                                 swapin_delay_total) +
+                               sizeof(uint64_t)) {
+            struct taskstats ts;
+            size_t len = na->nla_len - NLA_HDRLEN;
+            memset(&ts, 0, sizeof(ts));
+            memcpy(&ts, attr_data(na), len < sizeof(ts) ? len : sizeof(ts));
+            delays->cpu_ns = ts.cpu_delay_total;
+            delays->blkio_ns = ts.blkio_delay_total;
+            delays->swapin_ns = ts.swapin_delay_total;
+            delays->has_swapin = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Reads a small /proc file of pid into buf; returns its length or -1 */
+static ssize_t read_proc(pid_t pid, const char *file, char *buf,
+                         size_t size) {
+    char path[64];
+    // snprintf is not async-signal-safe; build the path by hand
+    char digits[16];
+    int nd = 0;
+    for (unsigned v = (unsigned)pid; nd == 0 || v != 0; v /= 10) {
+        digits[nd++] = (char)('0' + v % 10);
+    }
+    memcpy(path, "/proc/", 6);
+    size_t len = 6;
+    while (nd > 0) {
+        path[len++] = digits[--nd];
+    }
+    path[len++] = '/';
+    size_t flen = strlen(file);
+    memcpy(path + len, file, flen + 1);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n >= 0) {
+        buf[n] = '\0';
+    }
+    return n;
+}
+
+static uint64_t parse_u64(const char *p) {
+    uint64_t v = 0;
+    while (*p >= '0' && *p <= '9') {
+        v = v * 10 + (uint64_t)(*p++ - '0');
+    }
+    return v;
+}
+
+static bool collect_proc(pid_t pid, struct job_delays *delays) {
+    char buf[1024];
+    // schedstat: time on CPU, time waiting on a run queue, timeslices
+    if (read_proc(pid, "schedstat", buf, sizeof(buf)) <= 0) {
+        return false;
+    }
+    char *p = strchr(buf, ' ');
+    if (p == NULL) {
+        return false;
+    }
+    delays->cpu_ns = parse_u64(p + 1);
+
+    // stat field 42 is delayacct_blkio_ticks; fields from 3 on follow the
+    // command name, which may contain anything
+    delays->blkio_ns = 0;
+    if (read_proc(pid, "stat", buf, sizeof(buf)) > 0 &&
+        (p = strrchr(buf, ')')) != NULL) {
+        p++;
+        for (int field = 3; field <= 42 && p != NULL; field++) {
+            p = strchr(p + 1, ' ');
+            if (field == 41 && p != NULL) {
+                delays->blkio_ns =
+                    parse_u64(p + 1) * 1000000000 / (uint64_t)ticks_per_sec;
+            }
+        }
+    }
+    delays->has_swapin = false;
+    return true;
+}
+
+/**
+ * @brief Chooses the source of the delays, if TSH_DELAYACCT is set
+ *
+ * taskstats is used if a query for the shell itself succeeds, which fails
+ * without CAP_NET_ADMIN.
+ */
+void acct_init(void) {
+    const char *env = getenv("TSH_DELAYACCT");
+    if (env == NULL || strcmp(env, "1") != 0) {
+        return;
+    }
+    ticks_per_sec = sysconf(_SC_CLK_TCK);
+    source = ACCT_PROC;
+
+    nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (nl_fd < 0) {
+        return;
+    }
+    struct timeval timeout = {0, 100000};
+    setsockopt(nl_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct job_delays probe;
+    if (resolve_family() && collect_taskstats(getpid(), &probe)) {
+        source = ACCT_TASKSTATS;
+    } else {
+        close(nl_fd);
+        nl_fd = -1;
+    }
+}
+
+bool acct_enabled(void) {
+    return source != ACCT_OFF;
+}
+
+bool acct_collect(pid_t pid, struct job_delays *delays) {
+    bool ok = false;
+    if (source == ACCT_TASKSTATS) {
+        ok = collect_taskstats(pid, delays);
+    }
+    if (!ok && source != ACCT_OFF) {
+        ok = collect_proc(pid, delays);
+    }
+    delays->valid = ok;
+    return ok;
+}
@@ -0,0 +1,38 @@
+/**
+ * @file tsh_acct.h
+ * @brief Per-job delay accounting
+ *
+ * With TSH_DELAYACCT=1 in the environment, the shell records for every job
+ * it reaps how long the job's process spent runnable but waiting for a
+ * CPU, waiting for block I/O and waiting for swap-in, so that a job that
+ * was slow because of contention can be told apart from one that had more
+ * work to do.  The figures are read while the process is still a zombie.
+ *
+ * They come from the taskstats generic-netlink interface, which needs
+ * CAP_NET_ADMIN.  Without it the CPU wait is taken from
+ * /proc/<pid>/schedstat and the block I/O wait from /proc/<pid>/stat, and
+ * swap-in is not available.  The kernel only tracks block I/O and swap-in
+ * waits while delay accounting is on (kernel.task_delayacct=1).
+ */
+
+#ifndef __TSH_ACCT_H__
+#define __TSH_ACCT_H__
+
+#include "tsh_helper.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Sets up delay accounting if TSH_DELAYACCT asks for it */
+void acct_init(void);
+
+/* True if delays are being collected */
+bool acct_enabled(void);
+
+/*
+ * Reads the delays of pid, an unreaped child.  Returns false if they could
+ * not be read.  Async-signal-safe.
+ */
+bool acct_collect(pid_t pid, struct job_delays *delays);
+
+#endif /* __TSH_ACCT_H__ */
@@ -0,0 +1,514 @@
+/**
+ * @file tsh_array.c
+ * @brief Array jobs
+ *
+ * An array job is one job list entry that no process stands for.  Its
+ * tasks are started from the event loop as slots free up, each through
+ * spawn_job() with the template expanded for its index, and their exits
+ * come back through array_child_exited().  Signals sent to the array are
+ * spread to its running tasks.
+ */
+
+#include "tsh_array.h"
+#include "csapp.h"
+#include "tsh_sched.h"
+#include "tsh_script.h"
+#include "tsh_shell.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+/*****************
+ * Job arrays
+ *****************/
+
+#define ARRAY_MAX_TASKS (1L << 24)
+
+/* What became of a task, in two bits of job_array.states */
+enum task_state {
+    TASK_PENDING,
+    TASK_RUNNING,
+    TASK_DONE,
+    TASK_CANCELLED,
+};
+
+/*
+ * An array job: one job list entry, with no process of its own, for the
+ * tasks first..last.  Besides the template, each task costs two bits of
+ * state and a byte of exit code; only the running tasks have a slot.
+ */
+struct job_array {
+    jid_t jid;
+    char *template; // command line with $IDX or ${IDX} for the index
+    long first, last;
+    long next;   // tasks before this are no longer pending
+    int limit;   // most tasks running at once
+    int running; // slots in use
+    bool paused; // stopped with STOP or TSTP
+    long done;      // tasks that finished, including those that failed
+    long failed;    // of which exited non-zero or were killed
+    long cancelled; // tasks killed before they started
+    uint64_t *states; // enum task_state, 32 tasks per word
+    uint8_t *codes;   // exit code, or 128 plus the signal that killed it
+    struct array_slot {
+        pid_t pid; // 0 if free
+        long idx;
+    } *slots; // limit entries
+};
+
+static struct job_array **arrays;
+static size_t narrays, arrays_cap;
+
+static enum task_state task_get(const struct job_array *a, long idx) {
+    size_t i = (size_t)(idx - a->first);
+    return (enum task_state)((a->states[i / 32] >> (2 * (i % 32))) & 3);
+}
+
+static void task_set(struct job_array *a, long idx, enum task_state state) {
+    size_t i = (size_t)(idx - a->first);
+    uint64_t shift = 2 * (i % 32);
+    a->states[i / 32] =
+        (a->states[i / 32] & ~((uint64_t)3 << shift)) |
+        ((uint64_t)state << shift);
+}
+
+/* Returns the array job jid, or NULL if jid is not one */
+struct job_array *array_find(jid_t jid) {
+    for (size_t i = 0; i < narrays; i++) {
+        if (arrays[i]->jid == jid) {
+            return arrays[i];
+        }
+    }
+    return NULL;
+}
+
+/* True if idx is a task of a (NULL for no array) */
+bool array_has_task(const struct job_array *a, long idx) {
+    return a != NULL && idx >= a->first && idx <= a->last;
+}
+
+/* True if task idx of array job jid is still pending or running */
+bool array_task_live(jid_t jid, long idx) {
+    const struct job_array *a = array_find(jid);
+    return array_has_task(a, idx) && task_get(a, idx) <= TASK_RUNNING;
+}
+
+/**
+ * @brief Expands the template of a for task idx
+ *
+ * @return false if the command line would not fit in size bytes
+ */
+static bool array_task_line(const struct job_array *a, long idx, char *buf,
+                            size_t size) {
+    char num[24];
+    snprintf(num, sizeof(num), "%ld", idx);
+    const char *name = "IDX", *value = num;
+    return expand_vars(a->template, &name, &value, 1, buf, size);
+}
+
+/* Settles task idx with its wait status (or exit code, if status < 0) */
+static void array_task_done(struct job_array *a, long idx, int status,
+                            int code) {
+    if (status >= 0) {
+        code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                 : 128 + WTERMSIG(status);
+    }
+    a->codes[idx - a->first] = (uint8_t)code;
+    task_set(a, idx, TASK_DONE);
+    a->done++;
+    if (code != 0) {
+        a->failed++;
+    }
+}
+
+/**
+ * @brief Starts task idx in a free slot
+ *
+ * A task whose command cannot be started counts as failed, with the
+ * exit code a shell would give it.
+ */
+static void array_start(struct job_array *a, long idx,
+                        const sigset_t *child_mask) {
+    char line[MAXLINE_TSH];
+    struct cmdline_tokens token;
+    if (!array_task_line(a, idx, line, sizeof(line))) {
+        sio_printf("array: %%%d.%ld: command line too long\n", (int)a->jid,
+                   idx);
+        array_task_done(a, idx, -1, 126);
+        return;
+    }
+    parseline_return result = parseline(line, &token);
+    if ((result != PARSELINE_FG && result != PARSELINE_BG) ||
+        token.argc == 0) {
+        array_task_done(a, idx, -1, 126);
+        return;
+    }
+    pid_t pid = spawn_job(&token, child_mask, -1);
+    if (pid == 0) {
+        array_task_done(a, idx, -1, 1);
+        return;
+    }
+    struct array_slot *slot = a->slots;
+    while (slot->pid != 0) {
+        slot++;
+    }
+    *slot = (struct array_slot){pid, idx};
+    a->running++;
+    task_set(a, idx, TASK_RUNNING);
+}
+
+/**
+ * @brief Starts pending tasks, in index order, up to the array's limit,
+ * and retires the array once every task has settled
+ *
+ * Frees a when it retires, so the caller must not use it afterwards.
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+static void array_pump(struct job_array *a) {
+    if (!shutting_down && !a->paused) {
+        sigset_t child_mask;
+        sigprocmask(SIG_BLOCK, NULL, &child_mask);
+        sigdelset(&child_mask, SIGCHLD);
+        sigdelset(&child_mask, SIGINT);
+        sigdelset(&child_mask, SIGTSTP);
+        while (a->running < a->limit && a->next <= a->last) {
+            long idx = a->next++;
+            if (task_get(a, idx) == TASK_PENDING) {
+                array_start(a, idx, &child_mask);
+            }
+        }
+    }
+    if (a->running > 0 || a->done + a->cancelled <= a->last - a->first) {
+        return;
+    }
+
+    // Only a summary of what went wrong; the tasks that succeeded are
+    // as quiet as background jobs that exit
+    if ((a->failed > 0 || a->cancelled > 0) && !shutting_down) {
+        sio_printf("[%d] (array) %ld done, %ld failed, %ld cancelled: %s\n",
+                   (int)a->jid, a->done, a->failed, a->cancelled,
+                   job_get_cmdline(a->jid));
+    }
+    int status = (a->failed > 0 || a->cancelled > 0) ? 1 << 8 : 0;
+    shutdown_child_exited(a->jid, status);
+    delete_job(a->jid);
+    hooks_job_done(a->jid, status);
+    for (size_t i = 0; i < narrays; i++) {
+        if (arrays[i] == a) {
+            arrays[i] = arrays[--narrays];
+            break;
+        }
+    }
+    free(a->template);
+    free(a->states);
+    free(a->codes);
+    free(a->slots);
+    free(a);
+}
+
+/* Sends sig to the process group of a running task */
+static void array_kill_slot(const struct array_slot *slot, int sig) {
+    // A task reaped but not yet dispatched may have had its pid reused
+    if (!reap_pending(slot->pid, NULL)) {
+        kill(-slot->pid, sig);
+    }
+}
+
+/* Cancels the pending tasks of a; true if there were any */
+static bool array_cancel_pending(struct job_array *a) {
+    long before = a->cancelled;
+    for (long idx = a->next; idx <= a->last; idx++) {
+        if (task_get(a, idx) == TASK_PENDING) {
+            task_set(a, idx, TASK_CANCELLED);
+            a->cancelled++;
+        }
+    }
+    a->next = a->last + 1;
+    return a->cancelled > before;
+}
+
+/**
+ * @brief Signals an array job, or task idx of it, as kill does
+ *
+ * @param[in] idx The task, or -1 for the whole array
+ * @return 0, or -1 with errno set (ESRCH for a task that is over)
+ *
+ * For the whole array, STOP and TSTP pause it: the running tasks stop
+ * and no more start until CONT.  Any other real signal cancels the
+ * pending tasks and goes to the running ones, which are continued if the
+ * array was paused.  A pending task is cancelled by any real signal but
+ * CONT.  May retire the array (see array_pump()).  Must be called with
+ * SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+int array_signal(struct job_array *a, long idx, int sig) {
+    if (idx >= 0) {
+        enum task_state state = task_get(a, idx);
+        if (state == TASK_RUNNING) {
+            for (int i = 0; i < a->limit; i++) {
+                if (a->slots[i].pid != 0 && a->slots[i].idx == idx) {
+                    array_kill_slot(&a->slots[i], sig);
+                }
+            }
+        } else if (state == TASK_PENDING && sig != 0 && sig != SIGCONT) {
+            task_set(a, idx, TASK_CANCELLED);
+            a->cancelled++;
+            array_pump(a);
+        } else if (state != TASK_PENDING) {
+            errno = ESRCH;
+            return -1;
+        }
+        return 0;
+    }
+    if (sig == 0) {
+        return 0;
+    }
+
+    bool pause = sig == SIGSTOP || sig == SIGTSTP;
+    if (!pause && sig != SIGCONT) {
+        array_cancel_pending(a);
+    }
+    for (int i = 0; i < a->limit; i++) {
+        if (a->slots[i].pid != 0) {
+            array_kill_slot(&a->slots[i], sig);
+            if (a->paused && !pause && sig != SIGCONT) {
+                array_kill_slot(&a->slots[i], SIGCONT);
+            }
+        }
+    }
+    a->paused = pause;
+    job_set_state(a->jid, pause ? ST : BG);
+    array_pump(a);
+    return 0;
+}
+
+/* Records the exit of a task (from event_dispatch()) */
+void array_child_exited(pid_t pid, int status) {
+    for (size_t i = 0; i < narrays; i++) {
+        struct job_array *a = arrays[i];
+        for (int j = 0; j < a->limit; j++) {
+            if (a->slots[j].pid == pid) {
+                array_task_done(a, a->slots[j].idx, status, 0);
+                a->slots[j].pid = 0;
+                a->running--;
+                array_pump(a);
+                return;
+            }
+        }
+    }
+}
+
+/* Cancels the pending tasks of every array job, for shell_shutdown() */
+void array_cancel_all(void) {
+    // array_pump() may retire arrays[i], moving the last one into its place
+    for (size_t i = narrays; i-- > 0;) {
+        array_cancel_pending(arrays[i]);
+        array_pump(arrays[i]);
+    }
+}
+
+/* Shows the progress of each array job in its jobs line */
+void array_annotate(void) {
+    for (size_t i = 0; i < narrays; i++) {
+        const struct job_array *a = arrays[i];
+        char note[64];
+        int n = snprintf(note, sizeof(note), "%ld/%ld done, %d running",
+                         a->done, a->last - a->first + 1, a->running);
+        if (a->failed > 0 && n > 0 && (size_t)n < sizeof(note)) {
+            n += snprintf(note + n, sizeof(note) - (size_t)n, ", %ld failed",
+                          a->failed);
+        }
+        if (a->cancelled > 0 && n > 0 && (size_t)n < sizeof(note)) {
+            snprintf(note + n, sizeof(note) - (size_t)n, ", %ld cancelled",
+                     a->cancelled);
+        }
+        job_set_note(a->jid, note);
+    }
+}
+
+/* Prints the jobs line of task idx of a, e.g. [3.17] (1234) Running cmd */
+void array_list_task(int fd, const struct job_array *a, long idx) {
+    if (!array_has_task(a, idx)) {
+        return;
+    }
+    char line[MAXLINE_TSH];
+    if (!array_task_line(a, idx, line, sizeof(line))) {
+        snprintf(line, sizeof(line), "%s", a->template);
+    }
+    pid_t pid = 0;
+    char state[32];
+    switch (task_get(a, idx)) {
+    case TASK_PENDING:
+        snprintf(state, sizeof(state), a->paused ? "Stopped" : "Pending");
+        break;
+    case TASK_RUNNING:
+        for (int i = 0; i < a->limit; i++) {
+            if (a->slots[i].pid != 0 && a->slots[i].idx == idx) {
+                pid = a->slots[i].pid;
+            }
+        }
+        snprintf(state, sizeof(state), a->paused ? "Stopped" : "Running");
+        break;
+    case TASK_DONE:
+        snprintf(state, sizeof(state), "Done (exit %d)",
+                 a->codes[idx - a->first]);
+        break;
+    case TASK_CANCELLED:
+        snprintf(state, sizeof(state), "Cancelled");
+        break;
+    }
+    sio_dprintf(fd, "[%d.%ld] (%d) %s %s\n", (int)a->jid, idx, (int)pid,
+                state, line);
+}
+
+/**
+ * @brief Parses FIRST-LAST[%LIMIT] (or FIRST[%LIMIT] for one task)
+ */
+static bool parse_array_range(const char *text, long *first, long *last,
+                              int *limit) {
+    char *end;
+    if (!isdigit((unsigned char)text[0])) {
+        return false;
+    }
+    *first = *last = strtol(text, &end, 10);
+    if (*end == '-') {
+        const char *p = end + 1;
+        if (!isdigit((unsigned char)*p)) {
+            return false;
+        }
+        *last = strtol(p, &end, 10);
+    }
+    if (*end == '%') {
+        const char *p = end + 1;
+        long n = strtol(p, &end, 10);
+        if (end == p || n < 1 || n > INT_MAX) {
+            return false;
+        }
+        *limit = (int)n;
+    }
+    return *end == '\0' && *last >= *first && *last < LONG_MAX;
+}
+
+/**
+ * @brief Runs a command once for each index of a range, as one job
+ *
+ * array FIRST-LAST[%LIMIT] cmd [args...]
+ *
+ * Each task runs the rest of the command line with $IDX (or ${IDX})
+ * replaced by its index, wherever it appears.  At most LIMIT tasks run at
+ * once (by default one per CPU), starting in index order.  The array is a
+ * single background job: jobs shows its progress, kill and wait treat it
+ * as a whole, and %jid.idx names one of its tasks, e.g. to list, kill or
+ * wait for it.  STOP pauses the array and CONT (or bg) resumes it; other
+ * signals cancel the tasks that have not started.
+ */
+void builtin_array(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token) {
+    long first, last;
+    int limit = 0;
+    if (token->argc < 3 ||
+        !parse_array_range(token->argv[1], &first, &last, &limit)) {
+        sio_printf("array: usage: array FIRST-LAST[%%LIMIT] cmd [args...]\n");
+        return;
+    }
+    if (last - first >= ARRAY_MAX_TASKS) {
+        sio_printf("array: at most %ld tasks\n", ARRAY_MAX_TASKS);
+        return;
+    }
+    long ntasks = last - first + 1;
+    if (limit == 0) {
+        limit = sched_ncpu();
+    }
+    if (limit > ntasks) {
+        limit = (int)ntasks;
+    }
+
+    // The template is the raw text after "array" and the range, so that
+    // quoting survives; a final & is the array's own
+    const char *p = command_text(cmdline, 2);
+    size_t len = strlen(p);
+    if (parse_result == PARSELINE_BG) {
+        len = (size_t)(strrchr(p, '&') - p);
+    }
+    while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+        len--;
+    }
+
+    struct job_array *a = calloc(1, sizeof(*a));
+    if (a != NULL) {
+        a->template = strndup(p, len);
+        a->states = calloc(((size_t)ntasks + 31) / 32, sizeof(*a->states));
+        a->codes = calloc((size_t)ntasks, sizeof(*a->codes));
+        a->slots = calloc((size_t)limit, sizeof(*a->slots));
+    }
+    if (a == NULL || a->template == NULL || a->states == NULL ||
+        a->codes == NULL || a->slots == NULL) {
+        sio_printf("array: out of memory\n");
+        if (a != NULL) {
+            free(a->template);
+            free(a->states);
+            free(a->codes);
+            free(a->slots);
+            free(a);
+        }
+        return;
+    }
+    a->first = a->next = first;
+    a->last = last;
+    a->limit = limit;
+
+    // Check the command once, with the first index
+    char line[MAXLINE_TSH];
+    struct cmdline_tokens task;
+    parseline_return result = PARSELINE_ERROR;
+    if (array_task_line(a, first, line, sizeof(line))) {
+        result = parseline(line, &task);
+    }
+    if ((result != PARSELINE_FG && result != PARSELINE_BG) ||
+        task.argc == 0 || task.builtin != BUILTIN_NONE) {
+        sio_printf("array: the command must be a program\n");
+        free(a->template);
+        free(a->states);
+        free(a->codes);
+        free(a->slots);
+        free(a);
+        return;
+    }
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (narrays == arrays_cap) {
+        size_t cap = arrays_cap ? 2 * arrays_cap : 8;
+        struct job_array **grown = realloc(arrays, cap * sizeof(*grown));
+        if (grown != NULL) {
+            arrays = grown;
+            arrays_cap = cap;
+        }
+    }
+    // Added as a pending job, as only those may have no pid
+    a->jid = narrays < arrays_cap ? add_job(0, PD, cmdline) : 0;
+    if (a->jid == 0) {
+        sio_printf("array: cannot add job\n");
+        free(a->template);
+        free(a->states);
+        free(a->codes);
+        free(a->slots);
+        free(a);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
+    arrays[narrays++] = a;
+    job_set_state(a->jid, BG);
+    tag_job(a->jid, token);
+    sio_printf("[%d] (array) %s\n", (int)a->jid, cmdline);
+    array_pump(a);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
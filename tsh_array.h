@@ -0,0 +1,53 @@
+/**
+ * @file tsh_array.h
+ * @brief Array jobs, for the `array` builtin
+ *
+ * An array job runs one command template for each index of a range under
+ * a single job ID, with no process of its own: at most LIMIT tasks run at
+ * once, each with $IDX set to its index, and %jid.idx names a single
+ * task.  Each task costs two bits of state and a byte of exit code, so
+ * arrays of millions of tasks are cheap until they run.
+ */
+
+#ifndef __TSH_ARRAY_H__
+#define __TSH_ARRAY_H__
+
+#include "tsh_helper.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct job_array;
+
+/* Returns the array job jid, or NULL if jid is not one */
+struct job_array *array_find(jid_t jid);
+
+/* True if idx is a task of a (NULL for no array) */
+bool array_has_task(const struct job_array *a, long idx);
+
+/* True if task idx of array job jid is still pending or running */
+bool array_task_live(jid_t jid, long idx);
+
+/*
+ * Signals an array job, or task idx of it (-1 for the whole array), as
+ * kill does.  Returns 0, or -1 with errno set (ESRCH for a task that is
+ * over).  Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+int array_signal(struct job_array *a, long idx, int sig);
+
+/* Prints the jobs line of task idx of a, e.g. [3.17] (1234) Running cmd */
+void array_list_task(int fd, const struct job_array *a, long idx);
+
+/* Shows the progress of each array job in its jobs line */
+void array_annotate(void);
+
+/* Records the exit of a task (from event_dispatch()) */
+void array_child_exited(pid_t pid, int status);
+
+/* Cancels the pending tasks of every array job, for shell_shutdown() */
+void array_cancel_all(void);
+
+void builtin_array(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token);
+
+#endif /* __TSH_ARRAY_H__ */
@@ -0,0 +1,873 @@
+/**
+ * @file tsh_cache.c
+ * @brief Output memoization cache for the `cache` builtin
+ *
+ * Entries are plain files named by the hex form of their key.  The index of
+ * entries (key, size, last use) is loaded lazily from the directory the
+ * first time the cache is used and kept in memory afterwards, so a lookup
+ * costs no system calls.  The last-use time of an entry is mirrored in the
+ * file's mtime, which lets the LRU order survive across shell sessions.
+ *
+ * Several shells may use one cache directory at once; daemon sessions
+ * always do.  The directory is the shared state, and a 64-bit generation
+ * counter in the file .generation, mapped shared into every shell, says
+ * when it last changed.  A shell whose index was loaded at an older
+ * generation reloads it before its next lookup, which costs one memory
+ * read while nothing changes.  Stores, evictions and clears happen under
+ * an exclusive flock(2) on .generation, with the index reloaded first if
+ * it is stale, so the size cap holds for all the shells together and no
+ * shell evicts on a stale picture.  Each change bumps the generation.
+ * Hits only touch an entry's mtime and do not bump it; other shells see
+ * the new LRU order when they next reload.
+ *
+ * In memory, entries live in a dense array.  A linear-probing hash table of
+ * array indices finds an entry by key, and a doubly linked list through the
+ * array, oldest first, keeps the LRU order, so that lookups, uses and
+ * evictions all take constant time however full the cache is.
+ *
+ * Output is moved between files with FICLONE where the file system supports
+ * reflinks, then copy_file_range(), then sendfile(), and only then with a
+ * read/write loop.
+ */
+
+#define _GNU_SOURCE // copy_file_range
+
+#include "tsh_cache.h"
+#include "csapp.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_DEFAULT_MAX (256ULL << 20)
+#define CACHE_KEY_HEX 32
+
+/* Marks the ends of the LRU list */
+#define NO_ENTRY SIZE_MAX
+
+/* One cached output */
+struct cache_entry {
+    struct cache_key key;
+    uint64_t size;
+    int64_t last_use; // nanoseconds since the epoch
+    size_t older;     // neighbours in the LRU list, NO_ENTRY at either end
+    size_t newer;
+};
+
+/* Incremental 128-bit hash state (two independent 64-bit lanes) */
+struct hasher {
+    uint64_t a;
+    uint64_t b;
+};
+
+static bool cache_ready;
+static char cache_dir[4096];
+static char scratch_path[4096 + 32];
+static char gen_path[4096 + 32];
+static uint64_t cache_max;
+
+static struct cache_entry *entries;
+static size_t nentries;
+static size_t entries_cap;
+static uint64_t total_bytes;
+
+static size_t *key_table; // entry index + 1 by key; 0 marks an empty slot
+static size_t key_mask;   // table size - 1 (size is a power of two)
+static size_t lru_oldest = NO_ENTRY;
+static size_t lru_newest = NO_ENTRY;
+
+static uint64_t private_gen;                // used if .generation is unusable
+static uint64_t *shared_gen = &private_gen; // the counter in .generation
+static uint64_t index_gen;                  // *shared_gen when index was read
+
+static struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t evictions;
+    uint64_t uncacheable;
+    uint64_t bytes_restored;
+} stats;
+
+/*****************
+ * Hashing
+ *****************/
+
+static void hash_init(struct hasher *h) {
+    h->a = 0xcbf29ce484222325ULL; // FNV-1a offset basis
+    h->b = 0x9E3779B97F4A7C15ULL;
+}
+
+static void hash_bytes(struct hasher *h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h->a = (h->a ^ p[i]) * 0x100000001b3ULL; // FNV-1a
+        h->b = (h->b ^ p[i]) * 0xff51afd7ed558ccdULL;
+        h->b ^= h->b >> 29;
+    }
+}
+
+/* Hashes a length-prefixed string so that adjacent strings cannot alias */
+static void hash_str(struct hasher *h, const char *s) {
+    uint64_t len = (s != NULL) ? strlen(s) : UINT64_MAX;
+    hash_bytes(h, &len, sizeof(len));
+    if (s != NULL) {
+        hash_bytes(h, s, len);
+    }
+}
+
+/* Hashes the identity of a file: device, inode, size and change times */
+static bool hash_file_identity(struct hasher *h, const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return false;
+    }
+    uint64_t id[6] = {
+        (uint64_t)st.st_dev,          (uint64_t)st.st_ino,
+        (uint64_t)st.st_size,         (uint64_t)st.st_mtim.tv_sec,
+        (uint64_t)st.st_mtim.tv_nsec, (uint64_t)st.st_mode,
+    };
+    hash_bytes(h, id, sizeof(id));
+    return true;
+}
+
+/**
+ * @brief Computes the cache key for a command
+ *
+ * @param[in] argv The command's arguments; argv[0] is the binary
+ * @param[in] infile The input redirection, or NULL
+ * @param[out] key Receives the key
+ * @return false if the command cannot be cached (e.g. the binary or the
+ *         input file cannot be examined)
+ */
+bool cache_make_key(char *const argv[], const char *infile,
+                    struct cache_key *key) {
+    struct hasher h;
+    hash_init(&h);
+    hash_str(&h, "tsh-cache-v1");
+
+    if (!hash_file_identity(&h, argv[0])) {
+        stats.uncacheable++;
+        return false;
+    }
+    for (int i = 0; argv[i] != NULL; i++) {
+        hash_str(&h, argv[i]);
+    }
+    hash_str(&h, NULL); // end of argv
+
+    char cwd[4096];
+    hash_str(&h, getcwd(cwd, sizeof(cwd)));
+
+    if (infile != NULL) {
+        hash_str(&h, infile);
+        if (!hash_file_identity(&h, infile)) {
+            stats.uncacheable++;
+            return false;
+        }
+    } else {
+        hash_str(&h, NULL);
+    }
+
+    const char *names = getenv("TSH_CACHE_ENV");
+    while (names != NULL && *names != '\0') {
+        const char *sep = strchr(names, ':');
+        size_t len = (sep != NULL) ? (size_t)(sep - names) : strlen(names);
+        char name[256];
+        if (len > 0 && len < sizeof(name)) {
+            memcpy(name, names, len);
+            name[len] = '\0';
+            hash_str(&h, name);
+            hash_str(&h, getenv(name));
+        }
+        names = (sep != NULL) ? sep + 1 : NULL;
+    }
+
+    key->hi = h.a;
+    key->lo = h.b;
+    return true;
+}
+
+/*****************
+ * Index
+ *****************/
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void key_to_hex(const struct cache_key *key, char *hex) {
+    sio_snprintf(hex, CACHE_KEY_HEX + 1, "%016lx%016lx",
+                 (unsigned long)key->hi, (unsigned long)key->lo);
+}
+
+static bool hex_to_key(const char *hex, struct cache_key *key) {
+    uint64_t words[2] = {0, 0};
+    for (int i = 0; i < CACHE_KEY_HEX; i++) {
+        char c = hex[i];
+        unsigned digit;
+        if (c >= '0' && c <= '9') {
+            digit = (unsigned)(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            digit = (unsigned)(c - 'a' + 10);
+        } else {
+            return false;
+        }
+        words[i / 16] = (words[i / 16] << 4) | digit;
+    }
+    if (hex[CACHE_KEY_HEX] != '\0') {
+        return false;
+    }
+    key->hi = words[0];
+    key->lo = words[1];
+    return true;
+}
+
+static void entry_path(const struct cache_key *key, char *path, size_t size) {
+    char hex[CACHE_KEY_HEX + 1];
+    key_to_hex(key, hex);
+    sio_snprintf(path, size, "%s/%s", cache_dir, hex);
+}
+
+/* Returns the slot holding key, or the empty slot where it would go */
+static size_t key_find(const struct cache_key *key) {
+    // keys are hashes already, so their low bits serve as the slot
+    size_t i = (size_t)key->lo & key_mask;
+    while (key_table[i] != 0) {
+        const struct cache_key *k = &entries[key_table[i] - 1].key;
+        if (k->lo == key->lo && k->hi == key->hi) {
+            break;
+        }
+        i = (i + 1) & key_mask;
+    }
+    return i;
+}
+
+/* Empties slot i, shifting later entries of its probe run back into place */
+static void key_remove(size_t i) {
+    key_table[i] = 0;
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & key_mask;
+        if (key_table[j] == 0) {
+            return;
+        }
+        size_t home = (size_t)entries[key_table[j] - 1].key.lo & key_mask;
+        // Move j into the hole at i unless its home lies cyclically in (i, j]
+        bool stays = (i <= j) ? (i < home && home <= j)
+                              : (i < home || home <= j);
+        if (!stays) {
+            key_table[i] = key_table[j];
+            key_table[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/* Keeps the load factor at or below one half, rehashing every entry */
+static bool key_reserve(size_t count) {
+    size_t size = key_mask + 1;
+    if (key_table != NULL && 2 * count <= size) {
+        return true;
+    }
+
+    size_t new_size = (key_table == NULL) ? 128 : 2 * size;
+    while (2 * count > new_size) {
+        new_size *= 2;
+    }
+    size_t *table = calloc(new_size, sizeof(*table));
+    if (table == NULL) {
+        return false;
+    }
+    free(key_table);
+    key_table = table;
+    key_mask = new_size - 1;
+    for (size_t i = 0; i < nentries; i++) {
+        key_table[key_find(&entries[i].key)] = i + 1;
+    }
+    return true;
+}
+
+/* Returns the index of the entry for key, or NO_ENTRY */
+static size_t find_entry(const struct cache_key *key) {
+    if (key_table == NULL) {
+        return NO_ENTRY;
+    }
+    size_t slot = key_table[key_find(key)];
+    return slot != 0 ? slot - 1 : NO_ENTRY;
+}
+
+static void lru_unlink(size_t i) {
+    struct cache_entry *e = &entries[i];
+    if (e->older != NO_ENTRY) {
+        entries[e->older].newer = e->newer;
+    } else {
+        lru_oldest = e->newer;
+    }
+    if (e->newer != NO_ENTRY) {
+        entries[e->newer].older = e->older;
+    } else {
+        lru_newest = e->older;
+    }
+}
+
+/* Links entry i in as the most recently used */
+static void lru_push(size_t i) {
+    entries[i].older = lru_newest;
+    entries[i].newer = NO_ENTRY;
+    if (lru_newest != NO_ENTRY) {
+        entries[lru_newest].newer = i;
+    } else {
+        lru_oldest = i;
+    }
+    lru_newest = i;
+}
+
+/* Marks entry i as used at time when */
+static void touch_entry(size_t i, int64_t when) {
+    entries[i].last_use = when;
+    lru_unlink(i);
+    lru_push(i);
+}
+
+/* Adds room for one more entry to the array */
+static bool grow_entries(void) {
+    if (nentries < entries_cap) {
+        return true;
+    }
+    size_t cap = (entries_cap == 0) ? 64 : 2 * entries_cap;
+    struct cache_entry *grown = realloc(entries, cap * sizeof(*grown));
+    if (grown == NULL) {
+        return false;
+    }
+    entries = grown;
+    entries_cap = cap;
+    return true;
+}
+
+/* Adds an entry as the most recently used; NO_ENTRY if out of memory */
+static size_t append_entry(const struct cache_key *key, uint64_t size,
+                           int64_t last_use) {
+    if (!grow_entries() || !key_reserve(nentries + 1)) {
+        return NO_ENTRY;
+    }
+    size_t i = nentries++;
+    entries[i].key = *key;
+    entries[i].size = size;
+    entries[i].last_use = last_use;
+    key_table[key_find(key)] = i + 1;
+    lru_push(i);
+    total_bytes += size;
+    return i;
+}
+
+/* Forgets entry i, moving the last entry into its place */
+static void drop_entry(size_t i) {
+    total_bytes -= entries[i].size;
+    key_remove(key_find(&entries[i].key));
+    lru_unlink(i);
+
+    size_t last = --nentries;
+    if (i == last) {
+        return;
+    }
+    struct cache_entry *e = &entries[i];
+    *e = entries[last];
+    key_table[key_find(&e->key)] = i + 1;
+    if (e->older != NO_ENTRY) {
+        entries[e->older].newer = i;
+    } else {
+        lru_oldest = i;
+    }
+    if (e->newer != NO_ENTRY) {
+        entries[e->newer].older = i;
+    } else {
+        lru_newest = i;
+    }
+}
+
+static int last_use_cmp(const void *a, const void *b) {
+    int64_t x = ((const struct cache_entry *)a)->last_use;
+    int64_t y = ((const struct cache_entry *)b)->last_use;
+    return (x > y) - (x < y);
+}
+
+/* Deletes entry i and its file */
+static void remove_entry(size_t i) {
+    char path[sizeof(cache_dir) + CACHE_KEY_HEX + 2];
+    entry_path(&entries[i].key, path, sizeof(path));
+    unlink(path);
+    drop_entry(i);
+}
+
+/* Builds the hash table and LRU list over entries loaded in any order */
+static bool index_build(void) {
+    qsort(entries, nentries, sizeof(*entries), last_use_cmp);
+    lru_oldest = lru_newest = NO_ENTRY;
+    if (key_table != NULL) {
+        memset(key_table, 0, (key_mask + 1) * sizeof(*key_table));
+    }
+    if (!key_reserve(nentries)) {
+        return false;
+    }
+    for (size_t i = 0; i < nentries; i++) {
+        key_table[key_find(&entries[i].key)] = i + 1;
+        lru_push(i);
+    }
+    return true;
+}
+
+/* Parses a byte count with an optional K, M or G suffix */
+static uint64_t parse_size(const char *s, uint64_t fallback) {
+    char *end;
+    unsigned long long val = strtoull(s, &end, 10);
+    if (end == s) {
+        return fallback;
+    }
+    switch (*end) {
+    case 'k':
+    case 'K':
+        val <<= 10;
+        break;
+    case 'm':
+    case 'M':
+        val <<= 20;
+        break;
+    case 'g':
+    case 'G':
+        val <<= 30;
+        break;
+    default:
+        break;
+    }
+    return val;
+}
+
+/* Creates dir and any missing parents */
+static bool make_dirs(char *dir) {
+    for (char *p = dir + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+                *p = '/';
+                return false;
+            }
+            *p = '/';
+        }
+    }
+    return mkdir(dir, 0700) == 0 || errno == EEXIST;
+}
+
+/* Reads the index from the directory, replacing what was loaded before */
+static bool index_load(void) {
+    // Taken first, so that a change made during the scan forces a reload
+    index_gen = __atomic_load_n(shared_gen, __ATOMIC_ACQUIRE);
+
+    DIR *d = opendir(cache_dir);
+    if (d == NULL) {
+        sio_printf("cache: %s: %s\n", cache_dir, strerror(errno));
+        return false;
+    }
+    nentries = 0;
+    total_bytes = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        struct cache_key key;
+        struct stat st;
+        if (!hex_to_key(de->d_name, &key) ||
+            fstatat(dirfd(d), de->d_name, &st, 0) < 0 ||
+            !S_ISREG(st.st_mode) || !grow_entries()) {
+            continue;
+        }
+        struct cache_entry *e = &entries[nentries++];
+        e->key = key;
+        e->size = (uint64_t)st.st_size;
+        e->last_use =
+            (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        total_bytes += e->size;
+    }
+    closedir(d);
+    if (!index_build()) {
+        sio_printf("cache: out of memory\n");
+        return false;
+    }
+    return true;
+}
+
+/* Reloads the index if another shell has changed the cache since */
+static bool index_current(void) {
+    if (__atomic_load_n(shared_gen, __ATOMIC_ACQUIRE) == index_gen) {
+        return true;
+    }
+    return index_load();
+}
+
+/*
+ * Takes the lock for changing the cache and brings the index up to date
+ * under it.  Returns the lock descriptor (-1 if there is no lock file) for
+ * index_unlock(), or -2 if the index could not be reloaded.  The file is
+ * opened afresh each time because flock() locks belong to the open file,
+ * which the sessions of a daemon would otherwise share.
+ */
+static int index_lock(void) {
+    int fd = -1;
+    if (shared_gen != &private_gen &&
+        (fd = open(gen_path, O_RDWR | O_CLOEXEC)) >= 0) {
+        while (flock(fd, LOCK_EX) < 0 && errno == EINTR) {
+        }
+    }
+    if (!index_current()) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -2;
+    }
+    return fd;
+}
+
+/* Publishes a change made under the lock, then releases it */
+static void index_unlock(int fd) {
+    index_gen = __atomic_add_fetch(shared_gen, 1, __ATOMIC_RELEASE);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* Maps the generation counter, falling back to a private one */
+static void gen_map(void) {
+    sio_snprintf(gen_path, sizeof(gen_path), "%s/.generation", cache_dir);
+    int fd = open(gen_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        (st.st_size >= (off_t)sizeof(uint64_t) ||
+         ftruncate(fd, sizeof(uint64_t)) == 0)) {
+        void *p = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            shared_gen = p;
+        }
+    }
+    close(fd);
+}
+
+/* Locates the cache directory and loads the index on first use */
+static bool cache_init(void) {
+    if (cache_ready) {
+        return index_current();
+    }
+
+    const char *dir = getenv("TSH_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (dir != NULL && *dir != '\0') {
+        sio_snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    } else if (xdg != NULL && *xdg != '\0') {
+        sio_snprintf(cache_dir, sizeof(cache_dir), "%s/tsh", xdg);
+    } else if (home != NULL && *home != '\0') {
+        sio_snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/tsh", home);
+    } else {
+        sio_snprintf(cache_dir, sizeof(cache_dir), "/tmp/tsh-cache-%d",
+                     (int)getuid());
+    }
+    if (!make_dirs(cache_dir)) {
+        sio_printf("cache: %s: %s\n", cache_dir, strerror(errno));
+        return false;
+    }
+
+    const char *max = getenv("TSH_CACHE_MAX");
+    cache_max = (max != NULL) ? parse_size(max, CACHE_DEFAULT_MAX)
+                              : CACHE_DEFAULT_MAX;
+
+    gen_map();
+    if (!index_load()) {
+        return false;
+    }
+    cache_ready = true;
+    return true;
+}
+
+/* Evicts least recently used entries until the cache fits its cap */
+static void evict(void) {
+    while (total_bytes > cache_max && lru_oldest != NO_ENTRY) {
+        remove_entry(lru_oldest);
+        stats.evictions++;
+    }
+}
+
+/*****************
+ * Data movement
+ *****************/
+
+/**
+ * @brief Copies src_fd (from its current offset) to dst_fd
+ *
+ * Tries a reflink clone first, then in-kernel copies, then a plain
+ * read/write loop, falling through whenever a method is unsupported for
+ * the given pair of descriptors.
+ */
+bool cache_copy_fd(int dst_fd, int src_fd) {
+    struct stat src_st, dst_st;
+    if (fstat(src_fd, &src_st) < 0 || fstat(dst_fd, &dst_st) < 0) {
+        return false;
+    }
+
+    // A clone replaces the whole destination, so only use it on an empty
+    // regular file that is being written from the start
+    if (S_ISREG(dst_st.st_mode) && dst_st.st_size == 0 &&
+        lseek(dst_fd, 0, SEEK_CUR) == 0 && lseek(src_fd, 0, SEEK_CUR) == 0 &&
+        ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        lseek(dst_fd, src_st.st_size, SEEK_SET);
+        return true;
+    }
+
+    ssize_t n;
+    while ((n = copy_file_range(src_fd, NULL, dst_fd, NULL, 1 << 30, 0)) >
+           0) {
+    }
+    if (n == 0) {
+        return true;
+    }
+
+    while ((n = sendfile(dst_fd, src_fd, NULL, 1 << 30)) > 0) {
+    }
+    if (n == 0) {
+        return true;
+    }
+
+    char buf[65536];
+    while ((n = read(src_fd, buf, sizeof(buf))) > 0) {
+        if (sio_writen(dst_fd, buf, (size_t)n) < 0) {
+            return false;
+        }
+    }
+    return n == 0;
+}
+
+/*****************
+ * Public interface
+ *****************/
+
+/**
+ * @brief Checks whether an entry exists for key, counting a hit or miss
+ */
+bool cache_lookup(const struct cache_key *key) {
+    if (!cache_init()) {
+        return false;
+    }
+    if (find_entry(key) != NO_ENTRY) {
+        stats.hits++;
+        return true;
+    }
+    stats.misses++;
+    return false;
+}
+
+/**
+ * @brief Restores the entry for key into dst_fd and marks it recently used
+ *
+ * If the copy fails part way, whatever reached a regular file is cut off
+ * again, so that the command can be run instead without its output
+ * appearing twice.  Bytes already written to a pipe or terminal cannot be
+ * taken back; the failure is then reported and the restore counts as done.
+ *
+ * @return false if the command should be run instead: the entry has
+ *         disappeared or could not be copied, and the lookup is re-counted
+ *         as a miss
+ */
+bool cache_restore(const struct cache_key *key, int dst_fd) {
+    size_t i = find_entry(key);
+    if (i == NO_ENTRY) {
+        return false;
+    }
+
+    char path[sizeof(cache_dir) + CACHE_KEY_HEX + 2];
+    entry_path(key, path, sizeof(path));
+    off_t start = lseek(dst_fd, 0, SEEK_CUR);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    bool ok = fd >= 0 && cache_copy_fd(dst_fd, fd);
+    if (ok) {
+        futimens(fd, NULL);
+        touch_entry(i, now_ns());
+        stats.bytes_restored += entries[i].size;
+    } else if (fd >= 0 && start < 0 && lseek(fd, 0, SEEK_CUR) != 0) {
+        sio_printf("cache: %s: output cut short\n", path);
+        ok = true;
+    } else {
+        if (start >= 0) {
+            ftruncate(dst_fd, start);
+            lseek(dst_fd, start, SEEK_SET);
+        }
+        if (fd < 0) {
+            drop_entry(i); // evicted by another shell
+        }
+        stats.hits--;
+        stats.misses++;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+/**
+ * @brief Creates a scratch file for capturing a command's output
+ *
+ * The scratch file lives in the cache directory so that storing it later
+ * is a rename rather than a copy.  Its name is unique (mkstemp(3)), so
+ * shells sharing the cache directory never write into each other's.
+ */
+const char *cache_scratch_path(void) {
+    if (!cache_init()) {
+        return NULL;
+    }
+    sio_snprintf(scratch_path, sizeof(scratch_path), "%s/tmp.XXXXXX",
+                 cache_dir);
+    int fd = mkostemp(scratch_path, O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    close(fd);
+    return scratch_path;
+}
+
+/**
+ * @brief Stores the file at path as the output for key
+ *
+ * @param[in] key The key to store under
+ * @param[in] path The output to store
+ * @param[in] consume If true, path is a scratch file and is renamed into
+ *                    the cache; otherwise its data is cloned
+ */
+bool cache_store(const struct cache_key *key, const char *path, bool consume) {
+    if (!cache_init()) {
+        return false;
+    }
+
+    char dst[sizeof(cache_dir) + CACHE_KEY_HEX + 2];
+    entry_path(key, dst, sizeof(dst));
+
+    struct stat st;
+    if (stat(path, &st) < 0 || (uint64_t)st.st_size > cache_max) {
+        if (consume) {
+            unlink(path);
+        }
+        return false;
+    }
+
+    // A copy is made before taking the lock, so that the lock is held only
+    // for renames and unlinks
+    const char *src = path;
+    char tmp[sizeof(cache_dir) + 32];
+    if (!consume) {
+        sio_snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", cache_dir);
+        int tmp_fd = mkostemp(tmp, O_CLOEXEC);
+        if (tmp_fd < 0) {
+            return false;
+        }
+        int src_fd = open(path, O_RDONLY | O_CLOEXEC);
+        bool ok = src_fd >= 0 && cache_copy_fd(tmp_fd, src_fd);
+        if (src_fd >= 0) {
+            close(src_fd);
+        }
+        close(tmp_fd);
+        if (!ok) {
+            unlink(tmp);
+            return false;
+        }
+        src = tmp;
+    }
+
+    int lock = index_lock();
+    if (lock == -2 || rename(src, dst) < 0) {
+        unlink(src);
+        if (lock != -2) {
+            index_unlock(lock);
+        }
+        return false;
+    }
+    size_t i = find_entry(key);
+    if (i != NO_ENTRY) {
+        total_bytes -= entries[i].size;
+        entries[i].size = (uint64_t)st.st_size;
+        total_bytes += entries[i].size;
+        touch_entry(i, now_ns());
+    } else if (append_entry(key, (uint64_t)st.st_size, now_ns()) ==
+               NO_ENTRY) {
+        unlink(dst);
+        index_unlock(lock);
+        return false;
+    }
+    stats.stores++;
+    evict();
+    index_unlock(lock);
+    return true;
+}
+
+/**
+ * @brief Prints cache statistics to output_fd
+ */
+void cache_print_stats(int output_fd) {
+    if (!cache_init()) {
+        return;
+    }
+    uint64_t lookups = stats.hits + stats.misses;
+    unsigned pct = lookups > 0 ? (unsigned)(stats.hits * 100 / lookups) : 0;
+    sio_dprintf(output_fd,
+                "cache: %s\n"
+                "  entries      %zu\n"
+                "  size         %lu / %lu bytes\n"
+                "  hits         %lu (%u%%)\n"
+                "  misses       %lu\n"
+                "  stores       %lu\n"
+                "  evictions    %lu\n"
+                "  uncacheable  %lu\n"
+                "  restored     %lu bytes\n",
+                cache_dir, nentries, (unsigned long)total_bytes,
+                (unsigned long)cache_max, (unsigned long)stats.hits, pct,
+                (unsigned long)stats.misses, (unsigned long)stats.stores,
+                (unsigned long)stats.evictions,
+                (unsigned long)stats.uncacheable,
+                (unsigned long)stats.bytes_restored);
+}
+
+/**
+ * @brief Removes every entry from the cache
+ */
+void cache_clear(void) {
+    if (!cache_init()) {
+        return;
+    }
+    int lock = index_lock();
+    if (lock == -2) {
+        return;
+    }
+    while (nentries > 0) {
+        remove_entry(nentries - 1);
+    }
+    index_unlock(lock);
+}
+
+/**
+ * @brief Loads the cache index ahead of the first lookup
+ *
+ * Processes forked afterwards share the mapping of the generation counter
+ * and so notice each other's changes.
+ */
+void cache_warm(void) {
+    cache_init();
+}
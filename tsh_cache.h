@@ -0,0 +1,64 @@
+/**
+ * @file tsh_cache.h
+ * @brief Output memoization cache for the `cache` builtin
+ *
+ * A cached command is identified by a 128-bit key computed from its
+ * arguments, the working directory, a user-selected set of environment
+ * variables, the identity of its input file and the identity of the binary
+ * itself.  The output of a successful run is stored under that key in the
+ * cache directory and restored on later runs instead of launching anything.
+ *
+ * Environment:
+ *  TSH_CACHE_DIR  cache directory (default $XDG_CACHE_HOME/tsh or
+ *                 $HOME/.cache/tsh)
+ *  TSH_CACHE_MAX  size cap in bytes, with optional K/M/G suffix
+ *                 (default 256M); least recently used entries are evicted
+ *  TSH_CACHE_ENV  colon-separated list of environment variables whose
+ *                 values are part of the key
+ */
+
+#ifndef __TSH_CACHE_H__
+#define __TSH_CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Identifies one cached output */
+struct cache_key {
+    uint64_t hi;
+    uint64_t lo;
+};
+
+/* Computes the key for argv with the given input file (may be NULL) */
+bool cache_make_key(char *const argv[], const char *infile,
+                    struct cache_key *key);
+
+/* Returns true if an entry for key is present (counts a hit or a miss) */
+bool cache_lookup(const struct cache_key *key);
+
+/* Copies the entry for key to dst_fd; false if it could not be restored */
+bool cache_restore(const struct cache_key *key, int dst_fd);
+
+/*
+ * Stores the contents of path under key.  If consume is true, path must be
+ * a scratch file from cache_scratch_path() and is moved into place;
+ * otherwise its data is cloned.
+ */
+bool cache_store(const struct cache_key *key, const char *path, bool consume);
+
+/* Returns a scratch file name inside the cache directory, or NULL */
+const char *cache_scratch_path(void);
+
+/* Copies all data from src_fd to dst_fd using the cheapest available path */
+bool cache_copy_fd(int dst_fd, int src_fd);
+
+/* Prints hit/miss/size statistics */
+void cache_print_stats(int output_fd);
+
+/* Removes every entry */
+void cache_clear(void);
+
+/* Loads the index now rather than on first use (e.g. before forking) */
+void cache_warm(void);
+
+#endif /* __TSH_CACHE_H__ */
@@ -0,0 +1,262 @@
+/**
+ * @file tsh_cgroup.c
+ * @brief cgroup v2 limits for jobs that declare their resources
+ *
+ * All paths are resolved relative to a descriptor of the shell's cgroup
+ * directory, opened once.  Job cgroups are named job-<n> with n counting
+ * up, so a job ID that is reused never meets the cgroup of an earlier job
+ * that could not be removed yet.
+ */
+
+#include "tsh_cgroup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CPU_PERIOD_US 100000
+
+static enum { CG_UNKNOWN, CG_ON, CG_OFF } state = CG_UNKNOWN;
+static char status[PATH_MAX + 64] = "not enforced";
+static char base_path[PATH_MAX];
+static int base_fd = -1;
+static bool created_base; // base_path is tsh-<pid>, made by the shell
+static unsigned next_id = 1;
+
+/* Finds the mount point of the unified hierarchy; false if none */
+static bool find_mount(char *buf, size_t size) {
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+    if (f == NULL) {
+        return false;
+    }
+    char line[4096];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        // id parent major:minor root mountpoint options... - fstype ...
+        char *sep = strstr(line, " - ");
+        if (sep == NULL || strncmp(sep + 3, "cgroup2 ", 8) != 0) {
+            continue;
+        }
+        char *field = line;
+        for (int i = 0; i < 4 && field != NULL; i++) {
+            field = strchr(field, ' ');
+            field = field != NULL ? field + 1 : NULL;
+        }
+        size_t len = field != NULL ? strcspn(field, " ") : 0;
+        if (len > 0 && len < size) {
+            memcpy(buf, field, len);
+            buf[len] = '\0';
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/* Finds the shell's own cgroup in the unified hierarchy, e.g. "/user" */
+static bool find_own(char *buf, size_t size) {
+    FILE *f = fopen("/proc/self/cgroup", "re");
+    if (f == NULL) {
+        return false;
+    }
+    char line[4096];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            found = strlen(line + 3) < size;
+            if (found) {
+                strcpy(buf, line + 3);
+            }
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/* Writes text to file in directory dirfd; false with errno set on failure */
+static bool write_at(int dirfd, const char *file, const char *text) {
+    int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n = write(fd, text, strlen(text));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n == (ssize_t)strlen(text);
+}
+
+/* True if the controllers file of dirfd lists both cpu and memory */
+static bool has_controllers(int dirfd) {
+    char buf[512];
+    int fd = openat(dirfd, "cgroup.controllers", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return false;
+    }
+    buf[n] = '\0';
+    char *save;
+    bool cpu = false, memory = false;
+    for (char *w = strtok_r(buf, " \n", &save); w != NULL;
+         w = strtok_r(NULL, " \n", &save)) {
+        cpu = cpu || strcmp(w, "cpu") == 0;
+        memory = memory || strcmp(w, "memory") == 0;
+    }
+    return cpu && memory;
+}
+
+static bool give_up(const char *why) {
+    snprintf(status, sizeof(status), "not enforced (%s)", why);
+    if (base_fd >= 0) {
+        close(base_fd);
+        base_fd = -1;
+    }
+    if (created_base) {
+        rmdir(base_path);
+        created_base = false;
+    }
+    state = CG_OFF;
+    return false;
+}
+
+/**
+ * @brief Opens (or creates) the shell's cgroup directory and enables the
+ * cpu and memory controllers for the job cgroups below it
+ */
+bool cgroup_init(void) {
+    if (state != CG_UNKNOWN) {
+        return state == CG_ON;
+    }
+    const char *env = getenv("TSH_CGROUP");
+    if (env != NULL && env[0] != '\0') {
+        snprintf(base_path, sizeof(base_path), "%s", env);
+    } else {
+        char mount[PATH_MAX], own[PATH_MAX];
+        if (!find_mount(mount, sizeof(mount))) {
+            return give_up("no cgroup v2 hierarchy");
+        }
+        if (!find_own(own, sizeof(own))) {
+            return give_up("shell not in the cgroup v2 hierarchy");
+        }
+        const char *sub = strcmp(own, "/") == 0 ? "" : own;
+        char parent_path[PATH_MAX];
+        snprintf(parent_path, sizeof(parent_path), "%s%s", mount, sub);
+        if (snprintf(base_path, sizeof(base_path), "%s/tsh-%d", parent_path,
+                     (int)getpid()) >= (int)sizeof(base_path)) {
+            return give_up("cgroup path too long");
+        }
+
+        // Controllers can only be handed down from a cgroup without
+        // processes of its own (or from the root), which usually rules out
+        // the shell's; a delegated $TSH_CGROUP is the way around that
+        int parent = open(parent_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (parent < 0 || !has_controllers(parent)) {
+            if (parent >= 0) {
+                close(parent);
+            }
+            return give_up("cpu and memory controllers unavailable");
+        }
+        bool delegated =
+            write_at(parent, "cgroup.subtree_control", "+cpu +memory");
+        close(parent);
+        if (!delegated) {
+            return give_up("cannot delegate cpu and memory; set TSH_CGROUP");
+        }
+        if (mkdir(base_path, 0755) < 0 && errno != EEXIST) {
+            return give_up(strerror(errno));
+        }
+        created_base = true;
+    }
+
+    base_fd = open(base_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0) {
+        char why[PATH_MAX + 64];
+        snprintf(why, sizeof(why), "%s: %s", base_path, strerror(errno));
+        return give_up(why);
+    }
+    if (!has_controllers(base_fd) ||
+        !write_at(base_fd, "cgroup.subtree_control", "+cpu +memory")) {
+        return give_up("cpu and memory controllers unavailable");
+    }
+    snprintf(status, sizeof(status), "enforced in %s", base_path);
+    state = CG_ON;
+    return true;
+}
+
+const char *cgroup_status(void) {
+    return status;
+}
+
+unsigned cgroup_create(int64_t cpu_milli, int64_t mem_bytes, int *procs_fd) {
+    *procs_fd = -1;
+    if (!cgroup_init()) {
+        return 0;
+    }
+    unsigned id = next_id++;
+    char name[32], path[64], value[64];
+    snprintf(name, sizeof(name), "job-%u", id);
+    if (mkdirat(base_fd, name, 0755) < 0) {
+        return 0;
+    }
+    bool ok = true;
+    if (cpu_milli > 0) {
+        snprintf(path, sizeof(path), "%s/cpu.max", name);
+        snprintf(value, sizeof(value), "%lld %d",
+                 (long long)(cpu_milli * CPU_PERIOD_US / 1000), CPU_PERIOD_US);
+        ok = write_at(base_fd, path, value);
+    }
+    if (ok && mem_bytes > 0) {
+        snprintf(path, sizeof(path), "%s/memory.max", name);
+        snprintf(value, sizeof(value), "%lld", (long long)mem_bytes);
+        ok = write_at(base_fd, path, value);
+    }
+    snprintf(path, sizeof(path), "%s/cgroup.procs", name);
+    if (ok) {
+        *procs_fd = openat(base_fd, path, O_WRONLY | O_CLOEXEC);
+    }
+    if (*procs_fd < 0) {
+        unlinkat(base_fd, name, AT_REMOVEDIR);
+        return 0;
+    }
+    return id;
+}
+
+bool cgroup_freeze(unsigned id, bool frozen) {
+    if (id == 0 || base_fd < 0) {
+        return false;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "job-%u/cgroup.freeze", id);
+    return write_at(base_fd, path, frozen ? "1" : "0");
+}
+
+void cgroup_remove(unsigned id) {
+    if (id == 0 || base_fd < 0) {
+        return;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "job-%u", id);
+    unlinkat(base_fd, name, AT_REMOVEDIR);
+}
+
+void cgroup_cleanup(void) {
+    if (state != CG_ON) {
+        return;
+    }
+    for (unsigned id = 1; id < next_id; id++) {
+        cgroup_remove(id);
+    }
+    if (created_base) {
+        rmdir(base_path);
+    }
+}
@@ -0,0 +1,53 @@
+/**
+ * @file tsh_cgroup.h
+ * @brief cgroup v2 limits for jobs that declare their resources
+ *
+ * Jobs launched with &[cpu=N,mem=SIZE] each get a cgroup of their own
+ * whose cpu.max and memory.max enforce what they declared.  The cgroups
+ * live in a directory of the shell's: $TSH_CGROUP if it is set (a
+ * delegated cgroup the shell may manage), otherwise tsh-<pid> created
+ * next to the shell in its own cgroup.  Enforcement needs the unified
+ * (v2) hierarchy with the cpu and memory controllers available there;
+ * without them jobs run unconfined, and only the shell's admission
+ * control keeps them within the budget.
+ *
+ * A forked child joins its cgroup by writing to a descriptor of the
+ * cgroup's cgroup.procs before it execs, so that every process of the job
+ * is inside from the start.
+ */
+
+#ifndef __TSH_CGROUP_H__
+#define __TSH_CGROUP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sets up the shell's cgroup directory on first use.  Returns false if
+ * limits cannot be enforced; the reason is left in cgroup_status().
+ */
+bool cgroup_init(void);
+
+/* Describes whether and where limits are enforced */
+const char *cgroup_status(void);
+
+/*
+ * Creates the cgroup of a job with the given limits (0 for none).  Returns
+ * an ID for cgroup_remove() and sets *procs_fd to a descriptor of its
+ * cgroup.procs, for the child to write "0" to; returns 0 on failure.
+ */
+unsigned cgroup_create(int64_t cpu_milli, int64_t mem_bytes, int *procs_fd);
+
+/*
+ * Freezes or thaws every process of a job's cgroup (cgroup.freeze).  The
+ * processes are not told, unlike with SIGSTOP.  Returns false on failure.
+ */
+bool cgroup_freeze(unsigned id, bool frozen);
+
+/* Removes a job's cgroup once its processes are gone; harmless if not */
+void cgroup_remove(unsigned id);
+
+/* Removes the shell's cgroup directory at exit, if the shell created it */
+void cgroup_cleanup(void);
+
+#endif /* __TSH_CGROUP_H__ */
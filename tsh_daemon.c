@@ -0,0 +1,391 @@
+/**
+ * @file tsh_daemon.c
+ * @brief Shell daemon mode: one warm shell process serving many clients
+ *
+ * Protocol, over a SOCK_STREAM Unix socket:
+ *  client -> daemon  struct hello, carrying stdin, stdout, stderr and the
+ *                    working directory as SCM_RIGHTS descriptors, followed
+ *                    by env_len bytes of NUL-terminated "NAME=value" strings
+ *  session -> client the session's pid (int32)
+ *  session -> client the session's exit status (int32), as it exits
+ *
+ * The daemon forks as soon as a connection is accepted, so a slow client
+ * never holds up the accept loop; the handshake is read in the session.
+ *
+ * A session is not in the client terminal's foreground process group and
+ * so cannot read the terminal itself.  When its stdin is a terminal, the
+ * client passes a pipe instead and relays what the user types into it.
+ */
+
+#define _GNU_SOURCE // on_exit
+
+#include "tsh_daemon.h"
+#include "csapp.h"
+#include "tsh_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HELLO_MAGIC 0x74736831 // "tsh1"
+#define HELLO_NFDS 4           // stdin, stdout, stderr, cwd
+#define HELLO_PROMPT 0x1
+#define MAX_ENV_BYTES (1 << 20)
+
+struct hello {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t env_len;
+};
+
+/* Session pid the client forwards signals to */
+static volatile pid_t session_pid;
+
+/* Reads exactly n bytes; false on EOF or error */
+static bool read_full(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t nr = read(fd, p, n);
+        if (nr < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nr <= 0) {
+            return false;
+        }
+        p += nr;
+        n -= (size_t)nr;
+    }
+    return true;
+}
+
+static void send_int(int fd, int32_t val) {
+    send(fd, &val, sizeof(val), MSG_NOSIGNAL);
+}
+
+/* on_exit hook of a session: tell the client how the shell exited */
+static void report_exit(int status, void *arg) {
+    send_int((int)(intptr_t)arg, status);
+}
+
+static int make_socket(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        sio_eprintf("%s: socket path too long\n", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+/*
+ * Makes way for a new socket at path.  Only a stale socket is removed:
+ * anything else, or a socket a live daemon still accepts on, is left
+ * alone and the daemon does not start.
+ */
+static bool claim_path(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        perror(path);
+        return false;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        sio_eprintf("%s: exists and is not a socket\n", path);
+        return false;
+    }
+    struct sockaddr_un addr;
+    int fd = make_socket(path, &addr);
+    if (fd < 0) {
+        perror("socket");
+        return false;
+    }
+    int rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    int err = errno;
+    close(fd);
+    if (rc == 0) {
+        sio_eprintf("%s: a daemon is already serving this socket\n", path);
+        return false;
+    }
+    if (err != ECONNREFUSED) {
+        errno = err;
+        perror(path);
+        return false;
+    }
+    if (unlink(path) < 0) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+/* True if the peer of conn runs as the daemon's own user */
+static bool peer_allowed(int conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        perror("SO_PEERCRED");
+        return false;
+    }
+    if (cred.uid != geteuid()) {
+        sio_eprintf("tsh: refused a client of uid %d\n", (int)cred.uid);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Completes the handshake in a freshly forked session.  Returns false if
+ * the client went away or sent garbage.
+ */
+static bool start_session(int conn, bool *emit_prompt) {
+    struct hello hello;
+    char control[CMSG_SPACE(HELLO_NFDS * sizeof(int))];
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != (ssize_t)sizeof(hello) || hello.magic != HELLO_MAGIC ||
+        hello.env_len > MAX_ENV_BYTES || cmsg == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(HELLO_NFDS * sizeof(int))) {
+        return false;
+    }
+    int fds[HELLO_NFDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    // The strings are handed to putenv, so the block must stay allocated
+    char *env = malloc(hello.env_len + 1);
+    if (env == NULL || !read_full(conn, env, hello.env_len)) {
+        return false;
+    }
+    env[hello.env_len] = '\0';
+    clearenv();
+    for (char *p = env; p < env + hello.env_len; p += strlen(p) + 1) {
+        if (strchr(p, '=') != NULL) {
+            putenv(p);
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) < 0) {
+            return false;
+        }
+        close(fds[i]);
+    }
+    if (fchdir(fds[3]) < 0) {
+        perror("fchdir");
+    }
+    close(fds[3]);
+
+    *emit_prompt = (hello.flags & HELLO_PROMPT) != 0;
+    send_int(conn, (int32_t)getpid());
+    on_exit(report_exit, (void *)(intptr_t)conn);
+    return true;
+}
+
+/**
+ * @brief Accepts clients forever, forking a session for each
+ *
+ * Returns only in a session process.
+ */
+void daemon_serve(const char *path, bool *emit_prompt) {
+    struct sockaddr_un addr;
+    if (!claim_path(path)) {
+        exit(1);
+    }
+    int lfd = make_socket(path, &addr);
+    if (lfd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 128) < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    // Work done here is inherited by every session; the cache index is
+    // reloaded in a session whenever another one has changed the cache
+    cache_warm();
+
+    // Sessions are reaped automatically; the daemon never waits for them
+    Signal(SIGCHLD, SIG_IGN);
+    Signal(SIGPIPE, SIG_IGN);
+
+    while (true) {
+        int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            continue;
+        }
+        if (!peer_allowed(conn)) {
+            close(conn);
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(lfd);
+            Signal(SIGCHLD, SIG_DFL);
+            Signal(SIGPIPE, SIG_DFL);
+            if (!start_session(conn, emit_prompt)) {
+                _exit(1);
+            }
+            return;
+        }
+        if (pid < 0) {
+            perror("fork");
+        }
+        close(conn);
+    }
+}
+
+static void forward_signal(int sig) {
+    int olderrno = errno;
+    if (session_pid > 0) {
+        kill(session_pid, sig);
+    }
+    errno = olderrno;
+}
+
+/* Copies terminal input into the session's stdin pipe until end of file */
+static int relay(int sock, int tty, int pipe_wr) {
+    struct pollfd pfds[2] = {{sock, POLLIN, 0}, {tty, POLLIN, 0}};
+    char buf[4096];
+
+    while (true) {
+        int nfds = (pipe_wr >= 0) ? 2 : 1;
+        if (poll(pfds, (nfds_t)nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (pfds[0].revents != 0) {
+            return 0; // session reported its status or went away
+        }
+        if (nfds == 2 && pfds[1].revents != 0) {
+            ssize_t n = read(tty, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || sio_writen(pipe_wr, buf, (size_t)n) < 0) {
+                close(pipe_wr);
+                pipe_wr = -1;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Attaches to a daemon and stays until the session ends
+ *
+ * @return The session's exit status, 1 if the daemon is unreachable, or
+ *         128 + SIGHUP if the session went away without reporting one
+ *         (killed by a signal, or the daemon died)
+ */
+int daemon_attach(const char *path, bool emit_prompt) {
+    struct sockaddr_un addr;
+    int sock = make_socket(path, &addr);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    int in_fd = STDIN_FILENO;
+    int pipe_fds[2] = {-1, -1};
+    if (isatty(STDIN_FILENO)) {
+        if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        in_fd = pipe_fds[0];
+    }
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) {
+        cwd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    size_t env_len = 0;
+    for (char **e = environ; *e != NULL; e++) {
+        env_len += strlen(*e) + 1;
+    }
+    char *env = malloc(env_len > 0 ? env_len : 1);
+    if (env == NULL) {
+        return 1;
+    }
+    char *p = env;
+    for (char **e = environ; *e != NULL; e++) {
+        size_t len = strlen(*e) + 1;
+        memcpy(p, *e, len);
+        p += len;
+    }
+
+    struct hello hello = {HELLO_MAGIC, emit_prompt ? HELLO_PROMPT : 0,
+                          (uint32_t)env_len};
+    int fds[HELLO_NFDS] = {in_fd, STDOUT_FILENO, STDERR_FILENO, cwd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t pid;
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(hello) ||
+        sio_writen(sock, env, env_len) < 0 ||
+        !read_full(sock, &pid, sizeof(pid))) {
+        sio_eprintf("%s: handshake with daemon failed\n", path);
+        return 1;
+    }
+    free(env);
+    close(cwd);
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+    }
+
+    session_pid = pid;
+    Signal(SIGINT, forward_signal);
+    Signal(SIGTSTP, forward_signal);
+    Signal(SIGQUIT, forward_signal);
+
+    if (pipe_fds[1] >= 0) {
+        relay(sock, STDIN_FILENO, pipe_fds[1]);
+    }
+    int32_t status;
+    if (!read_full(sock, &status, sizeof(status))) {
+        sio_eprintf("%s: session ended without an exit status\n", path);
+        status = 128 + SIGHUP;
+    }
+    return status;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file tsh_daemon.h
+ * @brief Shell daemon mode: one warm shell process serving many clients
+ *
+ * `tsh -D path` listens on a Unix socket.  `tsh -A path` connects to it and
+ * hands over its standard descriptors, working directory and environment;
+ * the daemon forks a session for it, and the session runs the ordinary
+ * read/eval loop with its own job list.  Everything the daemon set up
+ * before accepting (loaded libraries, the cache index, ...) is inherited by
+ * every session instead of being rebuilt per shell.
+ *
+ * Of the shell's caches only the output cache (tsh_cache.h) is shared
+ * between sessions, through its directory.  The glob pattern cache is per
+ * session, and the shell has no PATH lookup or compiled-script cache to
+ * share.
+ *
+ * The daemon only serves clients running as its own user (SO_PEERCRED),
+ * whatever the socket file's mode, and will not replace a path that is
+ * not a socket or a socket another daemon is serving.
+ *
+ * The client stays attached until the session exits, forwards Ctrl-C,
+ * Ctrl-Z and SIGQUIT to it, and exits with the session's exit status
+ * (128 + SIGHUP if the session is lost before it reports one).
+ */
+
+#ifndef __TSH_DAEMON_H__
+#define __TSH_DAEMON_H__
+
+#include <stdbool.h>
+
+/*
+ * Serves sessions on the socket at path.  Returns only in a forked session
+ * process, after its descriptors, directory and environment have been set
+ * up, with *emit_prompt set as the client asked.  On a setup failure the
+ * daemon exits.
+ */
+void daemon_serve(const char *path, bool *emit_prompt);
+
+/* Runs a client session against the daemon at path; returns exit status */
+int daemon_attach(const char *path, bool emit_prompt);
+
+#endif /* __TSH_DAEMON_H__ */
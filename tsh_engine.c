@@ -0,0 +1,589 @@
+/**
+ * @file tsh_engine.c
+ * @brief Embeddable job engine (libtsh): tsh command semantics for hosts
+ *
+ * Jobs are started with posix_spawn(), which glibc implements with
+ * CLONE_VM | CLONE_VFORK, so launching stays cheap even from a host with a
+ * large address space.  Each child is tracked by a pidfd registered in the
+ * engine's epoll instance; a finished child makes its pidfd (and therefore
+ * the epoll descriptor) readable, and is reaped with waitid(P_PIDFD), which
+ * never touches children that belong to someone else.  No SIGCHLD handler
+ * is needed.
+ *
+ * Job IDs index the job array directly and the epoll events carry the job
+ * ID, so completing a job is O(1) regardless of how many are running.
+ */
+
+#define _GNU_SOURCE // waitid(P_PIDFD)
+
+#include "tsh_engine.h"
+#include "csapp.h"
+#include "tsh_helper.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/* A slot in the job table; pidfd < 0 marks a free slot */
+struct engine_job {
+    pid_t pid;
+    int pidfd;
+    tsh_job_state state;
+    int exit_code;
+    char *cmdline;
+    size_t cmdline_cap;
+};
+
+struct tsh_engine {
+    int epfd;
+    struct engine_job *jobs; // indexed by jid; slot 0 is unused
+    tsh_jid cap;
+    tsh_jid max_jid;         // highest jid in use
+    size_t count;            // live jobs
+    volatile tsh_jid fg;     // foreground job, read by signal handlers
+    struct tsh_engine_options opts;
+};
+
+/*
+ * The engine that receives forwarded SIGINT/SIGTSTP.  This is the only
+ * process-wide state, and it is set only when a host asks for forwarding.
+ */
+static tsh_engine *volatile signal_engine;
+
+static int pidfd_open(pid_t pid) {
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+static struct engine_job *get_job(const tsh_engine *eng, tsh_jid jid) {
+    if (jid < 1 || jid > eng->max_jid || eng->jobs[jid].pidfd < 0) {
+        return NULL;
+    }
+    return &eng->jobs[jid];
+}
+
+static void forward_handler(int sig) {
+    int olderrno = errno;
+    tsh_engine *eng = signal_engine;
+    if (eng != NULL) {
+        tsh_jid jid = eng->fg;
+        if (jid > 0 && jid <= eng->max_jid && eng->jobs[jid].pidfd >= 0) {
+            killpg(eng->jobs[jid].pid, sig);
+        }
+    }
+    errno = olderrno;
+}
+
+/**
+ * @brief Creates an engine
+ *
+ * @param[in] opts Options, or NULL for defaults
+ * @return The engine, or NULL if it could not be created
+ */
+tsh_engine *tsh_engine_create(const struct tsh_engine_options *opts) {
+    tsh_engine *eng = calloc(1, sizeof(*eng));
+    if (eng == NULL) {
+        return NULL;
+    }
+    if (opts != NULL) {
+        eng->opts = *opts;
+    } else {
+        eng->opts.output_fd = STDOUT_FILENO;
+    }
+    eng->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (eng->epfd < 0) {
+        free(eng);
+        return NULL;
+    }
+    if (eng->opts.forward_signals) {
+        signal_engine = eng;
+        Signal(SIGINT, forward_handler);
+        Signal(SIGTSTP, forward_handler);
+    }
+    return eng;
+}
+
+/* Removes a finished job from the table */
+static void release_job(tsh_engine *eng, tsh_jid jid) {
+    struct engine_job *job = &eng->jobs[jid];
+    epoll_ctl(eng->epfd, EPOLL_CTL_DEL, job->pidfd, NULL);
+    close(job->pidfd);
+    job->pidfd = -1;
+    eng->count--;
+    if (eng->fg == jid) {
+        eng->fg = 0;
+    }
+    while (eng->max_jid > 0 && eng->jobs[eng->max_jid].pidfd < 0) {
+        eng->max_jid--;
+    }
+}
+
+/**
+ * @brief Kills and reaps any remaining jobs, then frees the engine
+ */
+void tsh_engine_destroy(tsh_engine *eng) {
+    if (eng == NULL) {
+        return;
+    }
+    if (signal_engine == eng) {
+        Signal(SIGINT, SIG_DFL);
+        Signal(SIGTSTP, SIG_DFL);
+        signal_engine = NULL;
+    }
+    for (tsh_jid jid = 1; jid <= eng->max_jid; jid++) {
+        struct engine_job *job = &eng->jobs[jid];
+        if (job->pidfd >= 0) {
+            siginfo_t si;
+            killpg(job->pid, SIGKILL);
+            while (waitid(P_PIDFD, (id_t)job->pidfd, &si, WEXITED) < 0 &&
+                   errno == EINTR) {
+            }
+            close(job->pidfd);
+            job->pidfd = -1;
+        }
+    }
+    for (tsh_jid jid = 1; jid < eng->cap; jid++) {
+        free(eng->jobs[jid].cmdline);
+    }
+    free(eng->jobs);
+    close(eng->epfd);
+    free(eng);
+}
+
+int tsh_engine_fd(const tsh_engine *eng) {
+    return eng->epfd;
+}
+
+/* Adds a job for a freshly spawned child; returns its jid, or 0 */
+static tsh_jid track_job(tsh_engine *eng, pid_t pid, int pidfd,
+                         const char *cmdline) {
+    tsh_jid jid = eng->max_jid + 1;
+    if (jid >= eng->cap) {
+        tsh_jid cap = (eng->cap == 0) ? 64 : 2 * eng->cap;
+        struct engine_job *grown = realloc(eng->jobs, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return 0;
+        }
+        memset(grown + eng->cap, 0, (cap - eng->cap) * sizeof(*grown));
+        for (tsh_jid i = eng->cap; i < cap; i++) {
+            grown[i].pidfd = -1;
+        }
+        eng->jobs = grown;
+        eng->cap = cap;
+    }
+
+    struct engine_job *job = &eng->jobs[jid];
+    size_t len = strlen(cmdline);
+    if (job->cmdline_cap < len + 1) {
+        char *buf = realloc(job->cmdline, len + 1);
+        if (buf == NULL) {
+            return 0;
+        }
+        job->cmdline = buf;
+        job->cmdline_cap = len + 1;
+    }
+    memcpy(job->cmdline, cmdline, len + 1);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32_t)jid;
+    if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, pidfd, &ev) < 0) {
+        return 0;
+    }
+
+    job->pid = pid;
+    job->pidfd = pidfd;
+    job->state = TSH_JOB_RUNNING;
+    job->exit_code = -1;
+    eng->max_jid = jid;
+    eng->count++;
+    return jid;
+}
+
+/* Opens a redirection, reporting errors the way the shell does */
+static int open_redirect(tsh_engine *eng, const char *path, bool output) {
+    int fd = output ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                           S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+                    : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        sio_dprintf(eng->opts.output_fd, "%s: %s\n", path,
+                    errno == ENOENT ? "No such file or directory"
+                                    : "Permission denied");
+    }
+    return fd;
+}
+
+/* Spawns the command in token as a new job in its own process group */
+static tsh_jid launch(tsh_engine *eng, const char *cmdline,
+                      const struct cmdline_tokens *token) {
+    int infd = -1;
+    int outfd = -1;
+    if (token->infile != NULL &&
+        (infd = open_redirect(eng, token->infile, false)) < 0) {
+        return 0;
+    }
+    if (token->outfile != NULL &&
+        (outfd = open_redirect(eng, token->outfile, true)) < 0) {
+        if (infd >= 0) {
+            close(infd);
+        }
+        return 0;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none, defaults;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    if (infd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO);
+    }
+    if (outfd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    }
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                        POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, token->argv[0], &actions, &attr, token->argv,
+                          environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (infd >= 0) {
+        close(infd);
+    }
+    if (outfd >= 0) {
+        close(outfd);
+    }
+    if (err != 0) {
+        sio_dprintf(eng->opts.output_fd, "%s: %s\n", token->argv[0],
+                    err == ENOENT ? "No such file or directory"
+                                  : "Permission denied");
+        return 0;
+    }
+
+    // The child cannot have been reaped yet, so its pid is still valid
+    int pidfd = pidfd_open(pid);
+    tsh_jid jid = (pidfd >= 0) ? track_job(eng, pid, pidfd, cmdline) : 0;
+    if (jid == 0) {
+        sio_dprintf(eng->opts.output_fd, "%s: cannot track job: %s\n",
+                    token->argv[0], strerror(errno));
+        killpg(pid, SIGKILL);
+        if (pidfd >= 0) {
+            siginfo_t si;
+            waitid(P_PIDFD, (id_t)pidfd, &si, WEXITED);
+            close(pidfd);
+        } else {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return jid;
+}
+
+/*
+ * Collects the status of jid.  With block set, waits for it to exit or, if
+ * stop is also set, to stop.  Returns true if the job finished, in which
+ * case the callback has run and the job has been released.
+ */
+static bool collect(tsh_engine *eng, tsh_jid jid, bool block, bool stop,
+                    int *exit_code) {
+    struct engine_job *job = &eng->jobs[jid];
+    siginfo_t si;
+    int flags = WEXITED | (block ? 0 : WNOHANG) | (stop ? WSTOPPED : 0);
+
+    memset(&si, 0, sizeof(si));
+    while (waitid(P_PIDFD, (id_t)job->pidfd, &si, flags) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    if (si.si_pid == 0) {
+        return false;
+    }
+    if (si.si_code == CLD_STOPPED) {
+        job->state = TSH_JOB_STOPPED;
+        if (eng->fg == jid) {
+            eng->fg = 0;
+        }
+        sio_dprintf(eng->opts.output_fd, "Job [%d] (%d) stopped by signal %d\n",
+                    (int)jid, (int)job->pid, si.si_status);
+        return false;
+    }
+
+    if (si.si_code == CLD_EXITED) {
+        job->exit_code = si.si_status;
+    } else {
+        job->exit_code = 128 + si.si_status;
+        sio_dprintf(eng->opts.output_fd,
+                    "Job [%d] (%d) terminated by signal %d\n", (int)jid,
+                    (int)job->pid, si.si_status);
+    }
+    job->state = TSH_JOB_DONE;
+    if (exit_code != NULL) {
+        *exit_code = job->exit_code;
+    }
+
+    if (eng->opts.on_complete != NULL) {
+        struct tsh_job_info info = {jid, job->pid, job->state, job->exit_code,
+                                    job->cmdline};
+        eng->opts.on_complete(eng, &info, eng->opts.arg);
+    }
+    release_job(eng, jid);
+    return true;
+}
+
+/* Waits for the foreground job to finish or stop; -1 if it stopped */
+static int wait_fg(tsh_engine *eng, tsh_jid jid) {
+    int exit_code = -1;
+    eng->fg = jid;
+    if (!collect(eng, jid, true, true, &exit_code)) {
+        exit_code = -1;
+    }
+    eng->fg = 0;
+    return exit_code;
+}
+
+/* Resolves a "%jid" or "pid" argument of bg/fg */
+static tsh_jid resolve_job(tsh_engine *eng, const char *name,
+                           const char *arg) {
+    bool is_jid = (arg[0] == '%');
+    int num = atoi(is_jid ? arg + 1 : arg);
+    if (num <= 0) {
+        sio_dprintf(eng->opts.output_fd,
+                    "%s: argument must be a PID or %%jobid\n", name);
+        return 0;
+    }
+    if (is_jid) {
+        if (get_job(eng, num) != NULL) {
+            return num;
+        }
+    } else {
+        for (tsh_jid jid = 1; jid <= eng->max_jid; jid++) {
+            if (eng->jobs[jid].pidfd >= 0 && eng->jobs[jid].pid == num) {
+                return jid;
+            }
+        }
+    }
+    sio_dprintf(eng->opts.output_fd, "%s: No such job\n", arg);
+    return 0;
+}
+
+/**
+ * @brief Evaluates a command line as the interactive shell would
+ */
+int tsh_engine_eval(tsh_engine *eng, const char *cmdline, tsh_jid *jid_out,
+                    int *exit_code) {
+    struct cmdline_tokens token;
+    parseline_return parse_result = parseline(cmdline, &token);
+
+    if (jid_out != NULL) {
+        *jid_out = 0;
+    }
+    if (exit_code != NULL) {
+        *exit_code = 0;
+    }
+    if (parse_result == PARSELINE_ERROR) {
+        return -1;
+    }
+    if (parse_result == PARSELINE_EMPTY) {
+        return 0;
+    }
+
+    switch (token.builtin) {
+    case BUILTIN_QUIT:
+        sio_dprintf(eng->opts.output_fd, "quit: not available in an engine\n");
+        return -1;
+    case BUILTIN_JOBS: {
+        int fd = eng->opts.output_fd;
+        if (token.outfile != NULL && (fd = open_redirect(eng, token.outfile,
+                                                         true)) < 0) {
+            return -1;
+        }
+        tsh_engine_list_jobs(eng, fd);
+        if (fd != eng->opts.output_fd) {
+            close(fd);
+        }
+        return 0;
+    }
+    case BUILTIN_BG:
+    case BUILTIN_FG: {
+        const char *name = token.builtin == BUILTIN_BG ? "bg" : "fg";
+        if (token.argc == 1) {
+            sio_dprintf(eng->opts.output_fd,
+                        "%s command requires PID or %%jobid argument\n", name);
+            return -1;
+        }
+        tsh_jid jid = resolve_job(eng, name, token.argv[1]);
+        if (jid == 0) {
+            return -1;
+        }
+        struct engine_job *job = &eng->jobs[jid];
+        job->state = TSH_JOB_RUNNING;
+        killpg(job->pid, SIGCONT);
+        if (token.builtin == BUILTIN_BG) {
+            sio_dprintf(eng->opts.output_fd, "[%d] (%d) %s\n", (int)jid,
+                        (int)job->pid, job->cmdline);
+        } else {
+            int code = wait_fg(eng, jid);
+            if (exit_code != NULL) {
+                *exit_code = code;
+            }
+        }
+        return 0;
+    }
+    case BUILTIN_NONE:
+        break;
+    }
+
+    tsh_jid jid = launch(eng, cmdline, &token);
+    if (jid == 0) {
+        return -1;
+    }
+    if (parse_result == PARSELINE_BG) {
+        if (jid_out != NULL) {
+            *jid_out = jid;
+        }
+        return 0;
+    }
+    int code = wait_fg(eng, jid);
+    if (exit_code != NULL) {
+        *exit_code = code;
+    }
+    return 0;
+}
+
+/**
+ * @brief Starts cmdline as a background job
+ *
+ * @return The new job ID, or 0 on failure
+ */
+tsh_jid tsh_engine_spawn(tsh_engine *eng, const char *cmdline) {
+    struct cmdline_tokens token;
+    parseline_return parse_result = parseline(cmdline, &token);
+    if (parse_result == PARSELINE_ERROR || parse_result == PARSELINE_EMPTY ||
+        token.builtin != BUILTIN_NONE) {
+        return 0;
+    }
+    return launch(eng, cmdline, &token);
+}
+
+/**
+ * @brief Reaps finished jobs and reports them to the completion callback
+ */
+int tsh_engine_poll(tsh_engine *eng, int timeout_ms) {
+    struct epoll_event events[64];
+    int reported = 0;
+
+    int n = epoll_wait(eng->epfd, events, 64, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        tsh_jid jid = (tsh_jid)events[i].data.u32;
+        if (get_job(eng, jid) != NULL && collect(eng, jid, false, false, NULL)) {
+            reported++;
+        }
+    }
+    return reported;
+}
+
+/**
+ * @brief Blocks until jid finishes
+ *
+ * @return The job's exit code, or -1 if jid is not a live job
+ */
+int tsh_engine_wait(tsh_engine *eng, tsh_jid jid) {
+    int exit_code = -1;
+    if (get_job(eng, jid) == NULL || !collect(eng, jid, true, false,
+                                              &exit_code)) {
+        return -1;
+    }
+    return exit_code;
+}
+
+int tsh_engine_signal(tsh_engine *eng, tsh_jid jid, int sig) {
+    struct engine_job *job = get_job(eng, jid);
+    if (job == NULL) {
+        errno = ESRCH;
+        return -1;
+    }
+    if (sig == SIGCONT && job->state == TSH_JOB_STOPPED) {
+        job->state = TSH_JOB_RUNNING;
+    }
+    return killpg(job->pid, sig);
+}
+
+bool tsh_engine_job(const tsh_engine *eng, tsh_jid jid,
+                    struct tsh_job_info *info) {
+    struct engine_job *job = get_job(eng, jid);
+    if (job == NULL) {
+        return false;
+    }
+    info->jid = jid;
+    info->pid = job->pid;
+    info->state = job->state;
+    info->exit_code = job->exit_code;
+    info->cmdline = job->cmdline;
+    return true;
+}
+
+size_t tsh_engine_job_count(const tsh_engine *eng) {
+    return eng->count;
+}
+
+/**
+ * @brief Writes the job table to fd, batching lines into few writes
+ */
+bool tsh_engine_list_jobs(const tsh_engine *eng, int fd) {
+    char buf[4096];
+    size_t used = 0;
+
+    for (tsh_jid jid = 1; jid <= eng->max_jid; jid++) {
+        const struct engine_job *job = &eng->jobs[jid];
+        if (job->pidfd < 0) {
+            continue;
+        }
+        const char *state_str = (jid == eng->fg)                   ? "Foreground"
+                                : (job->state == TSH_JOB_STOPPED) ? "Stopped"
+                                                                   : "Running";
+        char line[MAXLINE_TSH + 64];
+        size_t n = sio_snprintf(line, sizeof(line), "[%d] (%d) %s %s\n",
+                                (int)jid, (int)job->pid, state_str,
+                                job->cmdline);
+        if (n >= sizeof(line)) {
+            n = sizeof(line) - 1;
+        }
+        if (used + n > sizeof(buf)) {
+            if (sio_writen(fd, buf, used) < 0) {
+                return false;
+            }
+            used = 0;
+        }
+        memcpy(buf + used, line, n);
+        used += n;
+    }
+    return used == 0 || sio_writen(fd, buf, used) >= 0;
+}
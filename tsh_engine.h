@@ -0,0 +1,120 @@
+/**
+ * @file tsh_engine.h
+ * @brief Embeddable job engine (libtsh): tsh command semantics for hosts
+ *
+ * An engine runs tsh command lines ("prog args [< in] [> out] [&]" and the
+ * jobs, bg and fg builtins) on behalf of a host process, and tracks the
+ * resulting jobs in its own job table.  Several engines can coexist; an
+ * engine holds no process-wide state and, unless asked to, installs no
+ * signal handlers and never calls wait on children it did not start.
+ *
+ * The engine implements the core command language only: programs with
+ * their arguments, < and > redirections, & and the jobs, bg and fg
+ * builtins.  The interactive shell's other builtins, @tags, &[...]
+ * options and scheduling are not part of it; its launch and reaping paths
+ * are its own, built on posix_spawn and pidfds rather than on the shell's
+ * SIGCHLD handler.  tests/test_engine.c and tests/test_engine_cpp.cpp
+ * exercise both APIs.
+ *
+ * Completion is event driven: every job is tracked through a pidfd, and
+ * tsh_engine_fd() returns a descriptor that becomes readable whenever a
+ * job has finished.  A host adds it to its own poll loop and calls
+ * tsh_engine_poll() when it fires, which reaps the finished jobs and
+ * invokes the completion callback for each.
+ *
+ * Requires Linux 5.4 or later (pidfd_open and waitid(P_PIDFD)).  The host
+ * must not reap the engine's children itself, e.g. with waitpid(-1).
+ */
+
+#ifndef __TSH_ENGINE_H__
+#define __TSH_ENGINE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tsh_engine tsh_engine;
+
+/* Job IDs are positive; they may be reused after a job is reported done */
+typedef int tsh_jid;
+
+typedef enum tsh_job_state {
+    TSH_JOB_RUNNING,
+    TSH_JOB_STOPPED,
+    TSH_JOB_DONE
+} tsh_job_state;
+
+/* A snapshot of one job */
+struct tsh_job_info {
+    tsh_jid jid;
+    pid_t pid;           // process and process group ID
+    tsh_job_state state;
+    int exit_code;       // when done: status, or 128 + signal number
+    const char *cmdline; // valid until the job is released
+};
+
+/* Called from tsh_engine_poll() or tsh_engine_wait() as each job ends */
+typedef void tsh_completion_fn(tsh_engine *engine,
+                               const struct tsh_job_info *job, void *arg);
+
+struct tsh_engine_options {
+    tsh_completion_fn *on_complete; // may be NULL
+    void *arg;                      // passed to on_complete
+    int output_fd;       // builtin output and error messages (default 1)
+    bool forward_signals; // install SIGINT/SIGTSTP handlers that forward
+                          // to this engine's foreground job
+};
+
+/* Creates an engine; opts may be NULL for defaults.  NULL on failure. */
+tsh_engine *tsh_engine_create(const struct tsh_engine_options *opts);
+
+/* Kills (SIGKILL) and reaps any remaining jobs, then frees the engine */
+void tsh_engine_destroy(tsh_engine *engine);
+
+/* Readable when at least one job has finished; never closed by the host */
+int tsh_engine_fd(const tsh_engine *engine);
+
+/*
+ * Evaluates a command line as the shell would.  Foreground commands and
+ * the fg builtin wait for the job; *exit_code receives its status (-1 if it
+ * stopped).  Background commands return immediately; *jid receives the new
+ * job ID.  Either pointer may be NULL.  Returns 0 on success, -1 if the
+ * line could not be parsed or the program could not be started.
+ */
+int tsh_engine_eval(tsh_engine *engine, const char *cmdline, tsh_jid *jid,
+                    int *exit_code);
+
+/* Starts cmdline as a background job whether or not it ends in '&' */
+tsh_jid tsh_engine_spawn(tsh_engine *engine, const char *cmdline);
+
+/*
+ * Reaps finished jobs, waiting up to timeout_ms (0: don't wait, -1:
+ * forever) for the first one.  Returns the number of jobs reported.
+ */
+int tsh_engine_poll(tsh_engine *engine, int timeout_ms);
+
+/* Blocks until jid finishes; returns its exit code, or -1 if unknown */
+int tsh_engine_wait(tsh_engine *engine, tsh_jid jid);
+
+/* Sends sig to the job's process group */
+int tsh_engine_signal(tsh_engine *engine, tsh_jid jid, int sig);
+
+/* Looks up a job; false if jid is not a live job */
+bool tsh_engine_job(const tsh_engine *engine, tsh_jid jid,
+                    struct tsh_job_info *info);
+
+/* Number of jobs not yet reported done */
+size_t tsh_engine_job_count(const tsh_engine *engine);
+
+/* Writes the job table to fd in the format of the jobs builtin */
+bool tsh_engine_list_jobs(const tsh_engine *engine, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TSH_ENGINE_H__ */
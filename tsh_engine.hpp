@@ -0,0 +1,116 @@
+/**
+ * @file tsh_engine.hpp
+ * @brief RAII C++ wrapper around the libtsh job engine
+ *
+ * tsh::Engine owns a tsh_engine and destroys it (killing and reaping any
+ * jobs still running) when it goes out of scope.  Completion callbacks can
+ * be any callable.
+ *
+ *     tsh::Engine engine([](const tsh_job_info &job) {
+ *         std::printf("[%d] exited %d\n", job.jid, job.exit_code);
+ *     });
+ *     engine.spawn("/bin/sleep 1");
+ *     while (engine.job_count() > 0) {
+ *         engine.poll(-1);
+ *     }
+ */
+
+#ifndef __TSH_ENGINE_HPP__
+#define __TSH_ENGINE_HPP__
+
+#include "tsh_engine.h"
+
+#include <functional>
+#include <new>
+#include <string>
+#include <utility>
+
+namespace tsh {
+
+class Engine {
+  public:
+    using Callback = std::function<void(const tsh_job_info &)>;
+
+    explicit Engine(Callback on_complete = nullptr, int output_fd = 1,
+                    bool forward_signals = false)
+        : callback_(new Callback(std::move(on_complete))) {
+        tsh_engine_options opts{};
+        opts.on_complete = &Engine::trampoline;
+        opts.arg = callback_;
+        opts.output_fd = output_fd;
+        opts.forward_signals = forward_signals;
+        engine_ = tsh_engine_create(&opts);
+        if (engine_ == nullptr) {
+            delete callback_;
+            throw std::bad_alloc();
+        }
+    }
+
+    ~Engine() {
+        tsh_engine_destroy(engine_);
+        delete callback_;
+    }
+
+    Engine(const Engine &) = delete;
+    Engine &operator=(const Engine &) = delete;
+
+    Engine(Engine &&other) noexcept
+        : engine_(std::exchange(other.engine_, nullptr)),
+          callback_(std::exchange(other.callback_, nullptr)) {}
+
+    Engine &operator=(Engine &&other) noexcept {
+        if (this != &other) {
+            tsh_engine_destroy(engine_);
+            delete callback_;
+            engine_ = std::exchange(other.engine_, nullptr);
+            callback_ = std::exchange(other.callback_, nullptr);
+        }
+        return *this;
+    }
+
+    /* Descriptor that becomes readable when a job finishes */
+    int fd() const { return tsh_engine_fd(engine_); }
+
+    /* Runs a command line; returns the foreground exit code (0 for '&') */
+    int run(const std::string &cmdline, tsh_jid *jid = nullptr) {
+        int exit_code = 0;
+        if (tsh_engine_eval(engine_, cmdline.c_str(), jid, &exit_code) < 0) {
+            return -1;
+        }
+        return exit_code;
+    }
+
+    /* Starts a background job; returns its job ID, or 0 */
+    tsh_jid spawn(const std::string &cmdline) {
+        return tsh_engine_spawn(engine_, cmdline.c_str());
+    }
+
+    /* Reports finished jobs; see tsh_engine_poll() */
+    int poll(int timeout_ms = 0) { return tsh_engine_poll(engine_, timeout_ms); }
+
+    /* Blocks until jid finishes and returns its exit code */
+    int wait(tsh_jid jid) { return tsh_engine_wait(engine_, jid); }
+
+    bool signal(tsh_jid jid, int sig) {
+        return tsh_engine_signal(engine_, jid, sig) == 0;
+    }
+
+    std::size_t job_count() const { return tsh_engine_job_count(engine_); }
+
+    tsh_engine *get() const { return engine_; }
+
+  private:
+    static void trampoline(tsh_engine *, const tsh_job_info *job, void *arg) {
+        auto *callback = static_cast<Callback *>(arg);
+        if (*callback) {
+            (*callback)(*job);
+        }
+    }
+
+    tsh_engine *engine_;
+    Callback *callback_; // heap-allocated so its address survives moves
+};
+
+} // namespace tsh
+
+#endif /* __TSH_ENGINE_HPP__ */
@@ -0,0 +1,917 @@
+/**
+ * @file tsh_helper.c
+ * @brief Command line parser and job list for the tiny shell
+ *
+ * Job list layout: jobs live in an array indexed directly by job ID, so
+ * every per-job accessor is a bounds check and a load.  Process IDs map to
+ * job IDs through a linear-probing hash table with backward-shift deletion
+ * (no tombstones), and the foreground job is tracked explicitly, so
+ * job_from_pid() and fg_job() are O(1) as well.
+ *
+ * Each tag keeps the IDs of its jobs in a sorted array, so that a builtin
+ * acting on @tag visits only the tagged jobs.  A new job always gets the
+ * largest job ID in use, so tagging appends; deleting a job removes it
+ * from its tags' arrays with a binary search and a memmove.
+ *
+ * The signal handlers call delete_job(), job_set_state(), job_kill() and
+ * the lookup functions, so none of those may allocate or free memory.  All growth
+ * happens in add_job(), which the shell calls with signals blocked, and a
+ * deleted job keeps its command line buffer for reuse by the next job that
+ * takes its slot.
+ */
+
+#include "tsh_helper.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+const char prompt[] = "tsh> ";
+bool verbose = false;
+
+/* A slot in the job list; state == UNDEF marks a free slot */
+struct job_t {
+    pid_t pid;
+    int pidfd;          // refers to pid's process, or -1
+    int64_t start_ns;   // CLOCK_MONOTONIC
+    job_state state;
+    char *cmdline;      // NUL-terminated command line
+    size_t cmdline_cap; // capacity of cmdline, kept across reuse
+    char note[64];      // shown by list_jobs() after the state, or ""
+    int prio;           // see job_set_prio()
+    int ntags;
+    unsigned tags[MAXTAGS]; // indices into tag_list
+};
+
+/* The jobs carrying a tag */
+struct tag_index {
+    char name[MAXTAGLEN];
+    jid_t *jids; // sorted
+    size_t count, cap;
+};
+
+/* A slot in the pid -> jid hash table; pid == 0 marks an empty slot */
+struct pid_slot {
+    pid_t pid;
+    jid_t jid;
+};
+
+static struct job_t *job_list; // indexed by jid; slot 0 is unused
+static jid_t job_cap;          // number of allocated slots
+static jid_t max_jid;          // highest jid in use, 0 if none
+static jid_t fg_jid;           // the foreground job, 0 if none
+static size_t job_count;       // number of jobs in use
+static size_t state_count[PR + 1]; // number of jobs in each state
+
+static struct pid_slot *pid_table;
+static size_t pid_mask; // table size - 1 (size is a power of two)
+
+static struct tag_index *tag_list; // every tag seen, never shrunk
+static size_t ntag_list;
+
+/*****************
+ * Command line parsing
+ *****************/
+
+/**
+ * @brief Parses a command line into arguments and I/O redirections
+ *
+ * @param[in] cmdline The command line to parse
+ * @param[out] token Receives the parsed tokens; argument strings are stored
+ *                   in token->_buf, so they remain valid as long as token
+ * @return PARSELINE_FG or PARSELINE_BG for a command, PARSELINE_EMPTY for a
+ *         blank line and PARSELINE_ERROR on a syntax error
+ *
+ * Arguments are separated by whitespace and may be quoted with single or
+ * double quotes.  A word starting with '<' or '>' names the input or output
+ * file (the file name may be attached or the next word).  A final "&"
+ * requests a background job, as does a final "&[options]", whose options
+ * (without the brackets) are left in token->bg_opts for the caller.
+ * Unquoted words starting with '@' before the command are tags for the
+ * job (token->tags), e.g. "@etl @nightly load.sh &".
+ */
+parseline_return parseline(const char *cmdline, struct cmdline_tokens *token) {
+    static const char delims[] = " \t\r\n";
+    enum { ST_NORMAL, ST_INFILE, ST_OUTFILE } parse_state = ST_NORMAL;
+
+    size_t len = strnlen(cmdline, MAXLINE_TSH - 1);
+    memcpy(token->_buf, cmdline, len);
+    token->_buf[len] = '\0';
+
+    token->argc = 0;
+    token->infile = NULL;
+    token->outfile = NULL;
+    token->bg_opts = NULL;
+    token->ntags = 0;
+    token->builtin = BUILTIN_NONE;
+
+    char *buf = token->_buf;
+    char *end = buf + len;
+
+    while (buf < end) {
+        buf += strspn(buf, delims);
+        if (buf >= end) {
+            break;
+        }
+
+        if (*buf == '<' || *buf == '>') {
+            if (parse_state != ST_NORMAL) {
+                sio_eprintf("Error: Ambiguous I/O redirection\n");
+                return PARSELINE_ERROR;
+            }
+            if (*buf == '<') {
+                if (token->infile != NULL) {
+                    sio_eprintf("Error: Ambiguous I/O redirection\n");
+                    return PARSELINE_ERROR;
+                }
+                parse_state = ST_INFILE;
+            } else {
+                if (token->outfile != NULL) {
+                    sio_eprintf("Error: Ambiguous I/O redirection\n");
+                    return PARSELINE_ERROR;
+                }
+                parse_state = ST_OUTFILE;
+            }
+            buf++;
+            continue;
+        }
+
+        char *word;
+        char *word_end;
+        bool quoted = *buf == '\'' || *buf == '"';
+        if (quoted) {
+            word = buf + 1;
+            word_end = strchr(word, *buf);
+            if (word_end == NULL) {
+                sio_eprintf("Error: unmatched %c.\n", *buf);
+                return PARSELINE_ERROR;
+            }
+        } else {
+            word = buf;
+            word_end = buf + strcspn(buf, delims);
+        }
+        buf = (word_end < end) ? word_end + 1 : end;
+        *word_end = '\0';
+
+        switch (parse_state) {
+        case ST_INFILE:
+            token->infile = word;
+            break;
+        case ST_OUTFILE:
+            token->outfile = word;
+            break;
+        case ST_NORMAL:
+            if (token->argc == 0 && !quoted && word[0] == '@' &&
+                word[1] != '\0') {
+                if (token->ntags >= MAXTAGS ||
+                    strlen(word + 1) >= MAXTAGLEN) {
+                    sio_eprintf("Error: Too many or too long tags.\n");
+                    return PARSELINE_ERROR;
+                }
+                token->tags[token->ntags++] = word + 1;
+                break;
+            }
+            if (token->argc >= MAXARGS - 1) {
+                sio_eprintf("Error: Too many arguments.\n");
+                return PARSELINE_ERROR;
+            }
+            token->argv[token->argc++] = word;
+            break;
+        }
+        parse_state = ST_NORMAL;
+    }
+
+    if (parse_state != ST_NORMAL) {
+        sio_eprintf("Error: must provide file name for redirection\n");
+        return PARSELINE_ERROR;
+    }
+
+    token->argv[token->argc] = NULL;
+
+    parseline_return result = PARSELINE_FG;
+    char *last = token->argc > 0 ? token->argv[token->argc - 1] : NULL;
+    size_t last_len = last != NULL ? strlen(last) : 0;
+    if (last != NULL && strcmp(last, "&") == 0) {
+        result = PARSELINE_BG;
+        token->argv[--token->argc] = NULL;
+    } else if (last != NULL && strncmp(last, "&[", 2) == 0 &&
+               last[last_len - 1] == ']') {
+        result = PARSELINE_BG;
+        last[last_len - 1] = '\0';
+        token->bg_opts = last + 2;
+        token->argv[--token->argc] = NULL;
+    }
+
+    if (token->argc == 0) {
+        return PARSELINE_EMPTY;
+    }
+
+    const char *name = token->argv[0];
+    if (strcmp(name, "quit") == 0) {
+        token->builtin = BUILTIN_QUIT;
+    } else if (strcmp(name, "jobs") == 0) {
+        token->builtin = BUILTIN_JOBS;
+    } else if (strcmp(name, "bg") == 0) {
+        token->builtin = BUILTIN_BG;
+    } else if (strcmp(name, "fg") == 0) {
+        token->builtin = BUILTIN_FG;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Prints a help message and exits
+ */
+void usage(void) {
+    printf("Usage: shell [-hvp] [-c command | -D socket | -A socket]\n");
+    printf("   -h   print this message\n");
+    printf("   -v   print additional diagnostic information\n");
+    printf("   -p   do not emit a command prompt\n");
+    printf("   -c   run command (a list of commands or pipelines) and exit\n");
+    printf("   -D   run as a daemon serving sessions on socket\n");
+    printf("   -A   attach to the daemon listening on socket\n");
+    exit(1);
+}
+
+/**
+ * @brief SIGQUIT handler: lets a test driver terminate the shell cleanly
+ */
+void sigquit_handler(int sig) {
+    sio_printf("Terminating after receipt of SIGQUIT signal\n");
+    _exit(1);
+}
+
+/*****************
+ * Pid hash table
+ *****************/
+
+static size_t pid_hash(pid_t pid) {
+    return (size_t)(((uint64_t)(uint32_t)pid * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+/* Returns the slot holding pid, or the empty slot where it would go */
+static size_t pid_find(pid_t pid) {
+    size_t i = pid_hash(pid) & pid_mask;
+    while (pid_table[i].pid != 0 && pid_table[i].pid != pid) {
+        i = (i + 1) & pid_mask;
+    }
+    return i;
+}
+
+static void pid_insert(pid_t pid, jid_t jid) {
+    size_t i = pid_find(pid);
+    pid_table[i].pid = pid;
+    pid_table[i].jid = jid;
+}
+
+/* Removes pid, shifting later entries of its probe run back into place */
+static void pid_remove(pid_t pid) {
+    size_t i = pid_find(pid);
+    if (pid_table[i].pid == 0) {
+        return;
+    }
+    pid_table[i].pid = 0;
+
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & pid_mask;
+        if (pid_table[j].pid == 0) {
+            return;
+        }
+        size_t home = pid_hash(pid_table[j].pid) & pid_mask;
+        // Move j into the hole at i unless its home lies cyclically in (i, j]
+        bool stays = (i <= j) ? (i < home && home <= j)
+                              : (i < home || home <= j);
+        if (!stays) {
+            pid_table[i] = pid_table[j];
+            pid_table[j].pid = 0;
+            i = j;
+        }
+    }
+}
+
+/* Keeps the load factor at or below one half; called only from add_job */
+static bool pid_reserve(size_t count) {
+    size_t size = pid_mask + 1;
+    if (pid_table != NULL && 2 * count <= size) {
+        return true;
+    }
+
+    size_t new_size = (pid_table == NULL) ? 64 : 2 * size;
+    while (2 * count > new_size) {
+        new_size *= 2;
+    }
+    struct pid_slot *old = pid_table;
+    pid_table = calloc(new_size, sizeof(*pid_table));
+    if (pid_table == NULL) {
+        pid_table = old;
+        return false;
+    }
+    pid_mask = new_size - 1;
+    if (old != NULL) {
+        for (size_t i = 0; i < size; i++) {
+            if (old[i].pid != 0) {
+                pid_insert(old[i].pid, old[i].jid);
+            }
+        }
+        free(old);
+    }
+    return true;
+}
+
+/*****************
+ * Job list
+ *****************/
+
+/**
+ * @brief Initializes the job list to empty
+ */
+void init_job_list(void) {
+    job_list = NULL;
+    job_cap = 0;
+    max_jid = 0;
+    fg_jid = 0;
+    job_count = 0;
+    memset(state_count, 0, sizeof(state_count));
+    pid_table = NULL;
+    pid_mask = 0;
+    pid_reserve(0);
+}
+
+/**
+ * @brief Frees all memory held by the job list
+ */
+void destroy_job_list(void) {
+    for (jid_t jid = 1; jid < job_cap; jid++) {
+        if (job_list[jid].state != UNDEF && job_list[jid].pidfd >= 0) {
+            close(job_list[jid].pidfd);
+        }
+        free(job_list[jid].cmdline);
+    }
+    for (size_t t = 0; t < ntag_list; t++) {
+        free(tag_list[t].jids);
+    }
+    free(tag_list);
+    tag_list = NULL;
+    ntag_list = 0;
+    free(job_list);
+    free(pid_table);
+    job_list = NULL;
+    pid_table = NULL;
+    job_cap = 0;
+    max_jid = 0;
+    fg_jid = 0;
+    job_count = 0;
+    memset(state_count, 0, sizeof(state_count));
+}
+
+/* Recently finished jobs, a ring indexed by exit number */
+static struct job_exit exits[JOB_EXITS];
+static size_t nexits; // exits recorded so far
+
+static int64_t monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline struct job_t *get_job(jid_t jid) {
+    if (jid < 1 || jid > max_jid || job_list[jid].state == UNDEF) {
+        return NULL;
+    }
+    return &job_list[jid];
+}
+
+/**
+ * @brief Adds a job to the job list
+ *
+ * @param[in] pid The process ID (and process group ID) of the job, or 0
+ *            for a pending job
+ * @param[in] state FG, BG, ST or PD
+ * @param[in] cmdline The command line, copied into the job
+ * @return The new job ID, or 0 on failure
+ *
+ * The new job receives the job ID one greater than the largest job ID in
+ * use, as in other shells.
+ */
+jid_t add_job(pid_t pid, job_state state, const char *cmdline) {
+    if ((pid < 1 && state != PD) || state == UNDEF ||
+        (state == FG && fg_jid != 0)) {
+        return 0;
+    }
+    if (!pid_reserve(job_count + 1)) {
+        return 0;
+    }
+
+    jid_t jid = max_jid + 1;
+    if (jid >= job_cap) {
+        jid_t new_cap = (job_cap == 0) ? 64 : 2 * job_cap;
+        struct job_t *grown = realloc(job_list, new_cap * sizeof(*grown));
+        if (grown == NULL) {
+            return 0;
+        }
+        memset(grown + job_cap, 0, (new_cap - job_cap) * sizeof(*grown));
+        job_list = grown;
+        job_cap = new_cap;
+    }
+
+    struct job_t *job = &job_list[jid];
+    size_t len = strlen(cmdline);
+    if (job->cmdline_cap < len + 1) {
+        size_t cap = len + 1 < 64 ? 64 : len + 1;
+        char *buf = realloc(job->cmdline, cap);
+        if (buf == NULL) {
+            return 0;
+        }
+        job->cmdline = buf;
+        job->cmdline_cap = cap;
+    }
+    memcpy(job->cmdline, cmdline, len + 1);
+    job->note[0] = '\0';
+    job->prio = 0;
+    job->ntags = 0;
+    job->pid = 0;
+    job->pidfd = -1;
+    job->state = state;
+    job->start_ns = monotonic_now();
+    max_jid = jid;
+    job_count++;
+    state_count[state]++;
+    if (pid > 0) {
+        job_set_pid(jid, pid);
+    }
+    if (state == FG) {
+        fg_jid = jid;
+    }
+    return jid;
+}
+
+/* Returns the index in tag->jids of the first job ID >= jid */
+static size_t tag_search(const struct tag_index *tag, jid_t jid) {
+    size_t lo = 0, hi = tag->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tag->jids[mid] < jid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Takes jid out of a tag; async-signal-safe */
+static void tag_remove(struct tag_index *tag, jid_t jid) {
+    size_t i = tag_search(tag, jid);
+    if (i < tag->count && tag->jids[i] == jid) {
+        memmove(&tag->jids[i], &tag->jids[i + 1],
+                (tag->count - i - 1) * sizeof(*tag->jids));
+        tag->count--;
+    }
+}
+
+/**
+ * @brief Deletes a job from the job list
+ *
+ * @return true if the job existed
+ *
+ * Safe to call from a signal handler: this never frees memory.
+ */
+bool delete_job(jid_t jid) {
+    struct job_t *job = get_job(jid);
+    if (job == NULL) {
+        return false;
+    }
+
+    if (job->pid != 0) {
+        pid_remove(job->pid);
+    }
+    if (job->pidfd >= 0) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+    for (int i = 0; i < job->ntags; i++) {
+        tag_remove(&tag_list[job->tags[i]], jid);
+    }
+    job->ntags = 0;
+    job->pid = 0;
+    state_count[job->state]--;
+    job->state = UNDEF;
+    job_count--;
+    if (fg_jid == jid) {
+        fg_jid = 0;
+    }
+    while (max_jid > 0 && job_list[max_jid].state == UNDEF) {
+        max_jid--;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the job ID of the foreground job, or 0 if there is none
+ */
+jid_t fg_job(void) {
+    return fg_jid;
+}
+
+/**
+ * @brief Returns the job ID of the job with the given pid, or 0
+ */
+jid_t job_from_pid(pid_t pid) {
+    if (pid < 1 || pid_table == NULL) {
+        return 0;
+    }
+    size_t i = pid_find(pid);
+    return pid_table[i].pid == pid ? pid_table[i].jid : 0;
+}
+
+bool job_exists(jid_t jid) {
+    return get_job(jid) != NULL;
+}
+
+pid_t job_get_pid(jid_t jid) {
+    struct job_t *job = get_job(jid);
+    return job != NULL ? job->pid : 0;
+}
+
+const char *job_get_cmdline(jid_t jid) {
+    struct job_t *job = get_job(jid);
+    return job != NULL ? job->cmdline : NULL;
+}
+
+job_state job_get_state(jid_t jid) {
+    struct job_t *job = get_job(jid);
+    return job != NULL ? job->state : UNDEF;
+}
+
+/**
+ * @brief Changes the state of a job, keeping the foreground job in sync
+ */
+void job_set_state(jid_t jid, job_state state) {
+    struct job_t *job = get_job(jid);
+    if (job == NULL || state == UNDEF) {
+        return;
+    }
+    if (fg_jid == jid && state != FG) {
+        fg_jid = 0;
+    }
+    if (state == FG) {
+        if (fg_jid != 0 && fg_jid != jid) {
+            return;
+        }
+        fg_jid = jid;
+    }
+    state_count[job->state]--;
+    state_count[state]++;
+    job->state = state;
+}
+
+/**
+ * @brief Gives a job its process, once it has been started
+ *
+ * Must be called with SIGCHLD blocked since the fork, so that pid cannot
+ * have been reaped yet and the pidfd is sure to refer to the job's
+ * process.  Running out of descriptors is not fatal: job_kill() then
+ * falls back to the pid.
+ */
+void job_set_pid(jid_t jid, pid_t pid) {
+    struct job_t *job = get_job(jid);
+    if (job == NULL || job->pid != 0 || pid < 1) {
+        return;
+    }
+    job->pid = pid;
+    job->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    job->start_ns = monotonic_now();
+    pid_insert(pid, jid);
+}
+
+/**
+ * @brief Sets the note list_jobs() shows for a job, truncating it to fit
+ */
+void job_set_note(jid_t jid, const char *note) {
+    struct job_t *job = get_job(jid);
+    if (job != NULL) {
+        sio_snprintf(job->note, sizeof(job->note), "%s", note);
+    }
+}
+
+void job_set_prio(jid_t jid, int prio) {
+    struct job_t *job = get_job(jid);
+    if (job != NULL) {
+        job->prio = prio;
+    }
+}
+
+int job_get_prio(jid_t jid) {
+    struct job_t *job = get_job(jid);
+    return job != NULL ? job->prio : 0;
+}
+
+size_t job_count_state(job_state state) {
+    return state <= PR ? state_count[state] : 0;
+}
+
+/* Returns the index of the named tag in tag_list, or ntag_list if none */
+static size_t tag_find(const char *name) {
+    size_t t = 0;
+    while (t < ntag_list && strcmp(tag_list[t].name, name) != 0) {
+        t++;
+    }
+    return t;
+}
+
+/**
+ * @brief Adds a tag to a job, indexing the job under it
+ *
+ * Must be called with signals blocked: it may grow the index, which the
+ * SIGCHLD handler reads through delete_job().
+ */
+bool job_add_tag(jid_t jid, const char *tag) {
+    struct job_t *job = get_job(jid);
+    if (job == NULL || strlen(tag) >= MAXTAGLEN) {
+        return false;
+    }
+    size_t t = tag_find(tag);
+    for (int i = 0; i < job->ntags; i++) {
+        if (job->tags[i] == t) {
+            return true;
+        }
+    }
+    if (job->ntags == MAXTAGS) {
+        return false;
+    }
+    if (t == ntag_list) {
+        struct tag_index *grown =
+            realloc(tag_list, (ntag_list + 1) * sizeof(*grown));
+        if (grown == NULL) {
+            return false;
+        }
+        tag_list = grown;
+        tag_list[t] = (struct tag_index){.jids = NULL, .count = 0, .cap = 0};
+        sio_snprintf(tag_list[t].name, MAXTAGLEN, "%s", tag);
+        ntag_list++;
+    }
+    struct tag_index *index = &tag_list[t];
+    if (index->count == index->cap) {
+        size_t cap = index->cap ? 2 * index->cap : 16;
+        jid_t *grown = realloc(index->jids, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return false;
+        }
+        index->jids = grown;
+        index->cap = cap;
+    }
+    // Usually the largest job ID, so this moves nothing
+    size_t i = tag_search(index, jid);
+    memmove(&index->jids[i + 1], &index->jids[i],
+            (index->count - i) * sizeof(*index->jids));
+    index->jids[i] = jid;
+    index->count++;
+    job->tags[job->ntags++] = (unsigned)t;
+    return true;
+}
+
+const jid_t *job_tagged(const char *tag, size_t *count) {
+    size_t t = tag_find(tag);
+    if (t == ntag_list || tag_list[t].count == 0) {
+        *count = 0;
+        return NULL;
+    }
+    *count = tag_list[t].count;
+    return tag_list[t].jids;
+}
+
+/**
+ * @brief Prints the job list to output_fd, one line per job
+ *
+ * @return false if writing to output_fd failed
+ */
+bool list_jobs(int output_fd) {
+    return list_jobs_of(output_fd, NULL, 0);
+}
+
+/**
+ * @brief Prints the given jobs as list_jobs() does, skipping any that no
+ * longer exist
+ *
+ * @param[in] jids The jobs, or NULL for all of them
+ * @return false if writing to output_fd failed
+ *
+ * Lines are batched into a single buffer so that listing many jobs costs
+ * one write per few kilobytes of output rather than one per job.
+ */
+bool list_jobs_of(int output_fd, const jid_t *jids, size_t count) {
+    char buf[4096];
+    size_t used = 0;
+
+    if (jids == NULL) {
+        count = (size_t)max_jid;
+    }
+    for (size_t i = 0; i < count; i++) {
+        jid_t jid = jids != NULL ? jids[i] : (jid_t)(i + 1);
+        struct job_t *job = get_job(jid);
+        if (job == NULL) {
+            continue;
+        }
+        const char *state_str;
+        switch (job->state) {
+        case FG:
+            state_str = "Foreground";
+            break;
+        case BG:
+            state_str = "Running";
+            break;
+        case ST:
+            state_str = "Stopped";
+            break;
+        case PD:
+            state_str = "Pending";
+            break;
+        case PR:
+            state_str = "Preempted";
+            break;
+        default:
+            continue;
+        }
+
+        while (true) {
+            size_t n = sio_snprintf(
+                buf + used, sizeof(buf) - used, "[%d] (%d) %s %s%s%s\n",
+                (int)jid, (int)job->pid, state_str, job->note,
+                job->note[0] != '\0' ? " " : "", job->cmdline);
+            if (used + n < sizeof(buf)) {
+                used += n;
+                break;
+            }
+            if (used == 0) {
+                // A single line larger than the buffer: write it truncated
+                used = sizeof(buf) - 1;
+                break;
+            }
+            if (sio_writen(output_fd, buf, used) < 0) {
+                return false;
+            }
+            used = 0;
+        }
+    }
+
+    if (used > 0 && sio_writen(output_fd, buf, used) < 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Iterates over the job list in job ID order
+ *
+ * @return The first job ID greater than jid, or 0 if there is none
+ */
+jid_t job_next(jid_t jid) {
+    for (jid_t next = (jid < 0 ? 0 : jid) + 1; next <= max_jid; next++) {
+        if (job_list[next].state != UNDEF) {
+            return next;
+        }
+    }
+    return 0;
+}
+
+int job_get_pidfd(jid_t jid) {
+    struct job_t *job = get_job(jid);
+    return job != NULL ? job->pidfd : -1;
+}
+
+/**
+ * @brief Signals a job's process group
+ *
+ * The job's pidfd is first probed with signal 0.  That fails once the
+ * process has exited, whereas the group ID could by then belong to an
+ * unrelated group.  Once the probe succeeds the process is alive or an
+ * unreaped zombie, and since the caller has SIGCHLD blocked it stays
+ * unreaped, so its group ID cannot be reused before the killpg().
+ */
+int job_kill(jid_t jid, int sig) {
+    struct job_t *job = get_job(jid);
+    if (job == NULL || job->pid == 0) {
+        errno = ESRCH;
+        return -1;
+    }
+    if (job->pidfd >= 0 &&
+        syscall(SYS_pidfd_send_signal, job->pidfd, 0, NULL, 0) < 0) {
+        return -1;
+    }
+    return killpg(job->pid, sig);
+}
+
+/**
+ * @brief Records what became of a job, before delete_job()
+ *
+ * The record is written in place in a fixed ring, so this is safe to call
+ * from the SIGCHLD handler.
+ */
+void job_record_exit(jid_t jid, int status, const struct rusage *ru,
+                     const struct job_delays *delays) {
+    struct job_t *job = get_job(jid);
+    if (job == NULL) {
+        return;
+    }
+    struct job_exit *e = &exits[nexits % JOB_EXITS];
+    e->jid = jid;
+    e->pid = job->pid;
+    e->status = status;
+    e->start_ns = job->start_ns;
+    e->end_ns = monotonic_now();
+    e->user_ns = (int64_t)ru->ru_utime.tv_sec * 1000000000 +
+                 (int64_t)ru->ru_utime.tv_usec * 1000;
+    e->sys_ns = (int64_t)ru->ru_stime.tv_sec * 1000000000 +
+                (int64_t)ru->ru_stime.tv_usec * 1000;
+    e->maxrss_kb = ru->ru_maxrss;
+    if (delays != NULL) {
+        e->delays = *delays;
+    } else {
+        e->delays.valid = false;
+    }
+    size_t len = strlen(job->cmdline);
+    if (len >= sizeof(e->cmdline)) {
+        len = sizeof(e->cmdline) - 1;
+    }
+    memcpy(e->cmdline, job->cmdline, len);
+    e->cmdline[len] = '\0';
+    nexits++;
+}
+
+size_t job_exit_count(void) {
+    return nexits;
+}
+
+const struct job_exit *job_exit_get(size_t n) {
+    if (n >= nexits || nexits - n > JOB_EXITS) {
+        return NULL;
+    }
+    return &exits[n % JOB_EXITS];
+}
+
+size_t format_ns(char *buf, size_t size, int64_t ns) {
+    if (ns < 0) {
+        ns = 0;
+    }
+    return sio_snprintf(buf, size, "%ld.%03lds", (long)(ns / 1000000000),
+                        (long)(ns / 1000000 % 1000));
+}
+
+/**
+ * @brief Lists the remembered exits with their resource use
+ *
+ * Each line shows how the job ended, its wall-clock, user and system time
+ * and peak RSS, and, when delay accounting collected them, how long it
+ * waited for a CPU, for block I/O and for swap-in.
+ */
+bool list_job_exits(int output_fd) {
+    size_t first = nexits > JOB_EXITS ? nexits - JOB_EXITS : 0;
+    for (size_t n = first; n < nexits; n++) {
+        const struct job_exit *e = &exits[n % JOB_EXITS];
+        char how[32], real[32], user[32], sys[32], wait[128];
+        if (WIFEXITED(e->status) && WEXITSTATUS(e->status) == 0) {
+            sio_snprintf(how, sizeof(how), "Done");
+        } else if (WIFEXITED(e->status)) {
+            sio_snprintf(how, sizeof(how), "Exit %d", WEXITSTATUS(e->status));
+        } else {
+            sio_snprintf(how, sizeof(how), "Signal %d", WTERMSIG(e->status));
+        }
+        format_ns(real, sizeof(real), e->end_ns - e->start_ns);
+        format_ns(user, sizeof(user), e->user_ns);
+        format_ns(sys, sizeof(sys), e->sys_ns);
+        wait[0] = '\0';
+        if (e->delays.valid) {
+            char cpu[32], blkio[32], swapin[32];
+            format_ns(cpu, sizeof(cpu), (int64_t)e->delays.cpu_ns);
+            format_ns(blkio, sizeof(blkio), (int64_t)e->delays.blkio_ns);
+            if (e->delays.has_swapin) {
+                format_ns(swapin, sizeof(swapin),
+                          (int64_t)e->delays.swapin_ns);
+            } else {
+                sio_snprintf(swapin, sizeof(swapin), "-");
+            }
+            sio_snprintf(wait, sizeof(wait),
+                         " wait cpu %s blkio %s swapin %s", cpu, blkio,
+                         swapin);
+        }
+        if (sio_dprintf(output_fd,
+                        "[%d] (%d) %s real %s user %s sys %s rss %ldK%s "
+                        "%s\n",
+                        (int)e->jid, (int)e->pid, how, real, user, sys,
+                        e->maxrss_kb, wait, e->cmdline) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,204 @@
+/**
+ * @file tsh_helper.h
+ * @brief Command line parser and job list for the tiny shell
+ *
+ * The parser tokenizes a command line in place inside the token structure,
+ * so parsing never allocates.  The job list is indexed both by job ID (a
+ * dense array) and by process ID (an open-addressing hash table), so every
+ * lookup used on the shell's hot paths is O(1).
+ *
+ * Each job holds a pidfd for its process (where the descriptor limit
+ * allows), which job_kill() uses to make sure the job's process group is
+ * still the one the shell started before signalling it.
+ *
+ * Unless noted otherwise, the job list functions must be called with
+ * SIGCHLD, SIGINT and SIGTSTP blocked, since the signal handlers modify
+ * the list.
+ */
+
+#ifndef __TSH_HELPER_H__
+#define __TSH_HELPER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Misc manifest constants */
+#define MAXLINE_TSH 1024 /* max line size */
+#define MAXARGS 128      /* max args on a command line */
+#define MAXTAGS 4        /* max @tags on a command line */
+#define MAXTAGLEN 32     /* max length of a tag, with the NUL */
+
+/* Job ID type */
+typedef int jid_t;
+
+/*
+ * Job states: FG (foreground), BG (background), ST (stopped),
+ * PD (pending), PR (preempted)
+ * Job state transitions and enabling actions:
+ *     FG -> ST  : ctrl-z
+ *     ST -> FG  : fg command
+ *     ST -> BG  : bg command
+ *     BG -> FG  : fg command
+ *     PD -> BG  : the scheduler starts the job, or bg command
+ *     PD -> FG  : fg command
+ *     BG -> PR  : a foreground job starts and preempts it
+ *     PR -> BG  : the foreground job finishes or stops, or bg command
+ *     PR -> FG  : fg command
+ * At most 1 job can be in the FG state.  A pending job has no process yet
+ * (its pid is 0) until job_set_pid() is called.
+ */
+typedef enum job_state {
+    UNDEF, // Undefined
+    FG,    // Running in foreground
+    BG,    // Running in background
+    ST,    // Stopped
+    PD,    // Pending: queued by the scheduler, not started yet
+    PR     // Preempted: stopped while a foreground job runs
+} job_state;
+
+/* Result of parsing a command line */
+typedef enum parseline_return {
+    PARSELINE_FG,    // Foreground job
+    PARSELINE_BG,    // Background job
+    PARSELINE_EMPTY, // Empty cmdline
+    PARSELINE_ERROR  // Parse error
+} parseline_return;
+
+/* Builtin commands recognized by the parser */
+typedef enum builtin_state {
+    BUILTIN_NONE,
+    BUILTIN_QUIT,
+    BUILTIN_JOBS,
+    BUILTIN_BG,
+    BUILTIN_FG
+} builtin_state;
+
+/* Parsed command line tokens */
+struct cmdline_tokens {
+    int argc;               // Number of arguments
+    char *argv[MAXARGS];    // The arguments list (NULL-terminated)
+    char *infile;           // The input file, or NULL
+    char *outfile;          // The output file, or NULL
+    char *bg_opts;          // The options of a final &[...], or NULL
+    int ntags;              // Number of leading @tags
+    char *tags[MAXTAGS];    // The tags, without the @
+    builtin_state builtin;  // Indicates if argv[0] is a builtin command
+    char _buf[MAXLINE_TSH]; // Storage for the argument strings
+};
+
+/* Shell globals */
+extern char **environ;    // Defined in libc
+extern const char prompt[]; // Command line prompt
+extern bool verbose;      // If true, print additional output
+
+/* Parses cmdline into token; never allocates */
+parseline_return parseline(const char *cmdline, struct cmdline_tokens *token);
+
+/* Prints a help message and exits */
+void usage(void);
+
+/* Terminates the shell cleanly when the driver sends SIGQUIT */
+void sigquit_handler(int sig);
+
+/* Job list management */
+void init_job_list(void);
+void destroy_job_list(void);
+jid_t add_job(pid_t pid, job_state state, const char *cmdline);
+bool delete_job(jid_t jid);
+jid_t fg_job(void);
+jid_t job_from_pid(pid_t pid);
+bool job_exists(jid_t jid);
+pid_t job_get_pid(jid_t jid);
+const char *job_get_cmdline(jid_t jid);
+job_state job_get_state(jid_t jid);
+void job_set_state(jid_t jid, job_state state);
+bool list_jobs(int output_fd);
+bool list_jobs_of(int output_fd, const jid_t *jids, size_t count);
+
+/* Gives a pending job the process that was started for it */
+void job_set_pid(jid_t jid, pid_t pid);
+
+/* Sets a short note that list_jobs() prints after the job's state */
+void job_set_note(jid_t jid, const char *note);
+
+/* The priority a job was launched with (&[prio=N]), 0 by default */
+void job_set_prio(jid_t jid, int prio);
+int job_get_prio(jid_t jid);
+
+/* Returns the number of jobs in state */
+size_t job_count_state(job_state state);
+
+/* How long a job's process was kept waiting, in nanoseconds */
+struct job_delays {
+    bool valid;         // collected at all (see tsh_acct.h)
+    bool has_swapin;    // swapin_ns is known
+    uint64_t cpu_ns;    // runnable, waiting for a CPU
+    uint64_t blkio_ns;  // waiting for block I/O
+    uint64_t swapin_ns; // waiting for pages to be swapped in
+};
+
+/* What became of a finished job */
+struct job_exit {
+    jid_t jid;
+    pid_t pid;
+    int status;       // wait status
+    int64_t start_ns; // CLOCK_MONOTONIC, at add_job()
+    int64_t end_ns;   // CLOCK_MONOTONIC, when reaped
+    int64_t user_ns;
+    int64_t sys_ns;
+    long maxrss_kb;
+    struct job_delays delays;
+    char cmdline[MAXLINE_TSH];
+};
+
+/* Finished jobs are remembered this many at a time */
+#define JOB_EXITS 64
+
+/*
+ * Records the exit of job jid before it is deleted.  ru is the rusage
+ * from wait4(); delays may be NULL.  Async-signal-safe.
+ */
+struct rusage;
+void job_record_exit(jid_t jid, int status, const struct rusage *ru,
+                     const struct job_delays *delays);
+
+/* Number of exits recorded so far; the latest has number count - 1 */
+size_t job_exit_count(void);
+
+/* Returns exit number n, or NULL if it has been overwritten */
+const struct job_exit *job_exit_get(size_t n);
+
+/* Lists the remembered exits, oldest first, for jobs -l */
+bool list_job_exits(int output_fd);
+
+/* Formats a duration in seconds with millisecond precision */
+size_t format_ns(char *buf, size_t size, int64_t ns);
+
+/* Returns the first job ID greater than jid (0 to start), or 0 at the end */
+jid_t job_next(jid_t jid);
+
+/*
+ * Tags a job (see parseline()).  Returns false if the job already has
+ * MAXTAGS tags, the tag is too long, or memory ran out.
+ */
+bool job_add_tag(jid_t jid, const char *tag);
+
+/*
+ * Returns the jobs with the given tag, in increasing job ID order, or NULL
+ * (and 0) if there are none.  The array stays valid until the job list
+ * next changes.
+ */
+const jid_t *job_tagged(const char *tag, size_t *count);
+
+/* Returns the job's pidfd, or -1 if it has none */
+int job_get_pidfd(jid_t jid);
+
+/*
+ * Sends sig to the job's process group.  Returns 0, or -1 with errno set
+ * (ESRCH if the job no longer exists).  Async-signal-safe.
+ */
+int job_kill(jid_t jid, int sig);
+
+#endif /* __TSH_HELPER_H__ */
@@ -0,0 +1,475 @@
+/**
+ * @file tsh_jtop.c
+ * @brief Resource sampling and display for the `jtop` builtin
+ *
+ * The view keeps one entry per job, sorted by job ID, and merges the job
+ * list into it on every sample: entries of jobs that are gone are closed,
+ * new jobs get their /proc descriptors opened, and everything else is
+ * re-read in place.  A separate array of entry numbers holds the display
+ * order.
+ */
+
+#include "tsh_jtop.h"
+#include "csapp.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* One job, as of the last sample */
+struct jtop_entry {
+    jid_t jid;
+    pid_t pid;
+    job_state state;
+    char *cmdline;
+    int stat_fd; // /proc/<pid>/stat, or -1
+    int io_fd;   // /proc/<pid>/io, or -1
+    int64_t sampled_ns;
+    int64_t start_ns; // start time, on the CLOCK_BOOTTIME scale
+    uint64_t cpu_ticks;
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t rss;
+    double cpu_pct;
+    double read_rate;
+    double write_rate;
+};
+
+struct jtop {
+    struct jtop_entry *entries;
+    size_t nentries;
+    size_t cap;
+    struct jtop_entry *spare; // the other buffer for the merge
+    size_t spare_cap;
+    size_t *order; // display order, as indices into entries
+    size_t order_cap;
+    enum jtop_sort sort;
+    jid_t selected;
+    long ticks_per_sec;
+    long page_size;
+    char tag[MAXTAGLEN]; // only the jobs with this tag, if not ""
+};
+
+static const char *const sort_names[] = {"cpu", "rss", "io", "age", "jid"};
+
+static int64_t boottime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct jtop *jtop_new(void) {
+    struct jtop *view = calloc(1, sizeof(*view));
+    if (view == NULL) {
+        return NULL;
+    }
+    view->ticks_per_sec = sysconf(_SC_CLK_TCK);
+    view->page_size = sysconf(_SC_PAGESIZE);
+    view->sort = JTOP_CPU;
+    return view;
+}
+
+static void close_entry(struct jtop_entry *e) {
+    if (e->stat_fd >= 0) {
+        close(e->stat_fd);
+    }
+    if (e->io_fd >= 0) {
+        close(e->io_fd);
+    }
+    free(e->cmdline);
+}
+
+void jtop_free(struct jtop *view) {
+    if (view == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < view->nentries; i++) {
+        close_entry(&view->entries[i]);
+    }
+    free(view->entries);
+    free(view->spare);
+    free(view->order);
+    free(view);
+}
+
+static int open_proc(pid_t pid, const char *file) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, file);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * @brief Re-reads a job's stat and io files, updating its rates
+ *
+ * A process that has exited but not yet been reaped keeps its last
+ * values.
+ */
+static void read_entry(struct jtop *view, struct jtop_entry *e,
+                       int64_t now) {
+    char buf[1024];
+    uint64_t ticks = e->cpu_ticks, rchar = e->rchar, wchar = e->wchar;
+
+    ssize_t n = e->stat_fd >= 0 ? pread(e->stat_fd, buf, sizeof(buf) - 1, 0)
+                                : -1;
+    char *p = n > 0 ? (buf[n] = '\0', strrchr(buf, ')')) : NULL;
+    if (p != NULL) {
+        // The fields after the command name (which may contain anything)
+        // start with field 3; utime and stime are 14 and 15, starttime is
+        // 22 and rss is 24
+        uint64_t utime = 0, stime = 0;
+        char *field = p + 2;
+        for (int i = 3; i <= 24 && field != NULL; i++) {
+            if (i == 14) {
+                utime = strtoull(field, NULL, 10);
+            } else if (i == 15) {
+                stime = strtoull(field, NULL, 10);
+            } else if (i == 22) {
+                e->start_ns = (int64_t)(strtoull(field, NULL, 10) *
+                                        1000000000 /
+                                        (uint64_t)view->ticks_per_sec);
+            } else if (i == 24) {
+                e->rss = strtoull(field, NULL, 10) *
+                         (uint64_t)view->page_size;
+            }
+            field = strchr(field, ' ');
+            field = field != NULL ? field + 1 : NULL;
+        }
+        ticks = utime + stime;
+    }
+
+    n = e->io_fd >= 0 ? pread(e->io_fd, buf, sizeof(buf) - 1, 0) : -1;
+    if (n > 0) {
+        buf[n] = '\0';
+        char *r = strstr(buf, "rchar: ");
+        char *w = strstr(buf, "wchar: ");
+        if (r != NULL && w != NULL) {
+            rchar = strtoull(r + 7, NULL, 10);
+            wchar = strtoull(w + 7, NULL, 10);
+        }
+    }
+
+    // Rates since the last sample, or over the job's lifetime at first
+    int64_t since = e->sampled_ns ? e->sampled_ns : e->start_ns;
+    double dt = (double)(now - since) / 1e9;
+    if (dt > 0) {
+        uint64_t base_ticks = e->sampled_ns ? e->cpu_ticks : 0;
+        e->cpu_pct = 100.0 * (double)(ticks - base_ticks) /
+                     (double)view->ticks_per_sec / dt;
+        e->read_rate = (double)(rchar - (e->sampled_ns ? e->rchar : 0)) / dt;
+        e->write_rate =
+            (double)(wchar - (e->sampled_ns ? e->wchar : 0)) / dt;
+    }
+    e->cpu_ticks = ticks;
+    e->rchar = rchar;
+    e->wchar = wchar;
+    e->sampled_ns = now;
+}
+
+static bool reserve_spare(struct jtop *view, size_t count) {
+    if (count <= view->spare_cap) {
+        return true;
+    }
+    size_t cap = view->spare_cap ? 2 * view->spare_cap : 64;
+    struct jtop_entry *grown = realloc(view->spare, cap * sizeof(*grown));
+    if (grown == NULL) {
+        return false;
+    }
+    view->spare = grown;
+    view->spare_cap = cap;
+    return true;
+}
+
+static const struct jtop *sort_view; // for compare_rows
+
+static int compare_rows(const void *a, const void *b) {
+    const struct jtop_entry *x = &sort_view->entries[*(const size_t *)a];
+    const struct jtop_entry *y = &sort_view->entries[*(const size_t *)b];
+    double kx = 0, ky = 0;
+    switch (sort_view->sort) {
+    case JTOP_CPU:
+        kx = x->cpu_pct, ky = y->cpu_pct;
+        break;
+    case JTOP_RSS:
+        kx = (double)x->rss, ky = (double)y->rss;
+        break;
+    case JTOP_IO:
+        kx = x->read_rate + x->write_rate, ky = y->read_rate + y->write_rate;
+        break;
+    case JTOP_AGE:
+        kx = (double)-x->start_ns, ky = (double)-y->start_ns;
+        break;
+    case JTOP_JID:
+        break;
+    }
+    // Larger first, then by job ID
+    if (kx != ky) {
+        return kx < ky ? 1 : -1;
+    }
+    return (x->jid > y->jid) - (x->jid < y->jid);
+}
+
+static void sort_rows(struct jtop *view) {
+    for (size_t i = 0; i < view->nentries; i++) {
+        view->order[i] = i;
+    }
+    sort_view = view;
+    qsort(view->order, view->nentries, sizeof(view->order[0]), compare_rows);
+}
+
+/**
+ * @brief Merges the job list into the view and samples every job
+ */
+void jtop_set_tag(struct jtop *view, const char *tag) {
+    snprintf(view->tag, sizeof(view->tag), "%s", tag != NULL ? tag : "");
+}
+
+/*
+ * The job to sample after jid: the next job, or with a tag the next one
+ * in the tag's index (also in job ID order), at *next
+ */
+static jid_t sample_next(const struct jtop *view, jid_t jid,
+                         const jid_t *tagged, size_t ntagged, size_t *next) {
+    if (view->tag[0] == '\0') {
+        return job_next(jid);
+    }
+    return *next < ntagged ? tagged[(*next)++] : 0;
+}
+
+void jtop_sample(struct jtop *view) {
+    int64_t now = boottime_ns();
+    size_t old = 0, count = 0;
+    size_t ntagged = 0, next = 0;
+    const jid_t *tagged =
+        view->tag[0] != '\0' ? job_tagged(view->tag, &ntagged) : NULL;
+    for (jid_t jid = sample_next(view, 0, tagged, ntagged, &next); jid != 0;
+         jid = sample_next(view, jid, tagged, ntagged, &next)) {
+        pid_t pid = job_get_pid(jid);
+        while (old < view->nentries && view->entries[old].jid < jid) {
+            close_entry(&view->entries[old++]);
+        }
+        if (!reserve_spare(view, count + 1)) {
+            break;
+        }
+        struct jtop_entry *e = &view->spare[count];
+        if (old < view->nentries && view->entries[old].jid == jid &&
+            view->entries[old].pid == pid) {
+            *e = view->entries[old++];
+        } else {
+            if (old < view->nentries && view->entries[old].jid == jid) {
+                close_entry(&view->entries[old++]);
+            }
+            char *cmdline = strdup(job_get_cmdline(jid));
+            if (cmdline == NULL) {
+                continue;
+            }
+            *e = (struct jtop_entry){.jid = jid,
+                                     .pid = pid,
+                                     .cmdline = cmdline,
+                                     .stat_fd = -1,
+                                     .io_fd = -1};
+            if (pid > 0) { // a pending job has no process yet
+                e->stat_fd = open_proc(pid, "stat");
+                e->io_fd = open_proc(pid, "io");
+            }
+        }
+        e->state = job_get_state(jid);
+        read_entry(view, e, now);
+        count++;
+    }
+    while (old < view->nentries) {
+        close_entry(&view->entries[old++]);
+    }
+
+    struct jtop_entry *entries = view->entries;
+    size_t cap = view->cap;
+    view->entries = view->spare;
+    view->cap = view->spare_cap;
+    view->nentries = count;
+    view->spare = entries;
+    view->spare_cap = cap;
+
+    if (count > view->order_cap) {
+        size_t *grown = realloc(view->order, view->cap * sizeof(*grown));
+        if (grown == NULL) {
+            view->nentries = 0;
+            return;
+        }
+        view->order = grown;
+        view->order_cap = view->cap;
+    }
+    sort_rows(view);
+}
+
+void jtop_set_sort(struct jtop *view, enum jtop_sort sort) {
+    view->sort = sort;
+    sort_rows(view);
+}
+
+bool jtop_sort_by_name(struct jtop *view, const char *name) {
+    for (size_t i = 0; i < sizeof(sort_names) / sizeof(sort_names[0]); i++) {
+        if (strcmp(name, sort_names[i]) == 0) {
+            jtop_set_sort(view, (enum jtop_sort)i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void jtop_next_sort(struct jtop *view) {
+    jtop_set_sort(view, (enum jtop_sort)((view->sort + 1) %
+                                         (sizeof(sort_names) /
+                                          sizeof(sort_names[0]))));
+}
+
+/* Returns the display row of the selected job, or 0 */
+static size_t selected_row(const struct jtop *view) {
+    for (size_t row = 0; row < view->nentries; row++) {
+        if (view->entries[view->order[row]].jid == view->selected) {
+            return row;
+        }
+    }
+    return 0;
+}
+
+void jtop_move(struct jtop *view, int delta) {
+    if (view->nentries == 0) {
+        return;
+    }
+    long row = (long)selected_row(view) + delta;
+    if (row < 0) {
+        row = 0;
+    } else if (row >= (long)view->nentries) {
+        row = (long)view->nentries - 1;
+    }
+    view->selected = view->entries[view->order[row]].jid;
+}
+
+jid_t jtop_selected(const struct jtop *view) {
+    if (view->nentries == 0) {
+        return 0;
+    }
+    return view->entries[view->order[selected_row(view)]].jid;
+}
+
+/* A growing output buffer, written out in one go */
+struct text {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void append(struct text *t, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
+        }
+        if (t->len + (size_t)n < t->cap) {
+            t->len += (size_t)n;
+            return;
+        }
+        size_t cap = 2 * t->cap + (size_t)n + 1;
+        char *grown = realloc(t->buf, cap);
+        if (grown == NULL) {
+            return;
+        }
+        t->buf = grown;
+        t->cap = cap;
+    }
+}
+
+/* Formats a byte count (or rate) with a binary unit */
+static void format_bytes(char *buf, size_t size, double bytes) {
+    static const char units[] = "BKMGT";
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buf, size, unit == 0 ? "%.0f%c" : "%.1f%c", bytes, units[unit]);
+}
+
+static void format_age(char *buf, size_t size, int64_t ns) {
+    long secs = ns > 0 ? (long)(ns / 1000000000) : 0;
+    if (secs < 3600) {
+        snprintf(buf, size, "%ld:%02ld", secs / 60, secs % 60);
+    } else {
+        snprintf(buf, size, "%ld:%02ld:%02ld", secs / 3600, secs / 60 % 60,
+                 secs % 60);
+    }
+}
+
+static char state_char(job_state state) {
+    switch (state) {
+    case FG:
+        return 'F';
+    case ST:
+        return 'T';
+    case PD:
+        return 'P';
+    case PR:
+        return 'Z';
+    default:
+        return 'R';
+    }
+}
+
+/**
+ * @brief Draws the view
+ *
+ * Interactive views scroll so that the selected row stays on screen.
+ */
+void jtop_render(const struct jtop *view, int fd, int rows,
+                 bool interactive) {
+    struct text t = {NULL, 0, 0};
+    int64_t now = boottime_ns();
+
+    if (interactive) {
+        append(&t, "\033[H\033[2J");
+    }
+    append(&t, "jtop: %zu jobs, sorted by %s\n", view->nentries,
+           sort_names[view->sort]);
+    append(&t, "%5s %7s S %6s %8s %8s %8s %9s  %s\n", "JID", "PID", "CPU%",
+           "RSS", "READ/s", "WRITE/s", "AGE", "COMMAND");
+
+    size_t first = 0, limit = view->nentries;
+    if (rows > 0) {
+        size_t avail = rows > 3 ? (size_t)rows - 3 : 1;
+        size_t sel = selected_row(view);
+        if (sel >= avail) {
+            first = sel - avail + 1;
+        }
+        if (limit > first + avail) {
+            limit = first + avail;
+        }
+    }
+    jid_t selected = jtop_selected(view);
+    for (size_t row = first; row < limit; row++) {
+        const struct jtop_entry *e = &view->entries[view->order[row]];
+        char rss[16], rd[16], wr[16], age[24];
+        format_bytes(rss, sizeof(rss), (double)e->rss);
+        format_bytes(rd, sizeof(rd), e->read_rate);
+        format_bytes(wr, sizeof(wr), e->write_rate);
+        format_age(age, sizeof(age), now - e->start_ns);
+        bool highlight = interactive && e->jid == selected;
+        append(&t, "%s%5d %7d %c %6.1f %8s %8s %8s %9s  %s%s\n",
+               highlight ? "\033[7m" : "", (int)e->jid, (int)e->pid,
+               state_char(e->state), e->cpu_pct, rss, rd, wr, age, e->cmdline,
+               highlight ? "\033[m" : "");
+    }
+    if (interactive) {
+        append(&t, "q quit  s sort  up/down select  f fg  b bg  "
+                   "z stop  x term  X kill");
+    }
+    if (t.buf != NULL) {
+        sio_writen(fd, t.buf, t.len);
+    }
+    free(t.buf);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file tsh_jtop.h
+ * @brief Resource sampling and display for the `jtop` builtin
+ *
+ * Each sample reads /proc/<pid>/stat and /proc/<pid>/io of every job's
+ * process (the group leader) and derives CPU%, resident size and
+ * read/write rates from the difference to the previous sample.  The two
+ * files are opened once per job and re-read with pread(), so a refresh
+ * costs two system calls per job.  A descriptor into /proc stays tied to
+ * the process it was opened for, so a recycled pid never shows up under
+ * the wrong job.
+ *
+ * The first sample of a job has nothing to compare to and shows averages
+ * over the job's lifetime instead.
+ */
+
+#ifndef __TSH_JTOP_H__
+#define __TSH_JTOP_H__
+
+#include "tsh_helper.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Orders the rows of the display */
+enum jtop_sort { JTOP_CPU, JTOP_RSS, JTOP_IO, JTOP_AGE, JTOP_JID };
+
+struct jtop;
+
+/* Creates an empty view; NULL if out of memory */
+struct jtop *jtop_new(void);
+
+/* Frees the view and closes its descriptors */
+void jtop_free(struct jtop *view);
+
+/* Limits the view to the jobs with a tag (NULL for every job) */
+void jtop_set_tag(struct jtop *view, const char *tag);
+
+/*
+ * Samples every job, or the tagged ones.  Must be called with SIGCHLD,
+ * SIGINT and SIGTSTP blocked.
+ */
+void jtop_sample(struct jtop *view);
+
+/* Sets the sort order, or parses it from a name; false if unknown */
+void jtop_set_sort(struct jtop *view, enum jtop_sort sort);
+bool jtop_sort_by_name(struct jtop *view, const char *name);
+
+/* Switches to the next sort order */
+void jtop_next_sort(struct jtop *view);
+
+/* Moves the selection by delta rows, within bounds */
+void jtop_move(struct jtop *view, int delta);
+
+/* Returns the selected job, or 0 if there are no jobs */
+jid_t jtop_selected(const struct jtop *view);
+
+/*
+ * Writes the view to fd.  rows limits the number of lines (0 for no limit);
+ * interactive views start with a screen clear and show the selection and
+ * the key help.
+ */
+void jtop_render(const struct jtop *view, int fd, int rows, bool interactive);
+
+#endif /* __TSH_JTOP_H__ */
@@ -0,0 +1,210 @@
+/**
+ * @file tsh_mtime.c
+ * @brief Modification times of many files in one batch, for needs
+ *
+ * The ring is set up on first use and kept for the life of the shell.
+ * There is no liburing in the tree, so the ring is driven through the raw
+ * system calls: the submission queue, completion queue and SQE array are
+ * mapped once, and each batch writes one IORING_OP_STATX entry per file,
+ * publishes the new tail and waits in io_uring_enter() until every entry
+ * has completed.  The ring is only ever used from this file, by one
+ * thread, and each batch is drained before the next one starts.  Whatever
+ * the ring fails to look up is looked up again with statx().
+ */
+
+#define _GNU_SOURCE // statx
+
+#include "tsh_mtime.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Below this many files a statx() per file is cheaper than a submission */
+#define MTIME_BATCH_MIN 4
+
+/* Failed io_uring_enter() calls a batch waits through before giving up */
+#define MTIME_RING_RETRIES 8
+
+/* Marks an entry that no lookup has answered yet */
+#define MTIME_PENDING INT64_MIN
+
+static struct {
+    enum { RING_UNTRIED, RING_READY, RING_NONE } state;
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+} ring = {.state = RING_UNTRIED, .fd = -1};
+
+/* Where the ring's lookups land; static, so that abandoned ones are safe */
+static struct statx ring_bufs[MTIME_RING_ENTRIES];
+
+static int64_t to_ns(const struct statx_timestamp *ts) {
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* Sets up the ring; false (for good) if io_uring cannot be used */
+static bool ring_init(void) {
+    if (ring.state != RING_UNTRIED) {
+        return ring.state == RING_READY;
+    }
+    ring.state = RING_NONE;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, MTIME_RING_ENTRIES, &p);
+    if (fd < 0) {
+        return false;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    char *cq = sq;
+    if (!single) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            munmap(sq, sq_size);
+            close(fd);
+            return false;
+        }
+    }
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (!single) {
+            munmap(cq, cq_size);
+        }
+        munmap(sq, sq_size);
+        close(fd);
+        return false;
+    }
+
+    ring.fd = fd;
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sqes = sqes;
+    ring.state = RING_READY;
+    return true;
+}
+
+/*
+ * Looks up at most MTIME_RING_ENTRIES files through the ring, leaving the
+ * entries it could not look up at MTIME_PENDING.  Returns false if the
+ * rest of the batch should not use the ring.
+ *
+ * A kernel without IORING_OP_STATX (before 5.6) fails the entries with
+ * -EINVAL, and io_uring_enter() may keep failing once some entries are in
+ * flight; either way the ring is given up on for good.  Entries still in
+ * flight then only write to ring_bufs, which nothing reads any more.
+ */
+static bool ring_batch(char *const *paths, size_t n, int64_t *mtimes) {
+    unsigned tail = *ring.sq_tail;
+    for (size_t i = 0; i < n; i++) {
+        unsigned idx = (tail + (unsigned)i) & *ring.sq_mask;
+        struct io_uring_sqe *sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)paths[i];
+        sqe->len = STATX_MTIME;
+        sqe->off = (unsigned long)&ring_bufs[i];
+        sqe->statx_flags = AT_STATX_DONT_SYNC;
+        sqe->user_data = i;
+        ring.sq_array[idx] = idx;
+    }
+    __atomic_store_n(ring.sq_tail, tail + (unsigned)n, __ATOMIC_RELEASE);
+
+    size_t to_submit = n;
+    size_t done = 0;
+    int failures = 0;
+    while (done < n && ring.state == RING_READY) {
+        long ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, n - done,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            if (to_submit == n) {
+                // nothing was taken: withdraw the entries
+                __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+                return false;
+            }
+            // completions are still owed; wait for them a few more times
+            if (++failures == MTIME_RING_RETRIES) {
+                ring.state = RING_NONE;
+            }
+        }
+        if (ret > 0) {
+            to_submit -= (size_t)ret < to_submit ? (size_t)ret : to_submit;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned ctail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            size_t i = (size_t)cqe->user_data;
+            if (i < n && cqe->res == 0) {
+                mtimes[i] = to_ns(&ring_bufs[i].stx_mtime);
+            } else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                // no IORING_OP_STATX: left to statx()
+                ring.state = RING_NONE;
+            } else if (i < n) {
+                mtimes[i] = -1;
+            }
+            done++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return ring.state == RING_READY;
+}
+
+void mtime_batch(char *const *paths, size_t n, int64_t *mtimes) {
+    for (size_t i = 0; i < n; i++) {
+        mtimes[i] = MTIME_PENDING;
+    }
+    if (n >= MTIME_BATCH_MIN && ring_init()) {
+        for (size_t i = 0; i < n; i += MTIME_RING_ENTRIES) {
+            size_t chunk = n - i;
+            if (chunk > MTIME_RING_ENTRIES) {
+                chunk = MTIME_RING_ENTRIES;
+            }
+            if (!ring_batch(paths + i, chunk, mtimes + i)) {
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (mtimes[i] != MTIME_PENDING) {
+            continue;
+        }
+        struct statx stx;
+        mtimes[i] = statx(AT_FDCWD, paths[i], AT_STATX_DONT_SYNC, STATX_MTIME,
+                          &stx) == 0
+                        ? to_ns(&stx.stx_mtime)
+                        : -1;
+    }
+}
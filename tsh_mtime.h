@@ -0,0 +1,33 @@
+/**
+ * @file tsh_mtime.h
+ * @brief Modification times of many files in one batch, for needs
+ *
+ * needs compares the mtimes of all of its inputs and outputs.  Asking for
+ * them one statx(2) at a time costs a system call and, on a cold cache or
+ * a network file system, a round trip per file.  Here the lookups are
+ * queued on an io_uring and submitted with a single io_uring_enter(2), so
+ * the kernel can work on them together and the shell waits once.  Where
+ * io_uring is not available (old kernels, seccomp filters), or for only a
+ * few files, the files are looked at with statx() in turn.
+ *
+ * Every lookup asks for the mtime alone, with AT_STATX_DONT_SYNC so that
+ * network file systems answer from their attribute cache.
+ */
+
+#ifndef __TSH_MTIME_H__
+#define __TSH_MTIME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Lookups queued on the ring at once; larger batches go in chunks */
+#define MTIME_RING_ENTRIES 64
+
+/*
+ * Sets mtimes[i] to the modification time of paths[i] in nanoseconds
+ * since the epoch, or to -1 if it cannot be looked up (e.g. it does not
+ * exist).
+ */
+void mtime_batch(char *const *paths, size_t n, int64_t *mtimes);
+
+#endif /* __TSH_MTIME_H__ */
@@ -0,0 +1,253 @@
+/**
+ * @file tsh_pattern.c
+ * @brief Compiled shell patterns (globs) for match and job selectors
+ *
+ * A pattern of m atoms (literals, ? and classes) is a shift-and automaton
+ * with states 0..m: state i means the first i atoms have matched.  masks[c]
+ * has bit i set if atom i accepts the character c, and loops has bit i set
+ * if a * comes before atom i (bit m for a trailing *), so that one step is
+ *
+ *     D = ((D & masks[c]) << 1) | (D & loops)
+ *
+ * starting from D = 1 and accepting if bit m is set at the end.  Patterns
+ * of up to 63 atoms fit one word; longer ones use as many as they need and
+ * carry the shift from word to word.  Patterns without any special
+ * character skip the automaton and compare the text directly.
+ */
+
+#include "tsh_pattern.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct pattern {
+    char *text;        // the pattern itself, the cache key
+    uint32_t hash;
+    bool literal;      // no special characters: compare text directly
+    size_t natoms;
+    size_t nwords;     // words per state vector, enough for natoms + 1 bits
+    uint64_t *masks;   // 256 vectors: atoms that accept each character
+    uint64_t *loops;   // states that a * lets consume any character
+    uint64_t *state;   // scratch for the multi-word matcher
+};
+
+static struct pattern *cache[PATTERN_CACHE_SIZE];
+static bool cache_used[PATTERN_CACHE_SIZE]; // referenced since the last sweep
+static size_t cache_hand;
+static size_t stat_compiled, stat_hits;
+
+/* FNV-1a of a string */
+static uint32_t hash_text(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s != '\0'; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+static void set_bit(uint64_t *v, size_t bit) {
+    v[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+/*
+ * Parses the class starting at the [ at s into set (256 flags).  Returns
+ * a pointer past its ], or NULL if it has none and so is no class.
+ */
+static const char *parse_class(const char *s, bool set[256]) {
+    const char *p = s + 1;
+    bool negate = *p == '!' || *p == '^';
+    if (negate) {
+        p++;
+    }
+    memset(set, 0, 256 * sizeof(bool));
+    bool first = true;
+    while (*p != '\0' && (*p != ']' || first)) {
+        first = false;
+        unsigned char lo = (unsigned char)*p++;
+        if (lo == '\\' && *p != '\0') {
+            lo = (unsigned char)*p++;
+        }
+        unsigned char hi = lo;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            p++;
+            hi = (unsigned char)*p++;
+            if (hi == '\\' && *p != '\0') {
+                hi = (unsigned char)*p++;
+            }
+        }
+        for (unsigned c = lo; c <= hi; c++) {
+            set[c] = true;
+        }
+    }
+    if (*p != ']') {
+        return NULL;
+    }
+    if (negate) {
+        for (int c = 0; c < 256; c++) {
+            set[c] = !set[c];
+        }
+    }
+    return p + 1;
+}
+
+/* Counts the atoms of a pattern, an upper bound for the automaton's size */
+static size_t count_atoms(const char *s) {
+    size_t n = 0;
+    for (; *s != '\0'; s++) {
+        if (*s != '*') {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void pattern_free(struct pattern *p) {
+    if (p != NULL) {
+        free(p->text);
+        free(p->masks);
+        free(p->loops);
+        free(p->state);
+        free(p);
+    }
+}
+
+/* Builds the automaton of a pattern; NULL if out of memory */
+static struct pattern *build(const char *text, uint32_t hash) {
+    struct pattern *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->text = strdup(text);
+    p->hash = hash;
+    p->literal = strpbrk(text, "*?[\\") == NULL;
+    size_t max = count_atoms(text);
+    p->nwords = (max + 1 + 63) / 64;
+    p->masks = calloc(256 * p->nwords, sizeof(uint64_t));
+    p->loops = calloc(p->nwords, sizeof(uint64_t));
+    p->state = calloc(p->nwords, sizeof(uint64_t));
+    if (p->text == NULL || p->masks == NULL || p->loops == NULL ||
+        p->state == NULL) {
+        pattern_free(p);
+        return NULL;
+    }
+
+    size_t m = 0;
+    bool set[256];
+    for (const char *s = text; *s != '\0';) {
+        if (*s == '*') {
+            set_bit(p->loops, m);
+            s++;
+            continue;
+        }
+        const char *next = NULL;
+        if (*s == '[') {
+            next = parse_class(s, set);
+        }
+        if (next != NULL) {
+            for (int c = 0; c < 256; c++) {
+                if (set[c]) {
+                    set_bit(p->masks + c * p->nwords, m);
+                }
+            }
+            s = next;
+        } else if (*s == '?') {
+            for (int c = 0; c < 256; c++) {
+                set_bit(p->masks + c * p->nwords, m);
+            }
+            s++;
+        } else {
+            if (*s == '\\' && s[1] != '\0') {
+                s++;
+            }
+            set_bit(p->masks + (unsigned char)*s * p->nwords, m);
+            s++;
+        }
+        m++;
+    }
+    p->natoms = m;
+    return p;
+}
+
+struct pattern *pattern_compile(const char *text) {
+    uint32_t hash = hash_text(text);
+    for (size_t i = 0; i < PATTERN_CACHE_SIZE; i++) {
+        struct pattern *p = cache[i];
+        if (p != NULL && p->hash == hash && strcmp(p->text, text) == 0) {
+            cache_used[i] = true;
+            stat_hits++;
+            return p;
+        }
+    }
+
+    struct pattern *p = build(text, hash);
+    if (p == NULL) {
+        return NULL;
+    }
+    stat_compiled++;
+    // Clock eviction: skip (and clear) slots used since the hand last
+    // passed, so patterns matched in a loop stay cached
+    while (cache[cache_hand] != NULL && cache_used[cache_hand]) {
+        cache_used[cache_hand] = false;
+        cache_hand = (cache_hand + 1) % PATTERN_CACHE_SIZE;
+    }
+    pattern_free(cache[cache_hand]);
+    cache[cache_hand] = p;
+    cache_used[cache_hand] = true;
+    cache_hand = (cache_hand + 1) % PATTERN_CACHE_SIZE;
+    return p;
+}
+
+/* The general matcher, for automata wider than a word */
+static bool match_wide(struct pattern *p, const unsigned char *s) {
+    size_t n = p->nwords;
+    uint64_t *d = p->state;
+    memset(d, 0, n * sizeof(uint64_t));
+    d[0] = 1;
+    for (; *s != '\0'; s++) {
+        const uint64_t *mask = p->masks + *s * n;
+        uint64_t carry = 0;
+        uint64_t any = 0;
+        for (size_t w = 0; w < n; w++) {
+            uint64_t hit = d[w] & mask[w];
+            uint64_t next = hit << 1 | carry | (d[w] & p->loops[w]);
+            carry = hit >> 63;
+            d[w] = next;
+            any |= next;
+        }
+        if (any == 0) {
+            return false;
+        }
+    }
+    return d[p->natoms / 64] >> (p->natoms % 64) & 1;
+}
+
+bool pattern_match(struct pattern *p, const char *text) {
+    if (p->literal) {
+        return strcmp(p->text, text) == 0;
+    }
+    if (p->nwords > 1) {
+        return match_wide(p, (const unsigned char *)text);
+    }
+    const uint64_t *masks = p->masks;
+    uint64_t loops = p->loops[0];
+    uint64_t d = 1;
+    for (const unsigned char *s = (const unsigned char *)text; *s != '\0';
+         s++) {
+        d = (d & masks[*s]) << 1 | (d & loops);
+        if (d == 0) {
+            return false;
+        }
+    }
+    return d >> p->natoms & 1;
+}
+
+bool pattern_matches(const char *pattern, const char *text) {
+    struct pattern *p = pattern_compile(pattern);
+    return p != NULL && pattern_match(p, text);
+}
+
+void pattern_stats(size_t *compiled, size_t *hits) {
+    *compiled = stat_compiled;
+    *hits = stat_hits;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file tsh_pattern.h
+ * @brief Compiled shell patterns (globs) for match and job selectors
+ *
+ * A pattern is compiled once into a bit-parallel automaton: every
+ * character class, ? or literal becomes one bit of state, and a * before
+ * it lets that state loop on any character.  Matching then costs a few
+ * word operations per character of text, whatever the pattern, so a
+ * pattern like a*a*a*a*b cannot send it into the exponential backtracking
+ * of a naive matcher.
+ *
+ * Compiled patterns are cached by their text, so a pattern used in a loop
+ * or against every job is compiled only the first time.
+ *
+ * Syntax: * matches any string, ? any character, [abc], [a-z] and [!a-z]
+ * (or [^a-z]) one character of (or not of) a set, and \c the character c
+ * itself.  A [ without a closing ] is an ordinary character.  Patterns
+ * match the whole text; "*" is not special before a / or a dot.
+ */
+
+#ifndef __TSH_PATTERN_H__
+#define __TSH_PATTERN_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Compiled patterns kept in the cache */
+#define PATTERN_CACHE_SIZE 64
+
+struct pattern;
+
+/*
+ * Returns the compiled form of pattern, from the cache if it was compiled
+ * before, or NULL if out of memory.  The result stays valid until
+ * PATTERN_CACHE_SIZE other patterns have been compiled.
+ */
+struct pattern *pattern_compile(const char *pattern);
+
+/* True if text matches the compiled pattern */
+bool pattern_match(struct pattern *p, const char *text);
+
+/* Compiles pattern through the cache and matches text against it */
+bool pattern_matches(const char *pattern, const char *text);
+
+/* Patterns compiled and cache hits so far */
+void pattern_stats(size_t *compiled, size_t *hits);
+
+#endif /* __TSH_PATTERN_H__ */
@@ -0,0 +1,323 @@
+/**
+ * @file tsh_pin.c
+ * @brief Pinned executables for the `pin` builtin
+ *
+ * Programs are kept in an array of entries, indexed by an open-addressing
+ * hash table of entry numbers keyed on the program name, so the lookup in
+ * pin_execve() is a hash and usually one string compare.  Entries are only
+ * ever appended while the shell runs; removing a pin just closes its
+ * descriptor, and pin_clear() is the only operation that shrinks the table.
+ *
+ * Descriptors are opened O_PATH | O_CLOEXEC.  The kernel cannot run a
+ * script (#!) through a close-on-exec descriptor, because the interpreter
+ * would be handed a /dev/fd path that no longer exists; execveat fails
+ * with ENOENT in that case and pin_execve() falls back to the path.
+ */
+
+#define _GNU_SOURCE // O_PATH, execveat
+
+#include "tsh_pin.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Programs counted for automatic mode without being pinned, at most */
+#define PIN_MAX_TRACKED 1024
+
+/* A program that is pinned or whose launches are being counted */
+struct pin_entry {
+    char *path;
+    uint64_t hash;
+    int fd;                 // O_PATH descriptor, or -1 if not pinned
+    bool automatic;         // pinned by automatic mode rather than by hand
+    dev_t dev;              // identity of the pinned file
+    ino_t ino;
+    unsigned long launches; // launches since the program was first seen
+};
+
+static struct pin_entry *entries;
+static size_t nentries;
+static size_t entries_cap;
+
+/* Entry number + 1 for each occupied slot, 0 for an empty one */
+static uint32_t *slots;
+static size_t slot_mask;
+
+static int auto_limit; // automatic mode keeps this many programs pinned
+static int nauto;      // programs currently pinned automatically
+
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static struct pin_entry *find(const char *path, uint64_t hash) {
+    if (slots == NULL) {
+        return NULL;
+    }
+    for (size_t i = hash & slot_mask; slots[i] != 0; i = (i + 1) & slot_mask) {
+        struct pin_entry *e = &entries[slots[i] - 1];
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Makes room for one more entry, keeping the load factor at most 1/2 */
+static bool reserve(void) {
+    if (nentries == entries_cap) {
+        size_t cap = entries_cap ? 2 * entries_cap : 32;
+        struct pin_entry *grown = realloc(entries, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return false;
+        }
+        entries = grown;
+        entries_cap = cap;
+    }
+    size_t size = slots ? slot_mask + 1 : 0;
+    if (2 * (nentries + 1) > size) {
+        size_t new_size = size ? 2 * size : 64;
+        uint32_t *table = calloc(new_size, sizeof(*table));
+        if (table == NULL) {
+            return false;
+        }
+        free(slots);
+        slots = table;
+        slot_mask = new_size - 1;
+        for (size_t n = 0; n < nentries; n++) {
+            size_t i = entries[n].hash & slot_mask;
+            while (slots[i] != 0) {
+                i = (i + 1) & slot_mask;
+            }
+            slots[i] = (uint32_t)(n + 1);
+        }
+    }
+    return true;
+}
+
+static struct pin_entry *find_or_add(const char *path) {
+    uint64_t hash = hash_path(path);
+    struct pin_entry *e = find(path, hash);
+    if (e != NULL) {
+        return e;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL || !reserve()) {
+        free(copy);
+        return NULL;
+    }
+    e = &entries[nentries];
+    *e = (struct pin_entry){copy, hash, -1, false, 0, 0, 0};
+    size_t i = hash & slot_mask;
+    while (slots[i] != 0) {
+        i = (i + 1) & slot_mask;
+    }
+    slots[i] = (uint32_t)(++nentries);
+    return e;
+}
+
+/* Opens the descriptor for e; prints an error if quiet is false */
+static bool open_pin(struct pin_entry *e, bool quiet) {
+    int fd = open(e->path, O_PATH | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        (st.st_mode & 0111) == 0) {
+        if (!quiet) {
+            sio_printf("pin: %s: %s\n", e->path,
+                       fd < 0 ? strerror(errno) : "not an executable file");
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    e->fd = fd;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    return true;
+}
+
+static void unpin(struct pin_entry *e) {
+    if (e->fd >= 0) {
+        close(e->fd);
+        e->fd = -1;
+    }
+    if (e->automatic) {
+        e->automatic = false;
+        nauto--;
+    }
+}
+
+/**
+ * @brief Runs a program through its pin if it has one
+ */
+int pin_execve(char *const argv[], char *const envp[]) {
+    struct pin_entry *e = find(argv[0], hash_path(argv[0]));
+    if (e != NULL && e->fd >= 0) {
+        execveat(e->fd, "", argv, envp, AT_EMPTY_PATH);
+        // Fall back to the path, e.g. for scripts (see above)
+    }
+    return execve(argv[0], argv, envp);
+}
+
+/**
+ * @brief Counts a launch and maintains the automatic pins
+ *
+ * A program that is not pinned takes the slot of the least launched
+ * automatic pin once it has been launched more often.
+ */
+void pin_note_launch(const char *path) {
+    struct pin_entry *e;
+    if (auto_limit == 0) {
+        e = find(path, hash_path(path));
+        if (e != NULL) {
+            e->launches++;
+        }
+        return;
+    }
+
+    e = (nentries < PIN_MAX_TRACKED) ? find_or_add(path)
+                                     : find(path, hash_path(path));
+    if (e == NULL) {
+        return;
+    }
+    e->launches++;
+    if (e->fd >= 0) {
+        return;
+    }
+
+    if (nauto >= auto_limit) {
+        struct pin_entry *coldest = NULL;
+        for (size_t i = 0; i < nentries; i++) {
+            if (entries[i].automatic &&
+                (coldest == NULL || entries[i].launches < coldest->launches)) {
+                coldest = &entries[i];
+            }
+        }
+        if (coldest == NULL || coldest->launches >= e->launches) {
+            return;
+        }
+        unpin(coldest);
+    }
+    if (open_pin(e, true)) {
+        e->automatic = true;
+        nauto++;
+    }
+}
+
+/**
+ * @brief Pins a program by hand
+ */
+bool pin_add(const char *path) {
+    struct pin_entry *e = find_or_add(path);
+    if (e == NULL) {
+        sio_printf("pin: out of memory\n");
+        return false;
+    }
+    if (e->fd >= 0) {
+        // Already pinned; a manual pin is never evicted by automatic mode
+        if (e->automatic) {
+            e->automatic = false;
+            nauto--;
+        }
+        return true;
+    }
+    return open_pin(e, false);
+}
+
+/**
+ * @brief Unpins a program, keeping its launch count
+ */
+bool pin_remove(const char *path) {
+    struct pin_entry *e = find(path, hash_path(path));
+    if (e == NULL || e->fd < 0) {
+        return false;
+    }
+    unpin(e);
+    return true;
+}
+
+/**
+ * @brief Unpins every program and forgets all launch counts
+ */
+void pin_clear(void) {
+    for (size_t i = 0; i < nentries; i++) {
+        if (entries[i].fd >= 0) {
+            close(entries[i].fd);
+        }
+        free(entries[i].path);
+    }
+    nentries = 0;
+    nauto = 0;
+    if (slots != NULL) {
+        memset(slots, 0, (slot_mask + 1) * sizeof(*slots));
+    }
+}
+
+/**
+ * @brief Reopens every pin so that later launches run the current files
+ */
+void pin_refresh(int output_fd) {
+    for (size_t i = 0; i < nentries; i++) {
+        struct pin_entry *e = &entries[i];
+        if (e->fd < 0) {
+            continue;
+        }
+        int old_fd = e->fd;
+        dev_t dev = e->dev;
+        ino_t ino = e->ino;
+        if (!open_pin(e, false)) {
+            // Keep running the old file rather than losing the pin
+            continue;
+        }
+        close(old_fd);
+        if (e->dev != dev || e->ino != ino) {
+            sio_dprintf(output_fd, "pin: %s changed\n", e->path);
+        }
+    }
+}
+
+/**
+ * @brief Sets how many programs automatic mode keeps pinned
+ */
+void pin_set_auto(int n) {
+    auto_limit = n < 0 ? 0 : n;
+    // Drop the coldest automatic pins beyond the new limit
+    while (nauto > auto_limit) {
+        struct pin_entry *coldest = NULL;
+        for (size_t i = 0; i < nentries; i++) {
+            if (entries[i].automatic &&
+                (coldest == NULL || entries[i].launches < coldest->launches)) {
+                coldest = &entries[i];
+            }
+        }
+        unpin(coldest);
+    }
+}
+
+/**
+ * @brief Lists pinned programs with their launch counts
+ */
+void pin_print(int output_fd) {
+    for (size_t i = 0; i < nentries; i++) {
+        const struct pin_entry *e = &entries[i];
+        if (e->fd >= 0) {
+            sio_dprintf(output_fd, "%8lu %s%s\n", e->launches, e->path,
+                        e->automatic ? " (auto)" : "");
+        }
+    }
+    if (auto_limit > 0) {
+        sio_dprintf(output_fd, "automatic: top %d, %d pinned\n", auto_limit,
+                    nauto);
+    }
+}
@@ -0,0 +1,49 @@
+/**
+ * @file tsh_pin.h
+ * @brief Pinned executables for the `pin` builtin
+ *
+ * A pinned program is held open through an O_PATH descriptor and launched
+ * with execveat(fd, "", AT_EMPTY_PATH), so starting it involves no path
+ * lookup, and replacing the file on disk (e.g. by a package update that
+ * renames a new binary into place) does not change what the shell runs
+ * until the pin is refreshed.
+ *
+ * Pins are keyed by the program name exactly as written on the command
+ * line.  In automatic mode the shell also counts launches and keeps the N
+ * most frequently launched programs pinned.
+ */
+
+#ifndef __TSH_PIN_H__
+#define __TSH_PIN_H__
+
+#include <stdbool.h>
+
+/*
+ * Executes argv[0] like execve, through its pinned descriptor if it has
+ * one.  Returns only on failure, with errno set.  Allocates nothing, so it
+ * is safe in a forked child.
+ */
+int pin_execve(char *const argv[], char *const envp[]);
+
+/* Counts a launch of path, pinning it if automatic mode ranks it hot */
+void pin_note_launch(const char *path);
+
+/* Pins path; prints an error and returns false on failure */
+bool pin_add(const char *path);
+
+/* Unpins path; false if it was not pinned */
+bool pin_remove(const char *path);
+
+/* Unpins everything and forgets all launch counts */
+void pin_clear(void);
+
+/* Reopens every pin, reporting programs that changed on disk */
+void pin_refresh(int output_fd);
+
+/* Keeps the n hottest programs pinned automatically (0 disables) */
+void pin_set_auto(int n);
+
+/* Lists the pinned programs */
+void pin_print(int output_fd);
+
+#endif /* __TSH_PIN_H__ */
@@ -0,0 +1,457 @@
+/**
+ * @file tsh_prewarm.c
+ * @brief Page-cache prewarming of programs and their shared libraries
+ *
+ * Reading ELF headers of a cold file is itself a blocking disk read, so
+ * the work happens in a helper process forked on first use.  The shell
+ * sends program paths, one per line, over a socket pair (non-blocking and
+ * without SIGPIPE); the helper walks each program's load dependencies and
+ * advises the kernel to read them ahead.  The helper ignores the terminal's job control signals and
+ * exits when the socket is closed, i.e. when the shell exits or execs.
+ *
+ * Library lookup follows the loader's order closely enough for warming:
+ * DT_RUNPATH/DT_RPATH (without $ORIGIN expansion), LD_LIBRARY_PATH, then
+ * the default system directories.  /etc/ld.so.cache is not consulted.
+ */
+
+#include "tsh_prewarm.h"
+#include "csapp.h"
+
+#include <ctype.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Files visited by one walk, at most */
+#define WALK_MAX_FILES 256
+
+/* Upper bound on the ELF metadata read from one file */
+#define WALK_MAX_META (256 * 1024)
+
+static const char *const default_lib_dirs[] = {
+    "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu",
+    "/lib64",                "/usr/lib64",
+    "/lib",                  "/usr/lib",
+    "/usr/local/lib",
+};
+
+static int enabled = -1;   // -1 until TSH_PREWARM has been read
+static int worker_fd = -1; // the shell's end of the socket to the helper
+
+/* Hashes of the programs already handed to the helper */
+static uint64_t *seen;
+static size_t seen_mask;
+static size_t nseen;
+
+/*****************
+ * Dependency walk
+ *****************/
+
+/* Files queued or visited by a walk */
+struct walk {
+    char *paths[WALK_MAX_FILES];
+    dev_t dev[WALK_MAX_FILES];
+    ino_t ino[WALK_MAX_FILES];
+    int nfiles;   // files queued
+    int nvisited; // files opened
+};
+
+static void walk_queue(struct walk *w, const char *path) {
+    if (w->nfiles == WALK_MAX_FILES) {
+        return;
+    }
+    for (int i = 0; i < w->nfiles; i++) {
+        if (strcmp(w->paths[i], path) == 0) {
+            return;
+        }
+    }
+    char *copy = strdup(path);
+    if (copy != NULL) {
+        w->paths[w->nfiles++] = copy;
+    }
+}
+
+/* Reads exactly len bytes at off into a new buffer, or returns NULL */
+static void *read_at(int fd, uint64_t off, uint64_t len) {
+    if (len == 0 || len > WALK_MAX_META) {
+        return NULL;
+    }
+    char *buf = malloc(len + 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+    if (pread(fd, buf, len, (off_t)off) != (ssize_t)len) {
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+/* Translates a virtual address to a file offset through the PT_LOADs */
+static bool vaddr_to_offset(const Elf64_Phdr *ph, int phnum, uint64_t vaddr,
+                            uint64_t *off) {
+    for (int i = 0; i < phnum; i++) {
+        if (ph[i].p_type == PT_LOAD && vaddr >= ph[i].p_vaddr &&
+            vaddr < ph[i].p_vaddr + ph[i].p_filesz) {
+            *off = vaddr - ph[i].p_vaddr + ph[i].p_offset;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Queues the first existing dir/name from a colon-separated list */
+static bool find_in_dirs(struct walk *w, const char *dirs, const char *name) {
+    char path[4096];
+    while (dirs != NULL && *dirs != '\0') {
+        size_t len = strcspn(dirs, ":");
+        if (len > 0 && memchr(dirs, '$', len) == NULL) {
+            sio_snprintf(path, sizeof(path), "%.*s/%s", (int)len, dirs, name);
+            if (access(path, R_OK) == 0) {
+                walk_queue(w, path);
+                return true;
+            }
+        }
+        dirs += len + (dirs[len] == ':');
+    }
+    return false;
+}
+
+static void queue_library(struct walk *w, const char *name,
+                          const char *runpath) {
+    if (strchr(name, '/') != NULL) {
+        walk_queue(w, name);
+        return;
+    }
+    if (find_in_dirs(w, runpath, name) ||
+        find_in_dirs(w, getenv("LD_LIBRARY_PATH"), name)) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(default_lib_dirs) / sizeof(char *); i++) {
+        if (find_in_dirs(w, default_lib_dirs[i], name)) {
+            return;
+        }
+    }
+}
+
+/* Queues the interpreter and libraries of one ELF file */
+static void scan_elf(struct walk *w, int fd, const Elf64_Ehdr *eh) {
+    if (eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_phnum == 0 ||
+        eh->e_phnum > 128) {
+        return;
+    }
+    Elf64_Phdr *ph = read_at(fd, eh->e_phoff,
+                             (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr));
+    if (ph == NULL) {
+        return;
+    }
+
+    Elf64_Dyn *dyn = NULL;
+    size_t ndyn = 0;
+    for (int i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_type == PT_INTERP) {
+            char *interp = read_at(fd, ph[i].p_offset, ph[i].p_filesz);
+            if (interp != NULL) {
+                walk_queue(w, interp);
+                free(interp);
+            }
+        } else if (ph[i].p_type == PT_DYNAMIC && dyn == NULL) {
+            dyn = read_at(fd, ph[i].p_offset, ph[i].p_filesz);
+            ndyn = ph[i].p_filesz / sizeof(Elf64_Dyn);
+        }
+    }
+
+    uint64_t strtab = 0, strsz = 0, off;
+    int64_t runpath = -1;
+    for (size_t i = 0; dyn != NULL && i < ndyn && dyn[i].d_tag != DT_NULL;
+         i++) {
+        if (dyn[i].d_tag == DT_STRTAB) {
+            strtab = dyn[i].d_un.d_ptr;
+        } else if (dyn[i].d_tag == DT_STRSZ) {
+            strsz = dyn[i].d_un.d_val;
+        } else if (dyn[i].d_tag == DT_RUNPATH ||
+                   (dyn[i].d_tag == DT_RPATH && runpath < 0)) {
+            runpath = (int64_t)dyn[i].d_un.d_val;
+        }
+    }
+    char *strings = NULL;
+    if (strtab != 0 && vaddr_to_offset(ph, eh->e_phnum, strtab, &off)) {
+        strings = read_at(fd, off, strsz);
+    }
+    if (strings != NULL) {
+        const char *rp = (runpath >= 0 && (uint64_t)runpath < strsz)
+                             ? strings + runpath
+                             : NULL;
+        for (size_t i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+            if (dyn[i].d_tag == DT_NEEDED && dyn[i].d_un.d_val < strsz) {
+                queue_library(w, strings + dyn[i].d_un.d_val, rp);
+            }
+        }
+    }
+    free(strings);
+    free(dyn);
+    free(ph);
+}
+
+/**
+ * @brief Visits a program and everything the loader would open for it
+ */
+int prewarm_walk(const char *path,
+                 void (*fn)(const char *file, int fd, void *arg), void *arg) {
+    struct walk *w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return 0;
+    }
+    walk_queue(w, path);
+
+    for (int next = 0; next < w->nfiles; next++) {
+        int fd = open(w->paths[next], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            continue;
+        }
+        // The same file may be reached through different names
+        bool dup = false;
+        for (int i = 0; i < w->nvisited; i++) {
+            dup |= w->dev[i] == st.st_dev && w->ino[i] == st.st_ino;
+        }
+        if (dup) {
+            close(fd);
+            continue;
+        }
+        w->dev[w->nvisited] = st.st_dev;
+        w->ino[w->nvisited] = st.st_ino;
+        w->nvisited++;
+
+        fn(w->paths[next], fd, arg);
+
+        union {
+            Elf64_Ehdr eh;
+            char text[256];
+        } head;
+        ssize_t n = pread(fd, &head, sizeof(head) - 1, 0);
+        if (n >= (ssize_t)sizeof(Elf64_Ehdr) &&
+            memcmp(head.eh.e_ident, ELFMAG, SELFMAG) == 0 &&
+            head.eh.e_ident[EI_CLASS] == ELFCLASS64) {
+            scan_elf(w, fd, &head.eh);
+        } else if (n > 2 && head.text[0] == '#' && head.text[1] == '!') {
+            // A script: warm its interpreter
+            head.text[n] = '\0';
+            char *interp = head.text + 2;
+            interp += strspn(interp, " \t");
+            interp[strcspn(interp, " \t\r\n")] = '\0';
+            if (*interp == '/') {
+                walk_queue(w, interp);
+            }
+        }
+        close(fd);
+    }
+
+    int visited = w->nvisited;
+    for (int i = 0; i < w->nfiles; i++) {
+        free(w->paths[i]);
+    }
+    free(w);
+    return visited;
+}
+
+/*****************
+ * Helper process
+ *****************/
+
+static void advise_willneed(const char *file, int fd, void *arg) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
+static void worker_main(int fd) {
+    char buf[8192];
+    size_t len = 0;
+    while (true) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            _exit(0);
+        }
+        len += (size_t)n;
+        char *line = buf;
+        char *nl;
+        while ((nl = memchr(line, '\n', len - (size_t)(line - buf))) != NULL) {
+            *nl = '\0';
+            prewarm_walk(line, advise_willneed, NULL);
+            line = nl + 1;
+        }
+        len -= (size_t)(line - buf);
+        memmove(buf, line, len);
+        if (len == sizeof(buf) - 1) {
+            len = 0; // an absurdly long line; drop it
+        }
+    }
+}
+
+static bool start_worker(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        close(fds[1]);
+        worker_main(fds[0]);
+    }
+    close(fds[0]);
+    shutdown(fds[1], SHUT_RD);
+    worker_fd = fds[1];
+    return true;
+}
+
+/*****************
+ * Shell side
+ *****************/
+
+/**
+ * @brief Reports whether prewarming was enabled through TSH_PREWARM
+ */
+bool prewarm_enabled(void) {
+    if (enabled < 0) {
+        const char *env = getenv("TSH_PREWARM");
+        enabled = env != NULL && *env != '\0' && strcmp(env, "0") != 0;
+    }
+    return enabled;
+}
+
+/* Records path as handed over; false if it already was */
+static bool mark_seen(const char *path, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+    }
+    h |= 1; // 0 marks an empty slot
+
+    if (2 * (nseen + 1) > (seen ? seen_mask + 1 : 0)) {
+        size_t size = seen ? 2 * (seen_mask + 1) : 256;
+        uint64_t *table = calloc(size, sizeof(*table));
+        if (table == NULL) {
+            return false;
+        }
+        for (size_t i = 0; seen != NULL && i <= seen_mask; i++) {
+            if (seen[i] != 0) {
+                size_t j = seen[i] & (size - 1);
+                while (table[j] != 0) {
+                    j = (j + 1) & (size - 1);
+                }
+                table[j] = seen[i];
+            }
+        }
+        free(seen);
+        seen = table;
+        seen_mask = size - 1;
+    }
+
+    size_t i = h & seen_mask;
+    while (seen[i] != 0) {
+        if (seen[i] == h) {
+            return false;
+        }
+        i = (i + 1) & seen_mask;
+    }
+    seen[i] = h;
+    nseen++;
+    return true;
+}
+
+static void queue_path(const char *path, size_t len) {
+    if (len == 0 || len >= 4096 || !mark_seen(path, len)) {
+        return;
+    }
+    if (worker_fd < 0 && !start_worker()) {
+        enabled = 0;
+        return;
+    }
+    char line[4096 + 1];
+    memcpy(line, path, len);
+    line[len] = '\n';
+    // Never wait for the helper: a full socket just loses this hint
+    if (send(worker_fd, line, len + 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+        errno == EPIPE) {
+        enabled = 0;
+    }
+}
+
+/**
+ * @brief Hands a program that is about to run to the helper
+ */
+void prewarm_command(const char *path) {
+    if (prewarm_enabled()) {
+        queue_path(path, strlen(path));
+    }
+}
+
+/**
+ * @brief Looks ahead at buffered command lines for programs to warm
+ *
+ * The program of a line is taken to be its first word containing a '/',
+ * which also finds the command behind prefix builtins such as retry.
+ */
+void prewarm_scan(const char *text, size_t len) {
+    if (!prewarm_enabled()) {
+        return;
+    }
+    const char *end = text + len;
+    const char *line = text;
+    const char *nl;
+    while (line < end && (nl = memchr(line, '\n', (size_t)(end - line)))) {
+        const char *p = line;
+        while (p < nl) {
+            while (p < nl && isspace((unsigned char)*p)) {
+                p++;
+            }
+            const char *word = p;
+            while (p < nl && !isspace((unsigned char)*p)) {
+                p++;
+            }
+            if (word < p && (*word == '<' || *word == '>')) {
+                // Skip a redirection and its file name
+                if (p == word + 1) {
+                    while (p < nl && isspace((unsigned char)*p)) {
+                        p++;
+                    }
+                    while (p < nl && !isspace((unsigned char)*p)) {
+                        p++;
+                    }
+                }
+                continue;
+            }
+            if (memchr(word, '/', (size_t)(p - word)) != NULL) {
+                queue_path(word, (size_t)(p - word));
+                break;
+            }
+        }
+        line = nl + 1;
+    }
+}
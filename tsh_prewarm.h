@@ -0,0 +1,42 @@
+/**
+ * @file tsh_prewarm.h
+ * @brief Page-cache prewarming of programs and their shared libraries
+ *
+ * On a cold host the first launch of a program stalls on page faults
+ * against the executable, its ELF interpreter and every DT_NEEDED library.
+ * When prewarming is enabled (TSH_PREWARM=1 in the environment), the shell
+ * hands each program it is about to run, and each program it sees coming
+ * up in already-buffered input, to a helper process that resolves the
+ * files the dynamic loader will map and issues POSIX_FADV_WILLNEED on
+ * them, so the reads are in flight before the loader needs the pages.
+ *
+ * Every program is handed over at most once per shell.  Requests are
+ * dropped rather than delaying the shell if the helper falls behind.
+ */
+
+#ifndef __TSH_PREWARM_H__
+#define __TSH_PREWARM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* True if TSH_PREWARM enables prewarming */
+bool prewarm_enabled(void);
+
+/* Queues path (a program about to be run) for prewarming */
+void prewarm_command(const char *path);
+
+/* Queues the programs named on the complete lines of text */
+void prewarm_scan(const char *text, size_t len);
+
+/*
+ * Calls fn for path and for every file the dynamic loader would open for
+ * it: a script's interpreter, the ELF interpreter and the DT_NEEDED
+ * libraries, recursively.  fd is open for reading during the call.
+ * Returns the number of files visited.
+ */
+int prewarm_walk(const char *path, void (*fn)(const char *file, int fd,
+                                              void *arg),
+                 void *arg);
+
+#endif /* __TSH_PREWARM_H__ */
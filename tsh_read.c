@@ -0,0 +1,202 @@
+/**
+ * @file tsh_read.c
+ * @brief Block-buffered record input for the read builtin
+ *
+ * Each descriptor being read has an entry in a small table, found by a
+ * linear search (there are rarely more than two: a loop's input and the
+ * shell's stdin).  An entry remembers how its descriptor may be read,
+ * decided by fstat(2) when it is created, and the unread rest of the last
+ * block.  read_sync() drops every entry but the owned ones, so the next
+ * read of a shared descriptor starts from its actual file offset and sees
+ * whatever replaced it in the meantime.
+ */
+
+#include "tsh_read.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Descriptors read at once: nested loops plus the shared ones */
+#define READ_MAX_BUFS 8
+
+struct read_buf {
+    int fd;         // -1 if the entry is free
+    bool owned;     // opened for the reader alone, never handed back
+    bool blocks;    // may be read ahead a block at a time
+    bool shared;    // a shared regular file: read_sync() seeks back
+    bool pollable;  // may block, so wait in poll() to notice a stop
+    char *data;     // READ_BLOCK_SIZE bytes, kept once allocated
+    size_t pos;     // the unread bytes are data[pos..len)
+    size_t len;
+};
+
+static struct read_buf bufs[READ_MAX_BUFS] = {
+    [0 ... READ_MAX_BUFS - 1] = {.fd = -1},
+};
+
+/* Finds or sets up the entry of fd; NULL if the table is full */
+static struct read_buf *find_buf(int fd, bool owned) {
+    struct read_buf *free_buf = NULL;
+    for (int i = 0; i < READ_MAX_BUFS; i++) {
+        if (bufs[i].fd == fd) {
+            return &bufs[i];
+        }
+        if (bufs[i].fd < 0 && free_buf == NULL) {
+            free_buf = &bufs[i];
+        }
+    }
+    if (free_buf == NULL) {
+        return NULL;
+    }
+
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    struct read_buf *b = free_buf;
+    b->fd = fd;
+    b->owned = owned;
+    b->blocks = owned || regular;
+    b->shared = regular && !owned;
+    b->pollable = !regular;
+    b->pos = b->len = 0;
+    if (b->blocks && b->data == NULL &&
+        (b->data = malloc(READ_BLOCK_SIZE)) == NULL) {
+        b->blocks = b->shared = false;
+    }
+    return b;
+}
+
+/*
+ * Refills an empty buffer: a block, or a single byte if read-ahead is not
+ * safe.  Returns the bytes read, 0 at end of input or -1 on error.
+ */
+static ssize_t fill(struct read_buf *b, char *byte,
+                    const volatile sig_atomic_t *stop) {
+    char *dst = b->blocks ? b->data : byte;
+    size_t want = b->blocks ? READ_BLOCK_SIZE : 1;
+    for (;;) {
+        if (b->pollable) {
+            struct pollfd pfd = {.fd = b->fd, .events = POLLIN};
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -1;
+            }
+        }
+        if (stop != NULL && *stop) {
+            errno = EINTR;
+            return -1;
+        }
+        ssize_t n = read(b->fd, dst, want);
+        if (n >= 0 || errno != EINTR) {
+            if (n > 0 && b->blocks) {
+                b->pos = 0;
+                b->len = (size_t)n;
+            }
+            return n;
+        }
+    }
+}
+
+size_t read_decode(struct read_state *state, const struct read_opts *opts,
+                   const char *data, size_t avail, char *buf, size_t size) {
+    size_t limit = size - 1;
+    if (opts->max > 0 && opts->max < limit) {
+        limit = opts->max;
+    }
+    size_t used = 0;
+    size_t n = state->len;
+    if (avail > 0) {
+        state->any = true;
+    }
+
+    if (opts->raw) {
+        // the common case: copy up to the delimiter in one go
+        size_t take = avail < limit - n ? avail : limit - n;
+        const char *end = memchr(data, opts->delim, take);
+        size_t len = end != NULL ? (size_t)(end - data) : take;
+        memcpy(buf + n, data, len);
+        n += len;
+        used = len + (end != NULL);
+        state->done = end != NULL;
+    } else {
+        // \c stands for c, and a backslash before the delimiter joins
+        // the next line to this record
+        while (used < avail && n < limit && !state->done) {
+            char c = data[used++];
+            if (state->escaped) {
+                state->escaped = false;
+                if (c != (char)opts->delim) {
+                    buf[n++] = c;
+                }
+            } else if (c == '\\') {
+                state->escaped = true;
+            } else if (c == (char)opts->delim) {
+                state->done = true;
+            } else {
+                buf[n++] = c;
+            }
+        }
+    }
+    if (n == limit) {
+        state->done = true;
+    }
+    state->len = n;
+    buf[n] = '\0';
+    return used;
+}
+
+int read_record(int fd, bool owned, const struct read_opts *opts, char *buf,
+                size_t size, const volatile sig_atomic_t *stop) {
+    struct read_buf local = {.fd = fd, .pollable = true};
+    struct read_buf *b = find_buf(fd, owned);
+    if (b == NULL) {
+        b = &local; // unbuffered, like a shared pipe
+    }
+
+    struct read_state state = {0};
+    char byte;
+    buf[0] = '\0';
+    while (!state.done) {
+        if (!b->blocks || b->pos == b->len) {
+            ssize_t got = fill(b, &byte, stop);
+            if (got <= 0) {
+                if (got < 0) {
+                    return -1;
+                }
+                break;
+            }
+        }
+        if (b->blocks) {
+            b->pos += read_decode(&state, opts, b->data + b->pos,
+                                  b->len - b->pos, buf, size);
+        } else {
+            read_decode(&state, opts, &byte, 1, buf, size);
+        }
+    }
+    return state.any ? 1 : 0;
+}
+
+void read_sync(void) {
+    for (int i = 0; i < READ_MAX_BUFS; i++) {
+        struct read_buf *b = &bufs[i];
+        if (b->fd < 0 || b->owned) {
+            continue;
+        }
+        if (b->shared && b->pos < b->len) {
+            lseek(b->fd, -(off_t)(b->len - b->pos), SEEK_CUR);
+        }
+        b->fd = -1;
+        b->pos = b->len = 0;
+    }
+}
+
+void read_forget(int fd) {
+    for (int i = 0; i < READ_MAX_BUFS; i++) {
+        if (bufs[i].fd == fd) {
+            bufs[i].fd = -1;
+            bufs[i].pos = bufs[i].len = 0;
+        }
+    }
+}
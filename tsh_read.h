@@ -0,0 +1,72 @@
+/**
+ * @file tsh_read.h
+ * @brief Block-buffered record input for the read builtin
+ *
+ * Reading a line from a descriptor that other processes also read must
+ * not consume anything past the line, which for a pipe means one read(2)
+ * per byte.  This module reads ahead in blocks whenever that is safe and
+ * keeps the read-ahead in a buffer per descriptor, so that a read loop
+ * costs a system call per block rather than per byte:
+ *
+ * - A descriptor the shell opened for reading alone (a loop's < file,
+ *   even a FIFO) is read in blocks; nothing else can see the difference.
+ * - A regular file that is shared (stdin, -u fd) is read in blocks too,
+ *   and the unread part of the block is handed back with lseek(2) by
+ *   read_sync(), which the shell calls before every fork and whenever a
+ *   read builtin returns.  Children and later commands therefore find
+ *   the file offset just past the last record the shell consumed.
+ * - Anything else (a shared pipe, a terminal) is read a byte at a time.
+ */
+
+#ifndef __TSH_READ_H__
+#define __TSH_READ_H__
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Size of a read-ahead block */
+#define READ_BLOCK_SIZE 65536
+
+/* How records are delimited and decoded */
+struct read_opts {
+    int delim;  // the byte that ends a record ('\n' by default)
+    size_t max; // stop after this many bytes of the record, 0 for no limit
+    bool raw;   // no backslash escapes or line continuations (-r)
+};
+
+/* Progress of a record decoded from one or more chunks of input */
+struct read_state {
+    size_t len;   // bytes of the record so far
+    bool any;     // some input was consumed, so there is a record
+    bool escaped; // the last chunk ended with a backslash
+    bool done;    // the delimiter or the size limit was reached
+};
+
+/*
+ * Decodes the next bytes of data (avail of them) into the record in buf,
+ * of size bytes, continuing where state (zeroed for a new record) left
+ * off.  Returns the bytes consumed; buf stays NUL-terminated.  This is
+ * how callers with an input buffer of their own read records from it.
+ */
+size_t read_decode(struct read_state *state, const struct read_opts *opts,
+                   const char *data, size_t avail, char *buf, size_t size);
+
+/*
+ * Reads the next record from fd into buf (NUL-terminated, without the
+ * delimiter), splitting records longer than size - 1 bytes.  owned says
+ * the shell opened fd for this reader alone.  A blocking read on a pipe
+ * or terminal gives up if *stop becomes set while it waits.  Returns 1
+ * for a record (the last may lack its delimiter), 0 at end of input and
+ * -1 on error, with errno set (EINTR if stopped).
+ */
+int read_record(int fd, bool owned, const struct read_opts *opts, char *buf,
+                size_t size, const volatile sig_atomic_t *stop);
+
+/* Hands back the read-ahead of shared regular files (see above) */
+void read_sync(void);
+
+/* Drops the buffer of an owned descriptor before it is closed */
+void read_forget(int fd);
+
+#endif /* __TSH_READ_H__ */
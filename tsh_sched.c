@@ -0,0 +1,1496 @@
+/**
+ * @file tsh_sched.c
+ * @brief Scheduling and preemption of background jobs
+ *
+ * Pending jobs wait in a binary heap per scheduler, ordered by its
+ * policy; each job ID maps to its scheduler through sched_owners.  With
+ * -j auto, a controller ticking on the shell's event loop grows the limit
+ * while throughput rises and backs off when it falls, the load exceeds
+ * the CPUs or memory runs short.
+ */
+
+#include "tsh_sched.h"
+#include "csapp.h"
+#include "tsh_cgroup.h"
+#include "tsh_shell.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*****************
+ * Scheduler
+ *****************/
+
+#define SCHED_TICK_NS 500000000LL    // controller period
+#define SCHED_WINDOW_NS 5000000000LL // longest measure of a limit
+#define SCHED_MAX_LIMIT 1024
+#define SCHED_EWMA 0.3       // weight of the latest tick in the throughput
+#define SCHED_HOLD 4         // after backing off, windows before growing
+#define SCHED_MIN_MEM_PCT 10 // below this much available memory, halve
+
+/*
+ * The scheduler of each of its jobs: where a pending job is in the queue,
+ * or which process a running job started as
+ */
+static struct sched_owner {
+    struct sched *s;
+    pid_t pid;        // 0 while pending
+    size_t pos;       // index in s->queue while pending
+    int64_t cpu, mem; // declared needs, held while running
+    unsigned cgroup;  // enforcing them, or 0
+} *sched_owners;
+static size_t sched_owners_cap; // indexed by jid
+
+/* Groups of the fair share policy; group 0 is for jobs without one */
+static struct sched_group {
+    char name[SCHED_GROUP_NAME];
+    int weight;
+    double last_tag; // tag of the group's latest job
+} *sched_groups;
+static size_t nsched_groups;
+
+struct sched bg_sched = {.name = "bg"};
+struct sched par_sched = {.name = "parallel", .quiet = true};
+
+static const char *const policy_names[] = {"fifo", "prio", "fair", "edf"};
+
+/*
+ * Background jobs below this priority are preempted while a foreground
+ * job runs (sched -f); INT_MIN for none.
+ */
+static int preempt_below = INT_MIN;
+static bool preempting; // between preempt_begin() and preempt_end()
+
+/* Controller trace (sched -t), or -1 */
+static int sched_trace_fd = -1;
+
+/* /proc files read on every tick, opened on first use */
+static int loadavg_fd = -1;
+static int meminfo_fd = -1;
+
+/* Online CPUs, the first limit of an adaptive scheduler */
+int sched_ncpu(void) {
+    static int ncpu;
+    if (ncpu == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        ncpu = n > 0 ? (int)n : 1;
+    }
+    return ncpu;
+}
+
+/* Reads a small /proc file through a descriptor kept open across calls */
+static ssize_t read_cached(int *fd, const char *path, char *buf,
+                           size_t size) {
+    if (*fd < 0) {
+        *fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    ssize_t n = *fd >= 0 ? pread(*fd, buf, size - 1, 0) : -1;
+    if (n >= 0) {
+        buf[n] = '\0';
+    }
+    return n;
+}
+
+/**
+ * @brief Reads the load the controller reacts to
+ *
+ * @param[out] runq Runnable tasks, not counting the shell
+ * @param[out] mem_pct Available memory as a percentage of the total
+ * @return false if /proc could not be read; both are then 0 and 100
+ */
+static bool sched_read_load(int *runq, int *mem_pct) {
+    char buf[2048];
+    *runq = 0;
+    *mem_pct = 100;
+
+    // loadavg: "0.50 0.40 0.30 R/T lastpid", R counting the shell itself
+    bool ok = read_cached(&loadavg_fd, "/proc/loadavg", buf, sizeof(buf)) > 0;
+    const char *p = ok ? strchr(buf, '/') : NULL;
+    if (p != NULL) {
+        while (p > buf && p[-1] != ' ') {
+            p--;
+        }
+        *runq = atoi(p) - 1;
+    }
+
+    if (read_cached(&meminfo_fd, "/proc/meminfo", buf, sizeof(buf)) <= 0) {
+        return false;
+    }
+    const char *total = strstr(buf, "MemTotal:");
+    const char *avail = strstr(buf, "MemAvailable:");
+    if (total != NULL && avail != NULL) {
+        long long t = atoll(total + 9);
+        long long a = atoll(avail + 13);
+        if (t > 0) {
+            *mem_pct = (int)(a * 100 / t);
+        }
+    }
+    return ok;
+}
+
+/* The host's CPUs (in milli-CPUs) and memory, the default budget */
+static void sched_host(int64_t *cpu, int64_t *mem) {
+    static int64_t total;
+    if (total == 0) {
+        char buf[2048];
+        const char *p = NULL;
+        if (read_cached(&meminfo_fd, "/proc/meminfo", buf, sizeof(buf)) > 0) {
+            p = strstr(buf, "MemTotal:");
+        }
+        total = p != NULL ? atoll(p + 9) * 1024 : 0;
+        if (total <= 0) {
+            long pages = sysconf(_SC_PHYS_PAGES);
+            total = (int64_t)pages * sysconf(_SC_PAGESIZE);
+        }
+    }
+    *cpu = (int64_t)sched_ncpu() * 1000;
+    *mem = total;
+}
+
+/* The resources the running jobs of s may declare between them */
+static void sched_budget(const struct sched *s, int64_t *cpu, int64_t *mem) {
+    sched_host(cpu, mem);
+    if (s->cpu_budget > 0) {
+        *cpu = s->cpu_budget;
+    }
+    if (s->mem_budget > 0) {
+        *mem = s->mem_budget;
+    }
+}
+
+/* Number of the scheduler's jobs that have not finished */
+static size_t sched_active(const struct sched *s) {
+    return (size_t)s->running + s->npending;
+}
+
+/* Records a change of the limit */
+static void sched_set_limit(struct sched *s, int limit, const char *why) {
+    struct sched_change *c = &s->history[s->nchanges++ % SCHED_HISTORY];
+    c->when = monotonic_ns();
+    c->from = s->limit;
+    c->to = limit;
+    c->why = why;
+    s->limit = limit;
+    s->window_start = c->when;
+    s->window_done = 0;
+    if (s->lowest == 0 || limit < s->lowest) {
+        s->lowest = limit;
+    }
+    if (limit > s->highest) {
+        s->highest = limit;
+    }
+}
+
+static void sched_pump(struct sched *s);
+
+/**
+ * @brief Timer callback: measures throughput and, for an adaptive
+ * scheduler, adjusts the limit
+ *
+ * While jobs are waiting for a slot, the limit is raised once the jobs
+ * completed under it give a fair measure of its throughput: twice as
+ * many jobs as the limit over at least two ticks, or SCHED_WINDOW_NS of
+ * running.  It doubles at first (slow
+ * start) and then grows by one (additive increase).  If an increase made
+ * the throughput fall, the limit goes back to where it was and holds for
+ * a few windows.  It shrinks multiplicatively when the run queue is more
+ * than twice the number of CPUs, and is halved when less than
+ * SCHED_MIN_MEM_PCT of memory is left.
+ */
+static void sched_tick(void *arg) {
+    struct sched *s = arg;
+    int64_t now = monotonic_ns();
+    double secs = (double)(now - s->last_tick) / 1e9;
+    double rate = secs > 0 ? s->completed / secs : 0;
+    s->throughput = s->throughput == 0
+                        ? rate
+                        : SCHED_EWMA * rate + (1 - SCHED_EWMA) * s->throughput;
+    s->completed = 0;
+    s->last_tick = now;
+
+    int runq, mem_pct;
+    sched_read_load(&runq, &mem_pct);
+    const char *why = NULL;
+    int limit = s->limit;
+    int64_t window = now - s->window_start;
+    if (!s->adaptive) {
+        // nothing to decide
+    } else if (mem_pct < SCHED_MIN_MEM_PCT) {
+        limit /= 2;
+        why = "memory low";
+    } else if (runq > 2 * sched_ncpu()) {
+        limit = limit * 3 / 4;
+        why = "run queue long";
+    } else if (s->npending > 0 && s->running >= s->limit &&
+               ((s->window_done >= 2 * (unsigned)s->limit &&
+                 window >= 2 * SCHED_TICK_NS) ||
+                window >= SCHED_WINDOW_NS)) {
+        double window_rate = s->window_done / ((double)window / 1e9);
+        if (s->prev_limit > 0 && window_rate < 0.9 * s->prev_rate) {
+            limit = s->prev_limit;
+            s->hold = SCHED_HOLD;
+            why = "throughput fell";
+        } else if (s->hold > 0) {
+            s->hold--;
+            s->window_start = now;
+            s->window_done = 0;
+        } else {
+            limit = s->slow_start ? 2 * limit : limit + 1;
+            why = "jobs waiting";
+        }
+        s->prev_rate = window_rate;
+    }
+    if (!s->adaptive) {
+        // no limit (0) stays so, when only declared resources hold jobs
+    } else if (limit < 1) {
+        limit = 1;
+    } else if (limit > SCHED_MAX_LIMIT) {
+        limit = SCHED_MAX_LIMIT;
+    }
+    if (limit != s->limit) {
+        if (limit < s->limit) {
+            s->slow_start = false;
+        }
+        s->prev_limit = limit > s->limit ? s->limit : 0;
+        sched_set_limit(s, limit, why);
+        sched_pump(s);
+    } else {
+        why = NULL;
+    }
+
+    if (sched_trace_fd >= 0) {
+        char rate_str[32];
+        snprintf(rate_str, sizeof(rate_str), "%.2f", s->throughput);
+        sio_dprintf(sched_trace_fd,
+                    "%ld %s limit=%d running=%d pending=%zu rate=%s "
+                    "runq=%d mem=%d%%%s%s\n",
+                    (long)(now / 1000000), s->name, s->limit, s->running,
+                    s->npending, rate_str, runq, mem_pct, why ? " " : "",
+                    why ? why : "");
+    }
+
+    if (sched_active(s) > 0) {
+        timer_add(now + SCHED_TICK_NS, sched_tick, s);
+    } else {
+        s->ticking = false;
+    }
+}
+
+/* Starts the controller ticking, if it is not already */
+static void sched_tick_start(struct sched *s) {
+    if (!s->ticking) {
+        s->ticking = true;
+        s->last_tick = monotonic_ns();
+        timer_add(s->last_tick + SCHED_TICK_NS, sched_tick, s);
+    }
+}
+
+/* Counts the exit of a job, freeing its slot and resources */
+static void sched_account(struct sched_owner *o, int status) {
+    struct sched *s = o->s;
+    o->s = NULL;
+    s->cpu_used -= o->cpu;
+    s->mem_used -= o->mem;
+    cgroup_remove(o->cgroup);
+    o->cgroup = 0;
+    s->running--;
+    s->completed++;
+    s->window_done++;
+    s->finished++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        s->failed++;
+    }
+}
+
+/**
+ * @brief Settles the slot of the job that last had jid, before the jid
+ * is reused
+ *
+ * A job ID is free again as soon as the SIGCHLD handler deletes the job,
+ * which may be before event_dispatch() has seen the exit; the exit is
+ * then still in the reap ring.
+ */
+static void sched_release(jid_t jid) {
+    struct sched_owner *o = &sched_owners[jid];
+    int status = 0;
+    reap_pending(o->pid, &status);
+    sched_account(o, status);
+}
+
+/* Returns the owner slot of jid, growing the table; NULL if out of memory */
+static struct sched_owner *sched_owner(jid_t jid) {
+    if ((size_t)jid >= sched_owners_cap) {
+        size_t cap = sched_owners_cap ? sched_owners_cap : 64;
+        while (cap <= (size_t)jid) {
+            cap *= 2;
+        }
+        struct sched_owner *grown =
+            realloc(sched_owners, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return NULL;
+        }
+        memset(grown + sched_owners_cap, 0,
+               (cap - sched_owners_cap) * sizeof(*grown));
+        sched_owners = grown;
+        sched_owners_cap = cap;
+    }
+    return &sched_owners[jid];
+}
+
+/* True if a should start before b under the policy of s */
+static bool sched_before(const struct sched *s, const struct sched_pending *a,
+                         const struct sched_pending *b) {
+    switch (s->policy) {
+    case SCHED_PRIO:
+        if (a->prio != b->prio) {
+            return a->prio > b->prio;
+        }
+        break;
+    case SCHED_FAIR:
+        if (a->tag != b->tag) {
+            return a->tag < b->tag;
+        }
+        break;
+    case SCHED_EDF:
+        if (a->deadline != b->deadline) {
+            return a->deadline < b->deadline;
+        }
+        break;
+    case SCHED_FIFO:
+        break;
+    }
+    return a->seq < b->seq;
+}
+
+/* Stores e at position i of the heap */
+static void sched_place(struct sched *s, size_t i, struct sched_pending e) {
+    s->queue[i] = e;
+    sched_owners[e.jid].pos = i;
+}
+
+static void sched_sift_up(struct sched *s, size_t i) {
+    struct sched_pending e = s->queue[i];
+    while (i > 0 && sched_before(s, &e, &s->queue[(i - 1) / 2])) {
+        sched_place(s, i, s->queue[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    sched_place(s, i, e);
+}
+
+static void sched_sift_down(struct sched *s, size_t i) {
+    struct sched_pending e = s->queue[i];
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= s->npending) {
+            break;
+        }
+        if (child + 1 < s->npending &&
+            sched_before(s, &s->queue[child + 1], &s->queue[child])) {
+            child++;
+        }
+        if (!sched_before(s, &s->queue[child], &e)) {
+            break;
+        }
+        sched_place(s, i, s->queue[child]);
+        i = child;
+    }
+    sched_place(s, i, e);
+}
+
+/* Takes the entry at position i out of the heap */
+static struct sched_pending sched_remove(struct sched *s, size_t i) {
+    struct sched_pending e = s->queue[i];
+    struct sched_pending last = s->queue[--s->npending];
+    if (i < s->npending) {
+        sched_place(s, i, last);
+        sched_sift_down(s, i);
+        sched_sift_up(s, sched_owners[last.jid].pos);
+    }
+    if (s->policy == SCHED_FAIR && e.tag > s->vtime) {
+        s->vtime = e.tag;
+    }
+    if (e.cpu > 0 || e.mem > 0) {
+        s->nsized--;
+    }
+    sched_owners[e.jid].s = NULL;
+    return e;
+}
+
+/* Gives a job of group g its tag: its virtual finish time in the share */
+static double sched_fair_tag(const struct sched *s, size_t g) {
+    struct sched_group *group = &sched_groups[g];
+    double start = group->last_tag > s->vtime ? group->last_tag : s->vtime;
+    group->last_tag = start + 1.0 / group->weight;
+    return group->last_tag;
+}
+
+/* Returns the index of the named group, adding it; 0 if out of memory */
+static size_t sched_group(const char *name, int weight) {
+    size_t g = 0;
+    while (g < nsched_groups && strcmp(sched_groups[g].name, name) != 0) {
+        g++;
+    }
+    if (g == nsched_groups) {
+        struct sched_group *grown =
+            realloc(sched_groups, (g + 1) * sizeof(*grown));
+        if (grown == NULL) {
+            return 0;
+        }
+        sched_groups = grown;
+        sched_groups[g] = (struct sched_group){"", 1, 0};
+        sio_snprintf(sched_groups[g].name, SCHED_GROUP_NAME, "%s", name);
+        nsched_groups++;
+    }
+    if (weight > 0) {
+        sched_groups[g].weight = weight;
+    }
+    return g;
+}
+
+static int compare_seq(const void *a, const void *b) {
+    const struct sched_pending *x = a, *y = b;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * @brief Switches s to a new policy, reordering the jobs it holds
+ *
+ * Fair-share tags are handed out again in submission order, as if the
+ * jobs had been queued under the new policy.
+ */
+static void sched_set_policy(struct sched *s, enum sched_policy policy) {
+    s->policy = policy;
+    qsort(s->queue, s->npending, sizeof(*s->queue), compare_seq);
+    if (policy == SCHED_FAIR) {
+        for (size_t g = 0; g < nsched_groups; g++) {
+            sched_groups[g].last_tag = s->vtime;
+        }
+        for (size_t i = 0; i < s->npending; i++) {
+            s->queue[i].tag = sched_fair_tag(s, s->queue[i].group);
+        }
+    }
+    for (size_t i = 0; i < s->npending; i++) {
+        sched_owners[s->queue[i].jid].pos = i;
+    }
+    for (size_t i = s->npending / 2; i-- > 0;) {
+        sched_sift_down(s, i);
+    }
+}
+
+/* Parses a number of CPUs such as 2 or 0.5 into milli-CPUs; 0 if bad */
+static int64_t parse_cpus(const char *text) {
+    char *end;
+    double cpus = strtod(text, &end);
+    if (end == text || *end != '\0' || !(cpus > 0) || cpus > 1e6) {
+        return 0;
+    }
+    int64_t milli = (int64_t)(cpus * 1000 + 0.5);
+    return milli > 0 ? milli : 1;
+}
+
+/*
+ * Parses a size such as 512M, 4G or 1.5GiB (binary units, B optional)
+ * into bytes; 0 if bad
+ */
+static int64_t parse_bytes(const char *text) {
+    static const char units[] = "KMGT";
+    char *end;
+    double size = strtod(text, &end);
+    if (end == text || !(size > 0)) {
+        return 0;
+    }
+    const char *u = *end != '\0' ? strchr(units, toupper(*end)) : NULL;
+    if (u != NULL) {
+        for (const char *v = units; v <= u; v++) {
+            size *= 1024;
+        }
+        end++;
+        if (*end == 'i') {
+            end++;
+        }
+    }
+    if (*end == 'B' || *end == 'b') {
+        end++;
+    }
+    if (*end != '\0' || size > 1e18) {
+        return 0;
+    }
+    return size < 1 ? 1 : (int64_t)size;
+}
+
+/* Formats milli-CPUs as a number of CPUs */
+static void format_cpus(char *buf, size_t size, int64_t milli) {
+    snprintf(buf, size, milli % 1000 == 0 ? "%.0f" : "%.3g", milli / 1000.0);
+}
+
+/* Formats a byte count with a binary unit, as parse_bytes() reads it */
+static void format_bytes(char *buf, size_t size, int64_t bytes) {
+    static const char units[] = "BKMGT";
+    double value = (double)bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(buf, size, unit == 0 ? "%.0f%c" : "%.3g%c", value, units[unit]);
+}
+
+/**
+ * @brief Parses the options of a final &[...]: prio=N, deadline=TIME,
+ * group=NAME, weight=N, cpu=N and mem=SIZE, separated by commas
+ *
+ * @param[in] text The options, or NULL for none
+ * @return false (after printing an error) if an option is not valid
+ */
+bool parse_job_opts(const char *text, struct job_opts *opts) {
+    *opts = (struct job_opts){0, -1, "", 0, 0, 0};
+    if (text == NULL) {
+        return true;
+    }
+    char buf[MAXLINE_TSH];
+    sio_snprintf(buf, sizeof(buf), "%s", text);
+    char *save;
+    for (char *opt = strtok_r(buf, ",", &save); opt != NULL;
+         opt = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(opt, '=');
+        char *end = NULL;
+        const char *endc = NULL;
+        if (val != NULL) {
+            *val++ = '\0';
+        }
+        bool ok = val != NULL && *val != '\0';
+        if (!ok) {
+            // reported below
+        } else if (strcmp(opt, "prio") == 0) {
+            opts->prio = (int)strtol(val, &end, 10);
+            ok = *end == '\0';
+        } else if (strcmp(opt, "deadline") == 0) {
+            opts->deadline = parse_duration(val, &endc);
+            ok = opts->deadline >= 0 && *endc == '\0';
+        } else if (strcmp(opt, "group") == 0) {
+            ok = strlen(val) < SCHED_GROUP_NAME;
+            sio_snprintf(opts->group, sizeof(opts->group), "%s", val);
+        } else if (strcmp(opt, "weight") == 0) {
+            long w = strtol(val, &end, 10);
+            ok = *end == '\0' && w >= 1 && w <= 1000;
+            opts->weight = (int)w;
+        } else if (strcmp(opt, "cpu") == 0) {
+            opts->cpu = parse_cpus(val);
+            ok = opts->cpu > 0;
+        } else if (strcmp(opt, "mem") == 0) {
+            opts->mem = parse_bytes(val);
+            ok = opts->mem > 0;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            sio_printf("&[%s]: bad option '%s' (want prio=N, "
+                       "deadline=TIME, group=NAME, weight=1..1000, cpu=N "
+                       "or mem=SIZE)\n",
+                       text, opt);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Starts a job that was pending, outside of any limit
+ *
+ * @param[in] e The job's queue entry, already out of the queue
+ * @return false (after deleting the job) if it could not be started
+ *
+ * A job that declared resources holds them from here until it is reaped,
+ * in a cgroup of its own if limits can be enforced.  Must be called with
+ * SIGCHLD, SIGINT and SIGTSTP blocked.  Frees the entry's tokens.
+ */
+static bool sched_start(struct sched *s, struct sched_pending *e,
+                        job_state state, const sigset_t *prev_mask) {
+    jid_t jid = e->jid;
+    int procs_fd = -1;
+    unsigned cgroup = 0;
+    if (e->cpu > 0 || e->mem > 0) {
+        cgroup = cgroup_create(e->cpu, e->mem, &procs_fd);
+    }
+    pid_t pid = spawn_job(e->token, prev_mask, procs_fd);
+    free(e->token);
+    if (procs_fd >= 0) {
+        close(procs_fd);
+    }
+    if (pid == 0) {
+        cgroup_remove(cgroup);
+        delete_job(jid);
+        s->finished++;
+        s->failed++;
+        retry_job_started(jid, 0);
+        return false;
+    }
+    if (e->deadline != INT64_MAX && monotonic_ns() > e->deadline) {
+        s->missed++;
+    }
+    job_set_pid(jid, pid);
+    job_set_state(jid, state);
+    job_set_note(jid, ""); // its place in the queue, from jobs
+    sched_owners[jid] =
+        (struct sched_owner){s, pid, 0, e->cpu, e->mem, cgroup};
+    s->cpu_used += e->cpu;
+    s->mem_used += e->mem;
+    s->running++;
+    retry_job_started(jid, pid);
+    return true;
+}
+
+/**
+ * @brief Picks the pending job to start next
+ *
+ * @return Its position in the queue, or s->npending if none fits
+ *
+ * Without jobs that declared resources, this is the head of the queue.
+ * With them, the free resources are packed greedily: the job with the
+ * largest dominant share (the larger of its fractions of the CPU and of
+ * the memory budget) among those that fit starts first, and the policy
+ * only breaks ties.  This scans the queue, so it is O(n) per start.
+ */
+static size_t sched_pick(const struct sched *s) {
+    if (s->nsized == 0) {
+        return 0;
+    }
+    int64_t cpu, mem;
+    sched_budget(s, &cpu, &mem);
+    size_t best = s->npending;
+    double best_share = -1;
+    for (size_t i = 0; i < s->npending; i++) {
+        const struct sched_pending *e = &s->queue[i];
+        if (s->cpu_used + e->cpu > cpu || s->mem_used + e->mem > mem) {
+            continue;
+        }
+        double share = (double)e->cpu / (double)cpu;
+        if ((double)e->mem / (double)mem > share) {
+            share = (double)e->mem / (double)mem;
+        }
+        if (share > best_share ||
+            (share == best_share && sched_before(s, e, &s->queue[best]))) {
+            best = i;
+            best_share = share;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Starts pending jobs while the limit and the resources allow
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+static void sched_pump(struct sched *s) {
+    if (shutting_down || preempting) {
+        return;
+    }
+    // The caller's mask is not known here; run children with the job
+    // control signals unblocked, as launch_job() does
+    sigset_t child_mask;
+    sigprocmask(SIG_BLOCK, NULL, &child_mask);
+    sigdelset(&child_mask, SIGCHLD);
+    sigdelset(&child_mask, SIGINT);
+    sigdelset(&child_mask, SIGTSTP);
+
+    while (s->npending > 0 && (s->limit == 0 || s->running < s->limit)) {
+        size_t next = sched_pick(s);
+        if (next == s->npending) {
+            break; // waiting for resources
+        }
+        struct sched_pending e = sched_remove(s, next);
+        if (sched_start(s, &e, BG, &child_mask) && !s->quiet) {
+            sio_printf("[%d] (%d) %s\n", (int)e.jid, (int)job_get_pid(e.jid),
+                       job_get_cmdline(e.jid));
+        }
+    }
+}
+
+/**
+ * @brief Queues a job, starting it right away if the limit allows
+ *
+ * @param[in] token The parsed command, copied for the queue
+ * @param[in] opts What the job asked for, or NULL for the defaults
+ * @return The job ID, or 0 if the job could not be queued
+ */
+jid_t sched_submit(struct sched *s, const char *cmdline,
+                   const struct cmdline_tokens *token,
+                   const struct job_opts *opts) {
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    if (opts != NULL && (opts->cpu > 0 || opts->mem > 0)) {
+        int64_t cpu, mem;
+        sched_budget(s, &cpu, &mem);
+        if (opts->cpu > cpu || opts->mem > mem) {
+            char need[32], have[32];
+            if (opts->cpu > cpu) {
+                format_cpus(need, sizeof(need), opts->cpu);
+                format_cpus(have, sizeof(have), cpu);
+            } else {
+                format_bytes(need, sizeof(need), opts->mem);
+                format_bytes(have, sizeof(have), mem);
+            }
+            sio_printf("%s: job needs %s %s, more than the budget of %s\n",
+                       s->name, need, opts->cpu > cpu ? "CPUs" : "of memory",
+                       have);
+            return 0;
+        }
+    }
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    if (s->npending == s->cap) {
+        size_t cap = s->cap ? 2 * s->cap : 16;
+        struct sched_pending *grown = realloc(s->queue, cap * sizeof(*grown));
+        if (grown == NULL) {
+            sio_printf("%s: out of memory\n", s->name);
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            return 0;
+        }
+        s->queue = grown;
+        s->cap = cap;
+    }
+    if (nsched_groups == 0) {
+        sched_group("", 1);
+    }
+    struct cmdline_tokens *copy = malloc(sizeof(*copy));
+    jid_t jid = copy != NULL ? add_job(0, PD, cmdline) : 0;
+    struct sched_owner *o = jid != 0 ? sched_owner(jid) : NULL;
+    if (o == NULL) {
+        sio_printf("%s: cannot add job\n", s->name);
+        if (jid != 0) {
+            delete_job(jid);
+        }
+        free(copy);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return 0;
+    }
+    if (o->s != NULL) {
+        sched_release(jid);
+    }
+    copy_tokens(copy, token);
+    tag_job(jid, token);
+
+    struct sched_pending e = {.jid = jid,
+                              .token = copy,
+                              .seq = s->next_seq++,
+                              .deadline = INT64_MAX};
+    if (opts != NULL) {
+        job_set_prio(jid, opts->prio);
+        e.cpu = opts->cpu;
+        e.mem = opts->mem;
+        if (e.cpu > 0 || e.mem > 0) {
+            s->nsized++;
+        }
+        e.prio = opts->prio;
+        if (opts->deadline >= 0) {
+            e.deadline = monotonic_ns() + opts->deadline;
+        }
+        e.group = sched_group(opts->group, opts->weight);
+    }
+    e.tag = sched_fair_tag(s, e.group);
+    o->s = s;
+    o->pid = 0;
+    s->queue[s->npending++] = e;
+    sched_sift_up(s, s->npending - 1);
+    if (s->started == 0) {
+        s->started = monotonic_ns();
+    }
+
+    sched_pump(s);
+    if (!s->quiet && job_get_state(jid) == PD) {
+        sio_printf("[%d] (pending) %s\n", (int)jid, cmdline);
+    }
+    sched_tick_start(s);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return jid;
+}
+
+/* Returns the scheduler holding jid as a pending job, or NULL */
+static struct sched *sched_find(jid_t jid) {
+    if (jid < 1 || (size_t)jid >= sched_owners_cap ||
+        sched_owners[jid].pid != 0) {
+        return NULL;
+    }
+    return sched_owners[jid].s;
+}
+
+/**
+ * @brief Starts a pending job now, regardless of its scheduler's limit
+ * (for bg and fg)
+ *
+ * @return false if the job could not be started
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+bool sched_start_now(jid_t jid, job_state state, const sigset_t *prev_mask) {
+    struct sched *s = sched_find(jid);
+    if (s == NULL) {
+        return false;
+    }
+    struct sched_pending e = sched_remove(s, sched_owners[jid].pos);
+    return sched_start(s, &e, state, prev_mask);
+}
+
+/**
+ * @brief Removes a pending job from its queue and the job list
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+bool sched_cancel(jid_t jid) {
+    struct sched *s = sched_find(jid);
+    if (s == NULL) {
+        return false;
+    }
+    struct sched_pending e = sched_remove(s, sched_owners[jid].pos);
+    free(e.token);
+    s->cancelled++;
+    delete_job(jid);
+    retry_job_started(jid, 0);
+    return true;
+}
+
+/* The scheduler being sorted by compare_queued() */
+static const struct sched *sorting;
+
+static int compare_queued(const void *a, const void *b) {
+    const struct sched_pending *x = a, *y = b;
+    return sched_before(sorting, x, y) ? -1 : sched_before(sorting, y, x);
+}
+
+/**
+ * @brief Notes on each pending job of s its place in the queue and what
+ * the policy decides on, for jobs to show
+ */
+void sched_annotate(const struct sched *s) {
+    struct sched_pending *order = malloc(s->npending * sizeof(*order) + 1);
+    if (order == NULL) {
+        return;
+    }
+    memcpy(order, s->queue, s->npending * sizeof(*order));
+    sorting = s;
+    qsort(order, s->npending, sizeof(*order), compare_queued);
+    int64_t now = monotonic_ns();
+    for (size_t i = 0; i < s->npending; i++) {
+        const struct sched_pending *e = &order[i];
+        char note[64], left[32];
+        switch (s->policy) {
+        case SCHED_PRIO:
+            sio_snprintf(note, sizeof(note), "#%zu prio=%d", i + 1, e->prio);
+            break;
+        case SCHED_FAIR:
+            sio_snprintf(note, sizeof(note), "#%zu group=%s weight=%d", i + 1,
+                         e->group == 0 ? "-" : sched_groups[e->group].name,
+                         sched_groups[e->group].weight);
+            break;
+        case SCHED_EDF:
+            if (e->deadline == INT64_MAX) {
+                sio_snprintf(note, sizeof(note), "#%zu no deadline", i + 1);
+            } else if (e->deadline < now) {
+                format_ns(left, sizeof(left), now - e->deadline);
+                sio_snprintf(note, sizeof(note), "#%zu deadline missed by %s",
+                             i + 1, left);
+            } else {
+                format_ns(left, sizeof(left), e->deadline - now);
+                sio_snprintf(note, sizeof(note), "#%zu deadline in %s", i + 1,
+                             left);
+            }
+            break;
+        case SCHED_FIFO:
+            sio_snprintf(note, sizeof(note), "#%zu", i + 1);
+            break;
+        }
+        if (e->cpu > 0 || e->mem > 0) {
+            // what it waits for; the packing may start it out of turn
+            char cpus[16] = "-", bytes[16] = "-";
+            size_t len = strlen(note);
+            if (e->cpu > 0) {
+                format_cpus(cpus, sizeof(cpus), e->cpu);
+            }
+            if (e->mem > 0) {
+                format_bytes(bytes, sizeof(bytes), e->mem);
+            }
+            sio_snprintf(note + len, sizeof(note) - len, " cpu=%s mem=%s",
+                         cpus, bytes);
+        }
+        job_set_note(e->jid, note);
+    }
+    free(order);
+}
+
+/**
+ * @brief Event loop hook: frees the slot of a job the scheduler started
+ *
+ * Called from event_dispatch() with signals blocked.
+ */
+void sched_child_exited(jid_t jid, pid_t pid, int status) {
+    if (jid < 1 || (size_t)jid >= sched_owners_cap ||
+        sched_owners[jid].s == NULL || sched_owners[jid].pid != pid) {
+        return;
+    }
+    struct sched *s = sched_owners[jid].s;
+    sched_account(&sched_owners[jid], status);
+    sched_pump(s);
+}
+
+/**
+ * @brief Parses a -j argument: a count, auto, or off (for no limit)
+ */
+static bool parse_sched_limit(const char *text, int *limit, bool *adaptive) {
+    *adaptive = false;
+    if (strcmp(text, "auto") == 0) {
+        *adaptive = true;
+        *limit = sched_ncpu();
+        return true;
+    }
+    if (strcmp(text, "off") == 0) {
+        *limit = 0;
+        return true;
+    }
+    char *end;
+    long n = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || n < 1 || n > SCHED_MAX_LIMIT) {
+        return false;
+    }
+    *limit = (int)n;
+    return true;
+}
+
+/* Applies a -j argument to s */
+static void sched_configure(struct sched *s, int limit, bool adaptive) {
+    s->adaptive = adaptive;
+    s->lowest = s->highest = 0;
+    s->prev_limit = 0;
+    s->hold = 0;
+    s->slow_start = true;
+    sched_set_limit(s, limit, adaptive ? "auto" : "set");
+}
+
+/* Prints the state of s and its recent changes of limit */
+static void sched_report(const struct sched *s) {
+    char rate[32], when[32];
+    snprintf(rate, sizeof(rate), "%.2f", s->throughput);
+    if (s->limit == 0) {
+        sio_printf("%s: no limit", s->name);
+    } else if (s->adaptive) {
+        sio_printf("%s: limit %d (auto, %d..%d)", s->name, s->limit,
+                   s->lowest, s->highest);
+    } else {
+        sio_printf("%s: limit %d", s->name, s->limit);
+    }
+    sio_printf(", policy %s, running %d, pending %zu, finished %u "
+               "(%u failed), cancelled %u, %s jobs/s",
+               policy_names[s->policy], s->running, s->npending, s->finished,
+               s->failed, s->cancelled, rate);
+    if (s->missed > 0) {
+        sio_printf(", %u started past their deadline", s->missed);
+    }
+    sio_printf("\n");
+    if (s == &bg_sched && (s->cpu_budget > 0 || s->mem_budget > 0 ||
+                           s->cpu_used > 0 || s->mem_used > 0 ||
+                           s->nsized > 0)) {
+        int64_t cpu, mem;
+        char used[2][16], budget[2][16];
+        sched_budget(s, &cpu, &mem);
+        format_cpus(used[0], sizeof(used[0]), s->cpu_used);
+        format_cpus(budget[0], sizeof(budget[0]), cpu);
+        format_bytes(used[1], sizeof(used[1]), s->mem_used);
+        format_bytes(budget[1], sizeof(budget[1]), mem);
+        sio_printf("  declared: cpu %s of %s%s, mem %s of %s%s; limits %s\n",
+                   used[0], budget[0], s->cpu_budget > 0 ? "" : " (host)",
+                   used[1], budget[1], s->mem_budget > 0 ? "" : " (host)",
+                   cgroup_status());
+    }
+    if (s == &bg_sched) {
+        if (preempt_below == INT_MAX) {
+            sio_printf("  foreground jobs preempt all background jobs\n");
+        } else if (preempt_below != INT_MIN) {
+            sio_printf("  foreground jobs preempt background jobs below "
+                       "prio %d\n",
+                       preempt_below);
+        }
+    }
+    size_t first = s->nchanges > SCHED_HISTORY ? s->nchanges - SCHED_HISTORY
+                                               : 0;
+    for (size_t n = first; n < s->nchanges; n++) {
+        const struct sched_change *c = &s->history[n % SCHED_HISTORY];
+        format_ns(when, sizeof(when), s->started ? c->when - s->started : 0);
+        sio_printf("  %10s  %d -> %d  %s\n", when, c->from, c->to, c->why);
+    }
+}
+
+/**
+ * @brief Parses a -b argument: host, or cpu=N and/or mem=SIZE separated
+ * by a comma, a part left out meaning the host's
+ */
+static bool parse_sched_budget(const char *text, int64_t *cpu,
+                               int64_t *mem) {
+    *cpu = *mem = 0;
+    if (strcmp(text, "host") == 0) {
+        return true;
+    }
+    char buf[MAXLINE_TSH];
+    sio_snprintf(buf, sizeof(buf), "%s", text);
+    char *save;
+    for (char *part = strtok_r(buf, ",", &save); part != NULL;
+         part = strtok_r(NULL, ",", &save)) {
+        if (strncmp(part, "cpu=", 4) == 0 && *cpu == 0) {
+            *cpu = parse_cpus(part + 4);
+            if (*cpu == 0) {
+                return false;
+            }
+        } else if (strncmp(part, "mem=", 4) == 0 && *mem == 0) {
+            *mem = parse_bytes(part + 4);
+            if (*mem == 0) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return *cpu > 0 || *mem > 0;
+}
+
+/**
+ * @brief Limits how many background jobs run at once
+ *
+ * Usage: sched [-j N | -j auto | -j off] [-p policy] [-b budget]
+ *              [-f prio | -f all | -f off] [-t file | -t off]
+ *
+ * With a limit, background jobs beyond it are queued as Pending (see jobs)
+ * and started as running ones finish; bg or fg starts a pending job at
+ * once, and kill cancels it.  -j auto lets a controller pick the limit,
+ * starting from the number of CPUs: it adds a slot every half second
+ * while jobs are waiting and completions keep up, steps back when an
+ * increase lowered the throughput, and cuts the limit when the run queue
+ * exceeds twice the CPUs or memory runs short (see sched_tick()).  -t
+ * appends a line per tick to file with the limit, throughput and load.
+ * Without arguments, prints the state and the recent limits of the
+ * background and parallel schedulers.
+ *
+ * -p chooses which pending job starts next: fifo (the default), prio
+ * (highest &[prio=N] first), fair (slots shared between &[group=NAME]
+ * groups in proportion to their &[weight=N]) or edf (earliest
+ * &[deadline=TIME] first, then the jobs without one).  Ties go in
+ * submission order.  The queue is a binary heap, so queueing and starting
+ * a job take O(log n) whatever the policy; jobs shows each pending job's
+ * place in the queue and the value the policy ordered it by.
+ *
+ * A job launched with &[cpu=N,mem=SIZE] declares the CPUs and memory it
+ * needs, and goes through the scheduler even without a limit.  The
+ * declared jobs are packed into a budget, the host's CPUs and memory
+ * unless -b sets cpu=N and/or mem=SIZE (-b host goes back): whenever
+ * resources free up, the largest pending job that fits starts (see
+ * sched_pick()), and a job larger than the whole budget is refused.  If
+ * cgroup v2 has the cpu and memory controllers (see tsh_cgroup.h), each
+ * declared job runs in a cgroup whose cpu.max and memory.max hold it to
+ * what it declared; otherwise the budget is only kept by admission.
+ *
+ * -f turns on preemption for foreground jobs: while one runs (started
+ * from the command line or continued with fg), the background jobs whose
+ * &[prio=N] is below prio (every one, for all) are stopped, shown as
+ * Preempted, and continued once it finishes or stops (see
+ * preempt_begin()).  Pending jobs wait meanwhile.  bg, fg or kill -TERM
+ * resume a preempted job early.
+ */
+void builtin_sched(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token) {
+    if (token->argc == 1) {
+        sched_report(&bg_sched);
+        sched_report(&par_sched);
+        return;
+    }
+    for (int i = 1; i < token->argc; i += 2) {
+        const char *opt = token->argv[i];
+        const char *val = (i + 1 < token->argc) ? token->argv[i + 1] : NULL;
+        if (val == NULL || opt[0] != '-' || opt[1] == '\0' ||
+            strchr("jpbft", opt[1]) == NULL || opt[2] != '\0') {
+            sio_printf("sched: usage: sched [-j N|auto|off] "
+                       "[-p fifo|prio|fair|edf] [-b cpu=N,mem=SIZE|host] "
+                       "[-f PRIO|all|off] [-t file|off]\n");
+            return;
+        }
+        sigset_t mask, prev;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTSTP);
+        if (strcmp(opt, "-p") == 0) {
+            size_t p = 0;
+            while (p < sizeof(policy_names) / sizeof(policy_names[0]) &&
+                   strcmp(val, policy_names[p]) != 0) {
+                p++;
+            }
+            if (p == sizeof(policy_names) / sizeof(policy_names[0])) {
+                sio_printf("sched: %s: policy must be fifo, prio, fair or "
+                           "edf\n",
+                           val);
+                return;
+            }
+            sigprocmask(SIG_BLOCK, &mask, &prev);
+            sched_set_policy(&bg_sched, (enum sched_policy)p);
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            continue;
+        }
+        if (strcmp(opt, "-b") == 0) {
+            int64_t cpu, mem;
+            if (!parse_sched_budget(val, &cpu, &mem)) {
+                sio_printf("sched: %s: budget must be cpu=N,mem=SIZE or "
+                           "host\n",
+                           val);
+                return;
+            }
+            sigprocmask(SIG_BLOCK, &mask, &prev);
+            bg_sched.cpu_budget = cpu;
+            bg_sched.mem_budget = mem;
+            sched_pump(&bg_sched); // a larger budget starts waiting jobs
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            continue;
+        }
+        if (strcmp(opt, "-f") == 0) {
+            char *end;
+            long prio = strtol(val, &end, 10);
+            if (strcmp(val, "off") == 0) {
+                preempt_below = INT_MIN;
+            } else if (strcmp(val, "all") == 0) {
+                preempt_below = INT_MAX;
+            } else if (end != val && *end == '\0' && prio > INT_MIN &&
+                       prio <= INT_MAX) {
+                preempt_below = (int)prio;
+            } else {
+                sio_printf("sched: %s: preemption must be a priority, all "
+                           "or off\n",
+                           val);
+                return;
+            }
+            continue;
+        }
+        if (strcmp(opt, "-t") == 0) {
+            if (sched_trace_fd >= 0) {
+                close(sched_trace_fd);
+                sched_trace_fd = -1;
+            }
+            if (strcmp(val, "off") != 0) {
+                sched_trace_fd =
+                    open(val, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+                if (sched_trace_fd < 0) {
+                    sio_printf("sched: %s: %s\n", val, strerror(errno));
+                }
+            }
+            continue;
+        }
+        int limit;
+        bool adaptive;
+        if (!parse_sched_limit(val, &limit, &adaptive)) {
+            sio_printf("sched: %s: limit must be 1..%d, auto or off\n", val,
+                       SCHED_MAX_LIMIT);
+            return;
+        }
+
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        sched_configure(&bg_sched, limit, adaptive);
+        if (bg_sched.started == 0) {
+            bg_sched.started = monotonic_ns();
+        }
+        sched_pump(&bg_sched); // a higher limit or none starts waiting jobs
+        if (sched_active(&bg_sched) > 0) {
+            sched_tick_start(&bg_sched);
+        }
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+    }
+}
+
+/* True if arg has to be quoted to parse back as one word */
+static bool needs_quotes(const char *arg) {
+    return arg[0] == '\0' || strcmp(arg, "&") == 0 ||
+           arg[strcspn(arg, " \t\r\n<>'\"")] != '\0';
+}
+
+/**
+ * @brief Builds the command line of one parallel job
+ *
+ * @return false if arg cannot be quoted or the line is too long
+ *
+ * Each {} in the template is replaced by arg; if there is none, arg is
+ * appended.  The template words are joined with spaces as they are, so a
+ * quoted word such as 'sort {} > {}.out' may carry redirections.
+ */
+static bool parallel_line(char *line, size_t size, char **words, int nwords,
+                          const char *arg) {
+    char quoted[MAXLINE_TSH];
+    if (needs_quotes(arg)) {
+        char q = strchr(arg, '\'') == NULL ? '\'' : '"';
+        if (strchr(arg, q) != NULL) {
+            return false; // holds both kinds of quote
+        }
+        sio_snprintf(quoted, sizeof(quoted), "%c%s%c", q, arg, q);
+        arg = quoted;
+    }
+    size_t len = 0;
+    bool substituted = false;
+    for (int i = 0; i < nwords; i++) {
+        for (const char *w = words[i]; *w != '\0';) {
+            const char *brace = strstr(w, "{}");
+            size_t n = brace ? (size_t)(brace - w) : strlen(w);
+            const char *insert = brace ? arg : "";
+            size_t m = strlen(insert);
+            if (len + n + m + 2 > size) {
+                return false;
+            }
+            memcpy(line + len, w, n);
+            memcpy(line + len + n, insert, m);
+            len += n + m;
+            w += n + (brace ? 2 : 0);
+            substituted = substituted || brace != NULL;
+        }
+        line[len++] = ' ';
+    }
+    if (!substituted) {
+        size_t m = strlen(arg);
+        if (len + m + 1 > size) {
+            return false;
+        }
+        memcpy(line + len, arg, m);
+        len += m;
+    } else {
+        len--;
+    }
+    line[len] = '\0';
+    return true;
+}
+
+/* Sends sig to the running jobs that s started */
+static void sched_signal_running(const struct sched *s, int sig) {
+    for (size_t jid = 1; jid < sched_owners_cap; jid++) {
+        if (sched_owners[jid].s == s && sched_owners[jid].pid != 0) {
+            job_kill((jid_t)jid, sig);
+        }
+    }
+}
+
+/**
+ * @brief Runs a command once for each argument, a limited number at a time
+ *
+ * Usage: parallel [-j N | -j auto] command [args...] ::: arg...
+ *
+ * Each argument replaces {} in the command, or is appended to it (see
+ * parallel_line()).  The jobs are queued on their own scheduler, which
+ * runs as many at once as there are CPUs unless -j says otherwise; -j
+ * auto adapts the limit as sched -j auto does.  The builtin returns when
+ * every job has finished, and reports how many failed.  Ctrl-C cancels
+ * the jobs that have not started and terminates the running ones.
+ */
+void builtin_parallel(const char *cmdline, parseline_return parse_result,
+                      struct cmdline_tokens *token) {
+    int limit = sched_ncpu();
+    bool adaptive = false;
+    int first = 1;
+    if (token->argc > 2 && strcmp(token->argv[1], "-j") == 0) {
+        if (!parse_sched_limit(token->argv[2], &limit, &adaptive)) {
+            sio_printf("parallel: %s: limit must be 1..%d, auto or off\n",
+                       token->argv[2], SCHED_MAX_LIMIT);
+            return;
+        }
+        first = 3;
+    }
+    int colon = first;
+    while (colon < token->argc && strcmp(token->argv[colon], ":::") != 0) {
+        colon++;
+    }
+    if (colon == first || colon + 1 >= token->argc) {
+        sio_printf("parallel: usage: parallel [-j N|auto] command "
+                   "[args...] ::: arg...\n");
+        return;
+    }
+    if (parse_result == PARSELINE_BG || token->infile != NULL ||
+        token->outfile != NULL) {
+        sio_printf("parallel: runs in the foreground; quote redirections "
+                   "to apply them to each job\n");
+        return;
+    }
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    sched_configure(&par_sched, limit, adaptive);
+    unsigned failed = par_sched.failed;
+    unsigned cancelled = par_sched.cancelled;
+    int njobs = 0;
+    for (int i = colon + 1; i < token->argc; i++) {
+        char line[MAXLINE_TSH];
+        struct cmdline_tokens job;
+        if (!parallel_line(line, sizeof(line), token->argv + first,
+                           colon - first, token->argv[i])) {
+            sio_printf("parallel: %s: cannot build the command line\n",
+                       token->argv[i]);
+            continue;
+        }
+        parseline_return result = parseline(line, &job);
+        if (result != PARSELINE_FG) {
+            sio_printf("parallel: %s: cannot parse the command line\n",
+                       line);
+            continue;
+        }
+        if (job.builtin != BUILTIN_NONE) {
+            sio_printf("parallel: %s is a builtin\n", job.argv[0]);
+            break;
+        }
+        if (sched_submit(&par_sched, line, &job, NULL) != 0) {
+            njobs++;
+        }
+    }
+
+    // Wait for the jobs; Ctrl-C cancels the pending ones and terminates
+    // the running ones, which are then waited for
+    sigint_pending = 0;
+    while (par_sched.running > 0 || par_sched.npending > 0) {
+        if (sigint_pending) {
+            sigint_pending = 0;
+            while (par_sched.npending > 0) {
+                sched_cancel(par_sched.queue[par_sched.npending - 1].jid);
+            }
+            sched_signal_running(&par_sched, SIGTERM);
+            sched_signal_running(&par_sched, SIGCONT);
+        }
+        event_poll(-1, -1);
+    }
+    failed = par_sched.failed - failed;
+    cancelled = par_sched.cancelled - cancelled;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    if (cancelled > 0) {
+        sio_printf("parallel: %u of %d jobs failed, %u cancelled\n", failed,
+                   njobs, cancelled);
+    } else if (failed > 0) {
+        sio_printf("parallel: %u of %d jobs failed\n", failed, njobs);
+    }
+}
+
+/*****************
+ * Preemption
+ *****************/
+
+/* A background job preempted for the foreground job */
+static struct preempted {
+    jid_t jid;
+    pid_t pid;       // to tell it from a later job with the same jid
+    unsigned cgroup; // frozen through its cgroup, or 0 if sent SIGSTOP
+} *preempted;
+static size_t npreempted, preempted_cap;
+
+/* The cgroup the scheduler started jid in, or 0 */
+static unsigned preempt_cgroup(jid_t jid) {
+    if ((size_t)jid >= sched_owners_cap || sched_owners[jid].s == NULL ||
+        sched_owners[jid].pid != job_get_pid(jid)) {
+        return 0;
+    }
+    return sched_owners[jid].cgroup;
+}
+
+/**
+ * @brief Preempts the background jobs below preempt_below, for the
+ * foreground job fg to have the machine to itself
+ *
+ * A job with a cgroup of its own (see tsh_cgroup.h) is frozen through it;
+ * any other is sent SIGSTOP, whose stop sigchld_handler() then keeps
+ * quiet about.  Either way the job shows as Preempted until
+ * preempt_end().  While jobs are preempted, the schedulers start no
+ * pending job either.  Must be called with SIGCHLD, SIGINT and SIGTSTP
+ * blocked.
+ */
+void preempt_begin(jid_t fg) {
+    if (preempt_below == INT_MIN || preempting) {
+        return;
+    }
+    preempting = true;
+    for (jid_t jid = job_next(0); jid != 0; jid = job_next(jid)) {
+        if (jid == fg || job_get_state(jid) != BG ||
+            job_get_prio(jid) >= preempt_below) {
+            continue;
+        }
+        if (npreempted == preempted_cap) {
+            size_t cap = preempted_cap ? 2 * preempted_cap : 16;
+            struct preempted *grown =
+                realloc(preempted, cap * sizeof(*grown));
+            if (grown == NULL) {
+                break; // the rest keep running
+            }
+            preempted = grown;
+            preempted_cap = cap;
+        }
+        unsigned cgroup = preempt_cgroup(jid);
+        if (cgroup != 0 && !cgroup_freeze(cgroup, true)) {
+            cgroup = 0;
+        }
+        // Preempted first, so that the stop is not reported as Ctrl-Z's
+        job_set_state(jid, PR);
+        if (cgroup == 0 && job_kill(jid, SIGSTOP) < 0) {
+            job_set_state(jid, BG);
+            continue;
+        }
+        preempted[npreempted++] = (struct preempted){jid, job_get_pid(jid),
+                                                     cgroup};
+    }
+}
+
+/* Continues a preempted job, as preempted[i] recorded it */
+static void preempt_thaw(const struct preempted *p) {
+    if (!job_exists(p->jid) || job_get_pid(p->jid) != p->pid ||
+        job_get_state(p->jid) != PR) {
+        return; // killed meanwhile, or already resumed
+    }
+    job_set_state(p->jid, BG);
+    if (p->cgroup == 0 || !cgroup_freeze(p->cgroup, false)) {
+        job_kill(p->jid, SIGCONT);
+    }
+}
+
+/**
+ * @brief Resumes the jobs preempt_begin() preempted, once the foreground
+ * job has finished or stopped
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+void preempt_end(void) {
+    if (!preempting) {
+        return;
+    }
+    preempting = false;
+    for (size_t i = 0; i < npreempted; i++) {
+        preempt_thaw(&preempted[i]);
+    }
+    npreempted = 0;
+    sched_pump(&bg_sched);
+    sched_pump(&par_sched);
+}
+
+/**
+ * @brief Resumes one preempted job ahead of the others (for bg, fg and
+ * kill), leaving it in the background
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+void preempt_resume(jid_t jid) {
+    for (size_t i = 0; i < npreempted; i++) {
+        if (preempted[i].jid == jid) {
+            preempt_thaw(&preempted[i]);
+            preempted[i] = preempted[--npreempted];
+            return;
+        }
+    }
+}
@@ -0,0 +1,155 @@
+/**
+ * @file tsh_sched.h
+ * @brief Scheduling and preemption of background jobs, for the `sched` and
+ *        `parallel` builtins
+ *
+ * A scheduler limits how many of the jobs submitted to it run at once;
+ * the others wait as pending jobs, in the order of its policy.  bg_sched
+ * takes background jobs once sched -j sets a limit, par_sched the jobs of
+ * the parallel builtin.  With -j auto a controller adjusts the limit to
+ * the throughput it measures.  Jobs that declare their CPU and memory
+ * with &[cpu=N,mem=SIZE] are packed into a budget and confined to it
+ * through cgroups (see tsh_cgroup.h).
+ *
+ * Background jobs below a priority are preempted while a foreground job
+ * runs (sched -f).
+ */
+
+#ifndef __TSH_SCHED_H__
+#define __TSH_SCHED_H__
+
+#include "tsh_helper.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SCHED_HISTORY 16
+#define SCHED_GROUP_NAME 32
+
+/* Order in which pending jobs start */
+enum sched_policy {
+    SCHED_FIFO, // submission order
+    SCHED_PRIO, // highest prio first
+    SCHED_FAIR, // weighted fair share between groups
+    SCHED_EDF,  // earliest deadline first, then jobs without one
+};
+
+/* What a background job asked for with &[...] */
+struct job_opts {
+    int prio;                     // higher starts sooner (prio)
+    int64_t deadline;             // relative, ns, or -1 for none (edf)
+    char group[SCHED_GROUP_NAME]; // share of the slots (fair)
+    int weight;                   // the group's weight, or 0 to keep it
+    int64_t cpu;                  // milli-CPUs it needs, 0 if undeclared
+    int64_t mem;                  // bytes it needs, 0 if undeclared
+};
+
+struct sched_pending {
+    jid_t jid;
+    struct cmdline_tokens *token;
+    uint64_t seq;     // submission order, breaks ties
+    int prio;
+    int64_t deadline; // CLOCK_MONOTONIC, INT64_MAX for none
+    size_t group;     // index into sched_groups
+    double tag;       // virtual finish time within the fair share
+    int64_t cpu, mem; // declared needs, as in struct job_opts
+};
+
+struct sched {
+    const char *name;
+    int limit;     // most jobs running at once, 0 for no limit
+    bool adaptive; // limit set by the controller
+    bool quiet;    // do not announce the jobs
+    int running;   // jobs started here and not reaped yet
+    enum sched_policy policy;
+    struct sched_pending *queue; // binary heap in policy order
+    size_t npending, cap;
+    uint64_t next_seq;
+    double vtime;    // fair share: tag of the last job started
+    unsigned missed; // jobs started after their deadline
+
+    // resources declared with &[cpu=N,mem=SIZE]
+    int64_t cpu_budget, mem_budget; // configured with -b, 0 for the host's
+    int64_t cpu_used, mem_used;     // declared by the running jobs
+    size_t nsized;                  // pending jobs that declared any
+
+    // controller state
+    bool ticking;           // a controller tick is scheduled
+    int64_t last_tick;
+    unsigned completed;     // jobs reaped since the last tick
+    unsigned finished;      // jobs reaped in total
+    unsigned failed;        // of which exited non-zero
+    unsigned cancelled;     // jobs cancelled before they started
+    double throughput;      // jobs per second, smoothed
+    int64_t window_start;   // when the limit last changed
+    unsigned window_done;   // jobs reaped since then
+    double prev_rate;       // throughput under the previous limit
+    int prev_limit;         // limit before the last increase, or 0
+    int hold;               // windows to wait before growing again
+    bool slow_start;        // double the limit until it first backs off
+    int lowest, highest;    // range of the limit so far
+    int64_t started;
+    struct sched_change {
+        int64_t when;
+        int from, to;
+        const char *why;
+    } history[SCHED_HISTORY];
+    size_t nchanges;
+};
+
+extern struct sched bg_sched, par_sched;
+
+/* Online CPUs, the first limit of an adaptive scheduler */
+int sched_ncpu(void);
+
+/*
+ * Parses the options of a final &[...] (NULL for none).  Returns false
+ * after printing an error if an option is not valid.
+ */
+bool parse_job_opts(const char *text, struct job_opts *opts);
+
+/*
+ * Queues a job, starting it right away if the limit allows; opts may be
+ * NULL for the defaults.  Returns the job ID, or 0 if it was not queued.
+ */
+jid_t sched_submit(struct sched *s, const char *cmdline,
+                   const struct cmdline_tokens *token,
+                   const struct job_opts *opts);
+
+/*
+ * Starts a pending job now, regardless of its scheduler's limit (for bg
+ * and fg).  Returns false if it could not be started.  Must be called
+ * with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+bool sched_start_now(jid_t jid, job_state state, const sigset_t *prev_mask);
+
+/*
+ * Removes a pending job from its queue and the job list; false if jid is
+ * not pending.  Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+bool sched_cancel(jid_t jid);
+
+/* Event loop hook: frees the slot of a job a scheduler started */
+void sched_child_exited(jid_t jid, pid_t pid, int status);
+
+/* Notes on each pending job of s its place in the queue, for jobs */
+void sched_annotate(const struct sched *s);
+
+/*
+ * Preempts the background jobs below the sched -f priority while the
+ * foreground job fg runs, and resumes them once it has finished or
+ * stopped; preempt_resume() resumes one ahead of the others.  Must be
+ * called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+void preempt_begin(jid_t fg);
+void preempt_end(void);
+void preempt_resume(jid_t jid);
+
+void builtin_sched(const char *cmdline, parseline_return parse_result,
+                   struct cmdline_tokens *token);
+void builtin_parallel(const char *cmdline, parseline_return parse_result,
+                      struct cmdline_tokens *token);
+
+#endif /* __TSH_SCHED_H__ */
@@ -0,0 +1,734 @@
+/**
+ * @file tsh_script.c
+ * @brief Script coroutines, traps and on-done hooks
+ *
+ * Each script runs on a stack of its own, switched to with swapcontext()
+ * from script_resume_all() at the end of event_dispatch(); the script
+ * switches back from event_poll() wherever it would block.  Trapped
+ * signals and finished jobs are only recorded where they happen, and
+ * hooks_dispatch() starts their commands as script jobs.
+ */
+
+#include "tsh_script.h"
+#include "csapp.h"
+#include "tsh_sched.h"
+#include "tsh_shell.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/*****************
+ * Script coroutines
+ *****************/
+
+#define SCRIPT_STACK_SIZE (1 << 20)
+
+/*
+ * A script run by spawn-script.  Its lines run through eval() on a stack
+ * of its own, sharing the job list, the schedulers and the caches with
+ * the shell; wherever a command would block in the event loop (waiting
+ * for a foreground job, wait, a retry's back-off...), the script yields
+ * instead, and the event loop resumes it after the next event.
+ */
+struct script {
+    jid_t jid;
+    char *path;
+    char *text;     // the whole script, NUL-terminated
+    size_t pos;     // start of the next line
+    unsigned line;  // number of the line being run
+    ucontext_t ctx; // where the script left off
+    void *stack;
+    bool finished;
+    bool paused;     // stopped with STOP or TSTP
+    bool cancelled;  // killed: run no further lines
+    pid_t wait_pid;  // the foreground job being waited for, or 0
+    int wait_status; // its wait status, once reaped
+    int status;      // exit code of the last foreground job
+};
+
+struct script *script_current;
+static struct script **scripts; // in the order they were spawned
+static size_t nscripts, scripts_cap;
+static ucontext_t script_caller; // the shell's, while a script runs
+unsigned scripts_retired;
+
+/* Returns the script job jid, or NULL if jid is not one */
+struct script *script_find(jid_t jid) {
+    for (size_t i = 0; i < nscripts; i++) {
+        if (scripts[i]->jid == jid) {
+            return scripts[i];
+        }
+    }
+    return NULL;
+}
+
+/* The job of the running script, or 0 */
+jid_t script_self(void) {
+    return script_current != NULL ? script_current->jid : 0;
+}
+
+/* True if the running script was killed */
+bool script_cancelled(void) {
+    return script_current != NULL && script_current->cancelled;
+}
+
+/* Does nothing: the timer only wakes the event loop */
+static void event_wake(void *arg) {
+}
+
+/**
+ * @brief Hands control back to the shell until the next event
+ *
+ * @param[in] deadline When the script wants to be resumed at the latest,
+ *            or -1
+ */
+void script_yield(int64_t deadline) {
+    if (deadline >= 0) {
+        timer_add(deadline, event_wake, NULL);
+    }
+    swapcontext(&script_current->ctx, &script_caller);
+}
+
+/**
+ * @brief Waits in a script for one of its foreground jobs, yielding
+ *
+ * @return As for wait_fg()
+ */
+int script_wait_job(jid_t jid) {
+    struct script *sc = script_current;
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    pid_t pid = job_get_pid(jid);
+    sc->wait_pid = pid;
+    sc->wait_status = 0;
+    // the job may have been reaped already, before the script got here
+    reap_pending(pid, &sc->wait_status);
+    while (job_exists(jid) && job_get_pid(jid) == pid &&
+           job_get_state(jid) != ST) {
+        event_poll(-1, -1);
+    }
+    sc->wait_pid = 0;
+
+    int status = -1;
+    if (!job_exists(jid) || job_get_pid(jid) != pid) {
+        if (WIFEXITED(sc->wait_status)) {
+            status = WEXITSTATUS(sc->wait_status);
+        } else if (WIFSIGNALED(sc->wait_status)) {
+            status = 128 + WTERMSIG(sc->wait_status);
+        }
+        sc->status = status;
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return status;
+}
+
+/* Records the exit of the job a script waits for (from event_dispatch()) */
+void script_child_exited(pid_t pid, int status) {
+    for (size_t i = 0; i < nscripts; i++) {
+        if (scripts[i]->wait_pid == pid) {
+            scripts[i]->wait_status = status;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Runs the lines of script_current, from its own stack
+ *
+ * Lines run with the job control signals unblocked, as at the prompt.
+ * Blank lines and # comments are skipped, and quit ends the script.
+ */
+static void script_main(void) {
+    struct script *sc = script_current;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+    char line[MAXLINE_TSH];
+    while (!sc->cancelled && !shutting_down && sc->text[sc->pos] != '\0') {
+        const char *start = sc->text + sc->pos;
+        size_t len = strcspn(start, "\n");
+        sc->pos += len + (start[len] == '\n');
+        sc->line++;
+        if (len >= sizeof(line)) {
+            sio_printf("%s: line %u: too long\n", sc->path, sc->line);
+            continue;
+        }
+        memcpy(line, start, len);
+        line[len] = '\0';
+        const char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+        struct cmdline_tokens token;
+        if (parseline(line, &token) != PARSELINE_ERROR &&
+            token.builtin == BUILTIN_QUIT) {
+            break;
+        }
+        eval(line);
+    }
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sc->finished = true;
+    // returns to script_caller through uc_link
+}
+
+/* Frees a script that has finished, and its job */
+static void script_retire(struct script *sc) {
+    shutdown_child_exited(sc->jid, (sc->status & 0xff) << 8);
+    delete_job(sc->jid);
+    hooks_job_done(sc->jid, (sc->status & 0xff) << 8);
+    for (size_t i = 0; i < nscripts; i++) {
+        if (scripts[i] == sc) {
+            memmove(&scripts[i], &scripts[i + 1],
+                    (nscripts - i - 1) * sizeof(*scripts));
+            nscripts--;
+            break;
+        }
+    }
+    free(sc->stack);
+    free(sc->text);
+    free(sc->path);
+    free(sc);
+    scripts_retired++;
+}
+
+/**
+ * @brief Runs each script that is not paused until it yields or ends
+ *
+ * Called at the end of event_dispatch(), in the shell's own context only:
+ * scripts are resumed from there, and yield back to it.  A script waiting
+ * for something checks again and yields if it is not there yet, which
+ * costs a context switch per script and event.
+ */
+void script_resume_all(void) {
+    if (script_current != NULL) {
+        return;
+    }
+    for (size_t i = 0; i < nscripts;) {
+        struct script *sc = scripts[i];
+        if (sc->paused) {
+            i++;
+            continue;
+        }
+        script_current = sc;
+        swapcontext(&script_caller, &sc->ctx);
+        script_current = NULL;
+        if (sc->finished) {
+            script_retire(sc); // the next script moves to i
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * @brief Signals a script job as kill does
+ *
+ * STOP and TSTP pause the script and its foreground job, CONT resumes
+ * them, and any other real signal goes to the foreground job and ends
+ * the script once that job is over.  Must be called with SIGCHLD, SIGINT
+ * and SIGTSTP blocked.
+ */
+int script_signal(struct script *sc, int sig) {
+    jid_t fg = sc->wait_pid != 0 ? job_from_pid(sc->wait_pid) : 0;
+    if (sig == 0) {
+        return 0;
+    }
+    if (sig != SIGSTOP && sig != SIGTSTP && sig != SIGCONT) {
+        sc->cancelled = true;
+    }
+    if (fg != 0) {
+        signal_job(fg, sig);
+    }
+    sc->paused = sig == SIGSTOP || sig == SIGTSTP;
+    job_set_state(sc->jid, sc->paused ? ST : BG);
+    return 0;
+}
+
+/* Shows the line each script job is at in its jobs line */
+void script_annotate(void) {
+    for (size_t i = 0; i < nscripts; i++) {
+        char note[64];
+        snprintf(note, sizeof(note), "line %u", scripts[i]->line);
+        job_set_note(scripts[i]->jid, note);
+    }
+}
+
+/**
+ * @brief Starts a script job that runs text, from the next event
+ *
+ * @param[in] cmdline The job's command line in the job list
+ * @param[in] name The script's name in error messages
+ * @param[in] text The script, malloc'd; the script takes it over
+ * @return The job ID, or 0 (after printing an error) on failure
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+static jid_t script_start(const char *cmdline, const char *name, char *text) {
+    struct script *sc = calloc(1, sizeof(*sc));
+    if (sc != NULL) {
+        sc->path = strdup(name);
+        sc->text = text;
+        sc->stack = malloc(SCRIPT_STACK_SIZE);
+    }
+    if (nscripts == scripts_cap) {
+        size_t cap = scripts_cap ? 2 * scripts_cap : 8;
+        struct script **grown = realloc(scripts, cap * sizeof(*grown));
+        if (grown != NULL) {
+            scripts = grown;
+            scripts_cap = cap;
+        }
+    }
+    // Added as a pending job, as only those may have no pid
+    if (sc != NULL && sc->path != NULL && sc->stack != NULL &&
+        nscripts < scripts_cap) {
+        sc->jid = add_job(0, PD, cmdline);
+    }
+    if (sc == NULL || sc->jid == 0) {
+        sio_printf("%s: cannot start script\n", name);
+        if (sc != NULL) {
+            free(sc->path);
+            free(sc->stack);
+            free(sc);
+        }
+        free(text);
+        return 0;
+    }
+    job_set_state(sc->jid, BG);
+
+    getcontext(&sc->ctx);
+    sc->ctx.uc_stack.ss_sp = sc->stack;
+    sc->ctx.uc_stack.ss_size = SCRIPT_STACK_SIZE;
+    sc->ctx.uc_link = &script_caller;
+    makecontext(&sc->ctx, script_main, 0);
+    scripts[nscripts++] = sc;
+    return sc->jid;
+}
+
+/**
+ * @brief Runs a script as a coroutine of the shell
+ *
+ * spawn-script file [&]
+ *
+ * The script's lines run as if typed at the prompt, in the shell process
+ * itself: its jobs are the shell's jobs and its builtins act on the shell.
+ * While one of its commands waits (for its foreground job, in wait...),
+ * the shell and the other scripts go on.  The script is a job of its own
+ * with no process: jobs shows the line it is at, kill ends it (and its
+ * foreground job), STOP pauses it and wait waits for it.  Without &,
+ * spawn-script waits for the script, and Ctrl-C ends it.
+ */
+void builtin_spawn_script(const char *cmdline, parseline_return parse_result,
+                          struct cmdline_tokens *token) {
+    if (token->argc != 2) {
+        sio_printf("spawn-script: usage: spawn-script file [&]\n");
+        return;
+    }
+    const char *path = token->argv[1];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        sio_printf("spawn-script: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    char *text = malloc((size_t)st.st_size + 1);
+    size_t len = 0;
+    while (text != NULL && len < (size_t)st.st_size) {
+        ssize_t n = read(fd, text + len, (size_t)st.st_size - len);
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    close(fd);
+    if (text == NULL) {
+        sio_printf("spawn-script: out of memory\n");
+        return;
+    }
+    text[len] = '\0';
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    jid_t jid = script_start(cmdline, path, text);
+    if (jid != 0) {
+        tag_job(jid, token);
+    }
+    if (jid != 0 && parse_result == PARSELINE_BG) {
+        sio_printf("[%d] (script) %s\n", (int)jid, cmdline);
+    } else if (jid != 0) {
+        sigint_pending = 0;
+        while (script_find(jid) != NULL) {
+            if (sigint_pending) {
+                sigint_pending = 0;
+                script_signal(script_find(jid), SIGINT);
+            }
+            event_poll(-1, -1);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*****************
+ * Traps and hooks
+ *****************/
+
+/* What trap can catch: EXIT (as 0) and a few signals */
+static const struct {
+    const char *name;
+    int sig;
+} trap_names[] = {
+    {"EXIT", 0}, {"HUP", SIGHUP}, {"INT", SIGINT}, {"TERM", SIGTERM},
+    {"USR1", SIGUSR1},
+};
+
+char *trap_cmds[NSIG];
+volatile sig_atomic_t trap_pending[NSIG];
+volatile sig_atomic_t traps_pending;
+
+/* A command to run once a job, or every job with a tag, is done */
+static struct done_hook {
+    jid_t jid; // 0 for a tag
+    pid_t pid; // to tell the job from a later one with its jid, or 0
+    char tag[MAXTAGLEN + 1];
+    char *cmdline; // the on-done command line, the hook's job's
+    char *cmd;
+    bool done;  // the job was reaped
+    int status; // its wait status, if done
+} *done_hooks;
+static size_t ndone_hooks, done_hooks_cap;
+
+/* Handles a trapped signal other than INT, for the event loop to see */
+static void trap_handler(int sig) {
+    trap_pending[sig] = 1;
+    traps_pending = 1;
+}
+
+/* Returns the signal trap name stands for (0 for EXIT), or -1 */
+static int trap_signal(const char *name) {
+    int sig = strcmp(name, "0") == 0 ? 0 : parse_signal(name);
+    if (strcasecmp(name, "EXIT") == 0) {
+        sig = 0;
+    }
+    for (size_t i = 0; i < sizeof(trap_names) / sizeof(trap_names[0]); i++) {
+        if (trap_names[i].sig == sig) {
+            return sig;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Starts a hook's command as a script job
+ *
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+static jid_t hook_run(const char *cmdline, const char *who, const char *cmd,
+                      const char *const *names, const char *const *values,
+                      size_t nvars) {
+    char line[MAXLINE_TSH];
+    if (!expand_vars(cmd, names, values, nvars, line, sizeof(line))) {
+        sio_printf("%s: command too long\n", who);
+        return 0;
+    }
+    char *text = strdup(line);
+    if (text == NULL) {
+        sio_printf("%s: out of memory\n", who);
+        return 0;
+    }
+    return script_start(cmdline, who, text);
+}
+
+/**
+ * @brief Records that job jid is done, for its on-done hooks
+ *
+ * Called with the job's wait status as it is reaped (or as an array or a
+ * script job finishes), with SIGCHLD, SIGINT and SIGTSTP blocked; the
+ * hooks run from the next hooks_dispatch().
+ */
+void hooks_job_done(jid_t jid, int status) {
+    for (size_t i = 0; i < ndone_hooks; i++) {
+        if (done_hooks[i].jid == jid && !done_hooks[i].done) {
+            done_hooks[i].done = true;
+            done_hooks[i].status = status;
+        }
+    }
+    if (ndone_hooks > 0) {
+        // for the event loop to get to them soon, even without further
+        // events; this also covers tags, whose last job this may have been
+        timer_add(monotonic_ns(), event_wake, NULL);
+    }
+}
+
+/**
+ * @brief Starts the commands of the signals trapped since the last call
+ * and of the hooks whose jobs are done (from event_dispatch())
+ *
+ * A job may also be gone without having been reaped, e.g. a pending job
+ * that was cancelled; its hook runs with $STATUS -1.
+ */
+void hooks_dispatch(void) {
+    if (traps_pending) {
+        traps_pending = 0;
+        for (size_t i = 0; i < sizeof(trap_names) / sizeof(trap_names[0]);
+             i++) {
+            int sig = trap_names[i].sig;
+            if (sig == 0 || !trap_pending[sig]) {
+                continue;
+            }
+            trap_pending[sig] = 0;
+            if (trap_cmds[sig] != NULL && trap_cmds[sig][0] != '\0') {
+                char cmdline[MAXLINE_TSH];
+                snprintf(cmdline, sizeof(cmdline), "trap %s: %s",
+                         trap_names[i].name, trap_cmds[sig]);
+                hook_run(cmdline, "trap", trap_cmds[sig], NULL, NULL, 0);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < ndone_hooks;) {
+        struct done_hook h = done_hooks[i];
+        bool fire = h.done;
+        if (h.jid != 0 && !fire) {
+            fire = !job_exists(h.jid) ||
+                   (h.pid != 0 && job_get_pid(h.jid) != h.pid);
+        } else if (h.jid == 0) {
+            size_t count;
+            job_tagged(h.tag, &count);
+            fire = count == 0;
+        }
+        if (!fire) {
+            i++;
+            continue;
+        }
+        memmove(&done_hooks[i], &done_hooks[i + 1],
+                (ndone_hooks - i - 1) * sizeof(*done_hooks));
+        ndone_hooks--;
+
+        char jid[16], status[16];
+        snprintf(jid, sizeof(jid), "%d", (int)h.jid);
+        snprintf(status, sizeof(status), "%d",
+                 !h.done                  ? -1
+                 : WIFEXITED(h.status)    ? WEXITSTATUS(h.status)
+                 : WIFSIGNALED(h.status)  ? 128 + WTERMSIG(h.status)
+                                          : -1);
+        const char *names[] = {"JID", "STATUS", "TAG"};
+        const char *values[] = {jid, status, h.tag};
+        hook_run(h.cmdline, "on-done", h.cmd, names, values, 3);
+        free(h.cmdline);
+        free(h.cmd);
+    }
+}
+
+/**
+ * @brief Runs the EXIT trap, if any, and waits for it until deadline or
+ * Ctrl-C (from shell_shutdown())
+ *
+ * @return The trap's job if it is still running, for shutdown to deal
+ *         with like any other job, or 0
+ */
+jid_t trap_exit(int64_t deadline) {
+    char *cmd = trap_cmds[0];
+    if (cmd == NULL || cmd[0] == '\0') {
+        return 0;
+    }
+    trap_cmds[0] = NULL;
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    char cmdline[MAXLINE_TSH];
+    snprintf(cmdline, sizeof(cmdline), "trap EXIT: %s", cmd);
+    jid_t jid = hook_run(cmdline, "trap", cmd, NULL, NULL, 0);
+    sigint_pending = 0;
+    while (jid != 0 && script_find(jid) != NULL && !sigint_pending &&
+           monotonic_ns() < deadline) {
+        event_poll(-1, deadline);
+    }
+    sigint_pending = 0;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    free(cmd);
+    return jid != 0 && script_find(jid) != NULL ? jid : 0;
+}
+
+/* Prints a command quoted for trap or on-done to read back */
+static void print_quoted(const char *prefix, const char *cmd,
+                         const char *suffix) {
+    sio_printf("%s'", prefix);
+    for (const char *p = cmd; *p != '\0'; p++) {
+        if (*p == '\'') {
+            sio_printf("'\\''");
+        } else {
+            sio_printf("%c", *p);
+        }
+    }
+    sio_printf("' %s\n", suffix);
+}
+
+/**
+ * @brief Sets, resets or lists the commands run on signals
+ *
+ * trap [cmd SIG...]
+ * trap - SIG...
+ *
+ * SIG is INT, TERM, HUP, USR1 or EXIT (with or without SIG, or as a
+ * number; 0 is EXIT).  The command runs as a script job from the event
+ * loop once the shell gets the signal, so it never interrupts what the
+ * shell is doing; EXIT's runs, and is waited for, when the shell quits.
+ * An empty command ignores the signal, and - restores the default.  INT
+ * still goes to the foreground job, as without a trap, and ignored
+ * signals stay ignored in the jobs the shell starts.  Without arguments,
+ * trap lists the traps.
+ */
+void builtin_trap(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token) {
+    if (token->argc == 1) {
+        for (size_t i = 0; i < sizeof(trap_names) / sizeof(trap_names[0]);
+             i++) {
+            const char *cmd = trap_cmds[trap_names[i].sig];
+            if (cmd != NULL) {
+                print_quoted("trap -- ", cmd, trap_names[i].name);
+            }
+        }
+        return;
+    }
+    if (token->argc < 3) {
+        sio_printf("trap: usage: trap [cmd | - ] SIG...\n");
+        return;
+    }
+    const char *cmd = token->argv[1];
+    bool reset = strcmp(cmd, "-") == 0;
+
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (int i = 2; i < token->argc; i++) {
+        int sig = trap_signal(token->argv[i]);
+        if (sig < 0) {
+            sio_printf("trap: %s: cannot trap that\n", token->argv[i]);
+            continue;
+        }
+        char *copy = reset ? NULL : strdup(cmd);
+        if (!reset && copy == NULL) {
+            sio_printf("trap: out of memory\n");
+            break;
+        }
+        if (sig != 0 && sig != SIGINT) {
+            Signal(sig, copy == NULL       ? SIG_DFL
+                        : copy[0] == '\0' ? SIG_IGN
+                                          : trap_handler);
+        }
+        free(trap_cmds[sig]);
+        trap_cmds[sig] = copy;
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/**
+ * @brief Runs a command once a job, or every job with a tag, is done
+ *
+ * on-done %jid cmd [args...]
+ * on-done @tag cmd [args...]
+ * on-done
+ *
+ * The command runs as a script job, started from the event loop right
+ * after the job is reaped; with @tag, once no job has the tag any more.
+ * $JID and $STATUS in it stand for the job and its exit code (128 plus
+ * the signal that killed it, or -1 if it never ran), and $TAG for the
+ * tag.  Each hook runs once.  Without arguments, on-done lists the hooks
+ * still waiting.
+ */
+void builtin_on_done(const char *cmdline, parseline_return parse_result,
+                     struct cmdline_tokens *token) {
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    if (token->argc == 1) {
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        for (size_t i = 0; i < ndone_hooks; i++) {
+            sio_printf("%s\n", done_hooks[i].cmdline);
+        }
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
+    const char *spec = token->argv[1];
+    if (token->argc < 3 || (spec[0] != '%' && spec[0] != '@')) {
+        sio_printf("on-done: usage: on-done %%jid|@tag cmd [args...]\n");
+        return;
+    }
+
+    struct done_hook h = {0};
+    jid_t first, last;
+    pid_t pid;
+    long idx;
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (spec[0] == '@') {
+        size_t count;
+        job_tagged(spec + 1, &count);
+        if (strlen(spec + 1) > MAXTAGLEN || count == 0) {
+            sio_printf("%s: No such job\n", spec);
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            return;
+        }
+        strcpy(h.tag, spec + 1);
+    } else if (!parse_job_spec(spec, &first, &last, &pid, &idx) ||
+               first != last || idx >= 0) {
+        sio_printf("on-done: %s: argument must be a %%jobid or @tag\n", spec);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    } else if (!job_exists(first)) {
+        sio_printf("%s: No such job\n", spec);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    } else {
+        h.jid = first;
+        h.pid = job_get_pid(first);
+    }
+
+    h.cmdline = strdup(cmdline);
+    h.cmd = strdup(command_text(cmdline, 2));
+    if (ndone_hooks == done_hooks_cap) {
+        size_t cap = done_hooks_cap ? 2 * done_hooks_cap : 8;
+        struct done_hook *grown = realloc(done_hooks, cap * sizeof(*grown));
+        if (grown != NULL) {
+            done_hooks = grown;
+            done_hooks_cap = cap;
+        }
+    }
+    if (h.cmdline == NULL || h.cmd == NULL || ndone_hooks == done_hooks_cap) {
+        sio_printf("on-done: out of memory\n");
+        free(h.cmdline);
+        free(h.cmd);
+    } else {
+        done_hooks[ndone_hooks++] = h;
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
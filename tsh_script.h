@@ -0,0 +1,97 @@
+/**
+ * @file tsh_script.h
+ * @brief Script coroutines, traps and on-done hooks, for the
+ *        `spawn-script`, `trap` and `on-done` builtins
+ *
+ * Scripts started with spawn-script run as coroutines on the event loop,
+ * one at a time: script_current is the one running, or NULL while the
+ * shell runs its own commands.  Wherever a command would block in the
+ * event loop, a script yields instead, and the loop resumes it after the
+ * next event.
+ *
+ * Commands set with trap run when the shell gets a signal, and those set
+ * with on-done when a job is done, as scripts started from the event loop.
+ */
+
+#ifndef __TSH_SCRIPT_H__
+#define __TSH_SCRIPT_H__
+
+#include "tsh_helper.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct script;
+extern struct script *script_current;
+
+/* Counts the scripts that finished, for event_poll() to see one finish */
+extern unsigned scripts_retired;
+
+/* Returns the script job jid, or NULL if jid is not one */
+struct script *script_find(jid_t jid);
+
+/* The job of the running script, or 0 */
+jid_t script_self(void);
+
+/* True if the running script was killed */
+bool script_cancelled(void);
+
+/*
+ * Waits in a script for one of its foreground jobs, yielding; returns as
+ * wait_fg() does
+ */
+int script_wait_job(jid_t jid);
+
+/*
+ * Hands control back to the shell until the next event, or deadline
+ * (CLOCK_MONOTONIC ns, or -1) at the latest
+ */
+void script_yield(int64_t deadline);
+
+/*
+ * Signals a script job as kill does.  Must be called with SIGCHLD, SIGINT
+ * and SIGTSTP blocked.
+ */
+int script_signal(struct script *sc, int sig);
+
+/* Shows the line each script job is at in its jobs line */
+void script_annotate(void);
+
+/* Records the exit of the job a script waits for (from event_dispatch()) */
+void script_child_exited(pid_t pid, int status);
+
+/* Runs each script that is not paused until it yields or ends */
+void script_resume_all(void);
+
+extern char *trap_cmds[NSIG]; // "" to ignore the signal, NULL for default
+extern volatile sig_atomic_t trap_pending[NSIG];
+extern volatile sig_atomic_t traps_pending; // any of trap_pending
+
+/*
+ * Records that job jid is done with wait status status, for its on-done
+ * hooks.  Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+void hooks_job_done(jid_t jid, int status);
+
+/*
+ * Starts the commands of the signals trapped since the last call and of
+ * the hooks whose jobs are done (from event_dispatch())
+ */
+void hooks_dispatch(void);
+
+/*
+ * Runs the EXIT trap, if any, and waits for it until deadline or Ctrl-C.
+ * Returns the trap's job if it is still running, or 0.
+ */
+jid_t trap_exit(int64_t deadline);
+
+void builtin_spawn_script(const char *cmdline, parseline_return parse_result,
+                          struct cmdline_tokens *token);
+void builtin_trap(const char *cmdline, parseline_return parse_result,
+                  struct cmdline_tokens *token);
+void builtin_on_done(const char *cmdline, parseline_return parse_result,
+                     struct cmdline_tokens *token);
+
+#endif /* __TSH_SCRIPT_H__ */
@@ -0,0 +1,108 @@
+/**
+ * @file tsh_shell.h
+ * @brief The parts of the shell core (shell.c) its builtin modules use
+ *
+ * The scheduler (tsh_sched.h), job arrays (tsh_array.h) and script
+ * coroutines (tsh_script.h) start their jobs through the same path as the
+ * shell's own commands, and are driven by its event loop: the SIGCHLD
+ * handler queues each reaped child, and event_dispatch() hands the exits
+ * to the modules' child_exited hooks before firing due timers.
+ */
+
+#ifndef __TSH_SHELL_H__
+#define __TSH_SHELL_H__
+
+#include "tsh_helper.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Set when Ctrl-C arrives while no job is in the foreground */
+extern volatile sig_atomic_t sigint_pending;
+
+/* Set while shutting down, when shell_shutdown() reports on each job */
+extern volatile sig_atomic_t shutting_down;
+
+/* Parses and runs one command line */
+void eval(const char *cmdline);
+
+/*
+ * Runs the handlers of the children reaped so far and the due timers.
+ * Must be called with SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+void event_dispatch(void);
+
+/*
+ * Dispatches events, then sleeps until fd (or -1 for none) is readable, a
+ * signal arrives or deadline (CLOCK_MONOTONIC ns, or -1) is due.  In a
+ * script it yields instead.  Returns false unless fd is readable.
+ */
+bool event_poll(int fd, int64_t deadline);
+
+/* Calls fn(arg) from the event loop once deadline has passed */
+void timer_add(int64_t deadline, void (*fn)(void *), void *arg);
+
+/* CLOCK_MONOTONIC in nanoseconds */
+int64_t monotonic_ns(void);
+
+/*
+ * True if pid was reaped but event_dispatch() has not seen it yet; then
+ * its wait status is stored in status, unless that is NULL.  Must be
+ * called with SIGCHLD blocked.
+ */
+bool reap_pending(pid_t pid, int *status);
+
+/*
+ * Opens the redirections and forks the process of a job, which joins the
+ * cgroup of cgroup_fd (or -1 for the shell's) and runs with prev_mask.
+ * Returns the pid, or 0 after printing an error.  Must be called with
+ * SIGCHLD, SIGINT and SIGTSTP blocked.
+ */
+pid_t spawn_job(const struct cmdline_tokens *token, const sigset_t *prev_mask,
+                int cgroup_fd);
+
+/* Files a new job under the @tags of its command line */
+void tag_job(jid_t jid, const struct cmdline_tokens *token);
+
+/* Copies parsed tokens into dst's own buffer, so they outlive src */
+void copy_tokens(struct cmdline_tokens *dst, const struct cmdline_tokens *src);
+
+/* The text of cmdline after its @tags and first n words */
+const char *command_text(const char *cmdline, int n);
+
+/*
+ * Replaces $NAME and ${NAME} in text with the value of NAME, for each of
+ * the nvars names.  Returns false if the result would not fit.
+ */
+bool expand_vars(const char *text, const char *const *names,
+                 const char *const *values, size_t nvars, char *buf,
+                 size_t size);
+
+/*
+ * Parses a duration such as "250ms", "1.5s" or "2m" into nanoseconds.
+ * Returns -1 if the text is not a duration.
+ */
+int64_t parse_duration(const char *text, const char **end);
+
+/*
+ * Parses %jid, %first-%last, %jid.idx or a pid into a job ID range or a
+ * pid, and the task index (or -1).  Returns false if spec is malformed.
+ */
+bool parse_job_spec(const char *spec, jid_t *first, jid_t *last, pid_t *pid,
+                    long *idx);
+
+/* Parses a signal name (with or without SIG) or number; -1 if not one */
+int parse_signal(const char *name);
+
+/* Signals a job as kill does; 0, or -1 with errno set */
+int signal_job(jid_t jid, int sig);
+
+/* Retry hook: a pending job was started as pid, or cancelled if pid is 0 */
+void retry_job_started(jid_t jid, pid_t pid);
+
+/* Records the exit of a job being shut down (from event_dispatch()) */
+void shutdown_child_exited(jid_t jid, int status);
+
+#endif /* __TSH_SHELL_H__ */